@@ -0,0 +1,709 @@
+// Microbenchmarks for the request path and the store, in the style of
+// Google Benchmark: each one runs its loop for a growing number of
+// iterations until the timing is stable, then reports time per iteration
+// and operator new calls per iteration.
+#include <fcntl.h>
+#include <unistd.h>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <new>
+#include <optional>
+#include <string>
+#include <vector>
+#include "core/command.hpp"
+#include "core/dispatcher.hpp"
+#include "core/response.hpp"
+#include "core/set.hpp"
+#include "core/stats.hpp"
+#include "core/store.hpp"
+#include "net/buffer.hpp"
+#include "net/resp_parser.hpp"
+
+namespace
+{
+    using Clock = std::chrono::steady_clock;
+
+    // Benchmarks run on one thread.
+    uint64_t allocation_count = 0;
+
+    template <typename T>
+    inline void do_not_optimize(const T &value)
+    {
+        asm volatile("" : : "r,m"(value) : "memory");
+    }
+
+    // Setup before the first keep_running() call is not timed.
+    class State
+    {
+    public:
+        explicit State(size_t iterations) : iterations_(iterations), remaining_(iterations) {}
+
+        bool keep_running()
+        {
+            if (remaining_ == iterations_ && !started_)
+            {
+                started_ = true;
+                start_allocations_ = allocation_count;
+                start_ = Clock::now();
+            }
+            if (remaining_ == 0)
+            {
+                elapsed_ = Clock::now() - start_;
+                allocations_ = allocation_count - start_allocations_;
+                return false;
+            }
+            remaining_--;
+            return true;
+        }
+
+        size_t iterations() const { return iterations_; }
+        void set_items_processed(size_t items) { items_ = items; }
+        size_t items_processed() const { return items_; }
+        double seconds() const { return elapsed_.count(); }
+        double allocations_per_iteration() const { return static_cast<double>(allocations_) / iterations_; }
+
+    private:
+        size_t iterations_;
+        size_t remaining_;
+        bool started_ = false;
+        size_t items_ = 0;
+        uint64_t start_allocations_ = 0;
+        uint64_t allocations_ = 0;
+        Clock::time_point start_;
+        std::chrono::duration<double> elapsed_{0};
+    };
+
+    struct Benchmark
+    {
+        std::string name;
+        std::function<void(State &)> run;
+    };
+
+    std::vector<Benchmark> &registry()
+    {
+        static std::vector<Benchmark> benchmarks;
+        return benchmarks;
+    }
+
+    void add(std::string name, std::function<void(State &)> run)
+    {
+        registry().push_back({std::move(name), std::move(run)});
+    }
+
+    std::string key_name(size_t i)
+    {
+        char buffer[32];
+        int len = std::snprintf(buffer, sizeof(buffer), "key:%012zu", i);
+        return std::string(buffer, len);
+    }
+
+    std::vector<std::string> make_keys(size_t count)
+    {
+        std::vector<std::string> keys;
+        keys.reserve(count);
+        for (size_t i = 0; i < count; ++i)
+        {
+            keys.push_back(key_name(i));
+        }
+        return keys;
+    }
+
+    std::string request(std::initializer_list<std::string_view> args)
+    {
+        core::Command command;
+        command.name = *args.begin();
+        command.args.assign(args.begin() + 1, args.end());
+        std::string out;
+        command.to_resp(out);
+        return out;
+    }
+
+    void register_parser()
+    {
+        add("RespParser/set", [](State &state)
+            {
+                std::string buffer = request({"SET", "key:000000000001", "xxx"});
+                net::RespParser parser;
+                std::vector<std::string_view> args;
+                while (state.keep_running())
+                {
+                    parser.next(buffer, args);
+                    parser.discard(parser.consumed());
+                    do_not_optimize(args.data());
+                }
+                state.set_items_processed(state.iterations());
+            });
+        add("RespParser/pipeline_100", [](State &state)
+            {
+                std::string buffer;
+                for (size_t i = 0; i < 100; ++i)
+                {
+                    buffer += request({"SET", key_name(i), "xxx"});
+                }
+                net::RespParser parser;
+                std::vector<std::string_view> args;
+                while (state.keep_running())
+                {
+                    while (parser.next(buffer, args) == net::ParseResult::COMMAND)
+                    {
+                        do_not_optimize(args.data());
+                    }
+                    parser.discard(parser.consumed());
+                }
+                state.set_items_processed(state.iterations() * 100);
+            });
+        add("RespParser/bulk_64k", [](State &state)
+            {
+                std::string buffer = request({"SET", "key", std::string(64 * 1024, 'x')});
+                net::RespParser parser;
+                std::vector<std::string_view> args;
+                while (state.keep_running())
+                {
+                    parser.next(buffer, args);
+                    parser.discard(parser.consumed());
+                    do_not_optimize(args.data());
+                }
+                state.set_items_processed(state.iterations());
+            });
+        add("RespParser/inline", [](State &state)
+            {
+                std::string buffer = "SET key:000000000001 xxx\r\n";
+                net::RespParser parser;
+                std::vector<std::string_view> args;
+                while (state.keep_running())
+                {
+                    parser.next(buffer, args);
+                    parser.discard(parser.consumed());
+                    do_not_optimize(args.data());
+                }
+                state.set_items_processed(state.iterations());
+            });
+    }
+
+    void register_response()
+    {
+        auto to_resp = [](core::Response response)
+        {
+            return [response](State &state)
+            {
+                while (state.keep_running())
+                {
+                    std::string out = response.to_resp();
+                    do_not_optimize(out.data());
+                }
+                state.set_items_processed(state.iterations());
+            };
+        };
+        add("Response/to_resp_ok", to_resp(core::Response::Ok()));
+        add("Response/to_resp_integer", to_resp(core::Response::Integer(1234567)));
+        add("Response/to_resp_bulk_16", to_resp(core::Response::String(std::string(16, 'x'))));
+        add("Response/to_resp_bulk_64k", to_resp(core::Response::String(std::string(64 * 1024, 'x'))));
+        add("Response/to_resp_array_100", to_resp(core::Response::Array(std::vector<std::string>(100, std::string(16, 'x')))));
+
+        // The server's path: serialize into the connection buffer and writev
+        // it out, here to /dev/null.
+        add("Response/write_resp_array_100", [](State &state)
+            {
+                int fd = open("/dev/null", O_WRONLY);
+                net::OutputBuffer output;
+                std::vector<std::string> items(100, std::string(16, 'x'));
+                while (state.keep_running())
+                {
+                    core::Response::Array(items).write_resp(output);
+                    while (!output.empty())
+                        output.write_to(fd);
+                }
+                close(fd);
+                state.set_items_processed(state.iterations());
+            });
+    }
+
+    const size_t KEYS = 100000;
+
+    void register_store()
+    {
+        add("Store/set_new", [](State &state)
+            {
+                auto keys = make_keys(state.iterations());
+                core::Store store;
+                size_t i = 0;
+                while (state.keep_running())
+                {
+                    store.set(keys[i++], "xxx");
+                }
+                state.set_items_processed(state.iterations());
+            });
+        add("Store/set_overwrite", [](State &state)
+            {
+                auto keys = make_keys(KEYS);
+                core::Store store;
+                for (const auto &key : keys)
+                    store.set(key, "xxx");
+                size_t i = 0;
+                while (state.keep_running())
+                {
+                    store.set(keys[i++ % KEYS], "yyy");
+                }
+                state.set_items_processed(state.iterations());
+            });
+        add("Store/get_hit", [](State &state)
+            {
+                auto keys = make_keys(KEYS);
+                core::Store store;
+                for (const auto &key : keys)
+                    store.set(key, "xxx");
+                size_t i = 0;
+                while (state.keep_running())
+                {
+                    auto value = store.get(keys[i++ % KEYS]);
+                    do_not_optimize(value);
+                }
+                state.set_items_processed(state.iterations());
+            });
+        add("Store/get_miss", [](State &state)
+            {
+                auto keys = make_keys(2 * KEYS);
+                core::Store store;
+                for (size_t i = 0; i < KEYS; ++i)
+                    store.set(keys[i], "xxx");
+                size_t i = 0;
+                while (state.keep_running())
+                {
+                    auto value = store.get(keys[KEYS + i++ % KEYS]);
+                    do_not_optimize(value);
+                }
+                state.set_items_processed(state.iterations());
+            });
+        add("Store/remove", [](State &state)
+            {
+                auto keys = make_keys(state.iterations());
+                core::Store store;
+                for (const auto &key : keys)
+                    store.set(key, "xxx");
+                size_t i = 0;
+                while (state.keep_running())
+                {
+                    store.remove(keys[i++]);
+                }
+                state.set_items_processed(state.iterations());
+            });
+        // One batch of 100 lookups against 100 separate ones, over a table
+        // too large for the cache.
+        add("Store/get_100", [](State &state)
+            {
+                auto keys = make_keys(KEYS);
+                core::Store store;
+                for (const auto &key : keys)
+                    store.set(key, "xxx");
+                size_t i = 0;
+                while (state.keep_running())
+                {
+                    for (size_t j = 0; j < 100; ++j)
+                    {
+                        auto value = store.get(keys[(i * 7919 + j * 104729) % KEYS]);
+                        do_not_optimize(value);
+                    }
+                    ++i;
+                }
+                state.set_items_processed(state.iterations() * 100);
+            });
+        add("Store/mget_100", [](State &state)
+            {
+                auto keys = make_keys(KEYS);
+                core::Store store;
+                for (const auto &key : keys)
+                    store.set(key, "xxx");
+                std::vector<std::string_view> batch(100);
+                size_t i = 0, found = 0;
+                while (state.keep_running())
+                {
+                    for (size_t j = 0; j < 100; ++j)
+                        batch[j] = keys[(i * 7919 + j * 104729) % KEYS];
+                    store.mget(batch, [&found](std::optional<std::string_view> value)
+                               { found += value.has_value(); });
+                    ++i;
+                }
+                do_not_optimize(found);
+                state.set_items_processed(state.iterations() * 100);
+            });
+        add("Store/expire_at", [](State &state)
+            {
+                auto keys = make_keys(KEYS);
+                core::Store store;
+                for (const auto &key : keys)
+                    store.set(key, "xxx");
+                int64_t when = core::Store::now_ms() + 3600 * 1000;
+                size_t i = 0;
+                while (state.keep_running())
+                {
+                    store.expire_at(keys[i++ % KEYS], when);
+                }
+                state.set_items_processed(state.iterations());
+            });
+        add("Store/lpush", [](State &state)
+            {
+                core::Store store;
+                while (state.keep_running())
+                {
+                    store.lpush("list", "xxx");
+                }
+                state.set_items_processed(state.iterations());
+            });
+        add("Store/rpush", [](State &state)
+            {
+                core::Store store;
+                while (state.keep_running())
+                {
+                    store.rpush("list", "xxx");
+                }
+                state.set_items_processed(state.iterations());
+            });
+        add("Store/lpop", [](State &state)
+            {
+                core::Store store;
+                for (size_t i = 0; i < state.iterations(); ++i)
+                    store.rpush("list", "xxx");
+                while (state.keep_running())
+                {
+                    auto value = store.lpop("list");
+                    do_not_optimize(value);
+                }
+                state.set_items_processed(state.iterations());
+            });
+        add("Store/lrange_100", [](State &state)
+            {
+                core::Store store;
+                for (size_t i = 0; i < 1000; ++i)
+                    store.rpush("list", "xxx");
+                size_t total = 0;
+                while (state.keep_running())
+                {
+                    store.lrange("list", 0, 99, [](size_t) {}, [&total](std::string_view item)
+                                 { total += item.size(); });
+                }
+                do_not_optimize(total);
+                state.set_items_processed(state.iterations());
+            });
+        add("Store/sadd", [](State &state)
+            {
+                auto members = make_keys(KEYS);
+                core::Store store;
+                size_t i = 0;
+                while (state.keep_running())
+                {
+                    store.sadd("set", members[i++ % KEYS]);
+                }
+                state.set_items_processed(state.iterations());
+            });
+        add("Store/sismember_100", [](State &state)
+            {
+                auto members = make_keys(100);
+                core::Store store;
+                for (const auto &member : members)
+                    store.sadd("set", member);
+                size_t i = 0;
+                while (state.keep_running())
+                {
+                    auto found = store.sismember("set", members[i++ % 100]);
+                    do_not_optimize(found);
+                }
+                state.set_items_processed(state.iterations());
+            });
+        add("Store/sinter_1000", [](State &state)
+            {
+                auto members = make_keys(1500);
+                core::Store store;
+                for (size_t i = 0; i < 1000; ++i)
+                {
+                    store.sadd("a", members[i]);
+                    store.sadd("b", members[i + 500]);
+                }
+                std::vector<std::string_view> keys = {"a", "b"};
+                while (state.keep_running())
+                {
+                    auto result = store.sinter(keys);
+                    do_not_optimize(result);
+                }
+                state.set_items_processed(state.iterations());
+            });
+    }
+
+    // Small objects of five fields, one hash per key.
+    void register_hash()
+    {
+        add("Store/hset_5_fields", [](State &state)
+            {
+                auto keys = make_keys(state.iterations());
+                core::Store store;
+                std::vector<core::Store::FieldValue> fields = {
+                    {"name", "alice"}, {"age", "42"}, {"city", "paris"}, {"email", "alice@example.com"}, {"score", "1000"}};
+                size_t i = 0;
+                while (state.keep_running())
+                {
+                    store.hset(keys[i++], fields);
+                }
+                state.set_items_processed(state.iterations());
+            });
+        add("Store/hget_5_fields", [](State &state)
+            {
+                auto keys = make_keys(KEYS);
+                core::Store store;
+                std::vector<core::Store::FieldValue> fields = {
+                    {"name", "alice"}, {"age", "42"}, {"city", "paris"}, {"email", "alice@example.com"}, {"score", "1000"}};
+                for (const auto &key : keys)
+                    store.hset(key, fields);
+                size_t i = 0;
+                std::optional<std::string> value;
+                while (state.keep_running())
+                {
+                    store.hget(keys[i++ % KEYS], "email", value);
+                    do_not_optimize(value);
+                }
+                state.set_items_processed(state.iterations());
+            });
+    }
+
+    void register_sorted_set()
+    {
+        auto make_zset = [](core::Store &store, const std::vector<std::string> &members)
+        {
+            std::vector<core::Store::ScoredMember> items;
+            for (size_t i = 0; i < members.size(); ++i)
+                items.push_back({members[i], static_cast<double>(i % 1000)});
+            store.zadd("zset", items, false, false);
+        };
+        add("Store/zadd", [](State &state)
+            {
+                auto members = make_keys(KEYS);
+                core::Store store;
+                size_t i = 0;
+                while (state.keep_running())
+                {
+                    double score = static_cast<double>(i % 1000);
+                    store.zadd("zset", {{members[i++ % KEYS], score}}, false, false);
+                }
+                state.set_items_processed(state.iterations());
+            });
+        add("Store/zrank_100000", [make_zset](State &state)
+            {
+                auto members = make_keys(KEYS);
+                core::Store store;
+                make_zset(store, members);
+                size_t i = 0;
+                std::optional<size_t> rank;
+                while (state.keep_running())
+                {
+                    store.zrank("zset", members[i++ % KEYS], rank);
+                    do_not_optimize(rank);
+                }
+                state.set_items_processed(state.iterations());
+            });
+        add("Store/zrangebyscore_100000", [make_zset](State &state)
+            {
+                auto members = make_keys(KEYS);
+                core::Store store;
+                make_zset(store, members);
+                size_t i = 0, total = 0;
+                while (state.keep_running())
+                {
+                    core::ScoreRange range{static_cast<double>(i++ % 1000), 1000};
+                    store.zrangebyscore("zset", range, 0, 10, [](size_t) {}, [&total](std::string_view member, double)
+                                        { total += member.size(); });
+                }
+                do_not_optimize(total);
+                state.set_items_processed(state.iterations());
+            });
+    }
+
+    void register_intersection()
+    {
+        auto sinter_ints = [](size_t small, size_t large)
+        {
+            return [small, large](State &state)
+            {
+                core::Set::configure(large, 128, 64);
+                core::Store store;
+                for (size_t i = 0; i < large; ++i)
+                {
+                    store.sadd("large", std::to_string(i * 3));
+                    if (i < small)
+                        store.sadd("small", std::to_string(i * 2 * large / small));
+                }
+                std::vector<std::string_view> keys = {"small", "large"};
+                while (state.keep_running())
+                {
+                    auto result = store.sinter(keys);
+                    do_not_optimize(result);
+                }
+                core::Set::configure(512, 128, 64);
+                state.set_items_processed(state.iterations());
+            };
+        };
+        add("Store/sinter_intset_1000x1000", sinter_ints(1000, 1000));
+        add("Store/sinter_intset_100x100000", sinter_ints(100, 100000));
+    }
+
+    void register_dispatcher()
+    {
+        // Command lookup, arity and flag checks around a cheap command.
+        add("Dispatcher/get", [](State &state)
+            {
+                core::Store store;
+                core::CommandDispatcher dispatcher(store);
+                store.set("key", "xxx");
+                core::Command command;
+                command.name = "get";
+                command.args = {"key"};
+                while (state.keep_running())
+                {
+                    core::Response response = dispatcher.dispatch(command);
+                    do_not_optimize(response);
+                }
+                state.set_items_processed(state.iterations());
+            });
+        // A value too long to stay inline, with the reply serialized as a
+        // connection would; the reply bytes come from the dispatcher's arena.
+        add("Dispatcher/get_100b", [](State &state)
+            {
+                core::Store store;
+                core::CommandDispatcher dispatcher(store);
+                store.set("key", std::string(100, 'x'));
+                core::Command command;
+                command.name = "get";
+                command.args = {"key"};
+                std::string out;
+                while (state.keep_running())
+                {
+                    out.clear();
+                    dispatcher.dispatch(command).write_resp(out);
+                    do_not_optimize(out.data());
+                }
+                state.set_items_processed(state.iterations());
+            });
+        // The same with per-command statistics recorded.
+        add("Dispatcher/get_stats", [](State &state)
+            {
+                core::Store store;
+                core::CommandDispatcher dispatcher(store);
+                core::ServerStats stats(1, core::CommandDispatcher::command_count());
+                dispatcher.set_stats(&stats, 0);
+                store.set("key", "xxx");
+                core::Command command;
+                command.name = "get";
+                command.args = {"key"};
+                while (state.keep_running())
+                {
+                    core::Response response = dispatcher.dispatch(command);
+                    do_not_optimize(response);
+                }
+                state.set_items_processed(state.iterations());
+            });
+        add("Dispatcher/find_command", [](State &state)
+            {
+                const std::string_view names[] = {"GET", "set", "ZRangeByScore", "hgetall", "NOSUCH"};
+                size_t i = 0;
+                while (state.keep_running())
+                {
+                    auto info = core::CommandDispatcher::find_command(names[i++ % 5]);
+                    do_not_optimize(info);
+                }
+                state.set_items_processed(state.iterations());
+            });
+    }
+
+    // Doubles the iteration count until a run takes at least a tenth of
+    // min_time, then scales it to last about min_time.
+    State measure(const Benchmark &benchmark, double min_time)
+    {
+        size_t iterations = 1;
+        while (true)
+        {
+            State state(iterations);
+            benchmark.run(state);
+            if (state.seconds() >= min_time || iterations >= (size_t(1) << 30))
+                return state;
+            if (state.seconds() >= min_time / 10)
+            {
+                iterations = static_cast<size_t>(iterations * min_time * 1.2 / state.seconds());
+                continue;
+            }
+            iterations *= 2;
+        }
+    }
+
+    void usage()
+    {
+        std::fprintf(stderr, "Usage: rdb-microbench [--filter substring] [--min-time seconds] [--list]\n");
+    }
+}
+
+void *operator new(size_t size)
+{
+    allocation_count++;
+    if (void *p = std::malloc(size))
+        return p;
+    throw std::bad_alloc();
+}
+
+void operator delete(void *p) noexcept
+{
+    std::free(p);
+}
+
+void operator delete(void *p, size_t) noexcept
+{
+    std::free(p);
+}
+
+int main(int argc, char *argv[])
+{
+    std::string filter;
+    double min_time = 0.5;
+    bool list = false;
+    for (int i = 1; i < argc; ++i)
+    {
+        std::string arg = argv[i];
+        if (arg == "--list")
+            list = true;
+        else if (arg == "--filter" && i + 1 < argc)
+            filter = argv[++i];
+        else if (arg == "--min-time" && i + 1 < argc)
+            min_time = std::stod(argv[++i]);
+        else
+        {
+            usage();
+            return 1;
+        }
+    }
+
+    register_parser();
+    register_response();
+    register_store();
+    register_hash();
+    register_sorted_set();
+    register_intersection();
+    register_dispatcher();
+
+    if (!list)
+        std::printf("%-32s %14s %12s %16s %12s\n", "Benchmark", "Time (ns)", "Iterations", "Items/s", "Allocs/iter");
+    for (const Benchmark &benchmark : registry())
+    {
+        if (!filter.empty() && benchmark.name.find(filter) == std::string::npos)
+            continue;
+        if (list)
+        {
+            std::printf("%s\n", benchmark.name.c_str());
+            continue;
+        }
+        State state = measure(benchmark, min_time);
+        double ns = state.seconds() * 1e9 / state.iterations();
+        double rate = state.seconds() > 0 ? state.items_processed() / state.seconds() : 0;
+        std::printf("%-32s %14.1f %12zu %16.0f %12.2f\n", benchmark.name.c_str(), ns, state.iterations(), rate,
+                    state.allocations_per_iteration());
+        std::fflush(stdout);
+    }
+    return 0;
+}
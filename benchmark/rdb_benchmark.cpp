@@ -0,0 +1,637 @@
+// Load generator in the spirit of redis-benchmark: a fixed number of
+// requests spread over many pipelined connections, reporting throughput
+// and a latency histogram per test.
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <system_error>
+#include <thread>
+#include <vector>
+#include "core/latency_histogram.hpp"
+
+namespace
+{
+    using Clock = std::chrono::steady_clock;
+
+    struct Options
+    {
+        std::string host = "127.0.0.1";
+        int port = 6666;
+        size_t clients = 50;
+        size_t requests = 100000;
+        size_t pipeline = 1;
+        size_t data_size = 3;
+        size_t keyspace = 0;
+        size_t threads = 1;
+        std::vector<std::string> tests = {"ping", "set", "get", "lpush", "rpush", "lpop", "rpop", "sadd", "lrange"};
+        std::string mix;
+        bool quiet = false;
+    };
+
+    // Appends one request. key and value are filled in per request so a
+    // random keyspace costs nothing when it is not used.
+    using RequestBuilder = std::function<void(std::string &out, std::string_view key, std::string_view value)>;
+
+    struct CommandTemplate
+    {
+        const char *name;
+        RequestBuilder build;
+    };
+
+    void append_bulk(std::string &out, std::string_view arg)
+    {
+        out += '$';
+        out += std::to_string(arg.size());
+        out += "\r\n";
+        out.append(arg.data(), arg.size());
+        out += "\r\n";
+    }
+
+    void append_command(std::string &out, std::initializer_list<std::string_view> args)
+    {
+        out += '*';
+        out += std::to_string(args.size());
+        out += "\r\n";
+        for (std::string_view arg : args)
+        {
+            append_bulk(out, arg);
+        }
+    }
+
+    // MSET and MGET touch ten keys sharing the request key as hash tag, so
+    // they stay on one shard.
+    const size_t MULTI_KEYS = 10;
+
+    void append_multi_key(std::string &out, std::string_view name, std::string_view key, std::string_view value)
+    {
+        out += '*';
+        out += std::to_string(1 + MULTI_KEYS * (value.empty() ? 1 : 2));
+        out += "\r\n";
+        append_bulk(out, name);
+        for (size_t i = 0; i < MULTI_KEYS; ++i)
+        {
+            append_bulk(out, "{" + std::string(key) + "}:" + std::to_string(i));
+            if (!value.empty())
+                append_bulk(out, value);
+        }
+    }
+
+    const std::vector<CommandTemplate> &command_templates()
+    {
+        static const std::vector<CommandTemplate> templates = {
+            {"ping", [](std::string &out, std::string_view, std::string_view)
+             { append_command(out, {"PING"}); }},
+            {"set", [](std::string &out, std::string_view key, std::string_view value)
+             { append_command(out, {"SET", key, value}); }},
+            {"get", [](std::string &out, std::string_view key, std::string_view)
+             { append_command(out, {"GET", key}); }},
+            {"del", [](std::string &out, std::string_view key, std::string_view)
+             { append_command(out, {"DEL", key}); }},
+            {"mset", [](std::string &out, std::string_view key, std::string_view value)
+             { append_multi_key(out, "MSET", key, value); }},
+            {"mget", [](std::string &out, std::string_view key, std::string_view)
+             { append_multi_key(out, "MGET", key, ""); }},
+            {"lpush", [](std::string &out, std::string_view, std::string_view value)
+             { append_command(out, {"LPUSH", "mylist", value}); }},
+            {"rpush", [](std::string &out, std::string_view, std::string_view value)
+             { append_command(out, {"RPUSH", "mylist", value}); }},
+            {"lpop", [](std::string &out, std::string_view, std::string_view)
+             { append_command(out, {"LPOP", "mylist"}); }},
+            {"rpop", [](std::string &out, std::string_view, std::string_view)
+             { append_command(out, {"RPOP", "mylist"}); }},
+            {"sadd", [](std::string &out, std::string_view key, std::string_view)
+             { append_command(out, {"SADD", "myset", key}); }},
+            {"lrange", [](std::string &out, std::string_view, std::string_view)
+             { append_command(out, {"LRANGE", "mylist", "0", "99"}); }},
+            {"hset", [](std::string &out, std::string_view key, std::string_view value)
+             { append_command(out, {"HSET", "myhash", key, value}); }},
+            // Scores the key by its number, so -r spreads them out.
+            {"zadd", [](std::string &out, std::string_view key, std::string_view)
+             { append_command(out, {"ZADD", "myzset", key.substr(4), key}); }},
+            {"zrangebyscore", [](std::string &out, std::string_view key, std::string_view)
+             { append_command(out, {"ZRANGEBYSCORE", "myzset", key.substr(4), "+inf", "LIMIT", "0", "10"}); }},
+        };
+        return templates;
+    }
+
+    const CommandTemplate *find_template(std::string_view name)
+    {
+        for (const auto &entry : command_templates())
+        {
+            if (name == entry.name)
+                return &entry;
+        }
+        return nullptr;
+    }
+
+    struct Workload
+    {
+        std::string title;
+        std::vector<const CommandTemplate *> commands;
+        std::vector<uint32_t> weights;
+        uint32_t total_weight = 0;
+    };
+
+    // Length of the complete reply at the front of data, or 0 if more
+    // bytes are needed.
+    size_t reply_length(const char *data, size_t size)
+    {
+        const char *end = static_cast<const char *>(std::memchr(data, '\n', size));
+        if (!end)
+            return 0;
+        size_t header = end - data + 1;
+        switch (data[0])
+        {
+        case '$':
+        {
+            long long len = std::atoll(data + 1);
+            if (len < 0)
+                return header;
+            size_t total = header + static_cast<size_t>(len) + 2;
+            return total <= size ? total : 0;
+        }
+        case '*':
+        {
+            long long count = std::atoll(data + 1);
+            size_t total = header;
+            for (long long i = 0; i < count; ++i)
+            {
+                size_t item = reply_length(data + total, size - total);
+                if (item == 0)
+                    return 0;
+                total += item;
+            }
+            return total;
+        }
+        default:
+            return header;
+        }
+    }
+
+    int connect_to(const Options &options)
+    {
+        addrinfo hints{};
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        addrinfo *result = nullptr;
+        std::string port = std::to_string(options.port);
+        int rc = getaddrinfo(options.host.c_str(), port.c_str(), &hints, &result);
+        if (rc != 0)
+            throw std::runtime_error(std::string("getaddrinfo: ") + gai_strerror(rc));
+        int fd = -1;
+        for (addrinfo *ai = result; ai; ai = ai->ai_next)
+        {
+            fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+            if (fd < 0)
+                continue;
+            if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0)
+                break;
+            close(fd);
+            fd = -1;
+        }
+        freeaddrinfo(result);
+        if (fd < 0)
+            throw std::system_error(errno, std::generic_category(), "connect");
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+        return fd;
+    }
+
+    struct Connection
+    {
+        int fd = -1;
+        std::string out;
+        size_t out_offset = 0;
+        std::string in;
+        std::deque<Clock::time_point> in_flight;
+        bool want_write = false;
+        bool done = false;
+    };
+
+    struct Shared
+    {
+        std::atomic<size_t> issued{0};
+        std::atomic<size_t> errors{0};
+    };
+
+    class Client
+    {
+    public:
+        Client(const Options &options, const Workload &workload, Shared &shared, size_t connections, uint64_t seed)
+            : options_(options), workload_(workload), shared_(shared), random_state_(seed | 1),
+              value_(options.data_size, 'x')
+        {
+            epfd_ = epoll_create1(0);
+            for (size_t i = 0; i < connections; ++i)
+            {
+                Connection &connection = connections_.emplace_back();
+                connection.fd = connect_to(options);
+            }
+            for (size_t i = 0; i < connections_.size(); ++i)
+            {
+                epoll_event ev{};
+                ev.events = EPOLLIN;
+                ev.data.u64 = i;
+                epoll_ctl(epfd_, EPOLL_CTL_ADD, connections_[i].fd, &ev);
+            }
+        }
+
+        ~Client()
+        {
+            for (auto &connection : connections_)
+            {
+                close(connection.fd);
+            }
+            close(epfd_);
+        }
+
+        void run()
+        {
+            size_t open = 0;
+            for (size_t i = 0; i < connections_.size(); ++i)
+            {
+                fill(connections_[i]);
+                if (!send(i))
+                    return;
+                if (connections_[i].in_flight.empty())
+                    connections_[i].done = true;
+                else
+                    open++;
+            }
+            epoll_event events[64];
+            while (open > 0)
+            {
+                int n = epoll_wait(epfd_, events, 64, 1000);
+                for (int e = 0; e < n; ++e)
+                {
+                    size_t index = events[e].data.u64;
+                    Connection &connection = connections_[index];
+                    if (connection.done)
+                        continue;
+                    if (events[e].events & EPOLLOUT && !send(index))
+                        return;
+                    if (!(events[e].events & (EPOLLIN | EPOLLHUP | EPOLLERR)))
+                        continue;
+                    if (!receive(connection))
+                        return;
+                    fill(connection);
+                    if (!send(index))
+                        return;
+                    if (connection.in_flight.empty())
+                    {
+                        connection.done = true;
+                        open--;
+                    }
+                }
+            }
+        }
+
+        core::LatencyHistogram &histogram() { return histogram_; }
+
+    private:
+        const Options &options_;
+        const Workload &workload_;
+        Shared &shared_;
+        std::vector<Connection> connections_;
+        int epfd_ = -1;
+        uint64_t random_state_;
+        std::string value_;
+        std::string key_;
+        core::LatencyHistogram histogram_;
+
+        uint64_t random()
+        {
+            random_state_ ^= random_state_ << 13;
+            random_state_ ^= random_state_ >> 7;
+            random_state_ ^= random_state_ << 17;
+            return random_state_;
+        }
+
+        void make_key()
+        {
+            char buffer[32];
+            size_t id = options_.keyspace ? random() % options_.keyspace : 0;
+            int len = std::snprintf(buffer, sizeof(buffer), "key:%012zu", id);
+            key_.assign(buffer, len);
+        }
+
+        // Tops the connection up to the pipeline depth while requests remain.
+        void fill(Connection &connection)
+        {
+            while (connection.in_flight.size() < options_.pipeline)
+            {
+                if (shared_.issued.fetch_add(1, std::memory_order_relaxed) >= options_.requests)
+                    return;
+                const CommandTemplate *command = workload_.commands.front();
+                if (workload_.commands.size() > 1)
+                {
+                    uint32_t pick = random() % workload_.total_weight;
+                    size_t i = 0;
+                    while (pick >= workload_.weights[i])
+                    {
+                        pick -= workload_.weights[i++];
+                    }
+                    command = workload_.commands[i];
+                }
+                make_key();
+                command->build(connection.out, key_, value_);
+                connection.in_flight.push_back(Clock::now());
+            }
+        }
+
+        bool send(size_t index)
+        {
+            Connection &connection = connections_[index];
+            while (connection.out_offset < connection.out.size())
+            {
+                ssize_t n = write(connection.fd, connection.out.data() + connection.out_offset,
+                                  connection.out.size() - connection.out_offset);
+                if (n < 0 && errno == EAGAIN)
+                    break;
+                if (n <= 0)
+                {
+                    std::cerr << "Write error: " << std::strerror(errno) << std::endl;
+                    return false;
+                }
+                connection.out_offset += n;
+            }
+            if (connection.out_offset == connection.out.size())
+            {
+                connection.out.clear();
+                connection.out_offset = 0;
+            }
+            bool want_write = !connection.out.empty();
+            if (want_write != connection.want_write)
+            {
+                connection.want_write = want_write;
+                epoll_event ev{};
+                ev.events = want_write ? EPOLLIN | EPOLLOUT : EPOLLIN;
+                ev.data.u64 = index;
+                epoll_ctl(epfd_, EPOLL_CTL_MOD, connection.fd, &ev);
+            }
+            return true;
+        }
+
+        bool receive(Connection &connection)
+        {
+            char buffer[64 * 1024];
+            while (true)
+            {
+                ssize_t n = read(connection.fd, buffer, sizeof(buffer));
+                if (n < 0 && errno == EAGAIN)
+                    break;
+                if (n <= 0)
+                {
+                    std::cerr << "Connection closed by server" << std::endl;
+                    return false;
+                }
+                connection.in.append(buffer, n);
+            }
+            size_t pos = 0;
+            auto now = Clock::now();
+            while (!connection.in_flight.empty())
+            {
+                size_t len = reply_length(connection.in.data() + pos, connection.in.size() - pos);
+                if (len == 0)
+                    break;
+                if (connection.in[pos] == '-')
+                    shared_.errors.fetch_add(1, std::memory_order_relaxed);
+                pos += len;
+                auto latency = std::chrono::duration_cast<std::chrono::nanoseconds>(now - connection.in_flight.front());
+                histogram_.record(latency.count());
+                connection.in_flight.pop_front();
+            }
+            connection.in.erase(0, pos);
+            return true;
+        }
+    };
+
+    void report(const Options &options, const Workload &workload, const core::LatencyHistogram &histogram,
+                size_t errors, double seconds)
+    {
+        double throughput = seconds > 0 ? histogram.count() / seconds : 0;
+        auto ms = [](uint64_t ns)
+        { return ns / 1e6; };
+        if (options.quiet)
+        {
+            std::printf("%s: %.2f requests per second, p50=%.3f msec\n", workload.title.c_str(), throughput,
+                        ms(histogram.percentile(50)));
+            return;
+        }
+        std::printf("====== %s ======\n", workload.title.c_str());
+        std::printf("  %zu requests completed in %.2f seconds\n", static_cast<size_t>(histogram.count()), seconds);
+        std::printf("  %zu parallel clients, %zu bytes payload, pipeline %zu, %zu threads\n", options.clients,
+                    options.data_size, options.pipeline, options.threads);
+        if (errors)
+            std::printf("  %zu error replies\n", errors);
+        std::printf("  throughput: %.2f requests per second\n", throughput);
+        std::printf("  latency (msec): avg=%.3f min=%.3f p50=%.3f p99=%.3f p999=%.3f max=%.3f\n",
+                    ms(histogram.mean()), ms(histogram.min()), ms(histogram.percentile(50)),
+                    ms(histogram.percentile(99)), ms(histogram.percentile(99.9)), ms(histogram.max()));
+        std::printf("  latency distribution:\n");
+        uint64_t seen = 0;
+        double next = 50;
+        histogram.for_each_bucket([&](uint64_t upper, uint64_t count)
+                                  {
+                                      seen += count;
+                                      double percent = 100.0 * seen / histogram.count();
+                                      if (percent >= next || seen == histogram.count())
+                                      {
+                                          std::printf("    %7.3f%% <= %.3f msec\n", percent, ms(std::min(upper, histogram.max())));
+                                          while (next <= percent && next < 100)
+                                              next = 100 - (100 - next) / 2;
+                                      } });
+        std::printf("\n");
+    }
+
+    void run_workload(const Options &options, const Workload &workload)
+    {
+        Shared shared;
+        std::vector<std::unique_ptr<Client>> clients;
+        for (size_t t = 0; t < options.threads; ++t)
+        {
+            size_t connections = options.clients / options.threads + (t < options.clients % options.threads);
+            if (connections)
+                clients.push_back(std::make_unique<Client>(options, workload, shared, connections, 0x9e3779b97f4a7c15ULL * (t + 1)));
+        }
+        auto started = Clock::now();
+        std::vector<std::thread> threads;
+        for (auto &client : clients)
+        {
+            threads.emplace_back([&client]
+                                 { client->run(); });
+        }
+        for (auto &thread : threads)
+        {
+            thread.join();
+        }
+        std::chrono::duration<double> elapsed = Clock::now() - started;
+        core::LatencyHistogram total;
+        for (auto &client : clients)
+        {
+            total.merge(client->histogram());
+        }
+        report(options, workload, total, shared.errors.load(), elapsed.count());
+    }
+
+    std::vector<std::string> split(const std::string &value, char separator)
+    {
+        std::vector<std::string> parts;
+        std::stringstream stream(value);
+        std::string part;
+        while (std::getline(stream, part, separator))
+        {
+            if (!part.empty())
+            {
+                std::transform(part.begin(), part.end(), part.begin(), ::tolower);
+                parts.push_back(part);
+            }
+        }
+        return parts;
+    }
+
+    void usage()
+    {
+        std::cerr << "Usage: rdb-benchmark [-h host] [-p port] [-c clients] [-n requests] [-P pipeline]\n"
+                     "                     [-d size] [-r keyspace] [--threads n] [-t tests] [--mix cmd:weight,...] [-q]\n"
+                     "\n"
+                     "  -t        comma-separated tests, run one after another\n"
+                     "  --mix     one run mixing commands by weight, e.g. get:9,set:1\n"
+                     "  -r        use random keys in [0, keyspace) instead of a single key\n"
+                     "\n"
+                     "Tests: ";
+        for (const auto &entry : command_templates())
+        {
+            std::cerr << entry.name << ' ';
+        }
+        std::cerr << std::endl;
+    }
+
+    bool parse_options(int argc, char *argv[], Options &options)
+    {
+        for (int i = 1; i < argc; ++i)
+        {
+            std::string arg = argv[i];
+            if (arg == "-q")
+            {
+                options.quiet = true;
+                continue;
+            }
+            if (i + 1 >= argc)
+                return false;
+            std::string value = argv[++i];
+            try
+            {
+                if (arg == "-h")
+                    options.host = value;
+                else if (arg == "-p")
+                    options.port = std::stoi(value);
+                else if (arg == "-c")
+                    options.clients = std::max<size_t>(1, std::stoul(value));
+                else if (arg == "-n")
+                    options.requests = std::stoul(value);
+                else if (arg == "-P")
+                    options.pipeline = std::max<size_t>(1, std::stoul(value));
+                else if (arg == "-d")
+                    options.data_size = std::stoul(value);
+                else if (arg == "-r")
+                    options.keyspace = std::stoul(value);
+                else if (arg == "--threads")
+                    options.threads = std::max<size_t>(1, std::stoul(value));
+                else if (arg == "-t")
+                    options.tests = split(value, ',');
+                else if (arg == "--mix")
+                    options.mix = value;
+                else
+                    return false;
+            }
+            catch (const std::exception &)
+            {
+                return false;
+            }
+        }
+        options.threads = std::min(options.threads, options.clients);
+        return true;
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    Options options;
+    if (!parse_options(argc, argv, options))
+    {
+        usage();
+        return 1;
+    }
+
+    std::vector<Workload> workloads;
+    if (!options.mix.empty())
+    {
+        Workload workload;
+        for (const std::string &part : split(options.mix, ','))
+        {
+            size_t colon = part.find(':');
+            std::string name = part.substr(0, colon);
+            const CommandTemplate *command = find_template(name);
+            uint32_t weight = colon == std::string::npos ? 1 : std::stoul(part.substr(colon + 1));
+            if (!command || weight == 0)
+            {
+                std::cerr << "Bad mix entry " << part << std::endl;
+                return 1;
+            }
+            workload.commands.push_back(command);
+            workload.weights.push_back(weight);
+            workload.total_weight += weight;
+        }
+        workload.title = "MIX " + options.mix;
+        workloads.push_back(std::move(workload));
+    }
+    else
+    {
+        for (const std::string &name : options.tests)
+        {
+            const CommandTemplate *command = find_template(name);
+            if (!command)
+            {
+                std::cerr << "Unknown test " << name << std::endl;
+                return 1;
+            }
+            Workload workload;
+            workload.title = name;
+            std::transform(workload.title.begin(), workload.title.end(), workload.title.begin(), ::toupper);
+            workload.commands.push_back(command);
+            workload.weights.push_back(1);
+            workload.total_weight = 1;
+            workloads.push_back(std::move(workload));
+        }
+    }
+
+    try
+    {
+        for (const Workload &workload : workloads)
+        {
+            run_workload(options, workload);
+        }
+    }
+    catch (const std::exception &e)
+    {
+        std::cerr << "Benchmark error: " << e.what() << std::endl;
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,53 @@
+#pragma once
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string_view>
+#include <vector>
+
+namespace core
+{
+    // Bump allocator for objects that only live while one request is
+    // handled, such as the bytes of a reply. reset() makes all of it free
+    // again at once; the blocks are kept, so once they have grown to the
+    // largest request seen, handling a request allocates nothing. Blocks
+    // beyond RETAIN_BYTES are released by reset() so that one huge reply
+    // does not pin its memory.
+    class Arena
+    {
+    public:
+        static constexpr size_t BLOCK_SIZE = 16 * 1024;
+        static constexpr size_t RETAIN_BYTES = 1024 * 1024;
+
+        Arena() = default;
+        Arena(const Arena &) = delete;
+        Arena &operator=(const Arena &) = delete;
+
+        char *allocate(size_t size);
+        std::string_view copy(std::string_view bytes);
+        void reset();
+
+        // Written by the owning thread, readable from any.
+        size_t reserved_bytes() const { return reserved_.load(std::memory_order_relaxed); }
+        uint64_t block_allocations() const { return block_allocations_.load(std::memory_order_relaxed); }
+        // Most bytes used between two resets.
+        size_t peak_bytes() const { return peak_.load(std::memory_order_relaxed); }
+
+    private:
+        struct Block
+        {
+            std::unique_ptr<char[]> bytes;
+            size_t size;
+        };
+
+        std::vector<Block> blocks_;
+        size_t current_ = 0;
+        size_t offset_ = 0;
+        // Bytes used in blocks before current_.
+        size_t used_before_ = 0;
+        std::atomic<size_t> reserved_{0};
+        std::atomic<uint64_t> block_allocations_{0};
+        std::atomic<size_t> peak_{0};
+    };
+}
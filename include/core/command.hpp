@@ -1,14 +1,47 @@
 #pragma once
+#include <cstdint>
 #include <string>
+#include <string_view>
 #include <vector>
 
 namespace core
 {
+    // The name and arguments are views into the connection's read buffer
+    // and are only valid for the duration of the dispatch call. The name
+    // keeps the client's case; the command table ignores it.
     class Command
     {
     public:
-        std::string name;
-        std::vector<std::string> args;
+        std::string_view name;
+        std::vector<std::string_view> args;
+        // Address of the client that sent it, "ip:port"; empty for
+        // commands replayed from the append-only file.
+        std::string_view client;
+        // Connection that sent it, unique for the server's lifetime; keys
+        // per-connection state such as WATCH. 0 for replayed commands.
+        uint64_t client_id = 0;
+
+        // Appends the command in RESP request form, as a client would send it.
+        void to_resp(std::string &out) const
+        {
+            out += '*';
+            out += std::to_string(args.size() + 1);
+            out += "\r\n";
+            append_bulk(out, name);
+            for (std::string_view arg : args)
+            {
+                append_bulk(out, arg);
+            }
+        }
+
+        static void append_bulk(std::string &out, std::string_view arg)
+        {
+            out += '$';
+            out += std::to_string(arg.size());
+            out += "\r\n";
+            out.append(arg.data(), arg.size());
+            out += "\r\n";
+        }
     };
 
 }
@@ -0,0 +1,506 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <functional>
+#include <new>
+#include <string>
+#include <string_view>
+#include <utility>
+#include "slab.hpp"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+namespace core
+{
+    // Open-addressing hash table keyed by strings, laid out Swiss-table style:
+    // slots are probed in groups of 16 whose one-byte control words (7 hash
+    // bits or an empty/deleted marker) are matched with a single SIMD compare.
+    // Empty is encoded as zero so fresh control arrays come from calloc and
+    // large tables cost no up-front memset.
+    //
+    // Growth never rehashes everything at once. A resize allocates a second
+    // table and every following insert or erase migrates one group, so the
+    // cost of growing is spread over many operations. Lookups consult both
+    // tables while a migration is in progress and never move entries, so an
+    // Entry pointer stays valid until the next insert or erase.
+    template <typename V>
+    class Dict
+    {
+    public:
+        struct Entry
+        {
+            SlabString key;
+            V value;
+        };
+
+        static constexpr size_t GROUP_SIZE = 16;
+
+    private:
+        static constexpr uint8_t EMPTY = 0x00;
+        static constexpr uint8_t DELETED = 0x01;
+        static constexpr uint8_t FULL = 0x80;
+        static constexpr size_t MIN_GROUPS = 1;
+
+        struct Table
+        {
+            uint8_t *ctrl = nullptr;
+            Entry *slots = nullptr;
+            size_t groups = 0;
+            size_t size = 0;
+            size_t tombstones = 0;
+
+            size_t capacity() const { return groups * GROUP_SIZE; }
+            size_t max_load() const { return capacity() - capacity() / 8; }
+        };
+
+        // tables_[0] is the live table; tables_[1] is only allocated while
+        // entries are migrated into it, after which it replaces tables_[0].
+        Table tables_[2];
+        size_t rehash_group_ = 0;
+
+        static uint64_t hash_of(std::string_view key) { return std::hash<std::string_view>{}(key); }
+        static uint8_t h2(uint64_t hash) { return static_cast<uint8_t>(FULL | (hash & 0x7f)); }
+        static size_t h1(uint64_t hash) { return static_cast<size_t>(hash >> 7); }
+
+#if defined(__SSE2__)
+        static uint32_t match(const uint8_t *group, uint8_t tag)
+        {
+            __m128i ctrl = _mm_load_si128(reinterpret_cast<const __m128i *>(group));
+            return static_cast<uint32_t>(_mm_movemask_epi8(_mm_cmpeq_epi8(ctrl, _mm_set1_epi8(static_cast<char>(tag)))));
+        }
+
+        // Full slots are the only control bytes with the top bit set.
+        static uint32_t match_free(const uint8_t *group)
+        {
+            return ~static_cast<uint32_t>(_mm_movemask_epi8(_mm_load_si128(reinterpret_cast<const __m128i *>(group)))) & 0xffff;
+        }
+#else
+        static uint32_t match(const uint8_t *group, uint8_t tag)
+        {
+            uint32_t mask = 0;
+            for (size_t i = 0; i < GROUP_SIZE; ++i)
+                mask |= static_cast<uint32_t>(group[i] == tag) << i;
+            return mask;
+        }
+
+        static uint32_t match_free(const uint8_t *group)
+        {
+            uint32_t mask = 0;
+            for (size_t i = 0; i < GROUP_SIZE; ++i)
+                mask |= static_cast<uint32_t>(!(group[i] & FULL)) << i;
+            return mask;
+        }
+#endif
+
+        static uint32_t match_empty(const uint8_t *group) { return match(group, EMPTY); }
+
+        static void allocate(Table &table, size_t groups)
+        {
+            table.groups = groups;
+            table.size = 0;
+            table.tombstones = 0;
+            table.ctrl = static_cast<uint8_t *>(std::calloc(table.capacity(), 1));
+            if (!table.ctrl)
+                throw std::bad_alloc();
+            table.slots = static_cast<Entry *>(::operator new(table.capacity() * sizeof(Entry), std::align_val_t(alignof(Entry))));
+        }
+
+        static void destroy(Table &table)
+        {
+            if (!table.ctrl)
+                return;
+            for (size_t i = 0; i < table.capacity(); ++i)
+            {
+                if (table.ctrl[i] & FULL)
+                    table.slots[i].~Entry();
+            }
+            std::free(table.ctrl);
+            ::operator delete(table.slots, std::align_val_t(alignof(Entry)));
+            table = Table{};
+        }
+
+        static Entry *lookup(const Table &table, std::string_view key, uint64_t hash)
+        {
+            if (!table.ctrl)
+                return nullptr;
+            size_t mask = table.groups - 1;
+            size_t group = h1(hash) & mask;
+            uint8_t tag = h2(hash);
+            for (size_t step = 1;; ++step)
+            {
+                const uint8_t *ctrl = table.ctrl + group * GROUP_SIZE;
+                for (uint32_t bits = match(ctrl, tag); bits; bits &= bits - 1)
+                {
+                    Entry &entry = table.slots[group * GROUP_SIZE + __builtin_ctz(bits)];
+                    if (entry.key == key)
+                        return &entry;
+                }
+                if (match_empty(ctrl) || step > table.groups)
+                    return nullptr;
+                group = (group + step) & mask;
+            }
+        }
+
+        // Claims a free slot for a key known to be absent from the table.
+        static size_t claim(Table &table, uint64_t hash)
+        {
+            size_t mask = table.groups - 1;
+            size_t group = h1(hash) & mask;
+            for (size_t step = 1;; ++step)
+            {
+                uint32_t bits = match_free(table.ctrl + group * GROUP_SIZE);
+                if (bits)
+                {
+                    size_t slot = group * GROUP_SIZE + __builtin_ctz(bits);
+                    if (table.ctrl[slot] == DELETED)
+                        table.tombstones--;
+                    table.ctrl[slot] = h2(hash);
+                    table.size++;
+                    return slot;
+                }
+                group = (group + step) & mask;
+            }
+        }
+
+        static void remove_slot(Table &table, size_t slot)
+        {
+            table.slots[slot].~Entry();
+            // A group that still has an empty slot never made a probe move on,
+            // so the freed slot can become empty instead of a tombstone.
+            const uint8_t *group = table.ctrl + (slot & ~(GROUP_SIZE - 1));
+            if (match_empty(group))
+                table.ctrl[slot] = EMPTY;
+            else
+            {
+                table.ctrl[slot] = DELETED;
+                table.tombstones++;
+            }
+            table.size--;
+        }
+
+        static size_t groups_for(size_t size)
+        {
+            size_t groups = MIN_GROUPS;
+            while (groups * GROUP_SIZE / 2 < size)
+                groups *= 2;
+            return groups;
+        }
+
+        bool rehashing() const { return tables_[1].ctrl != nullptr; }
+
+        static size_t reverse_bits(size_t v)
+        {
+            size_t r = 0;
+            for (size_t i = 0; i < sizeof(size_t) * 8; ++i, v >>= 1)
+                r = (r << 1) | (v & 1);
+            return r;
+        }
+
+        static size_t advance(size_t cursor, size_t mask)
+        {
+            cursor |= ~mask;
+            return reverse_bits(reverse_bits(cursor) + 1);
+        }
+
+        // Entries homed at a group lie on its probe path before the first
+        // group that still has an empty slot.
+        template <typename F>
+        static void visit_home(const Table &table, size_t home, F &fn)
+        {
+            size_t mask = table.groups - 1;
+            size_t group = home;
+            for (size_t step = 1; step <= table.groups; ++step)
+            {
+                const uint8_t *ctrl = table.ctrl + group * GROUP_SIZE;
+                for (size_t i = 0; i < GROUP_SIZE; ++i)
+                {
+                    if (!(ctrl[i] & FULL))
+                        continue;
+                    const Entry &entry = table.slots[group * GROUP_SIZE + i];
+                    if ((h1(hash_of(entry.key)) & mask) == home)
+                        fn(entry);
+                }
+                if (match_empty(ctrl))
+                    break;
+                group = (group + step) & mask;
+            }
+        }
+
+        void start_rehash(size_t groups)
+        {
+            allocate(tables_[1], groups);
+            rehash_group_ = 0;
+        }
+
+        void finish_rehash()
+        {
+            std::free(tables_[0].ctrl);
+            ::operator delete(tables_[0].slots, std::align_val_t(alignof(Entry)));
+            tables_[0] = tables_[1];
+            tables_[1] = Table{};
+        }
+
+        Table &insert_table()
+        {
+            if (rehashing())
+            {
+                rehash_step(1);
+                // Safety net: the migration must finish before the new table fills.
+                if (rehashing() && tables_[1].size + tables_[1].tombstones + 1 > tables_[1].max_load())
+                    rehash_step(tables_[0].groups);
+            }
+            if (!rehashing())
+            {
+                Table &table = tables_[0];
+                if (!table.ctrl)
+                    allocate(table, MIN_GROUPS);
+                else if (table.size + table.tombstones + 1 > table.max_load())
+                {
+                    start_rehash(groups_for(table.size + 1));
+                    rehash_step(1);
+                }
+            }
+            return rehashing() ? tables_[1] : tables_[0];
+        }
+
+        void maybe_shrink()
+        {
+            Table &table = tables_[0];
+            if (!rehashing() && table.groups > MIN_GROUPS && table.size < table.capacity() / 8)
+                start_rehash(groups_for(table.size));
+        }
+
+    public:
+        // Migrates up to n groups of the old table; returns true while a
+        // migration is still in progress.
+        bool rehash_step(size_t n)
+        {
+            if (!rehashing())
+                return false;
+            Table &from = tables_[0];
+            Table &to = tables_[1];
+            for (; n > 0 && rehash_group_ < from.groups; --n, ++rehash_group_)
+            {
+                for (size_t i = rehash_group_ * GROUP_SIZE; i < (rehash_group_ + 1) * GROUP_SIZE; ++i)
+                {
+                    if (!(from.ctrl[i] & FULL))
+                        continue;
+                    Entry &entry = from.slots[i];
+                    size_t slot = claim(to, hash_of(entry.key));
+                    new (&to.slots[slot]) Entry(std::move(entry));
+                    entry.~Entry();
+                    // Tombstone rather than empty: later groups may hold
+                    // entries whose probe sequence passes through this one.
+                    from.ctrl[i] = DELETED;
+                    from.size--;
+                }
+            }
+            if (rehash_group_ < from.groups)
+                return true;
+            finish_rehash();
+            return false;
+        }
+
+        Dict() = default;
+        Dict(const Dict &) = delete;
+        Dict &operator=(const Dict &) = delete;
+
+        ~Dict()
+        {
+            destroy(tables_[0]);
+            destroy(tables_[1]);
+        }
+
+        void clear()
+        {
+            destroy(tables_[0]);
+            destroy(tables_[1]);
+            rehash_group_ = 0;
+        }
+
+        Entry *find(std::string_view key) const { return find(key, hash_of(key)); }
+
+        // Batched lookups hash their keys up front and, while working on one
+        // key, prefetch the control bytes of a later key and then the slots
+        // its tag matches, so the cache misses of many keys overlap instead
+        // of being paid one after another. hash must come from hash().
+        static uint64_t hash(std::string_view key) { return hash_of(key); }
+
+        Entry *find(std::string_view key, uint64_t hash) const
+        {
+            if (rehashing())
+            {
+                if (Entry *entry = lookup(tables_[0], key, hash))
+                    return entry;
+                return lookup(tables_[1], key, hash);
+            }
+            return lookup(tables_[0], key, hash);
+        }
+
+        void prefetch(uint64_t hash) const
+        {
+            for (const Table &table : tables_)
+            {
+                if (table.ctrl)
+                    __builtin_prefetch(table.ctrl + (h1(hash) & (table.groups - 1)) * GROUP_SIZE);
+            }
+        }
+
+        // Only looks at the home group; keys that probed further are rare.
+        void prefetch_slots(uint64_t hash) const
+        {
+            for (const Table &table : tables_)
+            {
+                if (!table.ctrl)
+                    continue;
+                size_t group = h1(hash) & (table.groups - 1);
+                for (uint32_t bits = match(table.ctrl + group * GROUP_SIZE, h2(hash)); bits; bits &= bits - 1)
+                    __builtin_prefetch(&table.slots[group * GROUP_SIZE + __builtin_ctz(bits)]);
+            }
+        }
+
+        // Inserts value unless key exists; returns the entry and whether it was inserted.
+        std::pair<Entry *, bool> insert(std::string_view key, V &&value)
+        {
+            if (Entry *entry = find(key))
+                return {entry, false};
+            Table &table = insert_table();
+            size_t slot = claim(table, hash_of(key));
+            Entry *entry = new (&table.slots[slot]) Entry{SlabString(key.data(), key.size()), std::move(value)};
+            return {entry, true};
+        }
+
+        Entry *insert_or_assign(std::string_view key, V &&value)
+        {
+            auto [entry, inserted] = insert(key, std::move(value));
+            if (!inserted)
+                entry->value = std::move(value);
+            return entry;
+        }
+
+        bool erase(std::string_view key)
+        {
+            uint64_t hash = hash_of(key);
+            for (Table &table : tables_)
+            {
+                Entry *entry = lookup(table, key, hash);
+                if (entry)
+                {
+                    remove_slot(table, entry - table.slots);
+                    if (rehashing())
+                        rehash_step(1);
+                    else
+                        maybe_shrink();
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        // Sizes an empty dict for n entries up front, so bulk loads skip the
+        // intermediate migrations.
+        void reserve(size_t n)
+        {
+            if (!empty() || rehashing() || groups_for(n) <= tables_[0].groups)
+                return;
+            destroy(tables_[0]);
+            allocate(tables_[0], groups_for(n));
+        }
+
+        size_t size() const { return tables_[0].size + tables_[1].size; }
+        bool empty() const { return size() == 0; }
+
+        // Slots allocated across both tables, and the bytes they occupy.
+        size_t capacity() const { return tables_[0].capacity() + tables_[1].capacity(); }
+        size_t table_bytes() const { return capacity() * (sizeof(Entry) + 1); }
+
+        // Visits the entries whose home group matches cursor and returns the
+        // next cursor, 0 once the walk is complete. As in Redis, the cursor
+        // advances in reverse-binary order over home groups, so every entry
+        // present for the whole walk is visited at least once even if the
+        // table is resized in between; some entries may be visited twice.
+        template <typename F>
+        size_t scan(size_t cursor, F &&fn) const
+        {
+            if (!tables_[0].ctrl)
+                return 0;
+            if (!rehashing())
+            {
+                size_t mask = tables_[0].groups - 1;
+                visit_home(tables_[0], cursor & mask, fn);
+                return advance(cursor, mask);
+            }
+            const Table *small = &tables_[0];
+            const Table *large = &tables_[1];
+            if (small->groups > large->groups)
+                std::swap(small, large);
+            size_t small_mask = small->groups - 1;
+            size_t large_mask = large->groups - 1;
+            visit_home(*small, cursor & small_mask, fn);
+            do
+            {
+                visit_home(*large, cursor & large_mask, fn);
+                cursor = advance(cursor, large_mask);
+            } while (cursor & (small_mask ^ large_mask));
+            return cursor;
+        }
+
+        // Visits up to count entries from consecutive groups of the fuller
+        // table, starting at a group picked by random. Used for sampling.
+        template <typename F>
+        void sample(uint64_t random, size_t count, F &&fn) const
+        {
+            const Table &table = tables_[1].size > tables_[0].size ? tables_[1] : tables_[0];
+            if (table.size == 0)
+                return;
+            size_t mask = table.groups - 1;
+            size_t group = random & mask;
+            for (size_t visited = 0; visited < table.groups; ++visited, group = (group + 1) & mask)
+            {
+                for (size_t i = group * GROUP_SIZE; i < (group + 1) * GROUP_SIZE; ++i)
+                {
+                    if (!(table.ctrl[i] & FULL))
+                        continue;
+                    fn(table.slots[i]);
+                    if (--count == 0)
+                        return;
+                }
+            }
+        }
+
+        // Walks the slots of both tables for iterators: returns the first
+        // entry at or after position and moves position past it, or returns
+        // nullptr at the end. Only valid while the dict is not modified.
+        Entry *next(size_t &position) const
+        {
+            for (; position < capacity(); ++position)
+            {
+                bool first = position < tables_[0].capacity();
+                const Table &table = tables_[first ? 0 : 1];
+                size_t slot = first ? position : position - tables_[0].capacity();
+                if (table.ctrl[slot] & FULL)
+                {
+                    ++position;
+                    return &table.slots[slot];
+                }
+            }
+            return nullptr;
+        }
+
+        template <typename F>
+        void for_each(F &&fn) const
+        {
+            for (const Table &table : tables_)
+            {
+                for (size_t i = 0; i < table.capacity(); ++i)
+                {
+                    if (table.ctrl[i] & FULL)
+                        fn(table.slots[i]);
+                }
+            }
+        }
+    };
+}
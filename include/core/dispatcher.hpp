@@ -1,25 +1,247 @@
 #pragma once
+#include "arena.hpp"
 #include "command.hpp"
 #include "response.hpp"
-#include <unordered_map>
+#include <atomic>
+#include <cstdint>
 #include <functional>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+#include <vector>
 #include "store.hpp"
 
 namespace core
 {
+    class ServerStats;
+    enum class ValueType : uint8_t;
+    class SlowLog;
+    class Script;
+    class ScriptCache;
+    struct ShardStats;
+
     class CommandDispatcher
     {
-    private:
+    public:
         using CommandHandler = std::function<Response(const Command &)>;
-        std::unordered_map<std::string, CommandHandler> handlers_;
+        using WriteListener = std::function<void(const Command &)>;
+
+        enum CommandFlag : uint32_t
+        {
+            CMD_WRITE = 1 << 0,
+            CMD_READONLY = 1 << 1,
+            // May grow memory, so it is refused when the store cannot get
+            // under maxmemory.
+            CMD_DENYOOM = 1 << 2,
+            CMD_ADMIN = 1 << 3,
+            // Runs on every shard and the array replies are concatenated.
+            CMD_ALL_SHARDS = 1 << 4,
+            // Keyless, but routed to the shard its cursor (the first
+            // argument) is walking.
+            CMD_SHARD_CURSOR = 1 << 5,
+            // first_key holds the number of keys, which follow it.
+            CMD_NUMKEYS = 1 << 6,
+            // Refused when called from a script.
+            CMD_NOSCRIPT = 1 << 7,
+            // How the replies of a command split by split() are merged:
+            // integers summed, all OK, array items put back in key order,
+            // or arrays intersected.
+            CMD_SPLIT_SUM = 1 << 8,
+            CMD_SPLIT_OK = 1 << 9,
+            CMD_SPLIT_ORDERED = 1 << 10,
+            CMD_SPLIT_INTERSECT = 1 << 11,
+            CMD_SPLIT = CMD_SPLIT_SUM | CMD_SPLIT_OK | CMD_SPLIT_ORDERED | CMD_SPLIT_INTERSECT
+        };
+
+        // Entry of the static command table. arity counts the command name,
+        // as in Redis; -N means at least N. Key positions index args: the
+        // first key (-1 for keyless commands), the last (-1 meaning the final
+        // argument) and the step between keys. Commands implemented outside
+        // the core have no handler; add_command() supplies one at runtime.
+        struct CommandInfo
+        {
+            std::string_view name;
+            int arity;
+            uint32_t flags;
+            int first_key;
+            int last_key;
+            int key_step;
+            Response (CommandDispatcher::*handler)(const Command &);
+        };
+
+        // The share of a split command that one shard runs: the arguments
+        // before the first key, then the shard's keys in order, each with
+        // the key_step - 1 arguments that follow it. positions are the
+        // indexes of those keys among the command's keys.
+        struct Part
+        {
+            size_t shard;
+            Command command;
+            std::vector<size_t> positions;
+        };
+
+    private:
+        struct CommandTable;
+
+        // Handlers of commands implemented outside the core, by table index.
+        std::vector<CommandHandler> external_;
+        std::vector<WriteListener> write_listeners_;
         Store &store_;
+        ServerStats *stats_ = nullptr;
+        ShardStats *shard_stats_ = nullptr;
+        SlowLog *slowlog_ = nullptr;
+        ScriptCache *scripts_ = nullptr;
+        // Ticks from which a command is logged; the maximum when disabled.
+        uint64_t slowlog_threshold_ = UINT64_MAX;
+        size_t shard_ = 0;
+        size_t shards_ = 1;
+        const std::atomic<bool> *read_only_ = nullptr;
+        // Reply bytes of the command being executed; reset by the next one,
+        // so replies must be written out before dispatching again.
+        Arena arena_;
+        // Set by a handler to log something other than the command itself,
+        // e.g. relative TTLs as absolute times; empty means log nothing.
+        std::optional<std::vector<std::string>> propagate_;
+        // Keys each connection WATCHes on this shard, with the versions
+        // they had then.
+        std::unordered_map<uint64_t, std::vector<std::pair<std::string, uint64_t>>> watches_;
 
-        void registerStringCommands();
-        void registerListCommands();
-        void registerSetCommands();
+        void propagate_as(std::vector<std::string> argv);
+        void notify_write(const Command &command);
+        bool available(const CommandInfo &info) const;
+        // Drops a connection's watches; true if any watched key was written since.
+        bool unwatch_all(uint64_t client_id);
+        Response execute(const Command &command, bool replicated);
+
+        Response getCommand(const Command &command);
+        Response setCommand(const Command &command);
+        Response mgetCommand(const Command &command);
+        Response msetCommand(const Command &command);
+        Response msetnxCommand(const Command &command);
+        Response msetGenericCommand(const Command &command, bool nx);
+        Response delCommand(const Command &command);
+        Response unlinkCommand(const Command &command);
+        Response delGenericCommand(const Command &command, bool lazy);
+        Response existsCommand(const Command &command);
+        Response lpushCommand(const Command &command);
+        Response rpushCommand(const Command &command);
+        Response lpopCommand(const Command &command);
+        Response rpopCommand(const Command &command);
+        Response llenCommand(const Command &command);
+        Response lrangeCommand(const Command &command);
+        Response saddCommand(const Command &command);
+        Response sremCommand(const Command &command);
+        Response sismemberCommand(const Command &command);
+        Response scardCommand(const Command &command);
+        Response sinterCommand(const Command &command);
+        Response zaddCommand(const Command &command);
+        Response zincrbyCommand(const Command &command);
+        Response zremCommand(const Command &command);
+        Response zscoreCommand(const Command &command);
+        Response zrankCommand(const Command &command);
+        Response zcardCommand(const Command &command);
+        Response zcountCommand(const Command &command);
+        Response zrangeCommand(const Command &command);
+        Response zrangebyscoreCommand(const Command &command);
+        Response hsetCommand(const Command &command);
+        Response hgetCommand(const Command &command);
+        Response hmgetCommand(const Command &command);
+        Response hdelCommand(const Command &command);
+        Response hincrbyCommand(const Command &command);
+        Response hlenCommand(const Command &command);
+        Response hgetallCommand(const Command &command);
+        Response keysCommand(const Command &command);
+        Response scanCommand(const Command &command);
+        Response sscanCommand(const Command &command);
+        Response hscanCommand(const Command &command);
+        Response zscanCommand(const Command &command);
+        Response scanGenericCommand(const Command &command, ValueType type);
+        Response expireCommand(const Command &command);
+        Response pexpireCommand(const Command &command);
+        Response expireatCommand(const Command &command);
+        Response pexpireatCommand(const Command &command);
+        Response expireGenericCommand(const Command &command, bool seconds, bool relative);
+        Response ttlCommand(const Command &command);
+        Response pttlCommand(const Command &command);
+        Response ttlGenericCommand(const Command &command, bool millis);
+        Response persistCommand(const Command &command);
+        Response memoryCommand(const Command &command);
+        Response objectCommand(const Command &command);
+        Response pingCommand(const Command &command);
+        Response commandCommand(const Command &command);
+        Response infoCommand(const Command &command);
+        Response latencyCommand(const Command &command);
+        Response slowlogCommand(const Command &command);
+        Response watchCommand(const Command &command);
+        Response unwatchCommand(const Command &command);
+        Response multiCommand(const Command &command);
+        Response execCommand(const Command &command);
+        Response discardCommand(const Command &command);
+        Response evalCommand(const Command &command);
+        Response evalshaCommand(const Command &command);
+        Response evalGenericCommand(const Command &command, const Script &script);
+        Response scriptCommand(const Command &command);
 
     public:
         explicit CommandDispatcher(Store &store);
         Response dispatch(const Command &command);
+        // Applies a command from the replication stream: it bypasses the
+        // read-only check and the memory limit.
+        Response replicate(const Command &command);
+
+        // Returns the shard owning every key of the command, ROUTE_LOCAL for
+        // keyless commands or ROUTE_CROSS_SHARD when keys span shards.
+        int route(const Command &command, size_t shards) const;
+
+        // Why the command table rejects the command, an unknown name or the
+        // wrong number of arguments, as the error execute() would reply;
+        // empty if it passes. Lets MULTI refuse a command as it is queued.
+        static std::string check(const Command &command);
+
+        // Splits a CMD_SPLIT command whose keys span shards into one part
+        // per shard holding some of them. The parts' views point into
+        // command's arguments.
+        static std::vector<Part> split(const Command &command, size_t shards);
+        // Combines the RESP replies of the parts, in part order, into the
+        // reply of the whole command; the first error wins.
+        static std::string merge(const CommandInfo &info, const std::vector<std::string> &replies,
+                                 const std::vector<std::vector<size_t>> &positions);
+
+        // Looks a command up by name, ignoring case; nullptr if unknown.
+        static const CommandInfo *find_command(std::string_view name);
+        // The command table, in the order ShardStats indexes it.
+        static size_t command_count();
+        static const CommandInfo &command_at(size_t index);
+
+        // Position among the server's shards, for SCAN cursors that walk
+        // one shard after another.
+        void set_shard(size_t shard, size_t shards);
+
+        // Records per-command latencies and counts into the given shard of
+        // stats, and serves INFO and LATENCY from it.
+        void set_stats(ServerStats *stats, size_t shard);
+        // Logs commands slower than the log's threshold into the given
+        // shard's ring, and serves SLOWLOG from it.
+        void set_slowlog(SlowLog *slowlog, size_t shard);
+        // Serves EVAL, EVALSHA and SCRIPT from the cache, which all shards
+        // share.
+        void set_scripts(ScriptCache *scripts);
+
+        // While *read_only is set, write commands from clients are refused,
+        // as on a replica.
+        void set_read_only(const std::atomic<bool> *read_only) { read_only_ = read_only; }
+
+        // Supplies the handler of a table command implemented outside the
+        // core, e.g. persistence. Throws std::invalid_argument for names
+        // that are not in the table or are handled by the core.
+        void add_command(std::string_view name, CommandHandler handler);
+
+        // Listeners see every write command that executed without error, in
+        // execution order, e.g. to append it to a log.
+        void add_write_listener(WriteListener listener);
+
+        const Arena &arena() const { return arena_; }
     };
 }
@@ -0,0 +1,10 @@
+#pragma once
+#include <string_view>
+
+namespace core
+{
+    // Glob matching as in Redis KEYS and SCAN MATCH: * and ? wildcards,
+    // [abc], [^abc] and [a-z] classes, and backslash escapes. A * only
+    // backtracks to the most recent star, so matching is O(pattern * text).
+    bool glob_match(std::string_view pattern, std::string_view text);
+}
@@ -0,0 +1,88 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <variant>
+#include "dict.hpp"
+
+namespace core
+{
+    // Field/value map. While small it is one packed buffer of
+    // length-prefixed field and value pairs (listpack), searched linearly;
+    // it becomes a hash table once it outgrows that and never converts back.
+    class Hash
+    {
+    public:
+        enum class Kind : uint8_t
+        {
+            LISTPACK,
+            HASHTABLE
+        };
+
+        class const_iterator
+        {
+        public:
+            std::string_view field() const;
+            std::string_view value() const;
+            const_iterator &operator++();
+
+            bool operator==(const const_iterator &other) const { return index_ == other.index_; }
+            bool operator!=(const const_iterator &other) const { return index_ != other.index_; }
+
+        private:
+            friend class Hash;
+
+            const Hash *hash_ = nullptr;
+            size_t index_ = 0;
+            size_t offset_ = 0;
+            // Dict::next() position and current entry of a hash table.
+            size_t position_ = 0;
+            const Dict<std::string>::Entry *entry_ = nullptr;
+        };
+
+        Hash();
+
+        // Process-wide limits, as hash-max-listpack-entries and
+        // hash-max-listpack-value in Redis.
+        static void configure(size_t max_listpack_entries, size_t max_listpack_value);
+
+        // Returns true if the field is new.
+        bool set(std::string_view field, std::string_view value);
+        bool remove(std::string_view field);
+        // The view lasts until the hash is next modified.
+        std::optional<std::string_view> get(std::string_view field) const;
+
+        size_t size() const;
+        bool empty() const { return size() == 0; }
+        Kind kind() const { return static_cast<Kind>(data_.index()); }
+
+        // Heap bytes of the hash object and everything it owns.
+        size_t memory_usage() const;
+
+        const_iterator begin() const;
+        const_iterator end() const;
+
+        // One step of HSCAN, with the cursor semantics of Set::scan().
+        size_t scan(size_t cursor, const std::function<void(std::string_view field, std::string_view value)> &visit) const;
+
+    private:
+        struct Listpack
+        {
+            std::string bytes;
+            size_t count;
+        };
+        using Table = Dict<std::string>;
+
+        std::variant<Listpack, Table> data_;
+        // Heap bytes of the field and value strings in the hash table, kept
+        // as fields come and go; the table itself is counted by
+        // Dict::table_bytes().
+        size_t table_bytes_ = 0;
+
+        bool listpack_find(std::string_view field, size_t &offset, size_t &value_offset) const;
+        void to_table();
+    };
+}
@@ -0,0 +1,132 @@
+#pragma once
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+
+namespace core
+{
+    // Log-linear histogram: values below 64 get a bucket each, above that
+    // every power of two is split into 32 buckets, so a percentile is off
+    // by at most about 3%. Fixed size, no allocation; record() is a few
+    // instructions.
+    //
+    // One thread records; any thread may read or merge it meanwhile. The
+    // fields are relaxed atomics updated with a separate load and store,
+    // which compile to the same plain moves as ordinary integers.
+    class LatencyHistogram
+    {
+    public:
+        static constexpr int SUB_BITS = 5;
+        static constexpr size_t SUB_BUCKETS = size_t(1) << SUB_BITS;
+        static constexpr size_t BUCKETS = (64 - SUB_BITS) * SUB_BUCKETS;
+
+        LatencyHistogram() = default;
+        LatencyHistogram(const LatencyHistogram &) = delete;
+        LatencyHistogram &operator=(const LatencyHistogram &) = delete;
+
+        void record(uint64_t value)
+        {
+            add(counts_[index_of(value)], 1);
+            add(count_, 1);
+            add(sum_, value);
+            if (value < load(min_))
+                min_.store(value, std::memory_order_relaxed);
+            if (value > load(max_))
+                max_.store(value, std::memory_order_relaxed);
+        }
+
+        void merge(const LatencyHistogram &other)
+        {
+            for (size_t i = 0; i < BUCKETS; ++i)
+            {
+                add(counts_[i], load(other.counts_[i]));
+            }
+            add(count_, load(other.count_));
+            add(sum_, load(other.sum_));
+            min_.store(std::min(load(min_), load(other.min_)), std::memory_order_relaxed);
+            max_.store(std::max(load(max_), load(other.max_)), std::memory_order_relaxed);
+        }
+
+        void reset()
+        {
+            for (auto &count : counts_)
+            {
+                count.store(0, std::memory_order_relaxed);
+            }
+            count_.store(0, std::memory_order_relaxed);
+            sum_.store(0, std::memory_order_relaxed);
+            min_.store(std::numeric_limits<uint64_t>::max(), std::memory_order_relaxed);
+            max_.store(0, std::memory_order_relaxed);
+        }
+
+        uint64_t count() const { return load(count_); }
+        uint64_t sum() const { return load(sum_); }
+        uint64_t min() const { return count() ? load(min_) : 0; }
+        uint64_t max() const { return load(max_); }
+        double mean() const { return count() ? static_cast<double>(sum()) / count() : 0; }
+
+        // Upper bound of the bucket holding the given percentile (0-100),
+        // clamped to the largest value recorded.
+        uint64_t percentile(double p) const
+        {
+            uint64_t total = count();
+            if (total == 0)
+                return 0;
+            uint64_t rank = static_cast<uint64_t>(p / 100.0 * total + 0.5);
+            rank = std::clamp<uint64_t>(rank, 1, total);
+            uint64_t seen = 0;
+            for (size_t i = 0; i < BUCKETS; ++i)
+            {
+                seen += load(counts_[i]);
+                if (seen >= rank)
+                    return std::min(upper_bound(i), max());
+            }
+            return max();
+        }
+
+        // Calls fn(upper_bound, count) for every non-empty bucket in order.
+        template <typename Fn>
+        void for_each_bucket(Fn &&fn) const
+        {
+            for (size_t i = 0; i < BUCKETS; ++i)
+            {
+                if (uint64_t count = load(counts_[i]))
+                    fn(upper_bound(i), count);
+            }
+        }
+
+        static size_t index_of(uint64_t value)
+        {
+            if (value < 2 * SUB_BUCKETS)
+                return static_cast<size_t>(value);
+            int shift = 63 - __builtin_clzll(value) - SUB_BITS;
+            return (shift + 1) * SUB_BUCKETS + ((value >> shift) - SUB_BUCKETS);
+        }
+
+        static uint64_t upper_bound(size_t index)
+        {
+            if (index < 2 * SUB_BUCKETS)
+                return index;
+            int shift = static_cast<int>(index / SUB_BUCKETS) - 1;
+            uint64_t sub = index % SUB_BUCKETS + SUB_BUCKETS;
+            if (sub + 1 == 2 * SUB_BUCKETS && shift + SUB_BITS + 1 == 64)
+                return std::numeric_limits<uint64_t>::max();
+            return ((sub + 1) << shift) - 1;
+        }
+
+    private:
+        using Field = std::atomic<uint64_t>;
+
+        std::array<Field, BUCKETS> counts_{};
+        Field count_{0};
+        Field sum_{0};
+        Field min_{std::numeric_limits<uint64_t>::max()};
+        Field max_{0};
+
+        static uint64_t load(const Field &field) { return field.load(std::memory_order_relaxed); }
+        static void add(Field &field, uint64_t n) { field.store(load(field) + n, std::memory_order_relaxed); }
+    };
+}
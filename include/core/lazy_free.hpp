@@ -0,0 +1,66 @@
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace core
+{
+    class Value;
+
+    // Which removals hand their values to LazyFree, named after the Redis
+    // lazyfree-lazy-* settings. UNLINK always does.
+    struct LazyFreeOptions
+    {
+        bool user_del = false;   // DEL
+        bool server_del = false; // SET and restores overwriting a value
+        bool eviction = false;
+        bool expire = false;
+    };
+
+    // Frees large values on a background thread. A shard detaches the
+    // value from its key by moving it out, which is O(1), and pushes it on
+    // its own lock-free queue; the thread drains every queue and runs the
+    // destructors. Values cheaper to free than THRESHOLD allocations, and
+    // those that find their queue full, are freed in place.
+    class LazyFree
+    {
+    public:
+        // As LAZYFREE_THRESHOLD in Redis.
+        static constexpr size_t THRESHOLD = 64;
+
+        explicit LazyFree(size_t shards);
+        ~LazyFree();
+        LazyFree(const LazyFree &) = delete;
+        LazyFree &operator=(const LazyFree &) = delete;
+
+        // Called from the shard's thread; leaves value empty.
+        void release(size_t shard, Value &&value);
+
+        // Values queued and not yet freed, and values freed by the thread.
+        uint64_t pending() const;
+        uint64_t freed() const { return freed_.load(std::memory_order_relaxed); }
+
+    private:
+        struct Queue;
+
+        std::vector<std::unique_ptr<Queue>> queues_;
+        std::atomic<uint64_t> queued_{0};
+        std::atomic<uint64_t> freed_{0};
+        // Set by the thread before it waits; a shard that queues a value
+        // while it is set wakes the thread.
+        std::atomic<bool> sleeping_{false};
+
+        std::mutex mutex_;
+        std::condition_variable wake_cv_;
+        bool wake_ = false;
+        bool stop_ = false;
+        std::thread thread_;
+
+        void run();
+    };
+}
@@ -0,0 +1,117 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <iterator>
+#include <string>
+#include <string_view>
+
+namespace core
+{
+    // List encoding in the style of Redis' quicklist: a doubly linked list
+    // of nodes, each a contiguous "listpack" of length-prefixed entries
+    //   varint length | bytes | backlen
+    // where backlen is the size of the first two parts written so it can be
+    // read backwards, which is what makes popping the tail cheap. Nodes are
+    // capped at max_node_bytes (an entry larger than that gets a node of its
+    // own), so pushes and pops at either end stay O(1) while a short element
+    // costs a few bytes instead of a std::string in a deque block.
+    //
+    // With a compress depth of N, every node further than N nodes from both
+    // ends is kept LZF-compressed; only the ends are ever modified.
+    class Quicklist
+    {
+    private:
+        struct Node
+        {
+            Node *prev = nullptr;
+            Node *next = nullptr;
+            char *data = nullptr;
+            uint32_t bytes = 0;
+            uint32_t capacity = 0;
+            uint32_t count = 0;
+            // Listpack size while the node is compressed.
+            uint32_t raw_bytes = 0;
+            bool compressed = false;
+            bool incompressible = false;
+        };
+
+    public:
+        class const_iterator
+        {
+        public:
+            using iterator_category = std::forward_iterator_tag;
+            using value_type = std::string_view;
+            using difference_type = std::ptrdiff_t;
+            using pointer = const std::string_view *;
+            using reference = std::string_view;
+
+            const_iterator() = default;
+
+            std::string_view operator*() const;
+            const_iterator &operator++();
+            const_iterator operator++(int)
+            {
+                const_iterator old = *this;
+                ++*this;
+                return old;
+            }
+
+            bool operator==(const const_iterator &other) const { return node_ == other.node_ && index_ == other.index_; }
+            bool operator!=(const const_iterator &other) const { return !(*this == other); }
+
+        private:
+            friend class Quicklist;
+
+            const Node *node_ = nullptr;
+            uint32_t index_ = 0;
+            uint32_t offset_ = 0;
+            // Decompressed copy of node_ when it is compressed.
+            std::string scratch_;
+
+            void load(const Node *node);
+            const char *data() const { return node_->compressed ? scratch_.data() : node_->data; }
+        };
+
+        Quicklist();
+        ~Quicklist();
+        Quicklist(const Quicklist &) = delete;
+        Quicklist &operator=(const Quicklist &) = delete;
+
+        // Process-wide settings, applied to nodes created afterwards.
+        static void configure(size_t max_node_bytes, size_t compress_depth);
+
+        void push_front(std::string_view item);
+        void push_back(std::string_view item);
+        bool pop_front(std::string &out);
+        bool pop_back(std::string &out);
+
+        size_t size() const { return count_; }
+        bool empty() const { return count_ == 0; }
+        size_t node_count() const { return nodes_; }
+
+        // Heap bytes of the list object and all its nodes, kept up to date
+        // as the list changes.
+        size_t memory_usage() const { return bytes_; }
+
+        const_iterator begin() const { return at(0); }
+        const_iterator end() const { return const_iterator(); }
+        // Iterator to the element at index, or end() if out of range.
+        const_iterator at(size_t index) const;
+
+    private:
+        Node *head_ = nullptr;
+        Node *tail_ = nullptr;
+        size_t count_ = 0;
+        size_t nodes_ = 0;
+        size_t bytes_ = 0;
+
+        Node *add_node(bool front);
+        void remove_node(Node *node);
+        void reserve(Node *node, size_t bytes);
+        void shrink(Node *node);
+        void compress(Node *node);
+        void decompress(Node *node);
+        void update_compression();
+        bool fits(const Node *node, size_t entry_bytes) const;
+    };
+}
@@ -1,7 +1,10 @@
 #pragma once
+#include <charconv>
 #include <string>
+#include <string_view>
+#include <type_traits>
+#include <utility>
 #include <vector>
-#include <sstream>
 namespace core
 {
     enum class ResponseStatus
@@ -11,7 +14,9 @@ namespace core
         STRING,
         NIL,
         ARRAY,
-        INTEGER
+        INTEGER,
+        ENCODED, // message already holds the reply in RESP form
+        VIEW     // bulk string held by view, e.g. in the dispatcher's arena
     };
 
     class Response
@@ -21,6 +26,8 @@ namespace core
         std::string message;
         std::vector<std::string> array_data;
         long long int_value;
+        // Must outlive the response until it is written.
+        std::string_view view;
 
         Response(ResponseStatus status, const std::string &message = "", const std::vector<std::string> &array = {}, long long int_val = 0)
             : status(status), message(message), array_data(array), int_value(int_val) {}
@@ -40,6 +47,21 @@ namespace core
             return Response(ResponseStatus::STRING, msg);
         }
 
+        static Response String(std::string &&msg)
+        {
+            Response response(ResponseStatus::STRING);
+            response.message = std::move(msg);
+            return response;
+        }
+
+        // A bulk string that is not copied into the response.
+        static Response View(std::string_view bytes)
+        {
+            Response response(ResponseStatus::VIEW);
+            response.view = bytes;
+            return response;
+        }
+
         static Response Nil()
         {
             return Response(ResponseStatus::NIL);
@@ -50,42 +72,126 @@ namespace core
             return Response(ResponseStatus::ARRAY, "", arr);
         }
 
+        static Response Array(std::vector<std::string> &&arr)
+        {
+            Response response(ResponseStatus::ARRAY);
+            response.array_data = std::move(arr);
+            return response;
+        }
+
         static Response Integer(long long val)
         {
             return Response(ResponseStatus::INTEGER, "", {}, val);
         }
 
+        // For replies built element by element straight into RESP, without
+        // an intermediate vector of strings.
+        static Response Encoded(std::string resp)
+        {
+            Response response(ResponseStatus::ENCODED);
+            response.message = std::move(resp);
+            return response;
+        }
+
+        static void append_array_header(std::string &out, size_t count) { append_header(out, '*', static_cast<long long>(count)); }
+
+        static void append_bulk(std::string &out, std::string_view item)
+        {
+            append_header(out, '$', static_cast<long long>(item.size()));
+            out.append(item.data(), item.size());
+            out.append("\r\n", 2);
+        }
+
+        static void append_nil(std::string &out) { out.append("$-1\r\n", 5); }
+
+        static void append_integer(std::string &out, long long value) { append_header(out, ':', value); }
+
+        static void append_status(std::string &out, std::string_view status)
+        {
+            out += '+';
+            out.append(status.data(), status.size());
+            out.append("\r\n", 2);
+        }
+
         std::string to_resp() const
         {
-            std::ostringstream oss;
-            switch (status)
+            std::string out;
+            serialize(*this, out);
+            return out;
+        }
+
+        // Appends the reply in RESP form to any sink with append(string_view)
+        // and append(std::string &&). Payloads are moved into the sink, so a
+        // buffer that keeps large strings by reference never copies them.
+        template <typename Out>
+        void write_resp(Out &out) &&
+        {
+            serialize(std::move(*this), out);
+        }
+
+    private:
+        template <typename Self, typename Out>
+        static void serialize(Self &&self, Out &out)
+        {
+            constexpr bool steal = !std::is_lvalue_reference_v<Self>;
+            auto bulk = [&out](auto &item)
+            {
+                append_header(out, '$', static_cast<long long>(item.size()));
+                if constexpr (steal)
+                    out.append(std::move(item));
+                else
+                    out.append(std::string_view(item));
+                out.append(std::string_view("\r\n"));
+            };
+            switch (self.status)
             {
             case ResponseStatus::OK:
-                oss << "+OK\r\n";
+                out.append(std::string_view("+OK\r\n"));
                 break;
             case ResponseStatus::ERROR:
-                oss << "-ERR " << message << "\r\n";
+                out.append(std::string_view("-ERR "));
+                out.append(std::string_view(self.message));
+                out.append(std::string_view("\r\n"));
                 break;
             case ResponseStatus::STRING:
-                oss << "$" << message.size() << "\r\n"
-                    << message << "\r\n";
+                bulk(self.message);
+                break;
+            case ResponseStatus::VIEW:
+                append_header(out, '$', static_cast<long long>(self.view.size()));
+                out.append(self.view);
+                out.append(std::string_view("\r\n"));
                 break;
             case ResponseStatus::NIL:
-                oss << "$-1\r\n";
+                out.append(std::string_view("$-1\r\n"));
                 break;
             case ResponseStatus::ARRAY:
-                oss << "*" << array_data.size() << "\r\n";
-                for (const auto &item : array_data)
+                append_header(out, '*', static_cast<long long>(self.array_data.size()));
+                for (auto &item : self.array_data)
                 {
-                    oss << "$" << item.size() << "\r\n"
-                        << item << "\r\n";
+                    bulk(item);
                 }
                 break;
             case ResponseStatus::INTEGER:
-                oss << ":" << int_value << "\r\n";
+                append_header(out, ':', self.int_value);
+                break;
+            case ResponseStatus::ENCODED:
+                if constexpr (steal)
+                    out.append(std::move(self.message));
+                else
+                    out.append(std::string_view(self.message));
                 break;
             }
-            return oss.str();
+        }
+
+        template <typename Out>
+        static void append_header(Out &out, char type, long long value)
+        {
+            char header[24];
+            header[0] = type;
+            char *end = std::to_chars(header + 1, header + sizeof(header) - 2, value).ptr;
+            *end++ = '\r';
+            *end++ = '\n';
+            out.append(std::string_view(header, end - header));
         }
     };
 }
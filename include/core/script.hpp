@@ -0,0 +1,74 @@
+#pragma once
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <shared_mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+namespace core
+{
+    class Command;
+    class Response;
+
+    // Lower-case hex SHA1 of data, the name EVALSHA knows a script by.
+    std::string sha1_hex(std::string_view data);
+
+    // A script for EVAL, written in the subset of Lua described in the
+    // README and compiled to bytecode for a small stack machine. Compiled
+    // scripts are immutable, so one copy serves every shard; each run gets
+    // its own stack, locals and tables.
+    class Script
+    {
+    public:
+        // Runs a command for redis.call() and redis.pcall(). The command's
+        // views only live for the call.
+        using Call = std::function<Response(const Command &)>;
+        // The bytecode; only script.cpp knows its layout.
+        struct Program;
+
+        // nullptr, with error set, if the source does not compile.
+        static std::shared_ptr<const Script> compile(std::string_view source, std::string &error);
+        ~Script();
+
+        // Runs the script with KEYS and ARGV bound and returns its reply.
+        // A run still going after time_limit stops with an error; writes it
+        // made until then are kept.
+        Response run(const std::vector<std::string_view> &keys, const std::vector<std::string_view> &argv, const Call &call,
+                     std::chrono::milliseconds time_limit) const;
+
+    private:
+        explicit Script(std::unique_ptr<Program> program);
+
+        std::unique_ptr<Program> program_;
+    };
+
+    // Compiled scripts by SHA1, shared by all shards: EVALSHA may run on
+    // another shard than the SCRIPT LOAD that cached it. Lookups take a
+    // shared lock, so shards only wait on each other while a script is
+    // added.
+    class ScriptCache
+    {
+    public:
+        explicit ScriptCache(int64_t time_limit_ms);
+
+        // The cached script with source's digest, compiled first if it is
+        // new. nullptr with error set if it does not compile.
+        std::shared_ptr<const Script> load(std::string_view source, std::string &sha, std::string &error);
+        // nullptr if no script has that digest; case is ignored.
+        std::shared_ptr<const Script> find(std::string_view sha) const;
+        void flush();
+        size_t size() const;
+
+        std::chrono::milliseconds time_limit() const { return time_limit_; }
+
+    private:
+        mutable std::shared_mutex mutex_;
+        std::unordered_map<std::string, std::shared_ptr<const Script>> scripts_;
+        std::chrono::milliseconds time_limit_;
+    };
+}
@@ -0,0 +1,117 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <iterator>
+#include <string>
+#include <string_view>
+#include <variant>
+#include <vector>
+#include "dict.hpp"
+
+namespace core
+{
+    // Set with Redis-style adaptive encodings. It starts as a sorted array
+    // of integers (intset) while every member is a canonical integer, or
+    // as a packed buffer of length-prefixed strings (listpack) while it is
+    // small, and becomes a hash table once it outgrows either. Conversions
+    // only go towards the hash table.
+    class Set
+    {
+    public:
+        enum class Kind : uint8_t
+        {
+            INTSET,
+            LISTPACK,
+            HASHTABLE
+        };
+
+        // Members are handed out as views; integers are formatted into the
+        // iterator, so a view lasts until the iterator moves.
+        class const_iterator
+        {
+        public:
+            using iterator_category = std::forward_iterator_tag;
+            using value_type = std::string_view;
+            using difference_type = std::ptrdiff_t;
+            using pointer = const std::string_view *;
+            using reference = std::string_view;
+
+            std::string_view operator*() const;
+            const_iterator &operator++();
+
+            bool operator==(const const_iterator &other) const { return index_ == other.index_; }
+            bool operator!=(const const_iterator &other) const { return index_ != other.index_; }
+
+        private:
+            friend class Set;
+
+            const Set *set_ = nullptr;
+            size_t index_ = 0;
+            size_t offset_ = 0;
+            // Dict::next() position and current member of a hash table.
+            size_t position_ = 0;
+            const SlabString *member_ = nullptr;
+            mutable char buffer_[24];
+        };
+
+        Set();
+
+        // Process-wide limits, as set-max-intset-entries,
+        // set-max-listpack-entries and set-max-listpack-value in Redis.
+        static void configure(size_t max_intset_entries, size_t max_listpack_entries, size_t max_listpack_value);
+
+        // Return true if the set changed.
+        bool add(std::string_view member);
+        bool remove(std::string_view member);
+        bool contains(std::string_view member) const;
+
+        // Switches straight to a hash table if n members will not fit the
+        // compact encodings anyway.
+        void reserve(size_t n);
+
+        size_t size() const;
+        bool empty() const { return size() == 0; }
+        Kind kind() const { return static_cast<Kind>(data_.index()); }
+
+        // Heap bytes of the set object and everything it owns.
+        size_t memory_usage() const;
+
+        // The sorted members of an intset, or nullptr.
+        const std::vector<int64_t> *ints() const { return std::get_if<Ints>(&data_); }
+
+        const_iterator begin() const;
+        const_iterator end() const;
+
+        // One step of SSCAN: visits the members a cursor covers and returns
+        // the next cursor, 0 once done. A hash table is walked with
+        // Dict::scan cursors, so members present for the whole walk are
+        // seen even if it resizes in between; the compact encodings are
+        // visited whole in the first call.
+        size_t scan(size_t cursor, const std::function<void(std::string_view member)> &visit) const;
+
+        // Intersection of two sorted arrays, appended to out. Gallops
+        // through b when it is much larger than a, otherwise merges a
+        // block of b at a time.
+        static void intersect_sorted(const std::vector<int64_t> &a, const std::vector<int64_t> &b, std::vector<int64_t> &out);
+
+    private:
+        using Ints = std::vector<int64_t>;
+        struct Listpack
+        {
+            std::string bytes;
+            size_t count = 0;
+        };
+        using Table = Dict<std::monostate>;
+
+        std::variant<Ints, Listpack, Table> data_;
+        // Heap bytes of the member strings in the hash table, kept as members
+        // come and go; the table itself is counted by Dict::table_bytes().
+        size_t table_bytes_ = 0;
+
+        bool listpack_find(std::string_view member, size_t *offset, size_t *size) const;
+        void to_listpack();
+        void to_table();
+        void table_insert(std::string_view member);
+    };
+}
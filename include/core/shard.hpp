@@ -0,0 +1,36 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <string_view>
+
+namespace core
+{
+    // Route results besides a shard index: keyless commands run on the
+    // receiving shard, commands whose keys live on several shards are
+    // rejected, and commands such as KEYS run on every shard.
+    constexpr int ROUTE_LOCAL = -1;
+    constexpr int ROUTE_CROSS_SHARD = -2;
+    constexpr int ROUTE_ALL_SHARDS = -3;
+
+    // Returns the part of the key that decides its shard. As in Redis
+    // Cluster, a non-empty "{tag}" pins related keys to the same shard.
+    inline std::string_view hash_tag(std::string_view key)
+    {
+        size_t open = key.find('{');
+        if (open == std::string_view::npos)
+            return key;
+        size_t close = key.find('}', open + 1);
+        if (close == std::string_view::npos || close == open + 1)
+            return key;
+        return key.substr(open + 1, close - open - 1);
+    }
+
+    // Maps a key to one of `shards` partitions using the high bits of its
+    // hash, so the low bits stay well distributed for per-shard tables.
+    inline size_t shard_of(std::string_view key, size_t shards)
+    {
+        uint64_t hash = std::hash<std::string_view>{}(hash_tag(key));
+        return static_cast<size_t>((static_cast<unsigned __int128>(hash) * shards) >> 64);
+    }
+}
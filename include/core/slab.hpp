@@ -0,0 +1,65 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <new>
+#include <string>
+
+namespace core
+{
+    // Size-class allocator for stored keys and short values. Requests of
+    // up to MAX_SIZE bytes are rounded up to one of 16 classes and carved
+    // from 64 KB slabs of blocks of that class, so churn among keys of
+    // similar sizes reuses the same blocks instead of fragmenting the heap.
+    // Larger requests go to operator new.
+    //
+    // Each thread allocates from and frees into its own free lists without
+    // locks. A thread holding too many free blocks of a class, such as the
+    // lazy-free thread, hands a batch to a shared pool that the others
+    // refill from; so do threads that exit. Slabs are never returned.
+    class Slab
+    {
+    public:
+        static constexpr size_t MAX_SIZE = 512;
+
+        static void *allocate(size_t size);
+        // size must be the one given to allocate().
+        static void deallocate(void *block, size_t size);
+
+        // Bytes actually taken by an allocation of size bytes.
+        static size_t block_size(size_t size);
+
+        struct Stats
+        {
+            uint64_t allocations;
+            uint64_t frees;
+            // Requests above MAX_SIZE, passed on to operator new.
+            uint64_t large_allocations;
+            size_t reserved_bytes;
+            size_t used_bytes;
+        };
+        // Sums over all threads; counters of running threads may lag.
+        static Stats stats();
+    };
+
+    // std allocator over Slab, for containers holding stored data.
+    template <typename T>
+    struct SlabAllocator
+    {
+        using value_type = T;
+
+        SlabAllocator() = default;
+        template <typename U>
+        SlabAllocator(const SlabAllocator<U> &) {}
+
+        T *allocate(size_t n) { return static_cast<T *>(Slab::allocate(n * sizeof(T))); }
+        void deallocate(T *p, size_t n) { Slab::deallocate(p, n * sizeof(T)); }
+
+        template <typename U>
+        bool operator==(const SlabAllocator<U> &) const { return true; }
+        template <typename U>
+        bool operator!=(const SlabAllocator<U> &) const { return false; }
+    };
+
+    // Keys of up to 15 bytes stay inline; longer ones take a slab block.
+    using SlabString = std::basic_string<char, std::char_traits<char>, SlabAllocator<char>>;
+}
@@ -0,0 +1,65 @@
+#pragma once
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "command.hpp"
+
+namespace core
+{
+    // Commands that ran longer than a threshold, kept in one fixed-size ring
+    // per shard. Entries are allocated up front and arguments are copied
+    // into them truncated, so recording a slow command never allocates.
+    // Each ring has its own mutex, taken only to record a slow command or
+    // to read the log, so fast commands pay a single comparison.
+    class SlowLog
+    {
+    public:
+        // As in Redis: arguments beyond MAX_ARGS are summarized, and each
+        // is cut to MAX_ARG_LENGTH bytes.
+        static constexpr size_t MAX_ARGS = 32;
+        static constexpr size_t MAX_ARG_LENGTH = 128;
+        static constexpr size_t MAX_CLIENT_LENGTH = 48;
+
+        struct Entry
+        {
+            uint64_t id;
+            // Unix time in seconds when the command finished.
+            int64_t time;
+            uint64_t duration_usec;
+            std::string client;
+            // Name first, then arguments, with the truncation notes added.
+            std::vector<std::string> argv;
+        };
+
+        // A negative threshold disables the log; 0 logs every command.
+        SlowLog(size_t shards, size_t max_len, int64_t threshold_usec);
+        ~SlowLog();
+        SlowLog(const SlowLog &) = delete;
+        SlowLog &operator=(const SlowLog &) = delete;
+
+        // Execution time in ticks above which a command is logged.
+        uint64_t threshold_ticks() const { return threshold_ticks_; }
+        bool enabled() const { return enabled_; }
+
+        void record(size_t shard, const Command &command, uint64_t elapsed_ticks);
+
+        // Newest first across all shards; count < 0 means all of them.
+        std::vector<Entry> get(int64_t count) const;
+        size_t len() const;
+        void reset();
+
+    private:
+        struct Slot;
+        struct Ring;
+
+        std::vector<std::unique_ptr<Ring>> rings_;
+        size_t max_len_;
+        bool enabled_;
+        uint64_t threshold_ticks_;
+        std::atomic<uint64_t> next_id_{0};
+    };
+}
@@ -0,0 +1,43 @@
+#pragma once
+#include <functional>
+#include <string>
+#include <string_view>
+#include <unordered_set>
+#include "store.hpp"
+#include "value.hpp"
+
+namespace core
+{
+    // Point-in-time view of a Store produced without forking or blocking.
+    // The keyspace is walked a few groups at a time with a resize-safe
+    // cursor; a key about to be modified is emitted first if the walk has
+    // not reached it yet, and is skipped by the walk afterwards. Every key
+    // therefore comes out exactly as it was when the snapshot started. A
+    // key may be emitted more than once, so consumers must treat each
+    // emission as a full replacement.
+    class Snapshot
+    {
+    public:
+        // expire_at is the key's absolute expire time in ms, or -1.
+        using Emitter = std::function<void(std::string_view key, const Value &value, int64_t expire_at)>;
+
+        Snapshot(Store &store, Emitter emit);
+        ~Snapshot();
+        Snapshot(const Snapshot &) = delete;
+        Snapshot &operator=(const Snapshot &) = delete;
+
+        // Advances the walk by up to `groups` table groups; returns true when done.
+        bool step(size_t groups);
+        bool done() const { return done_; }
+
+        // Called by the store before it mutates or removes key.
+        void before_write(std::string_view key);
+
+    private:
+        Store &store_;
+        Emitter emit_;
+        size_t cursor_ = 0;
+        bool done_ = false;
+        std::unordered_set<std::string> handled_;
+    };
+}
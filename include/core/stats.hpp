@@ -0,0 +1,141 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+#include "latency_histogram.hpp"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+namespace core
+{
+    class Store;
+
+    // Timestamp for instrumentation: the TSC where there is one, a few
+    // cycles to read, otherwise the steady clock in nanoseconds.
+    inline uint64_t ticks()
+    {
+#if defined(__x86_64__) || defined(__i386__)
+        return __rdtsc();
+#else
+        return static_cast<uint64_t>(std::chrono::steady_clock::now().time_since_epoch().count());
+#endif
+    }
+
+    // Measured against the steady clock on first use.
+    double ticks_per_usec();
+
+    // Written by one thread, read by any, like LatencyHistogram.
+    class Counter
+    {
+    public:
+        void add(uint64_t n) { value_.store(load() + n, std::memory_order_relaxed); }
+        void set(uint64_t n) { value_.store(n, std::memory_order_relaxed); }
+        uint64_t load() const { return value_.load(std::memory_order_relaxed); }
+
+    private:
+        std::atomic<uint64_t> value_{0};
+    };
+
+    // Statistics of one shard, written only by its thread. Latencies are
+    // in ticks.
+    struct ShardStats
+    {
+        struct CommandStats
+        {
+            // Allocated on the first call, so unused commands cost a pointer.
+            std::atomic<LatencyHistogram *> latency{nullptr};
+            // Refused before running (arity, OOM) or replied with an error.
+            Counter rejected;
+            Counter failed;
+
+            ~CommandStats() { delete latency.load(); }
+
+            void record(uint64_t elapsed)
+            {
+                LatencyHistogram *histogram = latency.load(std::memory_order_relaxed);
+                if (!histogram)
+                {
+                    histogram = new LatencyHistogram();
+                    latency.store(histogram, std::memory_order_release);
+                }
+                histogram->record(elapsed);
+            }
+        };
+
+        explicit ShardStats(size_t commands) : commands(new CommandStats[commands]) {}
+
+        // Indexed like the dispatcher's command table.
+        std::unique_ptr<CommandStats[]> commands;
+        // Busy part of each event-loop iteration, from the end of one
+        // epoll_wait to the start of the next.
+        LatencyHistogram loop;
+        Counter connections_received;
+        Counter connected_clients;
+        Counter net_input_bytes;
+        Counter net_output_bytes;
+        // read and writev calls on client sockets.
+        Counter read_calls;
+        Counter write_calls;
+        // Copied from the store by observe().
+        Counter keys;
+        Counter expires;
+        Counter used_memory;
+        Counter maxmemory;
+        Counter expired_keys;
+        Counter evicted_keys;
+
+        void observe(const Store &store);
+    };
+
+    class ServerStats
+    {
+    public:
+        ServerStats(size_t shards, size_t commands);
+
+        size_t shards() const { return shards_.size(); }
+        ShardStats &shard(size_t id) { return *shards_[id]; }
+        const ShardStats &shard(size_t id) const { return *shards_[id]; }
+        int64_t uptime_seconds() const;
+
+        // Sums of a field over all shards.
+        uint64_t total(Counter ShardStats::*field) const;
+        struct CommandTotals
+        {
+            uint64_t calls = 0;
+            uint64_t ticks = 0;
+            uint64_t rejected = 0;
+            uint64_t failed = 0;
+        };
+        // Counts of one command across shards, without merging histograms.
+        CommandTotals command_totals(size_t command) const;
+        // Latency of one command across shards, in ticks.
+        void command_latency(size_t command, LatencyHistogram &out) const;
+
+        // INFO text for the given sections; empty means all of them.
+        std::string info(const std::vector<std::string> &sections) const;
+        // Prometheus text exposition format, version 0.0.4.
+        std::string prometheus() const;
+
+        // Adds an INFO section rendered by another module, listed before
+        // Keyspace. Only call before the server starts.
+        void add_section(std::string title, std::function<std::string()> render);
+
+    private:
+        struct Section
+        {
+            std::string title;
+            std::function<std::string()> render;
+        };
+
+        std::vector<std::unique_ptr<ShardStats>> shards_;
+        std::chrono::steady_clock::time_point started_;
+        std::vector<Section> sections_;
+    };
+}
@@ -1,32 +1,244 @@
 #pragma once
+#include <cstdint>
+#include <functional>
+#include <memory>
 #include <optional>
 #include <string>
-#include <deque>
-#include <unordered_set>
+#include <string_view>
+#include <vector>
 
 namespace core
 {
+    enum class EvictionPolicy
+    {
+        NOEVICTION,
+        ALLKEYS_LRU,
+        ALLKEYS_LFU,
+        VOLATILE_TTL
+    };
+
+    // Score interval of ZRANGEBYSCORE and ZCOUNT; either end may be open.
+    struct ScoreRange
+    {
+        double min;
+        double max;
+        bool min_exclusive = false;
+        bool max_exclusive = false;
+    };
+
+    class Arena;
+    class LazyFree;
+    struct LazyFreeOptions;
+    class StoreImpl;
+    class Snapshot;
+    class Value;
+
     class Store
     {
+    private:
+        std::unique_ptr<StoreImpl> impl_;
+
     public:
-        // String operations
-        bool set(const std::string &key, const std::string &value);
-        std::optional<std::string> get(const std::string &key) const;
-        bool remove(const std::string &key);
+        Store();
+        ~Store();
+
+        // String operations. set() clears any TTL unless keep_ttl is given.
+        bool set(std::string_view key, std::string_view value, bool keep_ttl = false);
+        std::optional<std::string> get(std::string_view key) const;
+        // Integers and embedded short strings are formatted into arena and
+        // valid until it is reset. Heap strings are copied into heap, which
+        // the caller can move into its reply; the view then points there.
+        std::optional<std::string_view> get(std::string_view key, Arena &arena, std::string &heap) const;
+        bool remove(std::string_view key);
+
+        // Multi-key operations. Each runs as one batch whose hash lookups
+        // prefetch the keys that follow (see Dict::prefetch).
+        using ValueVisitor = std::function<void(std::optional<std::string_view> value)>;
+        // Calls visit for every key in order, with nullopt for keys that are
+        // missing or hold another type.
+        void mget(const std::vector<std::string_view> &keys, const ValueVisitor &visit);
+        struct KeyValue
+        {
+            std::string_view key;
+            std::string_view value;
+        };
+        void mset(const std::vector<KeyValue> &pairs);
+        // Sets nothing and returns false if any of the keys exists.
+        bool msetnx(const std::vector<KeyValue> &pairs);
+        // Number of keys removed, and of keys that exist, counting a key
+        // each time it is named.
+        size_t remove(const std::vector<std::string_view> &keys);
+        // remove() that always frees the values lazily.
+        size_t unlink(const std::vector<std::string_view> &keys);
+        size_t exists(const std::vector<std::string_view> &keys);
 
         // List operations
-        bool lpush(const std::string &key, const std::string &value);
-        bool rpush(const std::string &key, const std::string &value);
-        std::optional<std::string> lpop(const std::string &key);
-        std::optional<std::string> rpop(const std::string &key);
-        std::optional<std::deque<std::string>> lrange(const std::string &key, int start, int end);
-        std::optional<size_t> llen(const std::string &key);
+        bool lpush(std::string_view key, std::string_view value);
+        bool rpush(std::string_view key, std::string_view value);
+        std::optional<std::string> lpop(std::string_view key);
+        std::optional<std::string> rpop(std::string_view key);
+        // Streams the elements from start to end inclusive (negative indices
+        // count from the tail) to visit, after telling begin how many there
+        // are. Returns false if the key holds another type.
+        using ItemVisitor = std::function<void(std::string_view item)>;
+        bool lrange(std::string_view key, long long start, long long end, const std::function<void(size_t count)> &begin,
+                    const ItemVisitor &visit);
+        std::optional<size_t> llen(std::string_view key);
 
         // Set operations
-        bool sadd(const std::string &key, const std::string &value);
-        bool srem(const std::string &key, const std::string &value);
-        std::optional<std::unordered_set<std::string>> sismember(const std::string &key);
-        std::optional<size_t> scard(const std::string &key);
-        std::optional<std::unordered_set<std::string>> sinter(const std::string &key1, const std::string &key2);
+        bool sadd(std::string_view key, std::string_view value);
+        bool srem(std::string_view key, std::string_view value);
+        // Tested in place; nullopt if the key holds another type.
+        std::optional<bool> sismember(std::string_view key, std::string_view member);
+        std::optional<size_t> scard(std::string_view key);
+        // Members common to all keys, walking the smallest set; a missing
+        // key is an empty set. nullopt if any key holds another type.
+        std::optional<std::vector<std::string>> sinter(const std::vector<std::string_view> &keys);
+        // One SSCAN step (see Set::scan) returning the next cursor; nullopt
+        // if the key holds another type, 0 for a missing key.
+        std::optional<size_t> sscan(std::string_view key, size_t cursor, const ItemVisitor &visit);
+
+        // Sorted set operations. Scores are never NaN. Methods returning an
+        // optional or a bool give nullopt or false if the key holds another
+        // type; a missing key is an empty sorted set.
+        struct ScoredMember
+        {
+            std::string_view member;
+            double score;
+        };
+        struct ZAddResult
+        {
+            size_t added;
+            size_t updated;
+        };
+        // With nx existing members are left alone, with xx new ones are not added.
+        std::optional<ZAddResult> zadd(std::string_view key, const std::vector<ScoredMember> &members, bool nx, bool xx);
+        // The new score; NaN, leaving the member alone, if the sum is not a number.
+        std::optional<double> zincrby(std::string_view key, std::string_view member, double increment);
+        std::optional<size_t> zrem(std::string_view key, const std::vector<std::string_view> &members);
+        bool zscore(std::string_view key, std::string_view member, std::optional<double> &score);
+        bool zrank(std::string_view key, std::string_view member, std::optional<size_t> &rank);
+        std::optional<size_t> zcard(std::string_view key);
+        std::optional<size_t> zcount(std::string_view key, const ScoreRange &range);
+        // Stream members with their scores, as lrange() does. zrange() takes
+        // ranks; zrangebyscore() skips offset matches and stops after limit
+        // of them unless limit is negative.
+        using ScoredVisitor = std::function<void(std::string_view member, double score)>;
+        bool zrange(std::string_view key, long long start, long long end, const std::function<void(size_t count)> &begin,
+                    const ScoredVisitor &visit);
+        bool zrangebyscore(std::string_view key, const ScoreRange &range, long long offset, long long limit,
+                           const std::function<void(size_t count)> &begin, const ScoredVisitor &visit);
+        std::optional<size_t> zscan(std::string_view key, size_t cursor, const ScoredVisitor &visit);
+
+        // Hash operations, with the same conventions as sorted sets.
+        struct FieldValue
+        {
+            std::string_view field;
+            std::string_view value;
+        };
+        // Returns how many of the fields are new.
+        std::optional<size_t> hset(std::string_view key, const std::vector<FieldValue> &fields);
+        bool hget(std::string_view key, std::string_view field, std::optional<std::string> &value);
+        // Calls visit for every field in order, with nullopt for missing ones.
+        bool hmget(std::string_view key, const std::vector<std::string_view> &fields, const ValueVisitor &visit);
+        std::optional<size_t> hdel(std::string_view key, const std::vector<std::string_view> &fields);
+        enum class IncrResult
+        {
+            OK,
+            WRONG_TYPE,
+            NOT_INTEGER,
+            OUT_OF_RANGE
+        };
+        // On OK value holds the new value; otherwise nothing changed.
+        IncrResult hincrby(std::string_view key, std::string_view field, int64_t increment, int64_t &value);
+        std::optional<size_t> hlen(std::string_view key);
+        using PairVisitor = std::function<void(std::string_view field, std::string_view value)>;
+        bool hgetall(std::string_view key, const std::function<void(size_t count)> &begin, const PairVisitor &visit);
+        std::optional<size_t> hscan(std::string_view key, size_t cursor, const PairVisitor &visit);
+
+        // Expiration. Times are absolute Unix milliseconds; keys past their
+        // time are removed on access and by active_expire_cycle().
+        bool exists(std::string_view key);
+        bool expire_at(std::string_view key, int64_t when);
+        bool persist(std::string_view key);
+        // -2 if key does not exist, -1 if it has no TTL.
+        int64_t expire_time(std::string_view key);
+
+        // Called from the event loop's cron. Samples keys with a TTL and
+        // removes expired ones within a small time budget; returns true while
+        // the sampled keys were mostly expired, i.e. it wants to run again
+        // soon.
+        bool active_expire_cycle();
+
+        // Sees every key the store removes on its own, because it expired
+        // or was evicted.
+        using RemovalListener = std::function<void(std::string_view key)>;
+        void set_removal_listener(RemovalListener listener);
+
+        // Values dropped the ways options enables, and by unlink(), go to
+        // lazy_free for the shard's queue instead of being freed in place.
+        void set_lazy_free(LazyFree *lazy_free, size_t shard, const LazyFreeOptions &options);
+
+        static int64_t now_ms();
+
+        // Memory limit. used_memory() counts both hash tables plus the heap
+        // bytes of every key and value, kept as a running total. make_room()
+        // evicts keys sampled according to the policy until the store is
+        // back under the limit; it returns false if it cannot (noeviction,
+        // or nothing left to evict), and the caller should refuse the write.
+        static bool parse_eviction_policy(std::string_view name, EvictionPolicy &policy);
+        void set_maxmemory(size_t bytes, EvictionPolicy policy);
+        EvictionPolicy eviction_policy() const;
+        size_t used_memory() const;
+        bool make_room();
+        // Seconds since last access under LRU, or the logarithmic access
+        // counter under allkeys-lfu; nullopt if the key is missing or the
+        // policy does not track it.
+        std::optional<uint32_t> idle_time(std::string_view key) const;
+        std::optional<uint32_t> access_frequency(std::string_view key) const;
+
+        // Introspection
+        struct MemoryStats
+        {
+            size_t keys;
+            size_t expires;
+            size_t table_bytes;
+            size_t overhead_per_key;
+            size_t value_header_bytes;
+            size_t used_memory;
+            size_t maxmemory;
+            size_t expired_keys;
+            size_t evicted_keys;
+        };
+
+        size_t size() const;
+        std::optional<size_t> memory_usage(std::string_view key) const;
+        std::optional<std::string> encoding(std::string_view key) const;
+        MemoryStats memory_stats() const;
+
+        // Calls visit for every key that has not expired, walking the whole
+        // shard in one go; for KEYS.
+        void for_each_key(const std::function<void(std::string_view key)> &visit) const;
+
+        // Raw access for persistence: no lazy expiry, expire_at is -1 for
+        // keys without a TTL. scan() follows Dict::scan semantics.
+        using EntryVisitor = std::function<void(std::string_view key, const Value &value, int64_t expire_at)>;
+        const Value *lookup(std::string_view key) const;
+        int64_t lookup_expire(std::string_view key) const;
+        size_t scan(size_t cursor, const EntryVisitor &visit) const;
+        void restore(std::string_view key, Value &&value, int64_t expire_at = -1);
+        void reserve(size_t keys);
+        // Drops every key, e.g. before a replica loads a full resync.
+        void clear();
+
+        // Optimistic locking for WATCH. A watched key carries a version that
+        // every write changing it bumps, including expiry, eviction and
+        // clear(); failed writes and no-ops leave it alone. watch() returns
+        // the current one and each call needs its unwatch().
+        uint64_t watch(std::string_view key);
+        void unwatch(std::string_view key);
+        uint64_t version(std::string_view key) const;
+        void attach(Snapshot *snapshot);
+        void detach(Snapshot *snapshot);
     };
 }
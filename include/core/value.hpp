@@ -1,36 +1,143 @@
-#include <variant>
-#include <deque>
-#include <unordered_set>
+#pragma once
+#include <cstddef>
+#include <cstdint>
 #include <string>
+#include <string_view>
+#include "hash.hpp"
+#include "quicklist.hpp"
+#include "set.hpp"
+#include "zset.hpp"
 
 namespace core
 {
-    using ValueData = std::variant<std::string, std::deque<std::string>, std::unordered_set<std::string>>;
-
-    enum class ValueType
+    enum class ValueType : uint8_t
     {
         STRING,
         LIST,
-        SET
+        SET,
+        ZSET,
+        HASH
+    };
+
+    enum class Encoding : uint8_t
+    {
+        EMBSTR,    // short string stored inside the value itself
+        INT,       // string holding a canonical 64-bit integer
+        RAW,       // heap-allocated string
+        QUICKLIST, // list
+        INTSET,    // set of integers in a sorted array
+        LISTPACK,  // small set, sorted set or hash in a packed buffer
+        HASHTABLE, // set or hash
+        BTREE      // sorted set
     };
 
+    // Accepts only the canonical form so that formatting gives back the
+    // exact bytes the client stored ("007" or "+1" stay strings).
+    bool parse_canonical_int(std::string_view str, int64_t &out);
+
+    // Compact 16-byte tagged value. Byte 0 holds type, encoding and whether
+    // the key has a TTL in the store's expires table; bytes 1-3 hold the
+    // store's 24-bit access metadata (LRU clock or LFU counter). The rest
+    // either embeds a short string, or holds a length and an integer/pointer
+    // payload in the second word. Containers are only allocated for keys that
+    // actually hold a container.
     class Value
     {
     public:
-        ValueType type;
-        ValueData data;
+        static constexpr size_t EMBSTR_MAX = 11;
+
+        using List = Quicklist;
+
+        static Value string(std::string_view str);
+        static Value list();
+        static Value set();
+        static Value zset();
+        static Value hash();
+
+        Value(Value &&other) noexcept;
+        Value &operator=(Value &&other) noexcept;
+        Value(const Value &) = delete;
+        Value &operator=(const Value &) = delete;
+        ~Value();
+
+        ValueType type() const { return static_cast<ValueType>((tag_ >> 4) & 0x07); }
+        // Sets, sorted sets and hashes pick their own representation; see
+        // their kind().
+        Encoding encoding() const;
+
+        // Lets lookups skip the expires table for keys without a TTL.
+        bool has_expire() const { return tag_ & EXPIRE_FLAG; }
+        void set_has_expire(bool on) { tag_ = static_cast<uint8_t>(on ? tag_ | EXPIRE_FLAG : tag_ & ~EXPIRE_FLAG); }
+
+        // String values; INT encoded strings are formatted on demand.
+        std::string str() const;
+        size_t str_size() const;
+        // Writes the str_size() bytes of str() to out.
+        void copy_str(char *out) const;
 
-        Value(const std::string &str) : type(ValueType::STRING), data(str) {}
-        Value(const std::deque<std::string> &list) : type(ValueType::LIST), data(list) {}
-        Value(const std::unordered_set<std::string> &set) : type(ValueType::SET), data(set) {}
+        List &as_list() { return *static_cast<List *>(ptr()); }
+        const List &as_list() const { return *static_cast<const List *>(ptr()); }
+        Set &as_set() { return *static_cast<Set *>(ptr()); }
+        const Set &as_set() const { return *static_cast<const Set *>(ptr()); }
+        ZSet &as_zset() { return *static_cast<ZSet *>(ptr()); }
+        const ZSet &as_zset() const { return *static_cast<const ZSet *>(ptr()); }
+        Hash &as_hash() { return *static_cast<Hash *>(ptr()); }
+        const Hash &as_hash() const { return *static_cast<const Hash *>(ptr()); }
 
-        void operator=(const Value &other)
+        // Bytes owned by this value, including sizeof(Value) and estimated
+        // allocator overhead for every heap block it references. Containers
+        // keep their own running total, so this is O(1).
+        size_t memory_usage() const;
+        // Roughly the number of allocations freed with the value: list
+        // nodes or table entries, 1 for everything else, as Redis counts
+        // it when deciding whether to free lazily.
+        size_t free_effort() const;
+
+        uint32_t meta() const { return meta_[0] | meta_[1] << 8 | meta_[2] << 16; }
+        void set_meta(uint32_t meta)
         {
-            if (this != &other)
-            {
-                type = other.type;
-                data = other.data;
-            }
+            meta_[0] = static_cast<uint8_t>(meta);
+            meta_[1] = static_cast<uint8_t>(meta >> 8);
+            meta_[2] = static_cast<uint8_t>(meta >> 16);
         }
+
+        static const char *encoding_name(Encoding encoding);
+        // As reported by TYPE and matched by SCAN TYPE.
+        static const char *type_name(ValueType type);
+
+    private:
+        static constexpr uint8_t EXPIRE_FLAG = 0x80;
+        static constexpr size_t LEN_OFFSET = 0;
+        static constexpr size_t WORD_OFFSET = 4;
+
+        uint8_t tag_;
+        uint8_t meta_[3];
+        // EMBSTR length byte and bytes, or a 32-bit RAW length followed by
+        // the payload word.
+        char data_[EMBSTR_MAX + 1];
+
+        Value(ValueType type, Encoding encoding);
+        void release();
+
+        Encoding tag_encoding() const { return static_cast<Encoding>(tag_ & 0x0f); }
+        void *ptr() const;
+        void set_ptr(void *ptr);
+        int64_t int_value() const;
+        uint32_t raw_len() const;
     };
+
+    static_assert(sizeof(Value) == 16, "Value must stay 16 bytes");
+
+    // Size of a heap block of n bytes once malloc rounding and headers are included.
+    inline size_t heap_size(size_t n)
+    {
+        size_t chunk = (n + 8 + 15) & ~static_cast<size_t>(15);
+        return chunk < 32 ? 32 : chunk;
+    }
+
+    // Heap bytes used by a std::string beyond its own footprint.
+    inline size_t string_heap_size(std::string_view str)
+    {
+        return str.size() > 15 ? heap_size(str.size() + 1) : 0;
+    }
 }
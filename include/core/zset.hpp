@@ -0,0 +1,96 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+
+namespace core
+{
+    // Sorted set ordered by score, then by member bytes. A small one is a
+    // packed buffer of (score, member) entries kept in order (listpack).
+    // Once it outgrows that it becomes a B+-tree whose inner nodes count
+    // the entries below each child, so rank and score lookups are
+    // O(log n), plus a hash table from member to score. Conversions only
+    // go towards the tree.
+    class ZSet
+    {
+    private:
+        struct Leaf;
+        struct Tree;
+
+    public:
+        enum class Kind : uint8_t
+        {
+            LISTPACK,
+            BTREE
+        };
+
+        class const_iterator
+        {
+        public:
+            std::string_view member() const;
+            double score() const;
+            const_iterator &operator++();
+
+            bool operator==(const const_iterator &other) const { return index_ == other.index_; }
+            bool operator!=(const const_iterator &other) const { return index_ != other.index_; }
+
+        private:
+            friend class ZSet;
+
+            const ZSet *zset_ = nullptr;
+            size_t index_ = 0;
+            size_t offset_ = 0;
+            const Leaf *leaf_ = nullptr;
+            uint32_t slot_ = 0;
+        };
+
+        ZSet();
+        ~ZSet();
+        ZSet(const ZSet &) = delete;
+        ZSet &operator=(const ZSet &) = delete;
+
+        // Process-wide limits, as zset-max-listpack-entries and
+        // zset-max-listpack-value in Redis.
+        static void configure(size_t max_listpack_entries, size_t max_listpack_value);
+
+        // Adds member or moves it to a new score; returns true if it was
+        // not there before. Scores must not be NaN.
+        bool add(std::string_view member, double score);
+        bool remove(std::string_view member);
+        std::optional<double> score(std::string_view member) const;
+        // 0-based position in score order.
+        std::optional<size_t> rank(std::string_view member) const;
+        // Number of entries scoring below score, or up to and including it.
+        size_t count_below(double score, bool inclusive) const;
+
+        size_t size() const;
+        bool empty() const { return size() == 0; }
+        Kind kind() const { return tree_ ? Kind::BTREE : Kind::LISTPACK; }
+
+        // Heap bytes of the sorted set object and everything it owns.
+        size_t memory_usage() const;
+
+        const_iterator begin() const { return at(0); }
+        const_iterator end() const;
+        // Iterator to the entry of the given rank, or end().
+        const_iterator at(size_t rank) const;
+
+        // One step of ZSCAN. A listpack is visited whole in the first call;
+        // a tree walks the buckets of its member table one per call, so a
+        // rehash caused by members added mid-walk may skip or repeat some.
+        size_t scan(size_t cursor, const std::function<void(std::string_view member, double score)> &visit) const;
+
+    private:
+        std::string listpack_;
+        size_t listpack_count_ = 0;
+        std::unique_ptr<Tree> tree_;
+
+        bool listpack_find(std::string_view member, size_t &offset, size_t &size, double &score) const;
+        void listpack_insert(std::string_view member, double score);
+        void to_tree();
+    };
+}
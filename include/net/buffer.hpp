@@ -0,0 +1,119 @@
+#pragma once
+#include <sys/types.h>
+#include <cstddef>
+#include <cstring>
+#include <deque>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace net
+{
+    // Growable byte buffer that sockets read into directly. Consumed bytes are
+    // only dropped by compact(), so views handed out stay valid until then.
+    class ReadBuffer
+    {
+    private:
+        std::unique_ptr<char[]> data_;
+        size_t size_ = 0;
+        size_t capacity_ = 0;
+
+    public:
+        const char *data() const { return data_.get(); }
+        size_t size() const { return size_; }
+        size_t capacity() const { return capacity_; }
+        bool empty() const { return size_ == 0; }
+        std::string_view view() const { return std::string_view(data_.get(), size_); }
+
+        // Returns a pointer to at least min_free writable bytes past size().
+        char *prepare(size_t min_free)
+        {
+            if (capacity_ - size_ < min_free)
+            {
+                size_t capacity = capacity_ ? capacity_ : min_free;
+                while (capacity - size_ < min_free)
+                    capacity *= 2;
+                std::unique_ptr<char[]> data(new char[capacity]);
+                if (size_)
+                    std::memcpy(data.get(), data_.get(), size_);
+                data_ = std::move(data);
+                capacity_ = capacity;
+            }
+            return data_.get() + size_;
+        }
+
+        size_t writable() const { return capacity_ - size_; }
+        void commit(size_t n) { size_ += n; }
+
+        // Frees the storage once empty if it grew past capacity.
+        void shrink(size_t capacity)
+        {
+            if (size_ == 0 && capacity_ > capacity)
+            {
+                data_.reset();
+                capacity_ = 0;
+            }
+        }
+
+        // Drops the first n bytes with a single move of the remainder.
+        void compact(size_t n)
+        {
+            if (n == 0)
+                return;
+            if (n < size_)
+                std::memmove(data_.get(), data_.get() + n, size_ - n);
+            size_ -= n;
+        }
+    };
+
+    // Reply bytes queued for a socket, kept as a list of segments and sent
+    // with writev. Small appends are packed into fixed-size chunks; strings
+    // of ZERO_COPY_MIN bytes or more handed over by rvalue become segments
+    // of their own, so large values are never copied again after the
+    // command produced them.
+    class OutputBuffer
+    {
+    public:
+        static constexpr size_t CHUNK_SIZE = 16 * 1024;
+        static constexpr size_t ZERO_COPY_MIN = 4 * 1024;
+
+        void append(std::string_view data)
+        {
+            if (tail_ && CHUNK_SIZE - tail_->size() >= data.size())
+            {
+                tail_->append(data.data(), data.size());
+                size_ += data.size();
+                return;
+            }
+            append_chunked(data);
+        }
+
+        void append(std::string &&data);
+        void append(const char *data) { append(std::string_view(data)); }
+
+        bool empty() const { return size_ == 0; }
+        size_t size() const { return size_; }
+
+        // One writev of as much as is queued; returns what write() would,
+        // having already dropped the bytes that were sent.
+        ssize_t write_to(int fd);
+
+    private:
+        struct Segment
+        {
+            std::string data;
+            bool sealed;
+        };
+
+        std::deque<Segment> segments_;
+        size_t offset_ = 0;
+        size_t size_ = 0;
+        std::vector<std::string> spare_;
+        // The last segment while it is an unsealed chunk, for the fast path.
+        std::string *tail_ = nullptr;
+
+        void append_chunked(std::string_view data);
+        void consume(size_t n);
+    };
+}
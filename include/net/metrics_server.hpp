@@ -0,0 +1,30 @@
+#pragma once
+#include <functional>
+#include <string>
+
+namespace net
+{
+    // Minimal HTTP endpoint for Prometheus: answers GET /metrics with the
+    // text from render, one request per connection, on a thread of its own
+    // so scrapes never stall a shard.
+    class MetricsServer
+    {
+    public:
+        using Render = std::function<std::string()>;
+
+    private:
+        int port;
+        Render render;
+        int server_fd = -1;
+
+        void serve();
+        void respond(int fd);
+
+    public:
+        MetricsServer(int port, Render render) : port(port), render(std::move(render)) {}
+
+        // Binds the port, throwing std::system_error on failure, then serves
+        // from a detached thread.
+        void start();
+    };
+}
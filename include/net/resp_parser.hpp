@@ -0,0 +1,58 @@
+#pragma once
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+namespace net
+{
+    enum class ParseResult
+    {
+        COMMAND,
+        INCOMPLETE,
+        PROTOCOL_ERROR
+    };
+
+    // Incremental RESP request parser. State survives across reads so a
+    // partially received command is never rescanned from its first byte.
+    // Arguments are returned as views into the caller's buffer; they stay
+    // valid until the buffer is modified.
+    class RespParser
+    {
+    private:
+        enum class State
+        {
+            START,
+            MULTIBULK_LEN,
+            BULK_LEN,
+            BULK_DATA,
+            INLINE
+        };
+
+        State state_ = State::START;
+        size_t consumed_ = 0;
+        size_t pos_ = 0;
+        long long remaining_ = 0;
+        long long bulk_len_ = 0;
+        std::vector<std::pair<size_t, size_t>> offsets_;
+        std::string error_;
+
+        ParseResult fail(const char *message);
+        ParseResult parse_inline(std::string_view buffer, std::vector<std::string_view> &args);
+
+    public:
+        static constexpr size_t MAX_INLINE_SIZE = 64 * 1024;
+        static constexpr long long MAX_MULTIBULK = 1024 * 1024;
+        static constexpr long long MAX_BULK = 512LL * 1024 * 1024;
+
+        ParseResult next(std::string_view buffer, std::vector<std::string_view> &args);
+
+        // Bytes at the front of the buffer that belong to fully parsed commands.
+        size_t consumed() const { return consumed_; }
+
+        // Must be called after the caller drops the first n bytes of its buffer.
+        void discard(size_t n);
+
+        const std::string &error() const { return error_; }
+    };
+}
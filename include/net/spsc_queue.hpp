@@ -0,0 +1,57 @@
+#pragma once
+#include <atomic>
+#include <cstddef>
+#include <vector>
+
+namespace net
+{
+    // Bounded lock-free single-producer/single-consumer ring. Each side keeps
+    // a cached copy of the other's index to avoid touching its cache line.
+    template <typename T>
+    class SpscQueue
+    {
+    private:
+        std::vector<T> slots_;
+        size_t mask_;
+        alignas(64) std::atomic<size_t> head_{0};
+        size_t cached_tail_ = 0;
+        alignas(64) std::atomic<size_t> tail_{0};
+        size_t cached_head_ = 0;
+
+    public:
+        // capacity must be a power of two
+        explicit SpscQueue(size_t capacity) : slots_(capacity), mask_(capacity - 1) {}
+
+        SpscQueue(const SpscQueue &) = delete;
+        SpscQueue &operator=(const SpscQueue &) = delete;
+
+        // Moves from value only on success.
+        bool try_push(T &value)
+        {
+            size_t tail = tail_.load(std::memory_order_relaxed);
+            if (tail - cached_head_ == slots_.size())
+            {
+                cached_head_ = head_.load(std::memory_order_acquire);
+                if (tail - cached_head_ == slots_.size())
+                    return false;
+            }
+            slots_[tail & mask_] = std::move(value);
+            tail_.store(tail + 1, std::memory_order_release);
+            return true;
+        }
+
+        bool try_pop(T &out)
+        {
+            size_t head = head_.load(std::memory_order_relaxed);
+            if (head == cached_tail_)
+            {
+                cached_tail_ = tail_.load(std::memory_order_acquire);
+                if (head == cached_tail_)
+                    return false;
+            }
+            out = std::move(slots_[head & mask_]);
+            head_.store(head + 1, std::memory_order_release);
+            return true;
+        }
+    };
+}
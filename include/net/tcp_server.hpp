@@ -1,21 +1,69 @@
 #pragma once
+#include <algorithm>
 #include <functional>
 #include <string>
+#include <vector>
 #include "core/command.hpp"
 #include "core/response.hpp"
+#include "core/stats.hpp"
 
 namespace net
 {
     using RequestHandler = std::function<core::Response(const core::Command &)>;
 
+    // Returns the shard that must execute a command, or core::ROUTE_LOCAL /
+    // core::ROUTE_CROSS_SHARD.
+    using RequestRouter = std::function<int(const core::Command &)>;
+
+    // Runs on each worker once per loop iteration, before replies are sent,
+    // and at least every CRON_INTERVAL_MS. Returning true keeps the loop
+    // polling instead of blocking while the shard has background work left.
+    using LoopHook = std::function<bool(size_t shard)>;
+
+    // Receives a connection that sent the command it was registered for;
+    // the server forgets the socket and the callee owns it from then on.
+    using Takeover = std::function<void(int fd, const core::Command &command)>;
+
+    constexpr int CRON_INTERVAL_MS = 100;
+    // Bytes read from one client per wake-up before others get their turn.
+    constexpr size_t DEFAULT_READ_BUDGET = 256 * 1024;
+
     class TCPServer
     {
     private:
         int port;
-        RequestHandler handler;
+        std::vector<RequestHandler> handlers;
+        RequestRouter router;
+        LoopHook before_sleep;
+        core::ServerStats *stats = nullptr;
+        size_t read_budget = DEFAULT_READ_BUDGET;
+        std::string takeover_command;
+        Takeover takeover;
+        // One eventfd per worker, created up front so wake() works before start().
+        std::vector<int> wake_fds;
 
     public:
-        TCPServer(int port, RequestHandler handler) : port(port), handler(handler) {}
+        TCPServer(int port, RequestHandler handler);
+
+        // One worker thread per handler, each with its own listener, epoll
+        // loop and keyspace shard; router assigns commands to shards.
+        TCPServer(int port, std::vector<RequestHandler> handlers, RequestRouter router);
+
+        void set_before_sleep(LoopHook hook) { before_sleep = std::move(hook); }
+        // Connection, traffic and event-loop counters go to the worker's shard.
+        void set_stats(core::ServerStats *server_stats) { stats = server_stats; }
+        void set_read_budget(size_t bytes) { read_budget = std::max<size_t>(bytes, 1); }
+        // Hands connections off when they send the named command, e.g. a
+        // replica's PSYNC. The name must be upper case.
+        void set_takeover(std::string command, Takeover handler)
+        {
+            takeover_command = std::move(command);
+            takeover = std::move(handler);
+        }
+
+        // Makes a worker run its loop hook soon, from any thread.
+        void wake(size_t shard);
+
         void start();
     };
 }
@@ -0,0 +1,108 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+#include "core/command.hpp"
+#include "core/snapshot.hpp"
+#include "core/store.hpp"
+
+namespace persist
+{
+    enum class FsyncPolicy
+    {
+        ALWAYS,
+        EVERYSEC,
+        NO
+    };
+
+    // Appends the commands that recreate key from scratch, as a rewrite
+    // writes them; a repeated emission replaces the key rather than adding
+    // to it.
+    void append_value_commands(std::string &out, std::string_view key, const core::Value &value, int64_t expire_at);
+
+    // Append-only file. Event loops append write commands to a per-shard
+    // buffer and hand it over once per loop iteration (group commit); a
+    // background thread does the write() and fsync() calls. With ALWAYS the
+    // loop waits for that fsync before replies go out, EVERYSEC fsyncs once
+    // a second and NO leaves flushing to the kernel.
+    //
+    // A rewrite walks every shard's store through a core::Snapshot into a
+    // temporary file while new commands keep going to both files; when all
+    // shards are done the temporary file atomically replaces the log.
+    class Aof
+    {
+    public:
+        Aof(std::string path, FsyncPolicy policy, size_t shards);
+        ~Aof();
+        Aof(const Aof &) = delete;
+        Aof &operator=(const Aof &) = delete;
+
+        static bool parse_policy(std::string_view name, FsyncPolicy &policy);
+
+        using Router = std::function<int(const core::Command &)>;
+        using Applier = std::function<void(size_t shard, const core::Command &)>;
+
+        // Replays the log, one thread per shard, and returns the number of
+        // commands. A command torn by a crash at the end of the file is
+        // truncated away.
+        size_t load(const Router &route, const Applier &apply);
+
+        // Opens the log for appending and starts the background writer.
+        void open();
+
+        // Event-loop side; each shard only touches its own state.
+        void append(size_t shard, const core::Command &command);
+
+        // Advances a running rewrite and commits the shard's buffer. Returns
+        // true while the shard still has rewrite work to do.
+        bool before_sleep(size_t shard, core::Store &store);
+
+        // Returns false if a rewrite is already running.
+        bool start_rewrite();
+        bool rewrite_in_progress() const { return rewriting_.load(std::memory_order_acquire); }
+
+    private:
+        struct Shard
+        {
+            std::string buffer;
+            std::string rewrite_buffer;
+            std::unique_ptr<core::Snapshot> snapshot;
+            uint64_t generation = 0;
+            bool in_rewrite = false;
+        };
+
+        const std::string path_;
+        const std::string rewrite_path_;
+        const FsyncPolicy policy_;
+        std::vector<Shard> shards_;
+
+        std::mutex mutex_;
+        std::condition_variable wake_writer_;
+        std::condition_variable synced_cv_;
+        std::string pending_;
+        std::string rewrite_pending_;
+        uint64_t appended_ = 0;
+        uint64_t synced_ = 0;
+        size_t shards_done_ = 0;
+        bool finishing_ = false;
+        bool stop_ = false;
+        int fd_ = -1;
+        int rewrite_fd_ = -1;
+        std::atomic<uint64_t> generation_{0};
+        std::atomic<bool> rewriting_{false};
+        std::atomic<uint64_t> file_size_{0};
+        uint64_t base_size_ = 0;
+        std::thread writer_;
+
+        void writer_loop();
+        void finish_rewrite(const std::string &data, const std::string &rewrite_data);
+    };
+}
@@ -0,0 +1,18 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+
+namespace persist
+{
+    // LZF-style byte-oriented LZ77: fast enough to run per value while
+    // saving, no external dependency. Control bytes below 32 start a run of
+    // ctrl + 1 literals; anything else is a back reference of up to 264
+    // bytes within the previous 8 KB.
+
+    // Returns the compressed size, or 0 if the result would not fit in
+    // out_capacity (callers pass less than input size to demand a saving).
+    size_t lzf_compress(const uint8_t *in, size_t in_len, uint8_t *out, size_t out_capacity);
+
+    // Returns the decompressed size, or 0 on corrupt input or overflow.
+    size_t lzf_decompress(const uint8_t *in, size_t in_len, uint8_t *out, size_t out_capacity);
+}
@@ -0,0 +1,181 @@
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+#include "core/command.hpp"
+#include "core/snapshot.hpp"
+#include "core/store.hpp"
+
+namespace persist
+{
+    // Primary side of replication. Write commands are batched per shard
+    // and, once per loop iteration, appended to a circular backlog of the
+    // recent stream; the replication offset counts every byte appended. A
+    // background thread streams the backlog to every replica.
+    //
+    // A replica asks with PSYNC <replid> <offset> for the stream from the
+    // offset it has applied. If the backlog still holds it the reply is
+    // +CONTINUE and the stream resumes; otherwise +FULLRESYNC <replid>
+    // follows with the whole keyspace as commands, built like an AOF
+    // rewrite: each shard walks its store through a core::Snapshot while
+    // its new commands go to both the backlog and the sync stream. Once
+    // every shard is done the sync ends with REPLCONF SYNCED <offset>,
+    // and the replica continues from that offset of the backlog.
+    //
+    // The backlog only starts filling when the first replica attaches.
+    class Replication
+    {
+    public:
+        Replication(size_t shards, size_t backlog_size);
+        ~Replication();
+        Replication(const Replication &) = delete;
+        Replication &operator=(const Replication &) = delete;
+
+        // Event-loop side; each shard only touches its own state.
+        void append(size_t shard, const core::Command &command);
+
+        // Commits the shard's batch and advances a running full sync.
+        // Returns true while the shard still has keys to walk.
+        bool before_sleep(size_t shard, core::Store &store);
+
+        // Takes over the connection of a replica that sent PSYNC.
+        void attach(int fd, const core::Command &psync);
+
+        // Lines for the replication section of INFO.
+        std::string info() const;
+
+    private:
+        struct Shard
+        {
+            std::string buffer;
+            std::string sync_buffer;
+            std::unique_ptr<core::Snapshot> snapshot;
+            uint64_t generation = 0;
+            bool in_sync = false;
+        };
+
+        enum class ReplicaState
+        {
+            WAIT_SYNC,
+            SYNCING,
+            ONLINE
+        };
+
+        struct Replica
+        {
+            int fd;
+            std::string address;
+            ReplicaState state;
+            // Position in the sync stream while syncing, else the backlog
+            // offset sent up to.
+            uint64_t position = 0;
+            std::string out;
+            bool closed = false;
+        };
+
+        const std::string replid_;
+        const size_t backlog_size_;
+        std::vector<Shard> shards_;
+        std::atomic<bool> active_{false};
+
+        mutable std::mutex mutex_;
+        std::string backlog_;
+        uint64_t offset_ = 0;
+        std::vector<std::unique_ptr<Replica>> replicas_;
+
+        std::atomic<uint64_t> generation_{0};
+        bool syncing_ = false;
+        size_t shards_done_ = 0;
+        // The current sync stream, minus the first sync_base_ bytes that
+        // every syncing replica has been sent already.
+        std::string sync_data_;
+        uint64_t sync_base_ = 0;
+        bool sync_complete_ = false;
+        uint64_t sync_offset_ = 0;
+
+        int wake_fd_ = -1;
+        bool stop_ = false;
+        std::thread sender_;
+
+        uint64_t backlog_start() const { return offset_ > backlog_size_ ? offset_ - backlog_size_ : 0; }
+        void write_backlog(const std::string &data);
+        void read_backlog(uint64_t from, size_t size, std::string &out) const;
+        void start_sync();
+        void fill(Replica &replica);
+        void wake();
+        void sender_loop();
+    };
+
+    // Replica side: a thread that connects to the primary, asks for a
+    // partial resync from the last offset received and queues the stream
+    // for the shards, which apply it from their loops. On a full resync
+    // every shard is emptied first. The link reconnects on its own.
+    class ReplicaLink
+    {
+    public:
+        using Router = std::function<int(const core::Command &)>;
+        using Applier = std::function<void(size_t shard, const core::Command &)>;
+        using Waker = std::function<void(size_t shard)>;
+
+        ReplicaLink(size_t shards, Router route, Applier apply, Waker wake);
+        ~ReplicaLink();
+        ReplicaLink(const ReplicaLink &) = delete;
+        ReplicaLink &operator=(const ReplicaLink &) = delete;
+
+        // Follows a primary, replacing any previous one.
+        void start(std::string host, int port);
+        // Stops following, keeping the data; the server accepts writes again.
+        // The replication offset is forgotten, so a later start() does a
+        // full resync.
+        void stop();
+
+        // Set while following a primary; client writes are refused.
+        const std::atomic<bool> &read_only() const { return active_; }
+        bool active() const { return active_.load(std::memory_order_relaxed); }
+
+        // Applies what arrived for the shard.
+        void before_sleep(size_t shard, core::Store &store);
+
+        std::string info() const;
+
+    private:
+        struct Inbox
+        {
+            std::mutex mutex;
+            std::string data;
+            bool clear = false;
+        };
+
+        const Router route_;
+        const Applier apply_;
+        const Waker wake_;
+        std::vector<std::unique_ptr<Inbox>> inboxes_;
+        std::atomic<bool> active_{false};
+
+        mutable std::mutex mutex_;
+        std::condition_variable stop_cv_;
+        bool stop_ = false;
+        int fd_ = -1;
+        std::string host_;
+        int port_ = 0;
+        std::string replid_;
+        uint64_t offset_ = 0;
+        bool has_offset_ = false;
+        bool link_up_ = false;
+        bool syncing_ = false;
+        std::thread thread_;
+
+        // Stops the thread, keeping the offset for a partial resync.
+        void halt();
+        void run();
+        // Reads the stream from one connection until it drops or stop().
+        void follow(int fd);
+    };
+}
@@ -0,0 +1,102 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "core/snapshot.hpp"
+#include "core/store.hpp"
+
+namespace persist
+{
+    // Point-in-time dump of every shard in a compact binary format.
+    //
+    // Saving never forks: each shard walks its store through a
+    // core::Snapshot a slice at a time from its own event loop and hands
+    // the encoded records to a background thread, which compresses large
+    // values, writes a temporary file and renames it into place once all
+    // shards are done.
+    //
+    // Layout: an 8-byte magic and a 4-byte version, then one record per key
+    //   tag (type, 0x40 if expiring, 0x80 if compressed) | varint key length |
+    //   key | [8-byte expire time in ms] | [varint raw length if compressed] |
+    //   varint payload length | payload
+    // and a footer of 0xFF, the record count and a checksum of everything
+    // before it. Strings are stored as is; lists and sets as a varint count
+    // followed by length-prefixed elements. Keys already expired at load
+    // time are skipped. A key may appear more than once
+    // (see core::Snapshot); the last record wins.
+    class SnapshotFile
+    {
+    public:
+        SnapshotFile(std::string path, size_t shards, bool compress);
+        ~SnapshotFile();
+        SnapshotFile(const SnapshotFile &) = delete;
+        SnapshotFile &operator=(const SnapshotFile &) = delete;
+
+        // Maps the file, decodes its records on every hardware thread and
+        // fills every store on its own thread. Returns the number of keys
+        // loaded, 0 if there is no file.
+        size_t load(const std::vector<core::Store *> &stores);
+
+        // Starts a background save; returns false if one is already running.
+        bool start_save();
+
+        // Saves and waits for the result. Other shards keep serving and do
+        // their part from their own loops.
+        bool save(size_t shard, core::Store &store);
+
+        // Advances a running save. Returns true while the shard still has
+        // keys to walk.
+        bool before_sleep(size_t shard, core::Store &store);
+
+        // Starts a background save every `interval` while there are writes
+        // that have not been saved; zero disables it.
+        void set_save_interval(std::chrono::seconds interval) { save_interval_ = interval; }
+        void note_write(size_t shard) { shards_[shard].dirty.fetch_add(1, std::memory_order_relaxed); }
+
+        bool save_in_progress() const { return saving_.load(std::memory_order_acquire); }
+        int64_t last_save() const { return last_save_.load(std::memory_order_relaxed); }
+
+    private:
+        struct Shard
+        {
+            std::string buffer;
+            std::unique_ptr<core::Snapshot> snapshot;
+            uint64_t generation = 0;
+            alignas(64) std::atomic<uint64_t> dirty{0};
+        };
+
+        const std::string path_;
+        const std::string temp_path_;
+        const bool compress_;
+        std::vector<Shard> shards_;
+
+        std::mutex mutex_;
+        std::condition_variable wake_writer_;
+        std::condition_variable done_cv_;
+        std::deque<std::string> queue_;
+        size_t queued_bytes_ = 0;
+        size_t shards_done_ = 0;
+        bool last_ok_ = false;
+        bool stop_ = false;
+        int fd_ = -1;
+        std::thread writer_;
+
+        std::atomic<uint64_t> generation_{0};
+        std::atomic<bool> saving_{false};
+        std::atomic<int64_t> last_save_{0};
+        std::chrono::seconds save_interval_{0};
+        std::chrono::steady_clock::time_point last_attempt_ = std::chrono::steady_clock::now();
+        uint64_t dirty_at_start_ = 0;
+        uint64_t dirty_saved_ = 0;
+
+        uint64_t dirty() const;
+        void writer_loop();
+    };
+}
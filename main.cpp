@@ -1,7 +1,26 @@
+#include <algorithm>
+#include <charconv>
+#include <chrono>
 #include <iostream>
+#include <memory>
 #include <sstream>
+#include <string>
+#include <vector>
 #include "core/dispatcher.hpp"
+#include "core/hash.hpp"
+#include "core/lazy_free.hpp"
+#include "core/quicklist.hpp"
+#include "core/script.hpp"
+#include "core/set.hpp"
+#include "core/slab.hpp"
+#include "core/slowlog.hpp"
+#include "core/stats.hpp"
+#include "core/zset.hpp"
+#include "net/metrics_server.hpp"
 #include "net/tcp_server.hpp"
+#include "persist/aof.hpp"
+#include "persist/replication.hpp"
+#include "persist/snapshot_file.hpp"
 
 using namespace core;
 
@@ -15,27 +34,432 @@ std::string toupper(const std::string &str)
     return result;
 }
 
-int main(int argc, char *argv[])
+struct Options
 {
-    Store store;
-    CommandDispatcher dispatcher(store);
-
     size_t port = 6666;
-    if (argc > 1)
+    size_t threads = 1;
+    // Port of the Prometheus endpoint; 0 disables it.
+    size_t metrics_port = 0;
+    size_t io_read_budget = net::DEFAULT_READ_BUDGET;
+    // Microseconds; negative disables the slow log, 0 logs every command.
+    int64_t slowlog_log_slower_than = 10000;
+    size_t slowlog_max_len = 128;
+    // Milliseconds a script may run before it is stopped.
+    int64_t script_time_limit = 5000;
+    bool appendonly = false;
+    std::string appendfilename = "appendonly.aof";
+    persist::FsyncPolicy appendfsync = persist::FsyncPolicy::EVERYSEC;
+    std::string dbfilename = "dump.rdb";
+    bool rdbcompression = true;
+    size_t save = 0;
+    // "host:port" of a primary to follow at startup.
+    std::string replicaof;
+    size_t repl_backlog_size = 1024 * 1024;
+    size_t maxmemory = 0;
+    EvictionPolicy maxmemory_policy = EvictionPolicy::NOEVICTION;
+    LazyFreeOptions lazyfree;
+    size_t list_max_listpack_size = 8 * 1024;
+    size_t list_compress_depth = 0;
+    size_t set_max_intset_entries = 512;
+    size_t set_max_listpack_entries = 128;
+    size_t set_max_listpack_value = 64;
+    size_t zset_max_listpack_entries = 128;
+    size_t zset_max_listpack_value = 64;
+    size_t hash_max_listpack_entries = 128;
+    size_t hash_max_listpack_value = 64;
+};
+
+// Accepts a byte count with an optional Redis-style unit: k/m/g are powers
+// of 1000, kb/mb/gb powers of 1024.
+size_t parse_memory(const std::string &value)
+{
+    size_t pos = 0;
+    size_t amount = std::stoull(value, &pos);
+    std::string unit = toupper(value.substr(pos));
+    if (unit.empty() || unit == "B")
+        return amount;
+    const std::vector<std::pair<std::string, size_t>> units = {
+        {"K", 1000}, {"KB", 1024}, {"M", 1000 * 1000}, {"MB", 1024 * 1024},
+        {"G", 1000 * 1000 * 1000}, {"GB", 1024 * 1024 * 1024}};
+    for (const auto &[name, factor] : units)
+    {
+        if (unit == name)
+            return amount * factor;
+    }
+    throw std::invalid_argument("unknown memory unit " + unit);
+}
+
+Options parse_options(int argc, char *argv[])
+{
+    Options options;
+    for (int i = 1; i < argc; ++i)
     {
+        std::string arg = argv[i];
         try
         {
-            port = std::stoul(argv[1]);
+            if (arg.rfind("--", 0) == 0 && i + 1 < argc)
+            {
+                std::string value = argv[++i];
+                if (arg == "--threads")
+                {
+                    options.threads = std::max<size_t>(1, std::stoul(value));
+                }
+                else if (arg == "--metrics-port")
+                {
+                    options.metrics_port = std::stoul(value);
+                }
+                else if (arg == "--io-read-budget")
+                {
+                    options.io_read_budget = parse_memory(value);
+                }
+                else if (arg == "--slowlog-log-slower-than")
+                {
+                    options.slowlog_log_slower_than = std::stoll(value);
+                }
+                else if (arg == "--slowlog-max-len")
+                {
+                    options.slowlog_max_len = std::stoul(value);
+                }
+                else if (arg == "--script-time-limit")
+                {
+                    options.script_time_limit = std::stoll(value);
+                }
+                else if (arg == "--appendonly")
+                {
+                    options.appendonly = toupper(value) == "YES";
+                }
+                else if (arg == "--appendfilename")
+                {
+                    options.appendfilename = value;
+                }
+                else if (arg == "--appendfsync")
+                {
+                    if (!persist::Aof::parse_policy(value, options.appendfsync))
+                    {
+                        std::cerr << "Unknown appendfsync policy " << value << "\nUsing everysec" << std::endl;
+                    }
+                }
+                else if (arg == "--dbfilename")
+                {
+                    options.dbfilename = value;
+                }
+                else if (arg == "--rdbcompression")
+                {
+                    options.rdbcompression = toupper(value) == "YES";
+                }
+                else if (arg == "--save")
+                {
+                    options.save = std::stoul(value);
+                }
+                else if (arg == "--replicaof")
+                {
+                    options.replicaof = value;
+                }
+                else if (arg == "--repl-backlog-size")
+                {
+                    options.repl_backlog_size = parse_memory(value);
+                }
+                else if (arg == "--maxmemory")
+                {
+                    options.maxmemory = parse_memory(value);
+                }
+                else if (arg == "--maxmemory-policy")
+                {
+                    if (!Store::parse_eviction_policy(value, options.maxmemory_policy))
+                    {
+                        std::cerr << "Unknown maxmemory policy " << value << "\nUsing noeviction" << std::endl;
+                    }
+                }
+                else if (arg == "--lazyfree-lazy-user-del")
+                {
+                    options.lazyfree.user_del = toupper(value) == "YES";
+                }
+                else if (arg == "--lazyfree-lazy-server-del")
+                {
+                    options.lazyfree.server_del = toupper(value) == "YES";
+                }
+                else if (arg == "--lazyfree-lazy-eviction")
+                {
+                    options.lazyfree.eviction = toupper(value) == "YES";
+                }
+                else if (arg == "--lazyfree-lazy-expire")
+                {
+                    options.lazyfree.expire = toupper(value) == "YES";
+                }
+                else if (arg == "--list-max-listpack-size")
+                {
+                    options.list_max_listpack_size = parse_memory(value);
+                }
+                else if (arg == "--list-compress-depth")
+                {
+                    options.list_compress_depth = std::stoul(value);
+                }
+                else if (arg == "--set-max-intset-entries")
+                {
+                    options.set_max_intset_entries = std::stoul(value);
+                }
+                else if (arg == "--set-max-listpack-entries")
+                {
+                    options.set_max_listpack_entries = std::stoul(value);
+                }
+                else if (arg == "--set-max-listpack-value")
+                {
+                    options.set_max_listpack_value = std::stoul(value);
+                }
+                else if (arg == "--zset-max-listpack-entries")
+                {
+                    options.zset_max_listpack_entries = std::stoul(value);
+                }
+                else if (arg == "--zset-max-listpack-value")
+                {
+                    options.zset_max_listpack_value = std::stoul(value);
+                }
+                else if (arg == "--hash-max-listpack-entries")
+                {
+                    options.hash_max_listpack_entries = std::stoul(value);
+                }
+                else if (arg == "--hash-max-listpack-value")
+                {
+                    options.hash_max_listpack_value = std::stoul(value);
+                }
+                else
+                {
+                    std::cerr << "Unknown option " << arg << std::endl;
+                }
+            }
+            else
+            {
+                options.port = std::stoul(arg);
+            }
         }
         catch (const std::exception &e)
         {
-            std::cerr << "Error parsing port number\nUsing default port" << std::endl;
+            std::cerr << "Error parsing argument " << arg << "\nUsing default" << std::endl;
         }
     }
+    return options;
+}
+
+int main(int argc, char *argv[])
+{
+    Options options = parse_options(argc, argv);
+    size_t threads = options.threads;
+    Quicklist::configure(options.list_max_listpack_size, options.list_compress_depth);
+    Set::configure(options.set_max_intset_entries, options.set_max_listpack_entries, options.set_max_listpack_value);
+    ZSet::configure(options.zset_max_listpack_entries, options.zset_max_listpack_value);
+    Hash::configure(options.hash_max_listpack_entries, options.hash_max_listpack_value);
+
+    ServerStats stats(threads, CommandDispatcher::command_count());
+    SlowLog slowlog(threads, options.slowlog_max_len, options.slowlog_log_slower_than);
+    LazyFree lazy_free(threads);
+    ScriptCache scripts(options.script_time_limit);
+    std::vector<std::unique_ptr<Store>> stores;
+    std::vector<std::unique_ptr<CommandDispatcher>> dispatchers;
+    std::vector<net::RequestHandler> handlers;
+    for (size_t i = 0; i < threads; ++i)
+    {
+        stores.push_back(std::make_unique<Store>());
+        // Keys spread evenly over shards, and so does the memory limit.
+        stores.back()->set_maxmemory(options.maxmemory / threads, options.maxmemory_policy);
+        stores.back()->set_lazy_free(&lazy_free, i, options.lazyfree);
+        dispatchers.push_back(std::make_unique<CommandDispatcher>(*stores.back()));
+        CommandDispatcher *dispatcher = dispatchers.back().get();
+        dispatcher->set_shard(i, threads);
+        dispatcher->set_stats(&stats, i);
+        dispatcher->set_slowlog(&slowlog, i);
+        dispatcher->set_scripts(&scripts);
+        handlers.push_back([dispatcher](const Command &command) -> Response
+                           { return dispatcher->dispatch(command); });
+    }
+
+    const CommandDispatcher &router = *dispatchers.front();
+    net::TCPServer server(options.port, handlers, [&router, threads](const Command &command)
+                          { return router.route(command, threads); });
+    server.set_stats(&stats);
+    server.set_read_budget(options.io_read_budget);
+    stats.add_section("Lazyfree", [&lazy_free]
+                      { return "lazyfree_pending_objects:" + std::to_string(lazy_free.pending()) + "\r\nlazyfreed_objects:" +
+                               std::to_string(lazy_free.freed()) + "\r\n"; });
+    stats.add_section("Scripting", [&scripts]
+                      { return "number_of_cached_scripts:" + std::to_string(scripts.size()) + "\r\n"; });
+    stats.add_section("Allocator", [&dispatchers]
+                      {
+                          Slab::Stats slab = Slab::stats();
+                          size_t arena_reserved = 0, arena_peak = 0;
+                          uint64_t arena_blocks = 0;
+                          for (const auto &dispatcher : dispatchers)
+                          {
+                              arena_reserved += dispatcher->arena().reserved_bytes();
+                              arena_peak = std::max(arena_peak, dispatcher->arena().peak_bytes());
+                              arena_blocks += dispatcher->arena().block_allocations();
+                          }
+                          return "slab_allocations:" + std::to_string(slab.allocations) + "\r\nslab_frees:" + std::to_string(slab.frees) +
+                                 "\r\nslab_large_allocations:" + std::to_string(slab.large_allocations) +
+                                 "\r\nslab_reserved_bytes:" + std::to_string(slab.reserved_bytes) +
+                                 "\r\nslab_used_bytes:" + std::to_string(slab.used_bytes) +
+                                 "\r\narena_reserved_bytes:" + std::to_string(arena_reserved) +
+                                 "\r\narena_block_allocations:" + std::to_string(arena_blocks) +
+                                 "\r\narena_peak_bytes:" + std::to_string(arena_peak) + "\r\n"; });
+    net::MetricsServer metrics(options.metrics_port, [&stats]
+                               { return stats.prometheus(); });
+
+    persist::Replication replication(threads, options.repl_backlog_size);
+    persist::ReplicaLink replica_link(
+        threads, [&router, threads](const Command &command)
+        { return router.route(command, threads); },
+        [&dispatchers](size_t shard, const Command &command)
+        { dispatchers[shard]->replicate(command); },
+        [&server](size_t shard)
+        { server.wake(shard); });
+
+    std::unique_ptr<persist::Aof> aof;
+    persist::SnapshotFile snapshots(options.dbfilename, threads, options.rdbcompression);
+    snapshots.set_save_interval(std::chrono::seconds(options.save));
+    try
+    {
+        if (options.appendonly)
+        {
+            aof = std::make_unique<persist::Aof>(options.appendfilename, options.appendfsync, threads);
+            auto started = std::chrono::steady_clock::now();
+            size_t loaded = aof->load([&router, threads](const Command &command)
+                                      { return router.route(command, threads); },
+                                      [&dispatchers](size_t shard, const Command &command)
+                                      { dispatchers[shard]->dispatch(command); });
+            std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - started;
+            std::cout << "Loaded " << loaded << " commands from " << options.appendfilename << " in "
+                      << elapsed.count() << "s" << std::endl;
+            aof->open();
+
+            persist::Aof *log = aof.get();
+            for (size_t i = 0; i < threads; ++i)
+            {
+                dispatchers[i]->add_write_listener([log, i](const Command &command)
+                                                   { log->append(i, command); });
+                dispatchers[i]->add_command("BGREWRITEAOF", [log](const Command &) -> Response
+                                            {
+                                                if (!log->start_rewrite())
+                                                {
+                                                    return Response::Error("Background append only file rewriting already in progress");
+                                                }
+                                                return Response::Ok();
+                                            });
+            }
+        }
+        else
+        {
+            std::vector<Store *> targets;
+            for (auto &store : stores)
+            {
+                targets.push_back(store.get());
+            }
+            auto started = std::chrono::steady_clock::now();
+            size_t loaded = snapshots.load(targets);
+            std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - started;
+            std::cout << "Loaded " << loaded << " keys from " << options.dbfilename << " in "
+                      << elapsed.count() << "s" << std::endl;
+        }
 
-    net::TCPServer server(port, [&dispatcher](const Command &command) -> Response
-                          { return dispatcher.dispatch(command); });
+        persist::SnapshotFile *dump = &snapshots;
+        for (size_t i = 0; i < threads; ++i)
+        {
+            Store *store = stores[i].get();
+            dispatchers[i]->add_write_listener([dump, i](const Command &)
+                                               { dump->note_write(i); });
+            dispatchers[i]->add_command("SAVE", [dump, store, i](const Command &) -> Response
+                                        {
+                                            if (dump->save_in_progress())
+                                            {
+                                                return Response::Error("Background save already in progress");
+                                            }
+                                            if (!dump->save(i, *store))
+                                            {
+                                                return Response::Error("Save failed");
+                                            }
+                                            return Response::Ok();
+                                        });
+            dispatchers[i]->add_command("BGSAVE", [dump](const Command &) -> Response
+                                        {
+                                            if (!dump->start_save())
+                                            {
+                                                return Response::Error("Background save already in progress");
+                                            }
+                                            return Response::String("Background saving started");
+                                        });
+            dispatchers[i]->add_command("LASTSAVE", [dump](const Command &) -> Response
+                                        { return Response::Integer(dump->last_save()); });
+        }
+        persist::Replication *primary = &replication;
+        persist::ReplicaLink *link = &replica_link;
+        for (size_t i = 0; i < threads; ++i)
+        {
+            dispatchers[i]->add_write_listener([primary, i](const Command &command)
+                                               { primary->append(i, command); });
+            dispatchers[i]->set_read_only(&link->read_only());
+            dispatchers[i]->add_command("REPLICAOF", [link](const Command &command) -> Response
+                                        {
+                                            if (toupper(std::string(command.args[0])) == "NO" && toupper(std::string(command.args[1])) == "ONE")
+                                            {
+                                                link->stop();
+                                                return Response::Ok();
+                                            }
+                                            int port;
+                                            std::string_view arg = command.args[1];
+                                            auto [ptr, ec] = std::from_chars(arg.data(), arg.data() + arg.size(), port);
+                                            if (ec != std::errc() || ptr != arg.data() + arg.size() || port <= 0 || port > 65535)
+                                            {
+                                                return Response::Error("Invalid master port");
+                                            }
+                                            link->start(std::string(command.args[0]), port);
+                                            return Response::Ok();
+                                        });
+        }
+        server.set_takeover("PSYNC", [primary](int fd, const Command &command)
+                            { primary->attach(fd, command); });
+        stats.add_section("Replication", [primary, link]
+                          { return std::string("role:") + (link->active() ? "slave\r\n" + link->info() : "master\r\n") + primary->info(); });
 
-    server.start();
+        persist::Aof *log = aof.get();
+        server.set_before_sleep([log, dump, primary, link, &stores, &stats](size_t shard)
+                                {
+                                    // A replica drops expired keys when the primary's DEL arrives.
+                                    bool busy = !link->active() && stores[shard]->active_expire_cycle();
+                                    link->before_sleep(shard, *stores[shard]);
+                                    stats.shard(shard).observe(*stores[shard]);
+                                    if (dump->before_sleep(shard, *stores[shard]))
+                                    {
+                                        busy = true;
+                                    }
+                                    if (log && log->before_sleep(shard, *stores[shard]))
+                                    {
+                                        busy = true;
+                                    }
+                                    if (primary->before_sleep(shard, *stores[shard]))
+                                    {
+                                        busy = true;
+                                    }
+                                    return busy; });
+
+        if (!options.replicaof.empty())
+        {
+            size_t colon = options.replicaof.rfind(':');
+            if (colon == std::string::npos)
+            {
+                throw std::invalid_argument("--replicaof expects host:port");
+            }
+            replica_link.start(options.replicaof.substr(0, colon), std::stoi(options.replicaof.substr(colon + 1)));
+        }
+
+        if (options.metrics_port)
+        {
+            metrics.start();
+            std::cout << "Metrics on port " << options.metrics_port << std::endl;
+        }
+        server.start();
+    }
+    catch (const std::exception &e)
+    {
+        std::cerr << "Server error: " << e.what() << std::endl;
+        return 1;
+    }
     return 0;
 }
@@ -0,0 +1,57 @@
+#include "core/arena.hpp"
+#include <algorithm>
+#include <cstring>
+
+namespace core
+{
+    char *Arena::allocate(size_t size)
+    {
+        size = (size + 7) & ~static_cast<size_t>(7);
+        if (blocks_.empty() || blocks_[current_].size - offset_ < size)
+        {
+            size_t next = blocks_.empty() ? 0 : current_ + 1;
+            if (next >= blocks_.size() || blocks_[next].size < size)
+            {
+                size_t block_size = std::max(BLOCK_SIZE, size);
+                blocks_.insert(blocks_.begin() + next, Block{std::unique_ptr<char[]>(new char[block_size]), block_size});
+                reserved_.store(reserved_bytes() + block_size, std::memory_order_relaxed);
+                block_allocations_.store(block_allocations() + 1, std::memory_order_relaxed);
+            }
+            if (!blocks_.empty() && next > 0)
+                used_before_ += offset_;
+            current_ = next;
+            offset_ = 0;
+        }
+        char *out = blocks_[current_].bytes.get() + offset_;
+        offset_ += size;
+        return out;
+    }
+
+    std::string_view Arena::copy(std::string_view bytes)
+    {
+        char *out = allocate(bytes.size());
+        std::memcpy(out, bytes.data(), bytes.size());
+        return std::string_view(out, bytes.size());
+    }
+
+    void Arena::reset()
+    {
+        size_t used = used_before_ + offset_;
+        if (used > peak_bytes())
+            peak_.store(used, std::memory_order_relaxed);
+        current_ = 0;
+        offset_ = 0;
+        used_before_ = 0;
+        size_t kept = 0;
+        size_t keep = 0;
+        while (keep < blocks_.size() && kept + blocks_[keep].size <= RETAIN_BYTES)
+        {
+            kept += blocks_[keep++].size;
+        }
+        if (keep < blocks_.size())
+        {
+            blocks_.resize(keep);
+            reserved_.store(kept, std::memory_order_relaxed);
+        }
+    }
+}
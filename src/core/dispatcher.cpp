@@ -1,255 +1,1968 @@
 #include "core/dispatcher.hpp"
+#include "core/glob.hpp"
+#include "core/shard.hpp"
+#include "core/script.hpp"
+#include "core/slowlog.hpp"
+#include "core/stats.hpp"
+#include "core/value.hpp"
+#include <algorithm>
+#include <cctype>
+#include <charconv>
+#include <cmath>
+#include <stdexcept>
+#include <unordered_set>
+#include <utility>
 
 namespace core
 {
-    CommandDispatcher::CommandDispatcher(Store &store) : store_(store)
+    namespace
     {
-        registerStringCommands();
-        registerListCommands();
-        registerSetCommands();
+        template <typename T>
+        bool parse_int(std::string_view str, T &out)
+        {
+            auto [ptr, ec] = std::from_chars(str.data(), str.data() + str.size(), out);
+            return ec == std::errc() && ptr == str.data() + str.size();
+        }
+
+        // Accepts what strtod does, including inf with an optional sign, but not NaN.
+        bool parse_score(std::string_view str, double &out)
+        {
+            if (str.size() > 1 && str[0] == '+' && str[1] != '-')
+                str.remove_prefix(1);
+            auto [ptr, ec] = std::from_chars(str.data(), str.data() + str.size(), out);
+            return ec == std::errc() && ptr == str.data() + str.size() && !std::isnan(out);
+        }
+
+        // A range bound; a leading '(' makes it exclusive.
+        bool parse_score_bound(std::string_view str, double &out, bool &exclusive)
+        {
+            exclusive = !str.empty() && str[0] == '(';
+            if (exclusive)
+                str.remove_prefix(1);
+            return parse_score(str, out);
+        }
+
+        // Shortest form that reads back as the same double.
+        std::string format_score(double score)
+        {
+            char buffer[32];
+            char *end = std::to_chars(buffer, buffer + sizeof(buffer), score).ptr;
+            return std::string(buffer, end - buffer);
+        }
+
+        std::string to_upper(std::string_view str)
+        {
+            std::string result(str);
+            for (char &c : result)
+            {
+                c = std::toupper(static_cast<unsigned char>(c));
+            }
+            return result;
+        }
+
+        // Converts an EX/PX style argument to absolute Unix milliseconds.
+        bool to_absolute_ms(int64_t amount, bool seconds, bool relative, int64_t &when)
+        {
+            if (seconds && __builtin_mul_overflow(amount, int64_t(1000), &amount))
+                return false;
+            if (relative && __builtin_add_overflow(amount, Store::now_ms(), &amount))
+                return false;
+            when = amount;
+            return true;
+        }
+
+        struct ScanOptions
+        {
+            // Empty matches everything.
+            std::string_view pattern;
+            size_t count = 10;
+            std::optional<ValueType> type;
+            bool novalues = false;
+        };
+
+        // Parses MATCH, COUNT and, where allowed, TYPE (SCAN) or NOVALUES
+        // (HSCAN) from args[first] on; returns an error message or nullptr.
+        const char *parse_scan_options(const std::vector<std::string_view> &args, size_t first, bool allow_type,
+                                       bool allow_novalues, ScanOptions &options)
+        {
+            for (size_t i = first; i < args.size(); ++i)
+            {
+                std::string option = to_upper(args[i]);
+                bool has_value = i + 1 < args.size();
+                if (option == "MATCH" && has_value)
+                {
+                    options.pattern = args[++i] == "*" ? std::string_view() : args[i];
+                }
+                else if (option == "COUNT" && has_value)
+                {
+                    if (!parse_int(args[++i], options.count))
+                        return "value is not an integer or out of range";
+                    if (options.count == 0)
+                        return "syntax error";
+                }
+                else if (option == "TYPE" && has_value && allow_type)
+                {
+                    std::string name(args[++i]);
+                    for (char &c : name)
+                    {
+                        c = std::tolower(static_cast<unsigned char>(c));
+                    }
+                    for (ValueType type : {ValueType::STRING, ValueType::LIST, ValueType::SET, ValueType::ZSET, ValueType::HASH})
+                    {
+                        if (name == Value::type_name(type))
+                            options.type = type;
+                    }
+                    if (!options.type)
+                        return "unknown type name";
+                }
+                else if (option == "NOVALUES" && allow_novalues)
+                {
+                    options.novalues = true;
+                }
+                else
+                {
+                    return "syntax error";
+                }
+            }
+            return nullptr;
+        }
+
+        // Takes scan steps until COUNT items were found, the walk ended or
+        // COUNT * 10 steps went by, which bounds the time spent on sparse
+        // tables or a pattern that rarely matches, as in Redis.
+        template <typename Step>
+        size_t scan_steps(size_t cursor, const ScanOptions &options, const size_t &found, Step step)
+        {
+            size_t steps = options.count * 10;
+            do
+            {
+                cursor = step(cursor);
+            } while (cursor != 0 && found < options.count && --steps > 0);
+            return cursor;
+        }
+
+        std::string scan_reply(uint64_t cursor, size_t count, const std::string &items)
+        {
+            std::string reply;
+            Response::append_array_header(reply, 2);
+            Response::append_bulk(reply, std::to_string(cursor));
+            Response::append_array_header(reply, count);
+            reply += items;
+            return reply;
+        }
+
+        // Commands are found through a perfect hash of their names: the seed
+        // is searched at compile time until every name has a slot of its own,
+        // so a lookup is one hash and one comparison.
+        constexpr size_t COMMAND_SLOTS = 512;
+        constexpr uint8_t NO_COMMAND = 0xff;
+
+        constexpr char upper(char c)
+        {
+            return c >= 'a' && c <= 'z' ? static_cast<char>(c - 'a' + 'A') : c;
+        }
+
+        // FNV-1a of the upper-cased name, with a final mix so the low bits
+        // depend on every byte.
+        constexpr uint32_t command_hash(std::string_view name, uint32_t seed)
+        {
+            uint32_t hash = 2166136261u ^ seed;
+            for (char c : name)
+            {
+                hash ^= static_cast<uint8_t>(upper(c));
+                hash *= 16777619u;
+            }
+            hash ^= hash >> 15;
+            hash *= 0x2c1b3c6du;
+            return hash ^ (hash >> 12);
+        }
+
+        struct CommandIndex
+        {
+            uint32_t seed = 0;
+            uint8_t slots[COMMAND_SLOTS] = {};
+        };
+
+        template <size_t N>
+        constexpr CommandIndex build_command_index(const CommandDispatcher::CommandInfo (&commands)[N])
+        {
+            static_assert(N < NO_COMMAND, "command table too large for one-byte slots");
+            for (uint32_t seed = 0;; ++seed)
+            {
+                CommandIndex index;
+                index.seed = seed;
+                for (uint8_t &slot : index.slots)
+                {
+                    slot = NO_COMMAND;
+                }
+                bool perfect = true;
+                for (size_t i = 0; i < N && perfect; ++i)
+                {
+                    uint8_t &slot = index.slots[command_hash(commands[i].name, seed) % COMMAND_SLOTS];
+                    perfect = slot == NO_COMMAND;
+                    slot = static_cast<uint8_t>(i);
+                }
+                if (perfect)
+                {
+                    return index;
+                }
+            }
+        }
+
+        // End of the RESP bulk string or nil at pos, npos if there is none.
+        size_t bulk_end(std::string_view reply, size_t pos)
+        {
+            size_t eol = reply.find("\r\n", pos);
+            int64_t length;
+            if (pos >= reply.size() || reply[pos] != '$' || eol == std::string_view::npos ||
+                !parse_int(reply.substr(pos + 1, eol - pos - 1), length))
+                return std::string_view::npos;
+            size_t end = length < 0 ? eol + 2 : eol + 2 + static_cast<size_t>(length) + 2;
+            return end <= reply.size() ? end : std::string_view::npos;
+        }
+
+        // The items of an array reply of bulk strings, headers included;
+        // false if the reply is something else.
+        bool bulk_items(std::string_view reply, std::vector<std::string_view> &items)
+        {
+            size_t eol = reply.find("\r\n");
+            size_t count;
+            if (reply.empty() || reply[0] != '*' || eol == std::string_view::npos || !parse_int(reply.substr(1, eol - 1), count))
+                return false;
+            size_t pos = eol + 2;
+            for (size_t i = 0; i < count; ++i)
+            {
+                size_t end = bulk_end(reply, pos);
+                if (end == std::string_view::npos)
+                    return false;
+                items.push_back(reply.substr(pos, end - pos));
+                pos = end;
+            }
+            return true;
+        }
+
+        bool arity_matches(const CommandDispatcher::CommandInfo &info, size_t argc)
+        {
+            int n = static_cast<int>(argc);
+            return info.arity >= 0 ? n == info.arity : n >= -info.arity;
+        }
+    }
+
+    struct CommandDispatcher::CommandTable
+    {
+        static constexpr uint32_t W = CMD_WRITE;
+        static constexpr uint32_t R = CMD_READONLY;
+        static constexpr uint32_t M = CMD_DENYOOM;
+        static constexpr uint32_t A = CMD_ADMIN;
+        static constexpr uint32_t S = CMD_ALL_SHARDS;
+        static constexpr uint32_t C = CMD_SHARD_CURSOR;
+        static constexpr uint32_t K = CMD_NUMKEYS;
+        static constexpr uint32_t N = CMD_NOSCRIPT;
+        static constexpr uint32_t P = CMD_SPLIT_SUM;
+        static constexpr uint32_t O = CMD_SPLIT_OK;
+        static constexpr uint32_t G = CMD_SPLIT_ORDERED;
+        static constexpr uint32_t I = CMD_SPLIT_INTERSECT;
+
+        static constexpr CommandInfo commands[] = {
+            {"GET", 2, R, 0, 0, 1, &CommandDispatcher::getCommand},
+            {"SET", -3, W | M, 0, 0, 1, &CommandDispatcher::setCommand},
+            {"MGET", -2, R | G, 0, -1, 1, &CommandDispatcher::mgetCommand},
+            {"MSET", -3, W | M | O, 0, -1, 2, &CommandDispatcher::msetCommand},
+            {"MSETNX", -3, W | M, 0, -1, 2, &CommandDispatcher::msetnxCommand},
+            {"DEL", -2, W | P, 0, -1, 1, &CommandDispatcher::delCommand},
+            {"UNLINK", -2, W | P, 0, -1, 1, &CommandDispatcher::unlinkCommand},
+            {"EXISTS", -2, R | P, 0, -1, 1, &CommandDispatcher::existsCommand},
+            {"LPUSH", -3, W | M, 0, 0, 1, &CommandDispatcher::lpushCommand},
+            {"RPUSH", -3, W | M, 0, 0, 1, &CommandDispatcher::rpushCommand},
+            {"LPOP", 2, W, 0, 0, 1, &CommandDispatcher::lpopCommand},
+            {"RPOP", 2, W, 0, 0, 1, &CommandDispatcher::rpopCommand},
+            {"LLEN", 2, R, 0, 0, 1, &CommandDispatcher::llenCommand},
+            {"LRANGE", 4, R, 0, 0, 1, &CommandDispatcher::lrangeCommand},
+            {"SADD", -3, W | M, 0, 0, 1, &CommandDispatcher::saddCommand},
+            {"SREM", -3, W, 0, 0, 1, &CommandDispatcher::sremCommand},
+            {"SISMEMBER", 3, R, 0, 0, 1, &CommandDispatcher::sismemberCommand},
+            {"SCARD", 2, R, 0, 0, 1, &CommandDispatcher::scardCommand},
+            {"SINTER", -2, R | I, 0, -1, 1, &CommandDispatcher::sinterCommand},
+            {"ZADD", -4, W | M, 0, 0, 1, &CommandDispatcher::zaddCommand},
+            {"ZINCRBY", 4, W | M, 0, 0, 1, &CommandDispatcher::zincrbyCommand},
+            {"ZREM", -3, W, 0, 0, 1, &CommandDispatcher::zremCommand},
+            {"ZSCORE", 3, R, 0, 0, 1, &CommandDispatcher::zscoreCommand},
+            {"ZRANK", 3, R, 0, 0, 1, &CommandDispatcher::zrankCommand},
+            {"ZCARD", 2, R, 0, 0, 1, &CommandDispatcher::zcardCommand},
+            {"ZCOUNT", 4, R, 0, 0, 1, &CommandDispatcher::zcountCommand},
+            {"ZRANGE", -4, R, 0, 0, 1, &CommandDispatcher::zrangeCommand},
+            {"ZRANGEBYSCORE", -4, R, 0, 0, 1, &CommandDispatcher::zrangebyscoreCommand},
+            {"HSET", -4, W | M, 0, 0, 1, &CommandDispatcher::hsetCommand},
+            {"HGET", 3, R, 0, 0, 1, &CommandDispatcher::hgetCommand},
+            {"HMGET", -3, R, 0, 0, 1, &CommandDispatcher::hmgetCommand},
+            {"HDEL", -3, W, 0, 0, 1, &CommandDispatcher::hdelCommand},
+            {"HINCRBY", 4, W | M, 0, 0, 1, &CommandDispatcher::hincrbyCommand},
+            {"HLEN", 2, R, 0, 0, 1, &CommandDispatcher::hlenCommand},
+            {"HGETALL", 2, R, 0, 0, 1, &CommandDispatcher::hgetallCommand},
+            {"KEYS", 2, R | S, -1, 0, 0, &CommandDispatcher::keysCommand},
+            {"SCAN", -2, R | C, -1, 0, 0, &CommandDispatcher::scanCommand},
+            {"SSCAN", -3, R, 0, 0, 1, &CommandDispatcher::sscanCommand},
+            {"HSCAN", -3, R, 0, 0, 1, &CommandDispatcher::hscanCommand},
+            {"ZSCAN", -3, R, 0, 0, 1, &CommandDispatcher::zscanCommand},
+            {"EXPIRE", 3, W, 0, 0, 1, &CommandDispatcher::expireCommand},
+            {"PEXPIRE", 3, W, 0, 0, 1, &CommandDispatcher::pexpireCommand},
+            {"EXPIREAT", 3, W, 0, 0, 1, &CommandDispatcher::expireatCommand},
+            {"PEXPIREAT", 3, W, 0, 0, 1, &CommandDispatcher::pexpireatCommand},
+            {"TTL", 2, R, 0, 0, 1, &CommandDispatcher::ttlCommand},
+            {"PTTL", 2, R, 0, 0, 1, &CommandDispatcher::pttlCommand},
+            {"PERSIST", 2, W, 0, 0, 1, &CommandDispatcher::persistCommand},
+            {"MEMORY", -2, R, 1, 1, 1, &CommandDispatcher::memoryCommand},
+            {"OBJECT", -2, R, 1, 1, 1, &CommandDispatcher::objectCommand},
+            {"PING", -1, 0, -1, 0, 0, &CommandDispatcher::pingCommand},
+            {"COMMAND", -1, 0, -1, 0, 0, &CommandDispatcher::commandCommand},
+            {"INFO", -1, 0, -1, 0, 0, &CommandDispatcher::infoCommand},
+            {"LATENCY", -2, A, -1, 0, 0, &CommandDispatcher::latencyCommand},
+            {"SLOWLOG", -2, A, -1, 0, 0, &CommandDispatcher::slowlogCommand},
+            {"WATCH", -2, N, 0, -1, 1, &CommandDispatcher::watchCommand},
+            {"UNWATCH", 1, N, -1, 0, 0, &CommandDispatcher::unwatchCommand},
+            {"MULTI", 1, N, -1, 0, 0, &CommandDispatcher::multiCommand},
+            {"EXEC", -1, N, -1, 0, 0, &CommandDispatcher::execCommand},
+            {"DISCARD", 1, N, -1, 0, 0, &CommandDispatcher::discardCommand},
+            {"EVAL", -3, K | N, 1, 0, 1, &CommandDispatcher::evalCommand},
+            {"EVALSHA", -3, K | N, 1, 0, 1, &CommandDispatcher::evalshaCommand},
+            {"SCRIPT", -2, N, -1, 0, 0, &CommandDispatcher::scriptCommand},
+            {"SAVE", 1, A, -1, 0, 0, nullptr},
+            {"BGSAVE", 1, A, -1, 0, 0, nullptr},
+            {"LASTSAVE", 1, 0, -1, 0, 0, nullptr},
+            {"BGREWRITEAOF", 1, A, -1, 0, 0, nullptr},
+            {"REPLICAOF", 3, A, -1, 0, 0, nullptr},
+        };
+        static constexpr size_t count = sizeof(commands) / sizeof(commands[0]);
+        static constexpr CommandIndex index = build_command_index(commands);
+    };
+
+    CommandDispatcher::CommandDispatcher(Store &store) : external_(CommandTable::count), store_(store)
+    {
+        store_.set_removal_listener([this](std::string_view key)
+                                    {
+                                        if (write_listeners_.empty())
+                                            return;
+                                        Command del;
+                                        del.name = "DEL";
+                                        del.args.push_back(key);
+                                        notify_write(del); });
+    }
+
+    Response CommandDispatcher::setCommand(const Command &command)
+    {
+        std::string_view key = command.args[0];
+        std::string_view value = command.args[1];
+        int64_t expire_at = -1;
+        bool nx = false, xx = false, keep_ttl = false;
+        for (size_t i = 2; i < command.args.size(); ++i)
+        {
+            std::string option = to_upper(command.args[i]);
+            if (option == "NX")
+            {
+                nx = true;
+            }
+            else if (option == "XX")
+            {
+                xx = true;
+            }
+            else if (option == "KEEPTTL")
+            {
+                keep_ttl = true;
+            }
+            else if ((option == "EX" || option == "PX" || option == "EXAT" || option == "PXAT") &&
+                     i + 1 < command.args.size() && expire_at < 0)
+            {
+                int64_t amount;
+                if (!parse_int(command.args[++i], amount))
+                {
+                    return Response::Error("value is not an integer or out of range");
+                }
+                if (amount <= 0 || !to_absolute_ms(amount, option[0] == 'E', option.size() == 2, expire_at))
+                {
+                    return Response::Error("invalid expire time in SET command");
+                }
+            }
+            else
+            {
+                return Response::Error("syntax error");
+            }
+        }
+        if ((nx && xx) || (keep_ttl && expire_at >= 0))
+        {
+            return Response::Error("syntax error");
+        }
+        if ((nx || xx) && store_.exists(key) == nx)
+        {
+            propagate_as({});
+            return Response::Nil();
+        }
+        if (!store_.set(key, value, keep_ttl))
+        {
+            return Response::Error("Failed to set value");
+        }
+        if (expire_at >= 0)
+        {
+            store_.expire_at(key, expire_at);
+            propagate_as({"SET", std::string(key), std::string(value), "PXAT", std::to_string(expire_at)});
+        }
+        return Response::Ok();
+    }
+
+    Response CommandDispatcher::getCommand(const Command &command)
+    {
+        std::string_view key = command.args[0];
+        // Large values go out as their own segment of the output buffer,
+        // so they are copied once, out of the store, and never into the arena.
+        std::string heap;
+        auto result = store_.get(key, arena_, heap);
+        if (result && result->data() == heap.data())
+        {
+            return Response::String(std::move(heap));
+        }
+        if (result)
+        {
+            return Response::View(*result);
+        }
+        return Response(ResponseStatus::NIL, "");
+    }
+
+    Response CommandDispatcher::delCommand(const Command &command)
+    {
+        return delGenericCommand(command, false);
+    }
+
+    // Like DEL, but values too big to free quickly are freed on the
+    // lazy-free thread whatever the lazyfree settings.
+    Response CommandDispatcher::unlinkCommand(const Command &command)
+    {
+        return delGenericCommand(command, true);
+    }
+
+    Response CommandDispatcher::delGenericCommand(const Command &command, bool lazy)
+    {
+        std::vector<std::string_view> keys(command.args.begin(), command.args.end());
+        size_t removed = lazy ? store_.unlink(keys) : store_.remove(keys);
+        if (removed == 0)
+        {
+            propagate_as({});
+        }
+        return Response::Integer(removed);
+    }
+
+    Response CommandDispatcher::existsCommand(const Command &command)
+    {
+        std::vector<std::string_view> keys(command.args.begin(), command.args.end());
+        return Response::Integer(store_.exists(keys));
+    }
+
+    Response CommandDispatcher::mgetCommand(const Command &command)
+    {
+        std::vector<std::string_view> keys(command.args.begin(), command.args.end());
+        std::string reply;
+        Response::append_array_header(reply, keys.size());
+        store_.mget(keys, [&reply](std::optional<std::string_view> value)
+                    {
+                        if (value)
+                            Response::append_bulk(reply, *value);
+                        else
+                            Response::append_nil(reply);
+                    });
+        return Response::Encoded(std::move(reply));
+    }
+
+    Response CommandDispatcher::msetCommand(const Command &command)
+    {
+        return msetGenericCommand(command, false);
+    }
+
+    Response CommandDispatcher::msetnxCommand(const Command &command)
+    {
+        return msetGenericCommand(command, true);
+    }
+
+    Response CommandDispatcher::msetGenericCommand(const Command &command, bool nx)
+    {
+        if (command.args.size() % 2 != 0)
+        {
+            return Response::Error(to_upper(command.name) + " command requires key value pairs");
+        }
+        std::vector<Store::KeyValue> pairs;
+        pairs.reserve(command.args.size() / 2);
+        for (size_t i = 0; i < command.args.size(); i += 2)
+        {
+            pairs.push_back({command.args[i], command.args[i + 1]});
+        }
+        if (!nx)
+        {
+            store_.mset(pairs);
+            return Response::Ok();
+        }
+        if (!store_.msetnx(pairs))
+        {
+            propagate_as({});
+            return Response::Integer(0);
+        }
+        return Response::Integer(1);
+    }
+
+    Response CommandDispatcher::lpushCommand(const Command &command)
+    {
+        std::string_view key = command.args[0];
+        for (size_t i = 1; i < command.args.size(); ++i)
+        {
+            if (!store_.lpush(key, command.args[i]))
+            {
+                return Response::Error("Failed to push to list");
+            }
+        }
+        return Response::Ok();
+    }
+
+    Response CommandDispatcher::rpushCommand(const Command &command)
+    {
+        std::string_view key = command.args[0];
+        for (size_t i = 1; i < command.args.size(); ++i)
+        {
+            if (!store_.rpush(key, command.args[i]))
+            {
+                return Response::Error("Failed to push to list");
+            }
+        }
+        return Response::Ok();
+    }
+
+    Response CommandDispatcher::lpopCommand(const Command &command)
+    {
+        std::string_view key = command.args[0];
+        auto result = store_.lpop(key);
+        if (result)
+        {
+            return Response::String(*result);
+        }
+        return Response::Nil();
+    }
+
+    Response CommandDispatcher::rpopCommand(const Command &command)
+    {
+        std::string_view key = command.args[0];
+        auto result = store_.rpop(key);
+        if (result)
+        {
+            return Response::String(*result);
+        }
+        return Response::Nil();
+    }
+
+    Response CommandDispatcher::llenCommand(const Command &command)
+    {
+        std::string_view key = command.args[0];
+        auto result = store_.llen(key);
+        if (result)
+        {
+            return Response::Integer(*result);
+        }
+        return Response::Integer(0);
+    }
+
+    Response CommandDispatcher::lrangeCommand(const Command &command)
+    {
+        std::string_view key = command.args[0];
+        long long start, end;
+        if (!parse_int(command.args[1], start) || !parse_int(command.args[2], end))
+        {
+            return Response::Error("value is not an integer or out of range");
+        }
+        std::string reply;
+        bool found = store_.lrange(key, start, end, [&reply](size_t count)
+                                   { Response::append_array_header(reply, count); },
+                                   [&reply](std::string_view item)
+                                   { Response::append_bulk(reply, item); });
+        if (!found)
+        {
+            return Response::Error("Key is not a list");
+        }
+        return Response::Encoded(std::move(reply));
+    }
+
+    Response CommandDispatcher::saddCommand(const Command &command)
+    {
+        std::string_view key = command.args[0];
+        for (size_t i = 1; i < command.args.size(); ++i)
+        {
+            if (!store_.sadd(key, command.args[i]))
+            {
+                return Response::Error("Failed to add to set");
+            }
+        }
+        return Response::Ok();
+    }
+
+    Response CommandDispatcher::sremCommand(const Command &command)
+    {
+        std::string_view key = command.args[0];
+        bool removed = false;
+        for (size_t i = 1; i < command.args.size(); ++i)
+        {
+            if (store_.srem(key, command.args[i]))
+            {
+                removed = true;
+            }
+        }
+        return removed ? Response::Ok() : Response::Error("Member not found in set");
+    }
+
+    Response CommandDispatcher::sismemberCommand(const Command &command)
+    {
+        std::string_view key = command.args[0];
+        std::string_view member = command.args[1];
+        auto result = store_.sismember(key, member);
+        if (result)
+        {
+            return Response::String(*result ? "1" : "0");
+        }
+        return Response::Error("Key is not a set");
+    }
+
+    Response CommandDispatcher::scardCommand(const Command &command)
+    {
+        std::string_view key = command.args[0];
+        auto result = store_.scard(key);
+        if (result)
+        {
+            return Response::String(std::to_string(*result));
+        }
+        return Response::Error("Key is not a set");
+    }
+
+    Response CommandDispatcher::sinterCommand(const Command &command)
+    {
+        auto result = store_.sinter(command.args);
+        if (result)
+        {
+            return Response::Array(std::move(*result));
+        }
+        return Response::Error("Keys are not sets");
+    }
+
+    Response CommandDispatcher::zaddCommand(const Command &command)
+    {
+        std::string_view key = command.args[0];
+        bool nx = false, xx = false, ch = false;
+        size_t i = 1;
+        for (; i < command.args.size(); ++i)
+        {
+            std::string option = to_upper(command.args[i]);
+            if (option == "NX")
+                nx = true;
+            else if (option == "XX")
+                xx = true;
+            else if (option == "CH")
+                ch = true;
+            else
+                break;
+        }
+        if (nx && xx)
+        {
+            return Response::Error("XX and NX options at the same time are not compatible");
+        }
+        if (i == command.args.size() || (command.args.size() - i) % 2 != 0)
+        {
+            return Response::Error("syntax error");
+        }
+        std::vector<Store::ScoredMember> members;
+        members.reserve((command.args.size() - i) / 2);
+        for (; i < command.args.size(); i += 2)
+        {
+            double score;
+            if (!parse_score(command.args[i], score))
+            {
+                return Response::Error("value is not a valid float");
+            }
+            members.push_back({command.args[i + 1], score});
+        }
+        auto result = store_.zadd(key, members, nx, xx);
+        if (!result)
+        {
+            return Response::Error("Key is not a sorted set");
+        }
+        return Response::Integer(result->added + (ch ? result->updated : 0));
+    }
+
+    Response CommandDispatcher::zincrbyCommand(const Command &command)
+    {
+        double increment;
+        if (!parse_score(command.args[1], increment))
+        {
+            return Response::Error("value is not a valid float");
+        }
+        auto result = store_.zincrby(command.args[0], command.args[2], increment);
+        if (!result)
+        {
+            return Response::Error("Key is not a sorted set");
+        }
+        if (std::isnan(*result))
+        {
+            return Response::Error("resulting score is not a number (NaN)");
+        }
+        return Response::String(format_score(*result));
+    }
+
+    Response CommandDispatcher::zremCommand(const Command &command)
+    {
+        std::vector<std::string_view> members(command.args.begin() + 1, command.args.end());
+        auto result = store_.zrem(command.args[0], members);
+        if (!result)
+        {
+            return Response::Error("Key is not a sorted set");
+        }
+        return Response::Integer(*result);
+    }
+
+    Response CommandDispatcher::zscoreCommand(const Command &command)
+    {
+        std::optional<double> score;
+        if (!store_.zscore(command.args[0], command.args[1], score))
+        {
+            return Response::Error("Key is not a sorted set");
+        }
+        if (score)
+        {
+            return Response::String(format_score(*score));
+        }
+        return Response::Nil();
+    }
+
+    Response CommandDispatcher::zrankCommand(const Command &command)
+    {
+        std::optional<size_t> rank;
+        if (!store_.zrank(command.args[0], command.args[1], rank))
+        {
+            return Response::Error("Key is not a sorted set");
+        }
+        if (rank)
+        {
+            return Response::Integer(*rank);
+        }
+        return Response::Nil();
+    }
+
+    Response CommandDispatcher::zcardCommand(const Command &command)
+    {
+        auto result = store_.zcard(command.args[0]);
+        if (result)
+        {
+            return Response::Integer(*result);
+        }
+        return Response::Error("Key is not a sorted set");
+    }
+
+    Response CommandDispatcher::zcountCommand(const Command &command)
+    {
+        ScoreRange range;
+        if (!parse_score_bound(command.args[1], range.min, range.min_exclusive) ||
+            !parse_score_bound(command.args[2], range.max, range.max_exclusive))
+        {
+            return Response::Error("min or max is not a float");
+        }
+        auto result = store_.zcount(command.args[0], range);
+        if (result)
+        {
+            return Response::Integer(*result);
+        }
+        return Response::Error("Key is not a sorted set");
+    }
+
+    Response CommandDispatcher::zrangeCommand(const Command &command)
+    {
+        bool with_scores = command.args.size() == 4 && to_upper(command.args[3]) == "WITHSCORES";
+        if (command.args.size() != 3 && !with_scores)
+        {
+            return Response::Error("ZRANGE command requires 3 arguments and an optional WITHSCORES");
+        }
+        long long start, end;
+        if (!parse_int(command.args[1], start) || !parse_int(command.args[2], end))
+        {
+            return Response::Error("value is not an integer or out of range");
+        }
+        std::string reply;
+        bool found = store_.zrange(command.args[0], start, end, [&reply, with_scores](size_t count)
+                                   { Response::append_array_header(reply, with_scores ? count * 2 : count); },
+                                   [&reply, with_scores](std::string_view member, double score)
+                                   {
+                                       Response::append_bulk(reply, member);
+                                       if (with_scores)
+                                           Response::append_bulk(reply, format_score(score));
+                                   });
+        if (!found)
+        {
+            return Response::Error("Key is not a sorted set");
+        }
+        return Response::Encoded(std::move(reply));
+    }
+
+    Response CommandDispatcher::zrangebyscoreCommand(const Command &command)
+    {
+        ScoreRange range;
+        if (!parse_score_bound(command.args[1], range.min, range.min_exclusive) ||
+            !parse_score_bound(command.args[2], range.max, range.max_exclusive))
+        {
+            return Response::Error("min or max is not a float");
+        }
+        bool with_scores = false;
+        long long offset = 0, limit = -1;
+        for (size_t i = 3; i < command.args.size(); ++i)
+        {
+            std::string option = to_upper(command.args[i]);
+            if (option == "WITHSCORES")
+            {
+                with_scores = true;
+            }
+            else if (option == "LIMIT" && i + 2 < command.args.size())
+            {
+                if (!parse_int(command.args[i + 1], offset) || !parse_int(command.args[i + 2], limit))
+                {
+                    return Response::Error("value is not an integer or out of range");
+                }
+                i += 2;
+            }
+            else
+            {
+                return Response::Error("syntax error");
+            }
+        }
+        std::string reply;
+        bool found = store_.zrangebyscore(command.args[0], range, offset, limit, [&reply, with_scores](size_t count)
+                                          { Response::append_array_header(reply, with_scores ? count * 2 : count); },
+                                          [&reply, with_scores](std::string_view member, double score)
+                                          {
+                                              Response::append_bulk(reply, member);
+                                              if (with_scores)
+                                                  Response::append_bulk(reply, format_score(score));
+                                          });
+        if (!found)
+        {
+            return Response::Error("Key is not a sorted set");
+        }
+        return Response::Encoded(std::move(reply));
+    }
+
+    Response CommandDispatcher::hsetCommand(const Command &command)
+    {
+        if (command.args.size() % 2 == 0)
+        {
+            return Response::Error("HSET command requires a key and field value pairs");
+        }
+        std::vector<Store::FieldValue> fields;
+        fields.reserve(command.args.size() / 2);
+        for (size_t i = 1; i < command.args.size(); i += 2)
+        {
+            fields.push_back({command.args[i], command.args[i + 1]});
+        }
+        auto result = store_.hset(command.args[0], fields);
+        if (!result)
+        {
+            return Response::Error("Key is not a hash");
+        }
+        return Response::Integer(*result);
+    }
+
+    Response CommandDispatcher::hgetCommand(const Command &command)
+    {
+        std::optional<std::string> value;
+        if (!store_.hget(command.args[0], command.args[1], value))
+        {
+            return Response::Error("Key is not a hash");
+        }
+        if (value)
+        {
+            return Response::String(*value);
+        }
+        return Response::Nil();
+    }
+
+    Response CommandDispatcher::hmgetCommand(const Command &command)
+    {
+        std::vector<std::string_view> fields(command.args.begin() + 1, command.args.end());
+        std::string reply;
+        Response::append_array_header(reply, fields.size());
+        bool found = store_.hmget(command.args[0], fields, [&reply](std::optional<std::string_view> value)
+                                  {
+                                      if (value)
+                                          Response::append_bulk(reply, *value);
+                                      else
+                                          Response::append_nil(reply);
+                                  });
+        if (!found)
+        {
+            return Response::Error("Key is not a hash");
+        }
+        return Response::Encoded(std::move(reply));
+    }
+
+    Response CommandDispatcher::hdelCommand(const Command &command)
+    {
+        std::vector<std::string_view> fields(command.args.begin() + 1, command.args.end());
+        auto result = store_.hdel(command.args[0], fields);
+        if (!result)
+        {
+            return Response::Error("Key is not a hash");
+        }
+        return Response::Integer(*result);
+    }
+
+    Response CommandDispatcher::hincrbyCommand(const Command &command)
+    {
+        int64_t increment, value;
+        if (!parse_int(command.args[2], increment))
+        {
+            return Response::Error("value is not an integer or out of range");
+        }
+        switch (store_.hincrby(command.args[0], command.args[1], increment, value))
+        {
+        case Store::IncrResult::WRONG_TYPE:
+            return Response::Error("Key is not a hash");
+        case Store::IncrResult::NOT_INTEGER:
+            return Response::Error("hash value is not an integer");
+        case Store::IncrResult::OUT_OF_RANGE:
+            return Response::Error("increment or decrement would overflow");
+        default:
+            return Response::Integer(value);
+        }
+    }
+
+    Response CommandDispatcher::hlenCommand(const Command &command)
+    {
+        auto result = store_.hlen(command.args[0]);
+        if (result)
+        {
+            return Response::Integer(*result);
+        }
+        return Response::Error("Key is not a hash");
+    }
+
+    Response CommandDispatcher::hgetallCommand(const Command &command)
+    {
+        std::string reply;
+        bool found = store_.hgetall(command.args[0], [&reply](size_t count)
+                                    { Response::append_array_header(reply, count * 2); },
+                                    [&reply](std::string_view field, std::string_view value)
+                                    {
+                                        Response::append_bulk(reply, field);
+                                        Response::append_bulk(reply, value);
+                                    });
+        if (!found)
+        {
+            return Response::Error("Key is not a hash");
+        }
+        return Response::Encoded(std::move(reply));
+    }
+
+    Response CommandDispatcher::keysCommand(const Command &command)
+    {
+        std::string_view pattern = command.args[0] == "*" ? std::string_view() : command.args[0];
+        std::string items;
+        size_t count = 0;
+        store_.for_each_key([&](std::string_view key)
+                            {
+                                if (!pattern.empty() && !glob_match(pattern, key))
+                                    return;
+                                Response::append_bulk(items, key);
+                                count++;
+                            });
+        std::string reply;
+        Response::append_array_header(reply, count);
+        reply += items;
+        return Response::Encoded(std::move(reply));
+    }
+
+    // The cursor is the shard's Dict::scan cursor times the shard count plus
+    // the shard, so routing can send each call to the shard being walked;
+    // when one shard is done the walk moves to the next.
+    Response CommandDispatcher::scanCommand(const Command &command)
+    {
+        uint64_t cursor;
+        if (!parse_int(command.args[0], cursor))
+        {
+            return Response::Error("invalid cursor");
+        }
+        ScanOptions options;
+        if (const char *error = parse_scan_options(command.args, 1, true, false, options))
+        {
+            return Response::Error(error);
+        }
+        int64_t now = Store::now_ms();
+        std::string items;
+        size_t found = 0;
+        size_t position = scan_steps(cursor / shards_, options, found, [&](size_t at)
+                                     {
+                                         return store_.scan(at, [&](std::string_view key, const Value &value, int64_t expire_at)
+                                                            {
+                                                                if (expire_at >= 0 && expire_at <= now)
+                                                                    return;
+                                                                if (options.type && value.type() != *options.type)
+                                                                    return;
+                                                                if (!options.pattern.empty() && !glob_match(options.pattern, key))
+                                                                    return;
+                                                                Response::append_bulk(items, key);
+                                                                found++;
+                                                            });
+                                     });
+        uint64_t next = position ? position * shards_ + shard_ : shard_ + 1 < shards_ ? shard_ + 1 : 0;
+        return Response::Encoded(scan_reply(next, found, items));
+    }
+
+    Response CommandDispatcher::sscanCommand(const Command &command)
+    {
+        return scanGenericCommand(command, ValueType::SET);
+    }
+
+    Response CommandDispatcher::hscanCommand(const Command &command)
+    {
+        return scanGenericCommand(command, ValueType::HASH);
+    }
+
+    Response CommandDispatcher::zscanCommand(const Command &command)
+    {
+        return scanGenericCommand(command, ValueType::ZSET);
+    }
+
+    Response CommandDispatcher::scanGenericCommand(const Command &command, ValueType type)
+    {
+        std::string_view key = command.args[0];
+        uint64_t cursor;
+        if (!parse_int(command.args[1], cursor))
+        {
+            return Response::Error("invalid cursor");
+        }
+        ScanOptions options;
+        if (const char *error = parse_scan_options(command.args, 2, false, type == ValueType::HASH, options))
+        {
+            return Response::Error(error);
+        }
+        std::string items;
+        size_t found = 0;
+        auto matches = [&options](std::string_view item)
+        {
+            return options.pattern.empty() || glob_match(options.pattern, item);
+        };
+        bool wrong_type = false;
+        cursor = scan_steps(cursor, options, found, [&](size_t at) -> size_t
+                            {
+                                std::optional<size_t> next;
+                                if (type == ValueType::SET)
+                                {
+                                    next = store_.sscan(key, at, [&](std::string_view member)
+                                                        {
+                                                            if (!matches(member))
+                                                                return;
+                                                            Response::append_bulk(items, member);
+                                                            found++;
+                                                        });
+                                }
+                                else if (type == ValueType::HASH)
+                                {
+                                    next = store_.hscan(key, at, [&](std::string_view field, std::string_view value)
+                                                        {
+                                                            if (!matches(field))
+                                                                return;
+                                                            Response::append_bulk(items, field);
+                                                            if (!options.novalues)
+                                                                Response::append_bulk(items, value);
+                                                            found++;
+                                                        });
+                                }
+                                else
+                                {
+                                    next = store_.zscan(key, at, [&](std::string_view member, double score)
+                                                        {
+                                                            if (!matches(member))
+                                                                return;
+                                                            Response::append_bulk(items, member);
+                                                            Response::append_bulk(items, format_score(score));
+                                                            found++;
+                                                        });
+                                }
+                                wrong_type = !next;
+                                return next.value_or(0);
+                            });
+        if (wrong_type)
+        {
+            return Response::Error(type == ValueType::SET ? "Key is not a set" : type == ValueType::HASH ? "Key is not a hash" : "Key is not a sorted set");
+        }
+        size_t per_item = type == ValueType::SET || options.novalues ? 1 : 2;
+        return Response::Encoded(scan_reply(cursor, found * per_item, items));
+    }
+
+    Response CommandDispatcher::expireCommand(const Command &command)
+    {
+        return expireGenericCommand(command, true, true);
+    }
+
+    Response CommandDispatcher::pexpireCommand(const Command &command)
+    {
+        return expireGenericCommand(command, false, true);
+    }
+
+    Response CommandDispatcher::expireatCommand(const Command &command)
+    {
+        return expireGenericCommand(command, true, false);
+    }
+
+    Response CommandDispatcher::pexpireatCommand(const Command &command)
+    {
+        return expireGenericCommand(command, false, false);
+    }
+
+    Response CommandDispatcher::expireGenericCommand(const Command &command, bool seconds, bool relative)
+    {
+        std::string_view key = command.args[0];
+        int64_t amount, when;
+        if (!parse_int(command.args[1], amount))
+        {
+            return Response::Error("value is not an integer or out of range");
+        }
+        if (!to_absolute_ms(amount, seconds, relative, when))
+        {
+            return Response::Error("invalid expire time in " + to_upper(command.name) + " command");
+        }
+        if (!store_.expire_at(key, when))
+        {
+            propagate_as({});
+            return Response::Integer(0);
+        }
+        propagate_as({"PEXPIREAT", std::string(key), std::to_string(when)});
+        return Response::Integer(1);
+    }
+
+    Response CommandDispatcher::ttlCommand(const Command &command)
+    {
+        return ttlGenericCommand(command, false);
+    }
+
+    Response CommandDispatcher::pttlCommand(const Command &command)
+    {
+        return ttlGenericCommand(command, true);
+    }
+
+    Response CommandDispatcher::ttlGenericCommand(const Command &command, bool millis)
+    {
+        int64_t when = store_.expire_time(command.args[0]);
+        if (when < 0)
+        {
+            return Response::Integer(when);
+        }
+        int64_t left = std::max<int64_t>(0, when - Store::now_ms());
+        return Response::Integer(millis ? left : (left + 500) / 1000);
+    }
+
+    Response CommandDispatcher::persistCommand(const Command &command)
+    {
+        if (!store_.persist(command.args[0]))
+        {
+            propagate_as({});
+            return Response::Integer(0);
+        }
+        return Response::Integer(1);
+    }
+
+    Response CommandDispatcher::memoryCommand(const Command &command)
+    {
+        std::string sub = to_upper(command.args[0]);
+        if (sub == "USAGE" && command.args.size() == 2)
+        {
+            auto result = store_.memory_usage(command.args[1]);
+            if (result)
+            {
+                return Response::Integer(*result);
+            }
+            return Response::Nil();
+        }
+        if (sub == "STATS" && command.args.size() == 1)
+        {
+            Store::MemoryStats stats = store_.memory_stats();
+            return Response::Array({"keys.count", std::to_string(stats.keys),
+                                    "keys.expires", std::to_string(stats.expires),
+                                    "overhead.hashtable.main", std::to_string(stats.table_bytes),
+                                    "overhead.per.key", std::to_string(stats.overhead_per_key),
+                                    "value.header.bytes", std::to_string(stats.value_header_bytes),
+                                    "used.memory", std::to_string(stats.used_memory),
+                                    "maxmemory", std::to_string(stats.maxmemory),
+                                    "expired.keys", std::to_string(stats.expired_keys),
+                                    "evicted.keys", std::to_string(stats.evicted_keys)});
+        }
+        return Response::Error("Unknown MEMORY subcommand or wrong number of arguments");
+    }
+
+    Response CommandDispatcher::objectCommand(const Command &command)
+    {
+        std::string sub = command.args.size() == 2 ? to_upper(command.args[0]) : "";
+        std::string_view key = command.args.size() == 2 ? command.args[1] : std::string_view();
+        if (sub == "ENCODING")
+        {
+            auto result = store_.encoding(key);
+            if (result)
+            {
+                return Response::String(*result);
+            }
+            return Response::Nil();
+        }
+        if (sub == "IDLETIME" || sub == "FREQ")
+        {
+            bool lfu = store_.eviction_policy() == EvictionPolicy::ALLKEYS_LFU;
+            if (lfu != (sub == "FREQ"))
+            {
+                return Response::Error(sub == "FREQ" ? "An LFU maxmemory policy is not selected, access frequency not tracked"
+                                                     : "An LFU maxmemory policy is selected, idle time not tracked");
+            }
+            auto result = lfu ? store_.access_frequency(key) : store_.idle_time(key);
+            if (result)
+            {
+                return Response::Integer(*result);
+            }
+            return Response::Nil();
+        }
+        return Response::Error("OBJECT supports only ENCODING, IDLETIME or FREQ <key>");
+    }
+
+    Response CommandDispatcher::pingCommand(const Command &command)
+    {
+        if (command.args.size() > 1)
+        {
+            return Response::Error("wrong number of arguments for 'PING' command");
+        }
+        if (command.args.empty())
+        {
+            return Response::Encoded("+PONG\r\n");
+        }
+        return Response::View(command.args[0]);
     }
 
-    void CommandDispatcher::registerStringCommands()
+    Response CommandDispatcher::commandCommand(const Command &command)
     {
-        handlers_["SET"] = [this](const Command &command) -> Response
+        std::string sub = command.args.empty() ? "" : to_upper(command.args[0]);
+        if (sub == "COUNT" && command.args.size() == 1)
         {
-            if (command.args.size() != 2)
+            size_t count = 0;
+            for (const CommandInfo &info : CommandTable::commands)
             {
-                return Response::Error("SET command requires 2 arguments");
+                count += available(info);
             }
-            const std::string &key = command.args[0];
-            const std::string &value = command.args[1];
-            if (store_.set(key, value))
+            return Response::Integer(count);
+        }
+        if (!sub.empty() && sub != "INFO")
+        {
+            return Response::Error("COMMAND supports only INFO [name ...] or COUNT");
+        }
+        // As in Redis: name, arity, flags and 1-based key positions
+        // counting the name, with 0 for keyless commands.
+        auto append_info = [](std::string &reply, const CommandInfo &info)
+        {
+            Response::append_array_header(reply, 6);
+            std::string name(info.name);
+            for (char &c : name)
             {
-                return Response::Ok();
+                c = std::tolower(static_cast<unsigned char>(c));
             }
-            return Response::Error("Failed to set value");
-        };
-
-        handlers_["GET"] = [this](const Command &command) -> Response
-        {
-            if (command.args.size() != 1)
+            Response::append_bulk(reply, name);
+            Response::append_integer(reply, info.arity);
+            static constexpr std::pair<uint32_t, const char *> labels[] = {
+                {CMD_WRITE, "write"}, {CMD_READONLY, "readonly"}, {CMD_DENYOOM, "denyoom"},
+                {CMD_ADMIN, "admin"}, {CMD_NOSCRIPT, "noscript"}, {CMD_NUMKEYS, "movablekeys"}};
+            size_t flags = 0;
+            for (auto [flag, label] : labels)
             {
-                return Response::Error("GET command requires 1 argument");
+                flags += (info.flags & flag) != 0;
             }
-            const std::string &key = command.args[0];
-            auto result = store_.get(key);
-            if (result)
+            Response::append_array_header(reply, flags);
+            for (auto [flag, label] : labels)
             {
-                return Response::String(*result);
+                if (info.flags & flag)
+                    Response::append_status(reply, label);
             }
-            return Response(ResponseStatus::NIL, "");
+            // Like Redis, commands whose keys follow a count report none.
+            bool keyless = info.first_key < 0 || (info.flags & CMD_NUMKEYS);
+            Response::append_integer(reply, keyless ? 0 : info.first_key + 1);
+            Response::append_integer(reply, keyless ? 0 : info.last_key < 0 ? info.last_key : info.last_key + 1);
+            Response::append_integer(reply, keyless ? 0 : info.key_step);
         };
-
-        handlers_["DEL"] = [this](const Command &command) -> Response
+        std::string reply;
+        if (sub.empty())
         {
-            if (command.args.size() != 1)
-            {
-                return Response::Error("DEL command requires 1 argument");
-            }
-            const std::string &key = command.args[0];
-            if (store_.remove(key))
+            std::string entries;
+            size_t count = 0;
+            for (const CommandInfo &info : CommandTable::commands)
             {
-                return Response::Ok();
+                if (!available(info))
+                    continue;
+                append_info(entries, info);
+                ++count;
             }
-            return Response::Error("Key not found");
-        };
+            Response::append_array_header(reply, count);
+            reply += entries;
+            return Response::Encoded(std::move(reply));
+        }
+        Response::append_array_header(reply, command.args.size() - 1);
+        for (size_t i = 1; i < command.args.size(); ++i)
+        {
+            const CommandInfo *info = find_command(command.args[i]);
+            if (info && available(*info))
+                append_info(reply, *info);
+            else
+                Response::append_nil(reply);
+        }
+        return Response::Encoded(std::move(reply));
     }
 
-    void CommandDispatcher::registerListCommands()
+    Response CommandDispatcher::infoCommand(const Command &command)
     {
-        handlers_["LPUSH"] = [this](const Command &command) -> Response
+        if (!stats_)
+        {
+            return Response::Error("INFO is not available: statistics are disabled");
+        }
+        // Other shards publish theirs once per loop iteration.
+        shard_stats_->observe(store_);
+        std::vector<std::string> sections;
+        for (std::string_view arg : command.args)
         {
-            if (command.args.size() < 2)
+            std::string section(arg);
+            for (char &c : section)
             {
-                return Response::Error("LPUSH command requires at least 2 arguments");
+                c = std::tolower(static_cast<unsigned char>(c));
             }
-            const std::string &key = command.args[0];
-            for (size_t i = 1; i < command.args.size(); ++i)
+            if (section == "all" || section == "everything" || section == "default")
             {
-                if (!store_.lpush(key, command.args[i]))
-                {
-                    return Response::Error("Failed to push to list");
-                }
+                sections.clear();
+                break;
             }
-            return Response::Ok();
-        };
+            sections.push_back(std::move(section));
+        }
+        return Response::String(stats_->info(sections));
+    }
 
-        handlers_["RPUSH"] = [this](const Command &command) -> Response
+    Response CommandDispatcher::latencyCommand(const Command &command)
+    {
+        if (to_upper(command.args[0]) != "HISTOGRAM")
         {
-            if (command.args.size() < 2)
-            {
-                return Response::Error("RPUSH command requires at least 2 arguments");
-            }
-            const std::string &key = command.args[0];
-            for (size_t i = 1; i < command.args.size(); ++i)
+            return Response::Error("LATENCY supports only HISTOGRAM [command ...]");
+        }
+        if (!stats_)
+        {
+            return Response::Error("LATENCY is not available: statistics are disabled");
+        }
+        std::vector<size_t> selected;
+        if (command.args.size() == 1)
+        {
+            for (size_t i = 0; i < CommandTable::count; ++i)
             {
-                if (!store_.rpush(key, command.args[i]))
-                {
-                    return Response::Error("Failed to push to list");
-                }
+                selected.push_back(i);
             }
-            return Response::Ok();
-        };
-
-        handlers_["LPOP"] = [this](const Command &command) -> Response
+        }
+        for (size_t i = 1; i < command.args.size(); ++i)
+        {
+            if (const CommandInfo *info = find_command(command.args[i]))
+                selected.push_back(info - CommandTable::commands);
+        }
+        // As in Redis: per command its call count and a cumulative histogram
+        // over power-of-two microsecond buckets.
+        double rate = ticks_per_usec();
+        std::string reply;
+        std::string entries;
+        size_t count = 0;
+        for (size_t index : selected)
         {
-            if (command.args.size() != 1)
+            LatencyHistogram histogram;
+            stats_->command_latency(index, histogram);
+            if (histogram.count() == 0)
+                continue;
+            std::vector<std::pair<uint64_t, uint64_t>> buckets;
+            uint64_t seen = 0;
+            histogram.for_each_bucket([&](uint64_t upper, uint64_t n)
+                                      {
+                                          uint64_t usec = static_cast<uint64_t>(upper / rate);
+                                          uint64_t bucket = usec < 2 ? 1 : uint64_t(1) << (64 - __builtin_clzll(usec - 1));
+                                          seen += n;
+                                          if (!buckets.empty() && buckets.back().first == bucket)
+                                              buckets.back().second = seen;
+                                          else
+                                              buckets.emplace_back(bucket, seen); });
+            std::string name(CommandTable::commands[index].name);
+            for (char &c : name)
             {
-                return Response::Error("LPOP command requires 1 argument");
+                c = std::tolower(static_cast<unsigned char>(c));
             }
-            const std::string &key = command.args[0];
-            auto result = store_.lpop(key);
-            if (result)
+            Response::append_bulk(entries, name);
+            Response::append_array_header(entries, 4);
+            Response::append_bulk(entries, "calls");
+            Response::append_integer(entries, histogram.count());
+            Response::append_bulk(entries, "histogram_usec");
+            Response::append_array_header(entries, 2 * buckets.size());
+            for (auto [bucket, cumulative] : buckets)
             {
-                return Response::String(*result);
+                Response::append_integer(entries, bucket);
+                Response::append_integer(entries, cumulative);
             }
-            return Response::Nil();
-        };
+            ++count;
+        }
+        Response::append_array_header(reply, 2 * count);
+        reply += entries;
+        return Response::Encoded(std::move(reply));
+    }
 
-        handlers_["RPOP"] = [this](const Command &command) -> Response
+    Response CommandDispatcher::slowlogCommand(const Command &command)
+    {
+        if (!slowlog_)
+        {
+            return Response::Error("SLOWLOG is not available: no slow log configured");
+        }
+        std::string sub = to_upper(command.args[0]);
+        if (sub == "LEN" && command.args.size() == 1)
+        {
+            return Response::Integer(slowlog_->len());
+        }
+        else if (sub == "RESET" && command.args.size() == 1)
+        {
+            slowlog_->reset();
+            return Response::Ok();
+        }
+        else if (sub == "GET" && command.args.size() <= 2)
         {
-            if (command.args.size() != 1)
+            int64_t count = 10;
+            if (command.args.size() == 2 && (!parse_int(command.args[1], count) || count < -1))
             {
-                return Response::Error("RPOP command requires 1 argument");
+                return Response::Error("count should be greater than or equal to -1");
             }
-            const std::string &key = command.args[0];
-            auto result = store_.rpop(key);
-            if (result)
+            // As in Redis: id, unix time, microseconds, arguments, client
+            // address and client name, which is always empty here.
+            std::vector<SlowLog::Entry> entries = slowlog_->get(count);
+            std::string reply;
+            Response::append_array_header(reply, entries.size());
+            for (const SlowLog::Entry &entry : entries)
             {
-                return Response::String(*result);
+                Response::append_array_header(reply, 6);
+                Response::append_integer(reply, entry.id);
+                Response::append_integer(reply, entry.time);
+                Response::append_integer(reply, entry.duration_usec);
+                Response::append_array_header(reply, entry.argv.size());
+                for (const std::string &arg : entry.argv)
+                {
+                    Response::append_bulk(reply, arg);
+                }
+                Response::append_bulk(reply, entry.client);
+                Response::append_bulk(reply, "");
             }
-            return Response::Nil();
-        };
+            return Response::Encoded(std::move(reply));
+        }
+        return Response::Error("SLOWLOG supports only GET [count], LEN or RESET");
+    }
 
-        handlers_["LLEN"] = [this](const Command &command) -> Response
+    Response CommandDispatcher::watchCommand(const Command &command)
+    {
+        auto &watched = watches_[command.client_id];
+        for (std::string_view key : command.args)
         {
-            if (command.args.size() != 1)
-            {
-                return Response::Error("LLEN command requires 1 argument");
-            }
-            const std::string &key = command.args[0];
-            auto result = store_.llen(key);
-            if (result)
+            watched.emplace_back(std::string(key), store_.watch(key));
+        }
+        return Response::Ok();
+    }
+
+    Response CommandDispatcher::unwatchCommand(const Command &command)
+    {
+        unwatch_all(command.client_id);
+        return Response::Ok();
+    }
+
+    // MULTI and DISCARD act on the connection and are answered by the TCP
+    // server; they are in the table for COMMAND and the queue-time checks.
+    Response CommandDispatcher::multiCommand(const Command &)
+    {
+        return Response::Error("MULTI is only available to client connections");
+    }
+
+    Response CommandDispatcher::discardCommand(const Command &)
+    {
+        return Response::Error("DISCARD is only available to client connections");
+    }
+
+    // MULTI and the queueing live in the TCP server, which sends the queued
+    // commands here as one EXEC whose arguments hold each command's word
+    // count followed by its name and arguments. They run back to back, so
+    // nothing else on the shard sees the keys in between, and the replies
+    // are encoded as they come because each dispatch resets the arena.
+    Response CommandDispatcher::execCommand(const Command &command)
+    {
+        std::vector<Command> batch;
+        bool valid = true;
+        for (size_t i = 0; i < command.args.size();)
+        {
+            size_t words;
+            if (!parse_int(command.args[i], words) || words == 0 || words > command.args.size() - i - 1)
             {
-                return Response::Integer(*result);
+                unwatch_all(command.client_id);
+                return Response::Error("malformed EXEC batch");
             }
-            return Response::Integer(0);
-        };
+            Command &queued = batch.emplace_back();
+            queued.name = command.args[i + 1];
+            queued.args.assign(command.args.begin() + i + 2, command.args.begin() + i + 1 + words);
+            queued.client = command.client;
+            queued.client_id = command.client_id;
+            const CommandInfo *info = find_command(queued.name);
+            valid &= info && available(*info) && arity_matches(*info, words);
+            i += words + 1;
+        }
+        bool changed = unwatch_all(command.client_id);
+        if (!valid)
+            return Response::Encoded("-EXECABORT Transaction discarded because of previous errors.\r\n");
+        if (changed)
+            return Response::Encoded("*-1\r\n");
+        std::string reply;
+        Response::append_array_header(reply, batch.size());
+        for (const Command &queued : batch)
+        {
+            execute(queued, false).write_resp(reply);
+        }
+        return Response::Encoded(std::move(reply));
+    }
+
+    Response CommandDispatcher::evalCommand(const Command &command)
+    {
+        if (!scripts_)
+        {
+            return Response::Error("scripting is not available: no script cache configured");
+        }
+        std::string sha;
+        std::string error;
+        std::shared_ptr<const Script> script = scripts_->load(command.args[0], sha, error);
+        if (!script)
+        {
+            return Response::Error("Error compiling script: " + error);
+        }
+        return evalGenericCommand(command, *script);
+    }
+
+    Response CommandDispatcher::evalshaCommand(const Command &command)
+    {
+        if (!scripts_)
+        {
+            return Response::Error("scripting is not available: no script cache configured");
+        }
+        std::shared_ptr<const Script> script = scripts_->find(command.args[0]);
+        if (!script)
+        {
+            return Response::Encoded("-NOSCRIPT No matching script. Please use EVAL.\r\n");
+        }
+        return evalGenericCommand(command, *script);
+    }
 
-        handlers_["LRANGE"] = [this](const Command &command) -> Response
+    // The script's commands go through execute() one by one on this shard,
+    // so nothing else runs in between and each write reaches the write
+    // listeners on its own, as Redis replicates script effects. Keys owned
+    // by another shard are refused.
+    Response CommandDispatcher::evalGenericCommand(const Command &command, const Script &script)
+    {
+        int64_t numkeys;
+        if (!parse_int(command.args[1], numkeys))
+        {
+            return Response::Error("value is not an integer or out of range");
+        }
+        if (numkeys < 0)
         {
-            if (command.args.size() != 3)
+            return Response::Error("Number of keys can't be negative");
+        }
+        if (static_cast<size_t>(numkeys) > command.args.size() - 2)
+        {
+            return Response::Error("Number of keys can't be greater than number of args");
+        }
+        std::vector<std::string_view> keys(command.args.begin() + 2, command.args.begin() + 2 + numkeys);
+        std::vector<std::string_view> argv(command.args.begin() + 2 + numkeys, command.args.end());
+        auto call = [this, &command](const Command &sub)
+        {
+            const CommandInfo *info = find_command(sub.name);
+            if (info && (info->flags & CMD_NOSCRIPT))
             {
-                return Response::Error("LRANGE command requires 3 arguments");
+                return Response::Error("This command is not allowed from scripts");
             }
-            const std::string &key = command.args[0];
-            int start = std::stoi(command.args[1]);
-            int end = std::stoi(command.args[2]);
-            auto result = store_.lrange(key, start, end);
-            if (result)
+            if (shards_ > 1)
             {
-                std::vector<std::string> arr(result->begin(), result->end());
-                return Response::Array(arr);
+                int shard = route(sub, shards_);
+                if (shard != ROUTE_LOCAL && shard != static_cast<int>(shard_))
+                {
+                    return Response::Error("Script attempted to access keys of another shard");
+                }
             }
-            return Response::Error("Key is not a list");
+            Command forwarded = sub;
+            forwarded.client = command.client;
+            forwarded.client_id = command.client_id;
+            return execute(forwarded, false);
         };
+        return script.run(keys, argv, call, scripts_->time_limit());
     }
 
-    void CommandDispatcher::registerSetCommands()
+    Response CommandDispatcher::scriptCommand(const Command &command)
     {
-        handlers_["SADD"] = [this](const Command &command) -> Response
+        if (!scripts_)
         {
-            if (command.args.size() < 2)
+            return Response::Error("scripting is not available: no script cache configured");
+        }
+        std::string sub = to_upper(command.args[0]);
+        if (sub == "LOAD" && command.args.size() == 2)
+        {
+            std::string sha;
+            std::string error;
+            if (!scripts_->load(command.args[1], sha, error))
             {
-                return Response::Error("SADD command requires at least 2 arguments");
+                return Response::Error("Error compiling script: " + error);
             }
-            const std::string &key = command.args[0];
+            return Response::String(sha);
+        }
+        else if (sub == "EXISTS" && command.args.size() >= 2)
+        {
+            std::string reply;
+            Response::append_array_header(reply, command.args.size() - 1);
             for (size_t i = 1; i < command.args.size(); ++i)
             {
-                if (!store_.sadd(key, command.args[i]))
-                {
-                    return Response::Error("Failed to add to set");
-                }
+                Response::append_integer(reply, scripts_->find(command.args[i]) ? 1 : 0);
             }
+            return Response::Encoded(std::move(reply));
+        }
+        else if (sub == "FLUSH" && command.args.size() <= 2)
+        {
+            scripts_->flush();
             return Response::Ok();
-        };
+        }
+        return Response::Error("SCRIPT supports only LOAD script, EXISTS sha [sha ...] or FLUSH");
+    }
+
+    bool CommandDispatcher::unwatch_all(uint64_t client_id)
+    {
+        auto it = watches_.find(client_id);
+        if (it == watches_.end())
+            return false;
+        bool changed = false;
+        for (const auto &[key, version] : it->second)
+        {
+            changed |= store_.version(key) != version;
+            store_.unwatch(key);
+        }
+        watches_.erase(it);
+        return changed;
+    }
+
+    const CommandDispatcher::CommandInfo *CommandDispatcher::find_command(std::string_view name)
+    {
+        uint8_t slot = CommandTable::index.slots[command_hash(name, CommandTable::index.seed) % COMMAND_SLOTS];
+        if (slot == NO_COMMAND)
+        {
+            return nullptr;
+        }
+        const CommandInfo &info = CommandTable::commands[slot];
+        if (info.name.size() != name.size())
+        {
+            return nullptr;
+        }
+        for (size_t i = 0; i < name.size(); ++i)
+        {
+            if (upper(name[i]) != info.name[i])
+                return nullptr;
+        }
+        return &info;
+    }
+
+    size_t CommandDispatcher::command_count()
+    {
+        return CommandTable::count;
+    }
+
+    const CommandDispatcher::CommandInfo &CommandDispatcher::command_at(size_t index)
+    {
+        return CommandTable::commands[index];
+    }
+
+    void CommandDispatcher::set_shard(size_t shard, size_t shards)
+    {
+        shard_ = shard;
+        shards_ = std::max<size_t>(shards, 1);
+    }
+
+    void CommandDispatcher::set_stats(ServerStats *stats, size_t shard)
+    {
+        stats_ = stats;
+        shard_stats_ = stats ? &stats->shard(shard) : nullptr;
+    }
+
+    void CommandDispatcher::set_scripts(ScriptCache *scripts)
+    {
+        scripts_ = scripts;
+    }
 
-        handlers_["SREM"] = [this](const Command &command) -> Response
+    void CommandDispatcher::set_slowlog(SlowLog *slowlog, size_t shard)
+    {
+        slowlog_ = slowlog;
+        slowlog_threshold_ = slowlog && slowlog->enabled() ? slowlog->threshold_ticks() : UINT64_MAX;
+        shard_ = shard;
+    }
+
+    bool CommandDispatcher::available(const CommandInfo &info) const
+    {
+        return info.handler || external_[&info - CommandTable::commands];
+    }
+
+    Response CommandDispatcher::dispatch(const Command &command)
+    {
+        return execute(command, false);
+    }
+
+    Response CommandDispatcher::replicate(const Command &command)
+    {
+        return execute(command, true);
+    }
+
+    std::string CommandDispatcher::check(const Command &command)
+    {
+        const CommandInfo *info = find_command(command.name);
+        if (!info)
+        {
+            return "Unknown command: " + to_upper(command.name);
+        }
+        if (!arity_matches(*info, command.args.size() + 1))
         {
-            if (command.args.size() < 2)
+            return "wrong number of arguments for '" + std::string(info->name) + "' command";
+        }
+        return "";
+    }
+
+    std::vector<CommandDispatcher::Part> CommandDispatcher::split(const Command &command, size_t shards)
+    {
+        const CommandInfo *info = find_command(command.name);
+        std::vector<Part> parts;
+        std::vector<size_t> part_of(shards, SIZE_MAX);
+        size_t first = static_cast<size_t>(info->first_key);
+        size_t last = info->last_key < 0 ? command.args.size() - 1 : std::min<size_t>(info->last_key, command.args.size() - 1);
+        size_t step = static_cast<size_t>(info->key_step);
+        size_t position = 0;
+        for (size_t i = first; i <= last; i += step, ++position)
+        {
+            size_t shard = shard_of(command.args[i], shards);
+            if (part_of[shard] == SIZE_MAX)
             {
-                return Response::Error("SREM command requires at least 2 arguments");
+                part_of[shard] = parts.size();
+                Part &part = parts.emplace_back();
+                part.shard = shard;
+                part.command.name = command.name;
+                part.command.client = command.client;
+                part.command.client_id = command.client_id;
+                part.command.args.assign(command.args.begin(), command.args.begin() + first);
             }
-            const std::string &key = command.args[0];
-            bool removed = false;
-            for (size_t i = 1; i < command.args.size(); ++i)
+            Part &part = parts[part_of[shard]];
+            auto group = command.args.begin() + i;
+            part.command.args.insert(part.command.args.end(), group, group + std::min(step, command.args.size() - i));
+            part.positions.push_back(position);
+        }
+        return parts;
+    }
+
+    std::string CommandDispatcher::merge(const CommandInfo &info, const std::vector<std::string> &replies,
+                                         const std::vector<std::vector<size_t>> &positions)
+    {
+        for (const std::string &reply : replies)
+        {
+            if (!reply.empty() && reply[0] == '-')
+                return reply;
+        }
+        std::string merged;
+        if (info.flags & CMD_SPLIT_SUM)
+        {
+            int64_t total = 0;
+            for (const std::string &reply : replies)
             {
-                if (store_.srem(key, command.args[i]))
-                {
-                    removed = true;
-                }
+                int64_t count;
+                if (reply.size() < 3 || reply[0] != ':' || !parse_int(std::string_view(reply).substr(1, reply.size() - 3), count))
+                    return "-ERR unexpected reply from a shard\r\n";
+                total += count;
             }
-            return removed ? Response::Ok() : Response::Error("Member not found in set");
-        };
-
-        handlers_["SISMEMBER"] = [this](const Command &command) -> Response
+            Response::append_integer(merged, total);
+            return merged;
+        }
+        if (info.flags & CMD_SPLIT_OK)
+        {
+            return replies.front();
+        }
+        std::vector<std::vector<std::string_view>> items(replies.size());
+        for (size_t i = 0; i < replies.size(); ++i)
         {
-            if (command.args.size() != 2)
+            if (!bulk_items(replies[i], items[i]))
+                return "-ERR unexpected reply from a shard\r\n";
+        }
+        std::vector<std::string_view> result;
+        if (info.flags & CMD_SPLIT_ORDERED)
+        {
+            for (const auto &keys : positions)
             {
-                return Response::Error("SISMEMBER command requires 2 arguments");
+                result.resize(result.size() + keys.size());
             }
-            const std::string &key = command.args[0];
-            const std::string &member = command.args[1];
-            auto set_opt = store_.sismember(key);
-            if (set_opt)
+            for (size_t i = 0; i < replies.size(); ++i)
             {
-                bool is_member = set_opt->find(member) != set_opt->end();
-                return Response::String(is_member ? "1" : "0");
+                if (items[i].size() != positions[i].size())
+                    return "-ERR unexpected reply from a shard\r\n";
+                for (size_t j = 0; j < items[i].size(); ++j)
+                {
+                    result[positions[i][j]] = items[i][j];
+                }
             }
-            return Response::Error("Key is not a set");
-        };
-
-        handlers_["SCARD"] = [this](const Command &command) -> Response
+        }
+        else
         {
-            if (command.args.size() != 1)
+            // Each shard intersected its own keys already. Equal items have
+            // equal headers, so whole items can be compared.
+            result = items.front();
+            for (size_t i = 1; i < items.size() && !result.empty(); ++i)
             {
-                return Response::Error("SCARD command requires 1 argument");
+                std::unordered_set<std::string_view> present(items[i].begin(), items[i].end());
+                result.erase(std::remove_if(result.begin(), result.end(), [&present](std::string_view item)
+                                            { return !present.count(item); }),
+                             result.end());
             }
-            const std::string &key = command.args[0];
-            auto result = store_.scard(key);
-            if (result)
+        }
+        Response::append_array_header(merged, result.size());
+        for (std::string_view item : result)
+        {
+            merged.append(item.data(), item.size());
+        }
+        return merged;
+    }
+
+    Response CommandDispatcher::execute(const Command &command, bool replicated)
+    {
+        arena_.reset();
+        const CommandInfo *info = find_command(command.name);
+        if (!info || !available(*info))
+        {
+            return Response::Error("Unknown command: " + to_upper(command.name));
+        }
+        ShardStats::CommandStats *stats = shard_stats_ ? &shard_stats_->commands[info - CommandTable::commands] : nullptr;
+        if (!arity_matches(*info, command.args.size() + 1))
+        {
+            if (stats)
+                stats->rejected.add(1);
+            return Response::Error("wrong number of arguments for '" + std::string(info->name) + "' command");
+        }
+        if (!replicated && (info->flags & CMD_WRITE) && read_only_ && read_only_->load(std::memory_order_relaxed))
+        {
+            if (stats)
+                stats->rejected.add(1);
+            return Response::Encoded("-READONLY You can't write against a read only replica.\r\n");
+        }
+        // A replica applies what its primary accepted, whatever its own limit.
+        if (!replicated && (info->flags & CMD_DENYOOM) && !store_.make_room())
+        {
+            if (stats)
+                stats->rejected.add(1);
+            return Response::Encoded("-OOM command not allowed when used memory > 'maxmemory'.\r\n");
+        }
+        bool timed = stats || slowlog_threshold_ != UINT64_MAX;
+        uint64_t started = timed ? ticks() : 0;
+        Response response = info->handler ? (this->*info->handler)(command) : external_[info - CommandTable::commands](command);
+        if (timed)
+        {
+            uint64_t elapsed = ticks() - started;
+            if (stats)
             {
-                return Response::String(std::to_string(*result));
+                stats->record(elapsed);
+                if (response.status == ResponseStatus::ERROR)
+                    stats->failed.add(1);
             }
-            return Response::Error("Key is not a set");
-        };
-
-        handlers_["SINTER"] = [this](const Command &command) -> Response
+            if (elapsed >= slowlog_threshold_)
+                slowlog_->record(shard_, command, elapsed);
+        }
+        if (!write_listeners_.empty() && response.status != ResponseStatus::ERROR && (info->flags & CMD_WRITE))
         {
-            if (command.args.size() != 2)
+            if (!propagate_)
             {
-                return Response::Error("SINTER command requires 2 arguments");
+                notify_write(command);
             }
-            const std::string &key1 = command.args[0];
-            const std::string &key2 = command.args[1];
-            auto result = store_.sinter(key1, key2);
-            if (result)
+            else if (!propagate_->empty())
             {
-                std::vector<std::string> arr(result->begin(), result->end());
-                return Response::Array(arr);
+                Command rewritten;
+                rewritten.name = propagate_->front();
+                rewritten.args.assign(propagate_->begin() + 1, propagate_->end());
+                notify_write(rewritten);
             }
-            return Response::Error("Keys are not sets");
-        };
+        }
+        propagate_.reset();
+        return response;
     }
 
-    Response CommandDispatcher::dispatch(const Command &command)
+    void CommandDispatcher::propagate_as(std::vector<std::string> argv)
+    {
+        propagate_ = std::move(argv);
+    }
+
+    void CommandDispatcher::notify_write(const Command &command)
+    {
+        for (const auto &listener : write_listeners_)
+        {
+            listener(command);
+        }
+    }
+
+    void CommandDispatcher::add_command(std::string_view name, CommandHandler handler)
+    {
+        const CommandInfo *info = find_command(name);
+        if (!info || info->handler)
+        {
+            throw std::invalid_argument("not an external command: " + std::string(name));
+        }
+        external_[info - CommandTable::commands] = std::move(handler);
+    }
+
+    void CommandDispatcher::add_write_listener(WriteListener listener)
+    {
+        write_listeners_.push_back(std::move(listener));
+    }
+
+    int CommandDispatcher::route(const Command &command, size_t shards) const
     {
-        auto it = handlers_.find(command.name);
-        if (it != handlers_.end())
+        const CommandInfo *info = find_command(command.name);
+        if (info && (info->flags & CMD_ALL_SHARDS) && shards > 1)
+        {
+            return ROUTE_ALL_SHARDS;
+        }
+        uint64_t cursor;
+        if (info && (info->flags & CMD_SHARD_CURSOR) && !command.args.empty() && parse_int(command.args[0], cursor))
+        {
+            return static_cast<int>(cursor % shards);
+        }
+        if (!info || info->first_key < 0 || command.args.empty())
+        {
+            return ROUTE_LOCAL;
+        }
+        int first = info->first_key;
+        int last = info->last_key < 0 ? static_cast<int>(command.args.size()) - 1 : info->last_key;
+        if (info->flags & CMD_NUMKEYS)
         {
-            return it->second(command);
+            // A bad count is left to the handler to report.
+            size_t numkeys;
+            if (first >= static_cast<int>(command.args.size()) || !parse_int(command.args[first], numkeys) ||
+                numkeys > command.args.size())
+            {
+                return ROUTE_LOCAL;
+            }
+            last = first + static_cast<int>(numkeys);
+            ++first;
+        }
+        if (last >= static_cast<int>(command.args.size()))
+        {
+            last = static_cast<int>(command.args.size()) - 1;
+        }
+        int shard = ROUTE_LOCAL;
+        for (int i = first; i <= last; i += info->key_step)
+        {
+            int key_shard = static_cast<int>(shard_of(command.args[i], shards));
+            if (shard != ROUTE_LOCAL && shard != key_shard)
+            {
+                return ROUTE_CROSS_SHARD;
+            }
+            shard = key_shard;
         }
-        return Response::Error("Unknown command: " + command.name);
+        return shard;
     }
 }
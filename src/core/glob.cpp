@@ -0,0 +1,96 @@
+#include "core/glob.hpp"
+#include <utility>
+
+namespace core
+{
+    namespace
+    {
+        // Matches c against the class whose body starts at p, just past the
+        // '[', and moves p past the closing ']'.
+        bool match_class(std::string_view pattern, size_t &p, char c)
+        {
+            bool negate = p < pattern.size() && pattern[p] == '^';
+            if (negate)
+                ++p;
+            bool matched = false;
+            while (p < pattern.size() && pattern[p] != ']')
+            {
+                if (pattern[p] == '\\' && p + 1 < pattern.size())
+                {
+                    matched |= pattern[p + 1] == c;
+                    p += 2;
+                }
+                else if (p + 2 < pattern.size() && pattern[p + 1] == '-' && pattern[p + 2] != ']')
+                {
+                    unsigned char low = pattern[p];
+                    unsigned char high = pattern[p + 2];
+                    if (low > high)
+                        std::swap(low, high);
+                    unsigned char value = c;
+                    matched |= value >= low && value <= high;
+                    p += 3;
+                }
+                else
+                {
+                    matched |= pattern[p] == c;
+                    ++p;
+                }
+            }
+            if (p < pattern.size())
+                ++p;
+            return matched != negate;
+        }
+    }
+
+    bool glob_match(std::string_view pattern, std::string_view text)
+    {
+        size_t p = 0;
+        size_t t = 0;
+        size_t star = std::string_view::npos;
+        size_t star_text = 0;
+        while (t < text.size())
+        {
+            if (p < pattern.size())
+            {
+                char c = pattern[p];
+                if (c == '*')
+                {
+                    while (p < pattern.size() && pattern[p] == '*')
+                        ++p;
+                    if (p == pattern.size())
+                        return true;
+                    star = p;
+                    star_text = t;
+                    continue;
+                }
+                size_t next = p + 1;
+                bool matched;
+                if (c == '?')
+                    matched = true;
+                else if (c == '[')
+                    matched = match_class(pattern, next, text[t]);
+                else if (c == '\\' && p + 1 < pattern.size())
+                {
+                    matched = pattern[p + 1] == text[t];
+                    next = p + 2;
+                }
+                else
+                    matched = c == text[t];
+                if (matched)
+                {
+                    p = next;
+                    ++t;
+                    continue;
+                }
+            }
+            // Let the last star absorb one more character and retry.
+            if (star == std::string_view::npos)
+                return false;
+            p = star;
+            t = ++star_text;
+        }
+        while (p < pattern.size() && pattern[p] == '*')
+            ++p;
+        return p == pattern.size();
+    }
+}
@@ -0,0 +1,276 @@
+#include "core/hash.hpp"
+#include "core/value.hpp"
+#include <algorithm>
+
+namespace core
+{
+    namespace
+    {
+        size_t max_listpack_entries = 128;
+        size_t max_listpack_value = 64;
+
+        size_t put_length(char *p, size_t n)
+        {
+            size_t size = 0;
+            while (n >= 0x80)
+            {
+                p[size++] = static_cast<char>(n | 0x80);
+                n >>= 7;
+            }
+            p[size++] = static_cast<char>(n);
+            return size;
+        }
+
+        size_t length_size(size_t n)
+        {
+            size_t size = 1;
+            for (; n >= 0x80; n >>= 7)
+                ++size;
+            return size;
+        }
+
+        size_t get_length(const char *p, size_t &n)
+        {
+            n = 0;
+            for (size_t i = 0, shift = 0;; ++i, shift += 7)
+            {
+                uint8_t byte = static_cast<uint8_t>(p[i]);
+                n |= static_cast<size_t>(byte & 0x7f) << shift;
+                if (!(byte & 0x80))
+                    return i + 1;
+            }
+        }
+
+        // Reads the length-prefixed string at offset and moves offset past it.
+        std::string_view read_item(const std::string &bytes, size_t &offset)
+        {
+            size_t len;
+            size_t header = get_length(bytes.data() + offset, len);
+            std::string_view item(bytes.data() + offset + header, len);
+            offset += header + len;
+            return item;
+        }
+
+        void append_item(std::string &bytes, std::string_view item)
+        {
+            char header[10];
+            bytes.append(header, put_length(header, item.size()));
+            bytes.append(item);
+        }
+
+        // std::string doubles its capacity when it grows; small hashes are
+        // many and rarely grow again, so grow by a quarter instead.
+        void grow(std::string &bytes, size_t extra)
+        {
+            size_t need = bytes.size() + extra;
+            if (need <= bytes.capacity())
+                return;
+            std::string grown;
+            grown.reserve(std::max(need, bytes.capacity() + bytes.capacity() / 4));
+            grown.append(bytes);
+            bytes.swap(grown);
+        }
+
+        size_t table_item_size(std::string_view field, std::string_view value)
+        {
+            return string_heap_size(field) + string_heap_size(value);
+        }
+    }
+
+    void Hash::configure(size_t listpack_entries, size_t listpack_value)
+    {
+        max_listpack_entries = listpack_entries;
+        max_listpack_value = listpack_value;
+    }
+
+    Hash::Hash() : data_(Listpack{}) {}
+
+    size_t Hash::size() const
+    {
+        if (kind() == Kind::LISTPACK)
+            return std::get<Listpack>(data_).count;
+        return std::get<Table>(data_).size();
+    }
+
+    size_t Hash::memory_usage() const
+    {
+        size_t total = heap_size(sizeof(Hash));
+        if (kind() == Kind::LISTPACK)
+        {
+            const std::string &bytes = std::get<Listpack>(data_).bytes;
+            return total + (bytes.capacity() > 15 ? heap_size(bytes.capacity() + 1) : 0);
+        }
+        return total + table_bytes_ + std::get<Table>(data_).table_bytes();
+    }
+
+    bool Hash::listpack_find(std::string_view field, size_t &offset, size_t &value_offset) const
+    {
+        const std::string &bytes = std::get<Listpack>(data_).bytes;
+        size_t pos = 0;
+        while (pos < bytes.size())
+        {
+            size_t start = pos;
+            if (read_item(bytes, pos) == field)
+            {
+                offset = start;
+                value_offset = pos;
+                return true;
+            }
+            read_item(bytes, pos);
+        }
+        return false;
+    }
+
+    void Hash::to_table()
+    {
+        Listpack listpack = std::move(std::get<Listpack>(data_));
+        Table &table = data_.emplace<Table>();
+        table.reserve(listpack.count);
+        table_bytes_ = 0;
+        for (size_t offset = 0; offset < listpack.bytes.size();)
+        {
+            std::string_view field = read_item(listpack.bytes, offset);
+            std::string_view value = read_item(listpack.bytes, offset);
+            table.insert(field, std::string(value));
+            table_bytes_ += table_item_size(field, value);
+        }
+    }
+
+    bool Hash::set(std::string_view field, std::string_view value)
+    {
+        if (kind() == Kind::LISTPACK)
+        {
+            Listpack &listpack = std::get<Listpack>(data_);
+            size_t offset, value_offset;
+            bool found = listpack_find(field, offset, value_offset);
+            if (value.size() <= max_listpack_value &&
+                (found || (listpack.count < max_listpack_entries && field.size() <= max_listpack_value)))
+            {
+                if (found)
+                {
+                    size_t end = value_offset;
+                    read_item(listpack.bytes, end);
+                    std::string item;
+                    append_item(item, value);
+                    if (item.size() > end - value_offset)
+                        grow(listpack.bytes, item.size() - (end - value_offset));
+                    listpack.bytes.replace(value_offset, end - value_offset, item);
+                    return false;
+                }
+                grow(listpack.bytes, length_size(field.size()) + field.size() + length_size(value.size()) + value.size());
+                append_item(listpack.bytes, field);
+                append_item(listpack.bytes, value);
+                listpack.count++;
+                return true;
+            }
+            to_table();
+        }
+        Table &table = std::get<Table>(data_);
+        auto [entry, inserted] = table.insert(field, std::string());
+        if (!inserted)
+            table_bytes_ -= string_heap_size(entry->value);
+        entry->value.assign(value);
+        table_bytes_ += inserted ? table_item_size(field, value) : string_heap_size(value);
+        return inserted;
+    }
+
+    bool Hash::remove(std::string_view field)
+    {
+        if (kind() == Kind::LISTPACK)
+        {
+            Listpack &listpack = std::get<Listpack>(data_);
+            size_t offset, end;
+            if (!listpack_find(field, offset, end))
+                return false;
+            read_item(listpack.bytes, end);
+            listpack.bytes.erase(offset, end - offset);
+            listpack.count--;
+            return true;
+        }
+        Table &table = std::get<Table>(data_);
+        auto *entry = table.find(field);
+        if (!entry)
+            return false;
+        table_bytes_ -= table_item_size(field, entry->value);
+        table.erase(field);
+        return true;
+    }
+
+    std::optional<std::string_view> Hash::get(std::string_view field) const
+    {
+        if (kind() == Kind::LISTPACK)
+        {
+            size_t offset, value_offset;
+            if (!listpack_find(field, offset, value_offset))
+                return std::nullopt;
+            return read_item(std::get<Listpack>(data_).bytes, value_offset);
+        }
+        auto *entry = std::get<Table>(data_).find(field);
+        if (!entry)
+            return std::nullopt;
+        return std::string_view(entry->value);
+    }
+
+    Hash::const_iterator Hash::begin() const
+    {
+        const_iterator it;
+        it.hash_ = this;
+        if (kind() == Kind::HASHTABLE)
+            it.entry_ = std::get<Table>(data_).next(it.position_);
+        return it;
+    }
+
+    Hash::const_iterator Hash::end() const
+    {
+        const_iterator it;
+        it.hash_ = this;
+        it.index_ = size();
+        return it;
+    }
+
+    std::string_view Hash::const_iterator::field() const
+    {
+        if (hash_->kind() == Kind::HASHTABLE)
+            return entry_->key;
+        size_t offset = offset_;
+        return read_item(std::get<Listpack>(hash_->data_).bytes, offset);
+    }
+
+    std::string_view Hash::const_iterator::value() const
+    {
+        if (hash_->kind() == Kind::HASHTABLE)
+            return entry_->value;
+        const std::string &bytes = std::get<Listpack>(hash_->data_).bytes;
+        size_t offset = offset_;
+        read_item(bytes, offset);
+        return read_item(bytes, offset);
+    }
+
+    Hash::const_iterator &Hash::const_iterator::operator++()
+    {
+        if (hash_->kind() == Kind::HASHTABLE)
+        {
+            entry_ = std::get<Table>(hash_->data_).next(position_);
+        }
+        else
+        {
+            const std::string &bytes = std::get<Listpack>(hash_->data_).bytes;
+            read_item(bytes, offset_);
+            read_item(bytes, offset_);
+        }
+        ++index_;
+        return *this;
+    }
+
+    size_t Hash::scan(size_t cursor, const std::function<void(std::string_view field, std::string_view value)> &visit) const
+    {
+        if (kind() == Kind::HASHTABLE)
+            return std::get<Table>(data_).scan(cursor, [&visit](const Table::Entry &entry)
+                                               { visit(entry.key, entry.value); });
+        for (auto it = begin(); it != end(); ++it)
+        {
+            visit(it.field(), it.value());
+        }
+        return 0;
+    }
+}
@@ -0,0 +1,92 @@
+#include "core/lazy_free.hpp"
+#include "core/value.hpp"
+#include "net/spsc_queue.hpp"
+
+namespace core
+{
+    namespace
+    {
+        const size_t QUEUE_CAPACITY = 1024;
+    }
+
+    struct LazyFree::Queue
+    {
+        net::SpscQueue<std::unique_ptr<Value>> values{QUEUE_CAPACITY};
+    };
+
+    LazyFree::LazyFree(size_t shards)
+    {
+        for (size_t i = 0; i < shards; ++i)
+        {
+            queues_.push_back(std::make_unique<Queue>());
+        }
+        thread_ = std::thread(&LazyFree::run, this);
+    }
+
+    LazyFree::~LazyFree()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stop_ = true;
+        }
+        wake_cv_.notify_one();
+        thread_.join();
+    }
+
+    void LazyFree::release(size_t shard, Value &&value)
+    {
+        if (value.free_effort() <= THRESHOLD)
+        {
+            Value dropped(std::move(value));
+            return;
+        }
+        auto detached = std::make_unique<Value>(std::move(value));
+        if (!queues_[shard]->values.try_push(detached))
+            return;
+        // Pairs with the thread storing sleeping_ before it reads queued_:
+        // either it sees this value or this sees it asleep.
+        queued_.fetch_add(1);
+        if (sleeping_.load())
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            wake_ = true;
+            wake_cv_.notify_one();
+        }
+    }
+
+    uint64_t LazyFree::pending() const
+    {
+        uint64_t freed = freed_.load(std::memory_order_relaxed);
+        uint64_t queued = queued_.load(std::memory_order_relaxed);
+        return queued > freed ? queued - freed : 0;
+    }
+
+    void LazyFree::run()
+    {
+        std::unique_ptr<Value> value;
+        while (true)
+        {
+            bool found = false;
+            for (const auto &queue : queues_)
+            {
+                while (queue->values.try_pop(value))
+                {
+                    value.reset();
+                    freed_.fetch_add(1, std::memory_order_relaxed);
+                    found = true;
+                }
+            }
+            if (found)
+                continue;
+            std::unique_lock<std::mutex> lock(mutex_);
+            if (stop_)
+                return;
+            sleeping_.store(true);
+            if (queued_.load() == freed_.load(std::memory_order_relaxed))
+                wake_cv_.wait(lock, [this]
+                              { return wake_ || stop_; });
+            sleeping_.store(false, std::memory_order_relaxed);
+            wake_ = false;
+        }
+    }
+}
@@ -0,0 +1,401 @@
+#include "core/quicklist.hpp"
+#include "core/value.hpp"
+#include "persist/lzf.hpp"
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+
+namespace core
+{
+    namespace
+    {
+        size_t max_node_bytes = 8 * 1024;
+        size_t compress_depth = 0;
+
+        // Nodes smaller than this are not worth compressing.
+        const size_t MIN_COMPRESS_BYTES = 48;
+        const size_t MIN_CAPACITY = 64;
+
+        size_t varint_size(uint32_t n)
+        {
+            size_t size = 1;
+            while (n >= 0x80)
+            {
+                n >>= 7;
+                ++size;
+            }
+            return size;
+        }
+
+        char *put_varint(char *p, uint32_t n)
+        {
+            while (n >= 0x80)
+            {
+                *p++ = static_cast<char>(n | 0x80);
+                n >>= 7;
+            }
+            *p++ = static_cast<char>(n);
+            return p;
+        }
+
+        const char *get_varint(const char *p, uint32_t &n)
+        {
+            n = 0;
+            for (int shift = 0;; shift += 7)
+            {
+                uint8_t byte = static_cast<uint8_t>(*p++);
+                n |= static_cast<uint32_t>(byte & 0x7f) << shift;
+                if (!(byte & 0x80))
+                    return p;
+            }
+        }
+
+        // backlen is a varint stored back to front: the byte just before the
+        // next entry holds the lowest seven bits.
+        char *put_backlen(char *p, uint32_t n)
+        {
+            size_t size = varint_size(n);
+            for (size_t i = size; i-- > 0;)
+            {
+                p[i] = static_cast<char>((n & 0x7f) | (i > 0 ? 0x80 : 0));
+                n >>= 7;
+            }
+            return p + size;
+        }
+
+        uint32_t get_backlen(const char *end, size_t &size)
+        {
+            uint32_t n = 0;
+            size = 0;
+            for (int shift = 0;; shift += 7)
+            {
+                uint8_t byte = static_cast<uint8_t>(*--end);
+                ++size;
+                n |= static_cast<uint32_t>(byte & 0x7f) << shift;
+                if (!(byte & 0x80))
+                    return n;
+            }
+        }
+
+        size_t entry_size(size_t len)
+        {
+            size_t body = varint_size(static_cast<uint32_t>(len)) + len;
+            return body + varint_size(static_cast<uint32_t>(body));
+        }
+
+        void encode_entry(char *p, std::string_view item)
+        {
+            char *start = p;
+            p = put_varint(p, static_cast<uint32_t>(item.size()));
+            std::memcpy(p, item.data(), item.size());
+            p += item.size();
+            put_backlen(p, static_cast<uint32_t>(p - start));
+        }
+
+        std::string_view decode_entry(const char *p, size_t &size)
+        {
+            uint32_t len;
+            const char *body = get_varint(p, len);
+            size = entry_size(len);
+            return std::string_view(body, len);
+        }
+
+        size_t block_size(size_t capacity)
+        {
+            return capacity ? heap_size(capacity) : 0;
+        }
+    }
+
+    void Quicklist::configure(size_t node_bytes, size_t depth)
+    {
+        max_node_bytes = std::max<size_t>(node_bytes, MIN_CAPACITY);
+        compress_depth = depth;
+    }
+
+    Quicklist::Quicklist() : bytes_(heap_size(sizeof(Quicklist))) {}
+
+    Quicklist::~Quicklist()
+    {
+        Node *node = head_;
+        while (node)
+        {
+            Node *next = node->next;
+            std::free(node->data);
+            delete node;
+            node = next;
+        }
+    }
+
+    bool Quicklist::fits(const Node *node, size_t entry_bytes) const
+    {
+        return node && (node->count == 0 || node->bytes + entry_bytes <= max_node_bytes);
+    }
+
+    Quicklist::Node *Quicklist::add_node(bool front)
+    {
+        Node *node = new Node();
+        if (front)
+        {
+            node->next = head_;
+            if (head_)
+                head_->prev = node;
+            head_ = node;
+            if (!tail_)
+                tail_ = node;
+        }
+        else
+        {
+            node->prev = tail_;
+            if (tail_)
+                tail_->next = node;
+            tail_ = node;
+            if (!head_)
+                head_ = node;
+        }
+        ++nodes_;
+        bytes_ += heap_size(sizeof(Node));
+        update_compression();
+        return node;
+    }
+
+    void Quicklist::remove_node(Node *node)
+    {
+        (node->prev ? node->prev->next : head_) = node->next;
+        (node->next ? node->next->prev : tail_) = node->prev;
+        bytes_ -= heap_size(sizeof(Node)) + block_size(node->capacity);
+        std::free(node->data);
+        delete node;
+        --nodes_;
+        update_compression();
+    }
+
+    void Quicklist::reserve(Node *node, size_t bytes)
+    {
+        if (bytes <= node->capacity)
+            return;
+        size_t capacity = std::max<size_t>({bytes, MIN_CAPACITY, std::min<size_t>(node->capacity * 2, max_node_bytes)});
+        char *data = static_cast<char *>(std::realloc(node->data, capacity));
+        if (!data)
+            throw std::bad_alloc();
+        bytes_ += block_size(capacity) - block_size(node->capacity);
+        node->data = data;
+        node->capacity = static_cast<uint32_t>(capacity);
+    }
+
+    // Gives back memory once a node has drained to a quarter of its block.
+    void Quicklist::shrink(Node *node)
+    {
+        if (node->capacity <= MIN_CAPACITY || node->bytes > node->capacity / 4)
+            return;
+        size_t capacity = std::max<size_t>(node->bytes * 2, MIN_CAPACITY);
+        char *data = static_cast<char *>(std::realloc(node->data, capacity));
+        if (!data)
+            return;
+        bytes_ -= block_size(node->capacity) - block_size(capacity);
+        node->data = data;
+        node->capacity = static_cast<uint32_t>(capacity);
+    }
+
+    void Quicklist::compress(Node *node)
+    {
+        if (node->compressed || node->incompressible || node->bytes < MIN_COMPRESS_BYTES)
+            return;
+        // Only worth it if it saves at least an eighth.
+        size_t limit = node->bytes - node->bytes / 8;
+        char *out = static_cast<char *>(std::malloc(limit));
+        if (!out)
+            return;
+        size_t size = persist::lzf_compress(reinterpret_cast<const uint8_t *>(node->data), node->bytes,
+                                            reinterpret_cast<uint8_t *>(out), limit);
+        if (size == 0)
+        {
+            std::free(out);
+            node->incompressible = true;
+            return;
+        }
+        std::free(node->data);
+        char *data = static_cast<char *>(std::realloc(out, size));
+        bytes_ += block_size(size) - block_size(node->capacity);
+        node->data = data ? data : out;
+        node->capacity = static_cast<uint32_t>(size);
+        node->raw_bytes = node->bytes;
+        node->bytes = static_cast<uint32_t>(size);
+        node->compressed = true;
+    }
+
+    void Quicklist::decompress(Node *node)
+    {
+        if (!node->compressed)
+            return;
+        char *data = static_cast<char *>(std::malloc(node->raw_bytes));
+        if (!data)
+            throw std::bad_alloc();
+        persist::lzf_decompress(reinterpret_cast<const uint8_t *>(node->data), node->bytes,
+                                reinterpret_cast<uint8_t *>(data), node->raw_bytes);
+        std::free(node->data);
+        bytes_ += block_size(node->raw_bytes) - block_size(node->capacity);
+        node->data = data;
+        node->capacity = node->raw_bytes;
+        node->bytes = node->raw_bytes;
+        node->compressed = false;
+    }
+
+    // Nodes only come and go at the ends, so only the depth + 1 nodes at
+    // each end can have changed sides of the boundary.
+    void Quicklist::update_compression()
+    {
+        if (compress_depth == 0)
+            return;
+        Node *front = head_;
+        Node *back = tail_;
+        for (size_t i = 0; i < compress_depth && front; ++i)
+        {
+            decompress(front);
+            decompress(back);
+            front = front->next;
+            back = back->prev;
+        }
+        if (nodes_ > 2 * compress_depth)
+        {
+            compress(front);
+            compress(back);
+        }
+    }
+
+    void Quicklist::push_front(std::string_view item)
+    {
+        size_t size = entry_size(item.size());
+        Node *node = fits(head_, size) ? head_ : add_node(true);
+        reserve(node, node->bytes + size);
+        std::memmove(node->data + size, node->data, node->bytes);
+        encode_entry(node->data, item);
+        node->bytes += static_cast<uint32_t>(size);
+        node->count++;
+        node->incompressible = false;
+        count_++;
+    }
+
+    void Quicklist::push_back(std::string_view item)
+    {
+        size_t size = entry_size(item.size());
+        Node *node = fits(tail_, size) ? tail_ : add_node(false);
+        reserve(node, node->bytes + size);
+        encode_entry(node->data + node->bytes, item);
+        node->bytes += static_cast<uint32_t>(size);
+        node->count++;
+        node->incompressible = false;
+        count_++;
+    }
+
+    bool Quicklist::pop_front(std::string &out)
+    {
+        if (!head_)
+            return false;
+        Node *node = head_;
+        decompress(node);
+        size_t size;
+        out.assign(decode_entry(node->data, size));
+        count_--;
+        if (--node->count == 0)
+        {
+            remove_node(node);
+            return true;
+        }
+        node->bytes -= static_cast<uint32_t>(size);
+        std::memmove(node->data, node->data + size, node->bytes);
+        shrink(node);
+        return true;
+    }
+
+    bool Quicklist::pop_back(std::string &out)
+    {
+        if (!tail_)
+            return false;
+        Node *node = tail_;
+        decompress(node);
+        size_t backlen_size;
+        uint32_t body = get_backlen(node->data + node->bytes, backlen_size);
+        size_t size = body + backlen_size;
+        size_t entry;
+        out.assign(decode_entry(node->data + node->bytes - size, entry));
+        count_--;
+        if (--node->count == 0)
+        {
+            remove_node(node);
+            return true;
+        }
+        node->bytes -= static_cast<uint32_t>(size);
+        shrink(node);
+        return true;
+    }
+
+    Quicklist::const_iterator Quicklist::at(size_t index) const
+    {
+        const_iterator it;
+        if (index >= count_)
+            return it;
+        const Node *node;
+        if (index < count_ / 2)
+        {
+            node = head_;
+            while (index >= node->count)
+            {
+                index -= node->count;
+                node = node->next;
+            }
+        }
+        else
+        {
+            size_t from_end = count_ - 1 - index;
+            node = tail_;
+            while (from_end >= node->count)
+            {
+                from_end -= node->count;
+                node = node->prev;
+            }
+            index = node->count - 1 - from_end;
+        }
+        it.load(node);
+        for (; index > 0; --index)
+        {
+            size_t size;
+            decode_entry(it.data() + it.offset_, size);
+            it.offset_ += static_cast<uint32_t>(size);
+            it.index_++;
+        }
+        return it;
+    }
+
+    void Quicklist::const_iterator::load(const Node *node)
+    {
+        node_ = node;
+        index_ = 0;
+        offset_ = 0;
+        if (node && node->compressed)
+        {
+            scratch_.resize(node->raw_bytes);
+            persist::lzf_decompress(reinterpret_cast<const uint8_t *>(node->data), node->bytes,
+                                    reinterpret_cast<uint8_t *>(scratch_.data()), node->raw_bytes);
+        }
+    }
+
+    std::string_view Quicklist::const_iterator::operator*() const
+    {
+        size_t size;
+        return decode_entry(data() + offset_, size);
+    }
+
+    Quicklist::const_iterator &Quicklist::const_iterator::operator++()
+    {
+        if (++index_ == node_->count)
+        {
+            load(node_->next);
+            return *this;
+        }
+        size_t size;
+        decode_entry(data() + offset_, size);
+        offset_ += static_cast<uint32_t>(size);
+        return *this;
+    }
+}
@@ -0,0 +1,2083 @@
+#include "core/script.hpp"
+#include "core/command.hpp"
+#include "core/response.hpp"
+#include <algorithm>
+#include <cctype>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <map>
+#include <mutex>
+
+namespace core
+{
+    namespace
+    {
+        uint32_t rotl(uint32_t x, int n)
+        {
+            return (x << n) | (x >> (32 - n));
+        }
+    }
+
+    std::string sha1_hex(std::string_view data)
+    {
+        uint32_t h[5] = {0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476, 0xc3d2e1f0};
+        std::string message(data);
+        uint64_t bits = static_cast<uint64_t>(data.size()) * 8;
+        message += '\x80';
+        while (message.size() % 64 != 56)
+        {
+            message += '\0';
+        }
+        for (int i = 7; i >= 0; --i)
+        {
+            message += static_cast<char>(bits >> (i * 8));
+        }
+        for (size_t chunk = 0; chunk < message.size(); chunk += 64)
+        {
+            uint32_t w[80];
+            for (int i = 0; i < 16; ++i)
+            {
+                const unsigned char *p = reinterpret_cast<const unsigned char *>(message.data() + chunk + 4 * i);
+                w[i] = uint32_t(p[0]) << 24 | uint32_t(p[1]) << 16 | uint32_t(p[2]) << 8 | p[3];
+            }
+            for (int i = 16; i < 80; ++i)
+            {
+                w[i] = rotl(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+            }
+            uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4];
+            for (int i = 0; i < 80; ++i)
+            {
+                uint32_t f, k;
+                if (i < 20)
+                {
+                    f = (b & c) | (~b & d);
+                    k = 0x5a827999;
+                }
+                else if (i < 40)
+                {
+                    f = b ^ c ^ d;
+                    k = 0x6ed9eba1;
+                }
+                else if (i < 60)
+                {
+                    f = (b & c) | (b & d) | (c & d);
+                    k = 0x8f1bbcdc;
+                }
+                else
+                {
+                    f = b ^ c ^ d;
+                    k = 0xca62c1d6;
+                }
+                uint32_t t = rotl(a, 5) + f + e + k + w[i];
+                e = d;
+                d = c;
+                c = rotl(b, 30);
+                b = a;
+                a = t;
+            }
+            h[0] += a;
+            h[1] += b;
+            h[2] += c;
+            h[3] += d;
+            h[4] += e;
+        }
+        static const char digits[] = "0123456789abcdef";
+        std::string hex;
+        for (uint32_t word : h)
+        {
+            for (int shift = 28; shift >= 0; shift -= 4)
+            {
+                hex += digits[(word >> shift) & 0xf];
+            }
+        }
+        return hex;
+    }
+
+    namespace
+    {
+        struct Table;
+
+        struct Value
+        {
+            enum class Type : uint8_t
+            {
+                NIL,
+                BOOLEAN,
+                NUMBER,
+                STRING,
+                TABLE
+            };
+
+            Type type = Type::NIL;
+            bool boolean = false;
+            double number = 0;
+            // Shared so that copying a value onto the stack does not copy
+            // the bytes.
+            std::shared_ptr<const std::string> string;
+            Table *table = nullptr;
+
+            static Value Boolean(bool b)
+            {
+                Value value;
+                value.type = Type::BOOLEAN;
+                value.boolean = b;
+                return value;
+            }
+
+            static Value Number(double n)
+            {
+                Value value;
+                value.type = Type::NUMBER;
+                value.number = n;
+                return value;
+            }
+
+            static Value String(std::string s)
+            {
+                Value value;
+                value.type = Type::STRING;
+                value.string = std::make_shared<const std::string>(std::move(s));
+                return value;
+            }
+
+            static Value Of(Table *t)
+            {
+                Value value;
+                value.type = Type::TABLE;
+                value.table = t;
+                return value;
+            }
+
+            bool is_nil() const { return type == Type::NIL; }
+            bool truthy() const { return type != Type::NIL && (type != Type::BOOLEAN || boolean); }
+        };
+
+        // Keys 1..n live in array, other numbers and strings in the maps.
+        // The length operator returns the size of array.
+        struct Table
+        {
+            std::vector<Value> array;
+            std::map<double, Value> numbers;
+            std::unordered_map<std::string, Value> strings;
+        };
+
+        const char *type_name(const Value &value)
+        {
+            switch (value.type)
+            {
+            case Value::Type::NIL:
+                return "nil";
+            case Value::Type::BOOLEAN:
+                return "boolean";
+            case Value::Type::NUMBER:
+                return "number";
+            case Value::Type::STRING:
+                return "string";
+            case Value::Type::TABLE:
+                return "table";
+            }
+            return "?";
+        }
+
+        // As Lua prints numbers: integers without a fraction.
+        std::string format_number(double n)
+        {
+            char buf[32];
+            int len = std::snprintf(buf, sizeof(buf), "%.14g", n);
+            return std::string(buf, len);
+        }
+
+        // Lua's string to number coercion: decimal or hex, surrounding
+        // spaces allowed.
+        bool parse_number(const std::string &text, double &out)
+        {
+            const char *begin = text.c_str();
+            char *end;
+            out = std::strtod(begin, &end);
+            if (end == begin)
+                return false;
+            while (std::isspace(static_cast<unsigned char>(*end)))
+            {
+                ++end;
+            }
+            return *end == '\0';
+        }
+
+        enum class Op : uint8_t
+        {
+            PUSH_NIL,
+            PUSH_TRUE,
+            PUSH_FALSE,
+            CONSTANT,
+            GET_LOCAL,
+            SET_LOCAL,
+            NEW_TABLE,
+            // Table constructor items: set positional item a, or a key and a
+            // value, leaving the table on the stack.
+            APPEND,
+            SET_ITEM,
+            GET_INDEX,
+            SET_INDEX,
+            ADD,
+            SUB,
+            MUL,
+            DIV,
+            MOD,
+            POW,
+            CONCAT,
+            EQ,
+            NE,
+            LT,
+            LE,
+            GT,
+            GE,
+            NEG,
+            NOT,
+            LEN,
+            JUMP,
+            JUMP_IF_FALSE,
+            // Short-circuit: jump keeping the operand if it decides the
+            // result, pop it otherwise.
+            AND,
+            OR,
+            CALL,
+            POP,
+            // The three hidden locals of a numeric for start at a, the loop
+            // variable follows them; b is the jump target.
+            FOR_PREP,
+            FOR_LOOP,
+            RETURN
+        };
+
+        struct Instruction
+        {
+            Op op;
+            uint32_t a = 0;
+            uint32_t b = 0;
+        };
+
+        enum class Builtin : uint8_t
+        {
+            REDIS_CALL,
+            REDIS_PCALL,
+            REDIS_ERROR_REPLY,
+            REDIS_STATUS_REPLY,
+            TONUMBER,
+            TOSTRING,
+            TYPE,
+            MATH_FLOOR,
+            MATH_CEIL,
+            MATH_ABS,
+            MATH_MIN,
+            MATH_MAX,
+            STRING_LEN,
+            STRING_SUB,
+            STRING_UPPER,
+            STRING_LOWER,
+            TABLE_INSERT
+        };
+
+        struct BuiltinInfo
+        {
+            std::string_view name;
+            Builtin id;
+            uint32_t min_args;
+            uint32_t max_args;
+        };
+
+        const uint32_t VARIADIC = UINT32_MAX;
+
+        const BuiltinInfo builtins[] = {
+            {"redis.call", Builtin::REDIS_CALL, 1, VARIADIC},
+            {"redis.pcall", Builtin::REDIS_PCALL, 1, VARIADIC},
+            {"redis.error_reply", Builtin::REDIS_ERROR_REPLY, 1, 1},
+            {"redis.status_reply", Builtin::REDIS_STATUS_REPLY, 1, 1},
+            {"tonumber", Builtin::TONUMBER, 1, 1},
+            {"tostring", Builtin::TOSTRING, 1, 1},
+            {"type", Builtin::TYPE, 1, 1},
+            {"math.floor", Builtin::MATH_FLOOR, 1, 1},
+            {"math.ceil", Builtin::MATH_CEIL, 1, 1},
+            {"math.abs", Builtin::MATH_ABS, 1, 1},
+            {"math.min", Builtin::MATH_MIN, 1, VARIADIC},
+            {"math.max", Builtin::MATH_MAX, 1, VARIADIC},
+            {"string.len", Builtin::STRING_LEN, 1, 1},
+            {"string.sub", Builtin::STRING_SUB, 2, 3},
+            {"string.upper", Builtin::STRING_UPPER, 1, 1},
+            {"string.lower", Builtin::STRING_LOWER, 1, 1},
+            {"table.insert", Builtin::TABLE_INSERT, 2, 3},
+        };
+
+        const BuiltinInfo *find_builtin(std::string_view name)
+        {
+            for (const BuiltinInfo &builtin : builtins)
+            {
+                if (builtin.name == name)
+                    return &builtin;
+            }
+            return nullptr;
+        }
+
+        bool is_library(std::string_view name)
+        {
+            return name == "redis" || name == "math" || name == "string" || name == "table";
+        }
+
+        struct CompileError
+        {
+            uint32_t line;
+            std::string message;
+        };
+
+        // Error raised while running; message is the RESP error line
+        // without its '-'.
+        struct ScriptError
+        {
+            std::string message;
+        };
+
+        enum class Token : uint8_t
+        {
+            EOS,
+            NAME,
+            NUMBER,
+            STRING,
+            AND,
+            BREAK,
+            DO,
+            ELSE,
+            ELSEIF,
+            END,
+            FALSE,
+            FOR,
+            FUNCTION,
+            IF,
+            IN,
+            LOCAL,
+            NIL,
+            NOT,
+            OR,
+            REPEAT,
+            RETURN,
+            THEN,
+            TRUE,
+            UNTIL,
+            WHILE,
+            PLUS,
+            MINUS,
+            STAR,
+            SLASH,
+            PERCENT,
+            CARET,
+            HASH,
+            EQ,
+            NE,
+            LE,
+            GE,
+            LT,
+            GT,
+            ASSIGN,
+            LPAREN,
+            RPAREN,
+            LBRACE,
+            RBRACE,
+            LBRACKET,
+            RBRACKET,
+            SEMICOLON,
+            COLON,
+            COMMA,
+            DOT,
+            CONCAT,
+            DOTS
+        };
+
+        const std::pair<std::string_view, Token> keywords[] = {
+            {"and", Token::AND},
+            {"break", Token::BREAK},
+            {"do", Token::DO},
+            {"else", Token::ELSE},
+            {"elseif", Token::ELSEIF},
+            {"end", Token::END},
+            {"false", Token::FALSE},
+            {"for", Token::FOR},
+            {"function", Token::FUNCTION},
+            {"if", Token::IF},
+            {"in", Token::IN},
+            {"local", Token::LOCAL},
+            {"nil", Token::NIL},
+            {"not", Token::NOT},
+            {"or", Token::OR},
+            {"repeat", Token::REPEAT},
+            {"return", Token::RETURN},
+            {"then", Token::THEN},
+            {"true", Token::TRUE},
+            {"until", Token::UNTIL},
+            {"while", Token::WHILE},
+        };
+
+        class Lexer
+        {
+        public:
+            explicit Lexer(std::string_view source) : source_(source) {}
+
+            Token next()
+            {
+                skip_space();
+                start_ = pos_;
+                token_line_ = line_;
+                if (pos_ >= source_.size())
+                    return Token::EOS;
+                char c = source_[pos_];
+                if (std::isalpha(static_cast<unsigned char>(c)) || c == '_')
+                    return name();
+                if (std::isdigit(static_cast<unsigned char>(c)) ||
+                    (c == '.' && std::isdigit(static_cast<unsigned char>(peek(1)))))
+                    return number();
+                if (c == '"' || c == '\'')
+                    return quoted(c);
+                if (c == '[' && (peek(1) == '[' || peek(1) == '='))
+                {
+                    size_t level;
+                    if (long_bracket(level))
+                    {
+                        text_ = long_string(level);
+                        return Token::STRING;
+                    }
+                }
+                ++pos_;
+                switch (c)
+                {
+                case '+':
+                    return Token::PLUS;
+                case '-':
+                    return Token::MINUS;
+                case '*':
+                    return Token::STAR;
+                case '/':
+                    return Token::SLASH;
+                case '%':
+                    return Token::PERCENT;
+                case '^':
+                    return Token::CARET;
+                case '#':
+                    return Token::HASH;
+                case '(':
+                    return Token::LPAREN;
+                case ')':
+                    return Token::RPAREN;
+                case '{':
+                    return Token::LBRACE;
+                case '}':
+                    return Token::RBRACE;
+                case '[':
+                    return Token::LBRACKET;
+                case ']':
+                    return Token::RBRACKET;
+                case ';':
+                    return Token::SEMICOLON;
+                case ':':
+                    return Token::COLON;
+                case ',':
+                    return Token::COMMA;
+                case '=':
+                    return accept('=') ? Token::EQ : Token::ASSIGN;
+                case '<':
+                    return accept('=') ? Token::LE : Token::LT;
+                case '>':
+                    return accept('=') ? Token::GE : Token::GT;
+                case '~':
+                    if (accept('='))
+                        return Token::NE;
+                    break;
+                case '.':
+                    if (!accept('.'))
+                        return Token::DOT;
+                    return accept('.') ? Token::DOTS : Token::CONCAT;
+                }
+                throw CompileError{token_line_, "unexpected symbol near '" + std::string(raw()) + "'"};
+            }
+
+            // Text of a name or string token, number of a number token.
+            const std::string &text() const { return text_; }
+            double number_value() const { return number_; }
+            // The token as written, for error messages.
+            std::string_view raw() const { return source_.substr(start_, pos_ - start_); }
+            uint32_t line() const { return token_line_; }
+
+        private:
+            std::string_view source_;
+            size_t pos_ = 0;
+            size_t start_ = 0;
+            uint32_t line_ = 1;
+            uint32_t token_line_ = 1;
+            std::string text_;
+            double number_ = 0;
+
+            char peek(size_t ahead) const { return pos_ + ahead < source_.size() ? source_[pos_ + ahead] : '\0'; }
+
+            bool accept(char c)
+            {
+                if (peek(0) != c)
+                    return false;
+                ++pos_;
+                return true;
+            }
+
+            void skip_space()
+            {
+                while (pos_ < source_.size())
+                {
+                    char c = source_[pos_];
+                    if (c == '\n')
+                    {
+                        ++line_;
+                        ++pos_;
+                    }
+                    else if (std::isspace(static_cast<unsigned char>(c)))
+                    {
+                        ++pos_;
+                    }
+                    else if (c == '-' && peek(1) == '-')
+                    {
+                        pos_ += 2;
+                        size_t level;
+                        if (peek(0) == '[' && long_bracket(level))
+                        {
+                            long_string(level);
+                            continue;
+                        }
+                        while (pos_ < source_.size() && source_[pos_] != '\n')
+                        {
+                            ++pos_;
+                        }
+                    }
+                    else
+                    {
+                        return;
+                    }
+                }
+            }
+
+            Token name()
+            {
+                while (pos_ < source_.size() && (std::isalnum(static_cast<unsigned char>(source_[pos_])) || source_[pos_] == '_'))
+                {
+                    ++pos_;
+                }
+                std::string_view word = raw();
+                for (const auto &[keyword, token] : keywords)
+                {
+                    if (keyword == word)
+                        return token;
+                }
+                text_ = std::string(word);
+                return Token::NAME;
+            }
+
+            Token number()
+            {
+                while (pos_ < source_.size())
+                {
+                    char c = source_[pos_];
+                    char prev = source_[pos_ - 1];
+                    if (std::isalnum(static_cast<unsigned char>(c)) || c == '.' ||
+                        ((c == '+' || c == '-') && (prev == 'e' || prev == 'E')))
+                        ++pos_;
+                    else
+                        break;
+                }
+                if (!parse_number(std::string(raw()), number_))
+                    throw CompileError{token_line_, "malformed number near '" + std::string(raw()) + "'"};
+                return Token::NUMBER;
+            }
+
+            Token quoted(char quote)
+            {
+                ++pos_;
+                text_.clear();
+                while (true)
+                {
+                    if (pos_ >= source_.size() || source_[pos_] == '\n')
+                        throw CompileError{token_line_, "unfinished string"};
+                    char c = source_[pos_++];
+                    if (c == quote)
+                        return Token::STRING;
+                    if (c != '\\')
+                    {
+                        text_ += c;
+                        continue;
+                    }
+                    if (pos_ >= source_.size())
+                        throw CompileError{token_line_, "unfinished string"};
+                    c = source_[pos_++];
+                    switch (c)
+                    {
+                    case 'n':
+                        text_ += '\n';
+                        break;
+                    case 't':
+                        text_ += '\t';
+                        break;
+                    case 'r':
+                        text_ += '\r';
+                        break;
+                    case 'a':
+                        text_ += '\a';
+                        break;
+                    case 'b':
+                        text_ += '\b';
+                        break;
+                    case 'f':
+                        text_ += '\f';
+                        break;
+                    case 'v':
+                        text_ += '\v';
+                        break;
+                    case '\n':
+                        ++line_;
+                        text_ += '\n';
+                        break;
+                    case 'x':
+                    {
+                        int value = 0;
+                        for (int i = 0; i < 2; ++i)
+                        {
+                            char h = peek(0);
+                            if (!std::isxdigit(static_cast<unsigned char>(h)))
+                                throw CompileError{token_line_, "hexadecimal digit expected"};
+                            value = value * 16 + (std::isdigit(static_cast<unsigned char>(h)) ? h - '0' : std::tolower(h) - 'a' + 10);
+                            ++pos_;
+                        }
+                        text_ += static_cast<char>(value);
+                        break;
+                    }
+                    default:
+                        if (std::isdigit(static_cast<unsigned char>(c)))
+                        {
+                            int value = c - '0';
+                            for (int i = 0; i < 2 && std::isdigit(static_cast<unsigned char>(peek(0))); ++i)
+                            {
+                                value = value * 10 + (source_[pos_++] - '0');
+                            }
+                            if (value > 255)
+                                throw CompileError{token_line_, "escape sequence too large"};
+                            text_ += static_cast<char>(value);
+                        }
+                        else
+                        {
+                            // \\, \" and \' stand for themselves.
+                            text_ += c;
+                        }
+                    }
+                }
+            }
+
+            // At "[" followed by "=" signs and another "[", consumes them.
+            bool long_bracket(size_t &level)
+            {
+                size_t p = pos_ + 1;
+                level = 0;
+                while (p < source_.size() && source_[p] == '=')
+                {
+                    ++level;
+                    ++p;
+                }
+                if (p >= source_.size() || source_[p] != '[')
+                    return false;
+                pos_ = p + 1;
+                return true;
+            }
+
+            std::string long_string(size_t level)
+            {
+                std::string close = "]" + std::string(level, '=') + "]";
+                if (peek(0) == '\r')
+                    ++pos_;
+                if (peek(0) == '\n')
+                {
+                    ++line_;
+                    ++pos_;
+                }
+                size_t end = source_.find(close, pos_);
+                if (end == std::string_view::npos)
+                    throw CompileError{token_line_, "unfinished long string"};
+                std::string text(source_.substr(pos_, end - pos_));
+                line_ += static_cast<uint32_t>(std::count(text.begin(), text.end(), '\n'));
+                pos_ = end + close.size();
+                return text;
+            }
+        };
+    }
+
+    struct Script::Program
+    {
+        std::vector<Instruction> code;
+        // Source line of each instruction, for runtime errors.
+        std::vector<uint32_t> lines;
+        std::vector<Value> constants;
+        // Locals the script needs at most, KEYS and ARGV included.
+        uint32_t slots = 0;
+    };
+
+    namespace
+    {
+        const size_t MAX_LOCALS = 200;
+        // Nesting of blocks and expressions, so that deep nesting fails to
+        // compile instead of overflowing the stack.
+        const size_t MAX_DEPTH = 200;
+
+        // Single-pass compiler from source to bytecode. Variables are all
+        // locals and resolve to slots while parsing; the only functions are
+        // the builtins, resolved by name.
+        class Compiler
+        {
+        public:
+            Compiler(std::string_view source, Script::Program &program) : lexer_(source), program_(program) {}
+
+            void compile()
+            {
+                declare("KEYS");
+                declare("ARGV");
+                advance();
+                statements();
+                if (token_ != Token::EOS)
+                    error("'<eof>' expected");
+                emit(Op::PUSH_NIL);
+                emit(Op::RETURN);
+            }
+
+        private:
+            // Where the value of a parsed expression is: on the stack, in a
+            // local not pushed yet, or a table and key on the stack not yet
+            // indexed. CALL is a value that came from a call.
+            struct Expr
+            {
+                enum class Kind
+                {
+                    VALUE,
+                    CALL,
+                    LOCAL,
+                    INDEXED
+                };
+                Kind kind;
+                uint32_t slot = 0;
+            };
+
+            Lexer lexer_;
+            Token token_ = Token::EOS;
+            Script::Program &program_;
+            std::vector<std::string> locals_;
+            // Pending jumps out of each enclosing loop.
+            std::vector<std::vector<size_t>> breaks_;
+            size_t depth_ = 0;
+
+            [[noreturn]] void error(const std::string &message)
+            {
+                std::string near = token_ == Token::EOS ? "<eof>" : std::string(lexer_.raw());
+                throw CompileError{lexer_.line(), message + " near '" + near + "'"};
+            }
+
+            void advance() { token_ = lexer_.next(); }
+
+            bool accept(Token token)
+            {
+                if (token_ != token)
+                    return false;
+                advance();
+                return true;
+            }
+
+            void expect(Token token, const char *what)
+            {
+                if (!accept(token))
+                    error(std::string("'") + what + "' expected");
+            }
+
+            std::string expect_name()
+            {
+                if (token_ != Token::NAME)
+                    error("<name> expected");
+                std::string name = lexer_.text();
+                advance();
+                return name;
+            }
+
+            void enter()
+            {
+                if (++depth_ > MAX_DEPTH)
+                    error("chunk has too many syntax levels");
+            }
+
+            size_t emit(Op op, uint32_t a = 0, uint32_t b = 0)
+            {
+                program_.code.push_back(Instruction{op, a, b});
+                program_.lines.push_back(lexer_.line());
+                return program_.code.size() - 1;
+            }
+
+            uint32_t here() const { return static_cast<uint32_t>(program_.code.size()); }
+
+            void constant(Value value)
+            {
+                program_.constants.push_back(std::move(value));
+                emit(Op::CONSTANT, static_cast<uint32_t>(program_.constants.size() - 1));
+            }
+
+            uint32_t declare(const std::string &name)
+            {
+                if (locals_.size() >= MAX_LOCALS)
+                    error("too many local variables");
+                locals_.push_back(name);
+                program_.slots = std::max(program_.slots, static_cast<uint32_t>(locals_.size()));
+                return static_cast<uint32_t>(locals_.size() - 1);
+            }
+
+            bool find_local(const std::string &name, uint32_t &slot) const
+            {
+                for (size_t i = locals_.size(); i-- > 0;)
+                {
+                    if (locals_[i] == name)
+                    {
+                        slot = static_cast<uint32_t>(i);
+                        return true;
+                    }
+                }
+                return false;
+            }
+
+            bool block_follow() const
+            {
+                return token_ == Token::EOS || token_ == Token::ELSE || token_ == Token::ELSEIF || token_ == Token::END ||
+                       token_ == Token::UNTIL;
+            }
+
+            void statements()
+            {
+                while (!block_follow())
+                {
+                    if (token_ == Token::RETURN)
+                    {
+                        return_statement();
+                        return;
+                    }
+                    statement();
+                }
+            }
+
+            void block()
+            {
+                enter();
+                size_t scope = locals_.size();
+                statements();
+                locals_.resize(scope);
+                --depth_;
+            }
+
+            void statement()
+            {
+                switch (token_)
+                {
+                case Token::SEMICOLON:
+                    advance();
+                    break;
+                case Token::IF:
+                    if_statement();
+                    break;
+                case Token::WHILE:
+                    while_statement();
+                    break;
+                case Token::DO:
+                    advance();
+                    block();
+                    expect(Token::END, "end");
+                    break;
+                case Token::FOR:
+                    for_statement();
+                    break;
+                case Token::REPEAT:
+                    repeat_statement();
+                    break;
+                case Token::LOCAL:
+                    local_statement();
+                    break;
+                case Token::BREAK:
+                    if (breaks_.empty())
+                        error("no loop to break");
+                    advance();
+                    breaks_.back().push_back(emit(Op::JUMP));
+                    break;
+                case Token::FUNCTION:
+                    error("functions are not supported");
+                default:
+                    expression_statement();
+                }
+            }
+
+            void return_statement()
+            {
+                advance();
+                if (block_follow() || token_ == Token::SEMICOLON)
+                    emit(Op::PUSH_NIL);
+                else
+                    expression();
+                accept(Token::SEMICOLON);
+                emit(Op::RETURN);
+                if (!block_follow())
+                    error("'end' expected");
+            }
+
+            void if_statement()
+            {
+                std::vector<size_t> exits;
+                advance();
+                expression();
+                expect(Token::THEN, "then");
+                size_t skip = emit(Op::JUMP_IF_FALSE);
+                block();
+                while (token_ == Token::ELSEIF)
+                {
+                    exits.push_back(emit(Op::JUMP));
+                    program_.code[skip].a = here();
+                    advance();
+                    expression();
+                    expect(Token::THEN, "then");
+                    skip = emit(Op::JUMP_IF_FALSE);
+                    block();
+                }
+                if (token_ == Token::ELSE)
+                {
+                    exits.push_back(emit(Op::JUMP));
+                    program_.code[skip].a = here();
+                    advance();
+                    block();
+                }
+                else
+                {
+                    program_.code[skip].a = here();
+                }
+                expect(Token::END, "end");
+                for (size_t exit : exits)
+                {
+                    program_.code[exit].a = here();
+                }
+            }
+
+            void end_loop()
+            {
+                for (size_t jump : breaks_.back())
+                {
+                    program_.code[jump].a = here();
+                }
+                breaks_.pop_back();
+            }
+
+            void while_statement()
+            {
+                uint32_t start = here();
+                advance();
+                expression();
+                expect(Token::DO, "do");
+                size_t exit = emit(Op::JUMP_IF_FALSE);
+                breaks_.emplace_back();
+                block();
+                expect(Token::END, "end");
+                emit(Op::JUMP, start);
+                program_.code[exit].a = here();
+                end_loop();
+            }
+
+            // The condition sees the body's locals, as in Lua.
+            void repeat_statement()
+            {
+                uint32_t start = here();
+                advance();
+                breaks_.emplace_back();
+                enter();
+                size_t scope = locals_.size();
+                statements();
+                expect(Token::UNTIL, "until");
+                expression();
+                emit(Op::JUMP_IF_FALSE, start);
+                locals_.resize(scope);
+                --depth_;
+                end_loop();
+            }
+
+            void for_statement()
+            {
+                advance();
+                std::string name = expect_name();
+                if (token_ == Token::COMMA || token_ == Token::IN)
+                    error("only numeric for loops are supported");
+                expect(Token::ASSIGN, "=");
+                expression();
+                expect(Token::COMMA, ",");
+                expression();
+                if (accept(Token::COMMA))
+                    expression();
+                else
+                    constant(Value::Number(1));
+                expect(Token::DO, "do");
+                size_t scope = locals_.size();
+                uint32_t base = declare("(for index)");
+                declare("(for limit)");
+                declare("(for step)");
+                declare(name);
+                emit(Op::SET_LOCAL, base + 2);
+                emit(Op::SET_LOCAL, base + 1);
+                emit(Op::SET_LOCAL, base);
+                size_t prep = emit(Op::FOR_PREP, base);
+                uint32_t body = here();
+                breaks_.emplace_back();
+                block();
+                expect(Token::END, "end");
+                emit(Op::FOR_LOOP, base, body);
+                program_.code[prep].b = here();
+                end_loop();
+                locals_.resize(scope);
+            }
+
+            // The names are in scope only after the values are computed.
+            void local_statement()
+            {
+                advance();
+                if (token_ == Token::FUNCTION)
+                    error("functions are not supported");
+                std::vector<std::string> names{expect_name()};
+                while (accept(Token::COMMA))
+                {
+                    names.push_back(expect_name());
+                }
+                size_t values = 0;
+                if (accept(Token::ASSIGN))
+                    values = expression_list();
+                for (; values > names.size(); --values)
+                {
+                    emit(Op::POP);
+                }
+                for (; values < names.size(); ++values)
+                {
+                    emit(Op::PUSH_NIL);
+                }
+                std::vector<uint32_t> slots;
+                for (const std::string &name : names)
+                {
+                    slots.push_back(declare(name));
+                }
+                for (size_t i = slots.size(); i-- > 0;)
+                {
+                    emit(Op::SET_LOCAL, slots[i]);
+                }
+            }
+
+            void expression_statement()
+            {
+                Expr target = suffixed();
+                if (token_ == Token::COMMA)
+                    error("multiple assignment is not supported");
+                if (token_ == Token::ASSIGN)
+                {
+                    if (target.kind != Expr::Kind::LOCAL && target.kind != Expr::Kind::INDEXED)
+                        error("syntax error");
+                    advance();
+                    expression();
+                    if (target.kind == Expr::Kind::LOCAL)
+                        emit(Op::SET_LOCAL, target.slot);
+                    else
+                        emit(Op::SET_INDEX);
+                    return;
+                }
+                if (target.kind != Expr::Kind::CALL)
+                    error("syntax error");
+                emit(Op::POP);
+            }
+
+            size_t expression_list()
+            {
+                size_t count = 1;
+                expression();
+                while (accept(Token::COMMA))
+                {
+                    expression();
+                    ++count;
+                }
+                return count;
+            }
+
+            void discharge(Expr &expr)
+            {
+                if (expr.kind == Expr::Kind::LOCAL)
+                    emit(Op::GET_LOCAL, expr.slot);
+                else if (expr.kind == Expr::Kind::INDEXED)
+                    emit(Op::GET_INDEX);
+                expr.kind = Expr::Kind::VALUE;
+            }
+
+            void expression()
+            {
+                Expr expr = subexpression(0);
+                discharge(expr);
+            }
+
+            Expr primary()
+            {
+                if (accept(Token::LPAREN))
+                {
+                    expression();
+                    expect(Token::RPAREN, ")");
+                    return Expr{Expr::Kind::VALUE};
+                }
+                if (token_ != Token::NAME)
+                    error("unexpected symbol");
+                std::string name = expect_name();
+                uint32_t slot;
+                if (find_local(name, slot))
+                    return Expr{Expr::Kind::LOCAL, slot};
+                if (is_library(name))
+                {
+                    expect(Token::DOT, ".");
+                    name += "." + expect_name();
+                }
+                const BuiltinInfo *builtin = find_builtin(name);
+                if (!builtin)
+                    error(is_library(name.substr(0, name.find('.'))) ? "unknown function '" + name + "'"
+                                                                       : "undefined variable '" + name + "'");
+                if (token_ != Token::LPAREN)
+                    error("'" + name + "' can only be called");
+                advance();
+                size_t argc = token_ == Token::RPAREN ? 0 : expression_list();
+                expect(Token::RPAREN, ")");
+                if (argc < builtin->min_args || argc > builtin->max_args)
+                    error("wrong number of arguments to '" + name + "'");
+                emit(Op::CALL, static_cast<uint32_t>(builtin->id), static_cast<uint32_t>(argc));
+                return Expr{Expr::Kind::CALL};
+            }
+
+            Expr suffixed()
+            {
+                Expr expr = primary();
+                while (true)
+                {
+                    switch (token_)
+                    {
+                    case Token::DOT:
+                        discharge(expr);
+                        advance();
+                        constant(Value::String(expect_name()));
+                        expr.kind = Expr::Kind::INDEXED;
+                        break;
+                    case Token::LBRACKET:
+                        discharge(expr);
+                        advance();
+                        expression();
+                        expect(Token::RBRACKET, "]");
+                        expr.kind = Expr::Kind::INDEXED;
+                        break;
+                    case Token::COLON:
+                        error("method calls are not supported");
+                    case Token::LPAREN:
+                    case Token::STRING:
+                    case Token::LBRACE:
+                        error("only builtin functions can be called");
+                    default:
+                        return expr;
+                    }
+                }
+            }
+
+            void table_constructor()
+            {
+                advance();
+                emit(Op::NEW_TABLE);
+                uint32_t position = 0;
+                while (token_ != Token::RBRACE)
+                {
+                    Lexer ahead = lexer_;
+                    if (token_ == Token::NAME && ahead.next() == Token::ASSIGN)
+                    {
+                        constant(Value::String(expect_name()));
+                        advance();
+                        expression();
+                        emit(Op::SET_ITEM);
+                    }
+                    else if (accept(Token::LBRACKET))
+                    {
+                        expression();
+                        expect(Token::RBRACKET, "]");
+                        expect(Token::ASSIGN, "=");
+                        expression();
+                        emit(Op::SET_ITEM);
+                    }
+                    else
+                    {
+                        expression();
+                        emit(Op::APPEND, ++position);
+                    }
+                    if (!accept(Token::COMMA) && !accept(Token::SEMICOLON))
+                        break;
+                }
+                expect(Token::RBRACE, "}");
+            }
+
+            Expr simple()
+            {
+                switch (token_)
+                {
+                case Token::NUMBER:
+                    constant(Value::Number(lexer_.number_value()));
+                    break;
+                case Token::STRING:
+                    constant(Value::String(lexer_.text()));
+                    break;
+                case Token::NIL:
+                    emit(Op::PUSH_NIL);
+                    break;
+                case Token::TRUE:
+                    emit(Op::PUSH_TRUE);
+                    break;
+                case Token::FALSE:
+                    emit(Op::PUSH_FALSE);
+                    break;
+                case Token::LBRACE:
+                    table_constructor();
+                    return Expr{Expr::Kind::VALUE};
+                case Token::FUNCTION:
+                    error("functions are not supported");
+                case Token::DOTS:
+                    error("varargs are not supported");
+                default:
+                    return suffixed();
+                }
+                advance();
+                return Expr{Expr::Kind::VALUE};
+            }
+
+            // Left and right priorities of the binary operators, as in Lua 5.1.
+            static bool binary(Token token, Op &op, int &left, int &right)
+            {
+                switch (token)
+                {
+                case Token::OR:
+                    op = Op::OR, left = 1, right = 1;
+                    return true;
+                case Token::AND:
+                    op = Op::AND, left = 2, right = 2;
+                    return true;
+                case Token::LT:
+                    op = Op::LT, left = 3, right = 3;
+                    return true;
+                case Token::LE:
+                    op = Op::LE, left = 3, right = 3;
+                    return true;
+                case Token::GT:
+                    op = Op::GT, left = 3, right = 3;
+                    return true;
+                case Token::GE:
+                    op = Op::GE, left = 3, right = 3;
+                    return true;
+                case Token::EQ:
+                    op = Op::EQ, left = 3, right = 3;
+                    return true;
+                case Token::NE:
+                    op = Op::NE, left = 3, right = 3;
+                    return true;
+                case Token::CONCAT:
+                    op = Op::CONCAT, left = 5, right = 4;
+                    return true;
+                case Token::PLUS:
+                    op = Op::ADD, left = 6, right = 6;
+                    return true;
+                case Token::MINUS:
+                    op = Op::SUB, left = 6, right = 6;
+                    return true;
+                case Token::STAR:
+                    op = Op::MUL, left = 7, right = 7;
+                    return true;
+                case Token::SLASH:
+                    op = Op::DIV, left = 7, right = 7;
+                    return true;
+                case Token::PERCENT:
+                    op = Op::MOD, left = 7, right = 7;
+                    return true;
+                case Token::CARET:
+                    op = Op::POW, left = 10, right = 9;
+                    return true;
+                default:
+                    return false;
+                }
+            }
+
+            static constexpr int UNARY_PRIORITY = 8;
+
+            Expr subexpression(int limit)
+            {
+                enter();
+                Expr expr;
+                if (token_ == Token::NOT || token_ == Token::MINUS || token_ == Token::HASH)
+                {
+                    Op op = token_ == Token::NOT ? Op::NOT : token_ == Token::MINUS ? Op::NEG
+                                                                                    : Op::LEN;
+                    advance();
+                    Expr operand = subexpression(UNARY_PRIORITY);
+                    discharge(operand);
+                    emit(op);
+                    expr = Expr{Expr::Kind::VALUE};
+                }
+                else
+                {
+                    expr = simple();
+                }
+                Op op;
+                int left, right;
+                while (binary(token_, op, left, right) && left > limit)
+                {
+                    discharge(expr);
+                    advance();
+                    size_t jump = op == Op::AND || op == Op::OR ? emit(op) : 0;
+                    Expr operand = subexpression(right);
+                    discharge(operand);
+                    if (op == Op::AND || op == Op::OR)
+                        program_.code[jump].a = here();
+                    else
+                        emit(op);
+                    expr = Expr{Expr::Kind::VALUE};
+                }
+                --depth_;
+                return expr;
+            }
+        };
+
+        // Checked every this many instructions.
+        const uint64_t CLOCK_INTERVAL = 1024;
+        // Nested tables deeper than this are returned as nil, which also
+        // stops tables that contain themselves.
+        const int MAX_REPLY_DEPTH = 32;
+
+        // One run of a script: its stack, locals and the tables it creates,
+        // all freed together when the run ends.
+        class Machine
+        {
+        public:
+            Machine(const Script::Program &program, const Script::Call &call, std::chrono::milliseconds time_limit)
+                : program_(program), call_(call), time_limit_(time_limit),
+                  deadline_(std::chrono::steady_clock::now() + time_limit)
+            {
+            }
+
+            Response run(const std::vector<std::string_view> &keys, const std::vector<std::string_view> &argv)
+            {
+                try
+                {
+                    locals_.assign(program_.slots, Value());
+                    locals_[0] = strings(keys);
+                    locals_[1] = strings(argv);
+                    Value result = execute();
+                    std::string reply;
+                    append_reply(reply, result, 0);
+                    return Response::Encoded(std::move(reply));
+                }
+                catch (const ScriptError &e)
+                {
+                    return Response::Encoded("-" + e.message + "\r\n");
+                }
+            }
+
+        private:
+            const Script::Program &program_;
+            const Script::Call &call_;
+            std::chrono::milliseconds time_limit_;
+            std::chrono::steady_clock::time_point deadline_;
+            std::vector<Value> stack_;
+            std::vector<Value> locals_;
+            std::vector<std::unique_ptr<Table>> tables_;
+            size_t pc_ = 0;
+
+            [[noreturn]] void fail(const std::string &message)
+            {
+                uint32_t line = pc_ > 0 ? program_.lines[pc_ - 1] : 0;
+                throw ScriptError{"ERR user_script:" + std::to_string(line) + ": " + message};
+            }
+
+            Table *new_table()
+            {
+                tables_.push_back(std::make_unique<Table>());
+                return tables_.back().get();
+            }
+
+            Value strings(const std::vector<std::string_view> &items)
+            {
+                Table *table = new_table();
+                for (std::string_view item : items)
+                {
+                    table->array.push_back(Value::String(std::string(item)));
+                }
+                return Value::Of(table);
+            }
+
+            Value pop()
+            {
+                Value value = std::move(stack_.back());
+                stack_.pop_back();
+                return value;
+            }
+
+            Value get(const Value &container, const Value &key)
+            {
+                if (container.type != Value::Type::TABLE)
+                    fail(std::string("attempt to index a ") + type_name(container) + " value");
+                const Table &table = *container.table;
+                if (key.type == Value::Type::NUMBER)
+                {
+                    double k = key.number;
+                    if (k >= 1 && k <= static_cast<double>(table.array.size()) && k == std::floor(k))
+                        return table.array[static_cast<size_t>(k) - 1];
+                    auto it = table.numbers.find(k);
+                    return it == table.numbers.end() ? Value() : it->second;
+                }
+                if (key.type == Value::Type::STRING)
+                {
+                    auto it = table.strings.find(*key.string);
+                    return it == table.strings.end() ? Value() : it->second;
+                }
+                return Value();
+            }
+
+            void set(const Value &container, const Value &key, Value value)
+            {
+                if (container.type != Value::Type::TABLE)
+                    fail(std::string("attempt to index a ") + type_name(container) + " value");
+                Table &table = *container.table;
+                if (key.type == Value::Type::STRING)
+                {
+                    if (value.is_nil())
+                        table.strings.erase(*key.string);
+                    else
+                        table.strings[*key.string] = std::move(value);
+                    return;
+                }
+                if (key.type != Value::Type::NUMBER)
+                    fail(key.is_nil() ? "table index is nil" : "table keys must be numbers or strings");
+                double k = key.number;
+                if (std::isnan(k))
+                    fail("table index is NaN");
+                if (k >= 1 && k == std::floor(k) && k <= static_cast<double>(table.array.size()) + 1)
+                {
+                    size_t index = static_cast<size_t>(k) - 1;
+                    if (index < table.array.size())
+                    {
+                        table.array[index] = std::move(value);
+                        while (!table.array.empty() && table.array.back().is_nil())
+                        {
+                            table.array.pop_back();
+                        }
+                        return;
+                    }
+                    if (!value.is_nil())
+                    {
+                        table.array.push_back(std::move(value));
+                        // Keys set earlier past the end may now continue the array.
+                        auto it = table.numbers.begin();
+                        while ((it = table.numbers.find(static_cast<double>(table.array.size() + 1))) != table.numbers.end())
+                        {
+                            table.array.push_back(std::move(it->second));
+                            table.numbers.erase(it);
+                        }
+                    }
+                    return;
+                }
+                if (value.is_nil())
+                    table.numbers.erase(k);
+                else
+                    table.numbers[k] = std::move(value);
+            }
+
+            double to_number(const Value &value)
+            {
+                double n;
+                if (value.type == Value::Type::NUMBER)
+                    return value.number;
+                if (value.type == Value::Type::STRING && parse_number(*value.string, n))
+                    return n;
+                fail(std::string("attempt to perform arithmetic on a ") + type_name(value) + " value");
+            }
+
+            std::string to_string(const Value &value, const char *action)
+            {
+                if (value.type == Value::Type::STRING)
+                    return *value.string;
+                if (value.type == Value::Type::NUMBER)
+                    return format_number(value.number);
+                fail(std::string("attempt to ") + action + " a " + type_name(value) + " value");
+            }
+
+            static bool equal(const Value &a, const Value &b)
+            {
+                if (a.type != b.type)
+                    return false;
+                switch (a.type)
+                {
+                case Value::Type::NIL:
+                    return true;
+                case Value::Type::BOOLEAN:
+                    return a.boolean == b.boolean;
+                case Value::Type::NUMBER:
+                    return a.number == b.number;
+                case Value::Type::STRING:
+                    return *a.string == *b.string;
+                case Value::Type::TABLE:
+                    return a.table == b.table;
+                }
+                return false;
+            }
+
+            bool less(const Value &a, const Value &b, bool or_equal)
+            {
+                if (a.type == Value::Type::NUMBER && b.type == Value::Type::NUMBER)
+                    return or_equal ? a.number <= b.number : a.number < b.number;
+                if (a.type == Value::Type::STRING && b.type == Value::Type::STRING)
+                    return or_equal ? *a.string <= *b.string : *a.string < *b.string;
+                fail(std::string("attempt to compare ") + type_name(a) + " with " + type_name(b));
+            }
+
+            double arithmetic(Op op, double a, double b)
+            {
+                switch (op)
+                {
+                case Op::ADD:
+                    return a + b;
+                case Op::SUB:
+                    return a - b;
+                case Op::MUL:
+                    return a * b;
+                case Op::DIV:
+                    return a / b;
+                case Op::MOD:
+                    return a - std::floor(a / b) * b;
+                default:
+                    return std::pow(a, b);
+                }
+            }
+
+            bool for_continues(size_t base)
+            {
+                double index = locals_[base].number;
+                double limit = locals_[base + 1].number;
+                return locals_[base + 2].number > 0 ? index <= limit : index >= limit;
+            }
+
+            Value execute()
+            {
+                const std::vector<Instruction> &code = program_.code;
+                uint64_t steps = 0;
+                while (true)
+                {
+                    if (++steps % CLOCK_INTERVAL == 0 && std::chrono::steady_clock::now() > deadline_)
+                        fail("script exceeded the time limit of " + std::to_string(time_limit_.count()) + " ms");
+                    const Instruction &in = code[pc_++];
+                    switch (in.op)
+                    {
+                    case Op::PUSH_NIL:
+                        stack_.emplace_back();
+                        break;
+                    case Op::PUSH_TRUE:
+                        stack_.push_back(Value::Boolean(true));
+                        break;
+                    case Op::PUSH_FALSE:
+                        stack_.push_back(Value::Boolean(false));
+                        break;
+                    case Op::CONSTANT:
+                        stack_.push_back(program_.constants[in.a]);
+                        break;
+                    case Op::GET_LOCAL:
+                        stack_.push_back(locals_[in.a]);
+                        break;
+                    case Op::SET_LOCAL:
+                        locals_[in.a] = pop();
+                        break;
+                    case Op::NEW_TABLE:
+                        stack_.push_back(Value::Of(new_table()));
+                        break;
+                    case Op::APPEND:
+                    {
+                        Value value = pop();
+                        set(stack_.back(), Value::Number(in.a), std::move(value));
+                        break;
+                    }
+                    case Op::SET_ITEM:
+                    {
+                        Value value = pop();
+                        Value key = pop();
+                        set(stack_.back(), key, std::move(value));
+                        break;
+                    }
+                    case Op::GET_INDEX:
+                    {
+                        Value key = pop();
+                        Value container = pop();
+                        stack_.push_back(get(container, key));
+                        break;
+                    }
+                    case Op::SET_INDEX:
+                    {
+                        Value value = pop();
+                        Value key = pop();
+                        Value container = pop();
+                        set(container, key, std::move(value));
+                        break;
+                    }
+                    case Op::ADD:
+                    case Op::SUB:
+                    case Op::MUL:
+                    case Op::DIV:
+                    case Op::MOD:
+                    case Op::POW:
+                    {
+                        Value b = pop();
+                        Value a = pop();
+                        stack_.push_back(Value::Number(arithmetic(in.op, to_number(a), to_number(b))));
+                        break;
+                    }
+                    case Op::CONCAT:
+                    {
+                        Value b = pop();
+                        Value a = pop();
+                        stack_.push_back(Value::String(to_string(a, "concatenate") + to_string(b, "concatenate")));
+                        break;
+                    }
+                    case Op::EQ:
+                    case Op::NE:
+                    {
+                        Value b = pop();
+                        Value a = pop();
+                        stack_.push_back(Value::Boolean(equal(a, b) == (in.op == Op::EQ)));
+                        break;
+                    }
+                    case Op::LT:
+                    case Op::LE:
+                    case Op::GT:
+                    case Op::GE:
+                    {
+                        Value b = pop();
+                        Value a = pop();
+                        bool result = in.op == Op::LT ? less(a, b, false) : in.op == Op::LE ? less(a, b, true)
+                                                                     : in.op == Op::GT   ? less(b, a, false)
+                                                                                         : less(b, a, true);
+                        stack_.push_back(Value::Boolean(result));
+                        break;
+                    }
+                    case Op::NEG:
+                        stack_.push_back(Value::Number(-to_number(pop())));
+                        break;
+                    case Op::NOT:
+                        stack_.push_back(Value::Boolean(!pop().truthy()));
+                        break;
+                    case Op::LEN:
+                    {
+                        Value value = pop();
+                        if (value.type == Value::Type::STRING)
+                            stack_.push_back(Value::Number(static_cast<double>(value.string->size())));
+                        else if (value.type == Value::Type::TABLE)
+                            stack_.push_back(Value::Number(static_cast<double>(value.table->array.size())));
+                        else
+                            fail(std::string("attempt to get length of a ") + type_name(value) + " value");
+                        break;
+                    }
+                    case Op::JUMP:
+                        pc_ = in.a;
+                        break;
+                    case Op::JUMP_IF_FALSE:
+                        if (!pop().truthy())
+                            pc_ = in.a;
+                        break;
+                    case Op::AND:
+                        if (!stack_.back().truthy())
+                            pc_ = in.a;
+                        else
+                            stack_.pop_back();
+                        break;
+                    case Op::OR:
+                        if (stack_.back().truthy())
+                            pc_ = in.a;
+                        else
+                            stack_.pop_back();
+                        break;
+                    case Op::CALL:
+                    {
+                        std::vector<Value> args(std::make_move_iterator(stack_.end() - in.b), std::make_move_iterator(stack_.end()));
+                        stack_.resize(stack_.size() - in.b);
+                        stack_.push_back(builtin(static_cast<Builtin>(in.a), args));
+                        break;
+                    }
+                    case Op::POP:
+                        stack_.pop_back();
+                        break;
+                    case Op::FOR_PREP:
+                        for (uint32_t i = 0; i < 3; ++i)
+                        {
+                            Value &slot = locals_[in.a + i];
+                            double n;
+                            if (slot.type == Value::Type::STRING && parse_number(*slot.string, n))
+                                slot = Value::Number(n);
+                            if (slot.type != Value::Type::NUMBER)
+                                fail(i == 0 ? "'for' initial value must be a number" : i == 1 ? "'for' limit must be a number"
+                                                                                            : "'for' step must be a number");
+                        }
+                        if (!for_continues(in.a))
+                            pc_ = in.b;
+                        else
+                            locals_[in.a + 3] = locals_[in.a];
+                        break;
+                    case Op::FOR_LOOP:
+                        locals_[in.a].number += locals_[in.a + 2].number;
+                        if (for_continues(in.a))
+                        {
+                            locals_[in.a + 3] = locals_[in.a];
+                            pc_ = in.b;
+                        }
+                        break;
+                    case Op::RETURN:
+                        return pop();
+                    }
+                }
+            }
+
+            static Value reply_table(const char *field, std::string text, Table *table)
+            {
+                table->strings[field] = Value::String(std::move(text));
+                return Value::Of(table);
+            }
+
+            // Converts what a command returned as Redis does for Lua: nil
+            // becomes false, a status a table with an ok field and an error
+            // a table with an err field, which redis.call() raises instead.
+            Value from_response(Response &&response, bool raise)
+            {
+                switch (response.status)
+                {
+                case ResponseStatus::OK:
+                    return reply_table("ok", "OK", new_table());
+                case ResponseStatus::ERROR:
+                    if (raise)
+                        throw ScriptError{"ERR " + response.message};
+                    return reply_table("err", "ERR " + response.message, new_table());
+                case ResponseStatus::STRING:
+                    return Value::String(std::move(response.message));
+                case ResponseStatus::VIEW:
+                    return Value::String(std::string(response.view));
+                case ResponseStatus::NIL:
+                    return Value::Boolean(false);
+                case ResponseStatus::INTEGER:
+                    return Value::Number(static_cast<double>(response.int_value));
+                case ResponseStatus::ARRAY:
+                {
+                    Table *table = new_table();
+                    for (std::string &item : response.array_data)
+                    {
+                        table->array.push_back(Value::String(std::move(item)));
+                    }
+                    return Value::Of(table);
+                }
+                case ResponseStatus::ENCODED:
+                {
+                    std::string_view resp = response.message;
+                    return parse_reply(resp, raise);
+                }
+                }
+                return Value();
+            }
+
+            // Replies built straight into RESP are parsed back; errors
+            // nested in arrays become err tables.
+            Value parse_reply(std::string_view &resp, bool raise)
+            {
+                size_t eol = resp.find("\r\n");
+                if (resp.empty() || eol == std::string_view::npos)
+                    fail("malformed reply from command");
+                char type = resp[0];
+                std::string line(resp.substr(1, eol - 1));
+                resp.remove_prefix(eol + 2);
+                switch (type)
+                {
+                case '+':
+                    return reply_table("ok", line, new_table());
+                case '-':
+                    if (raise)
+                        throw ScriptError{line};
+                    return reply_table("err", line, new_table());
+                case ':':
+                    return Value::Number(std::strtod(line.c_str(), nullptr));
+                case '$':
+                {
+                    long long length = std::strtoll(line.c_str(), nullptr, 10);
+                    if (length < 0)
+                        return Value::Boolean(false);
+                    if (resp.size() < static_cast<size_t>(length) + 2)
+                        fail("malformed reply from command");
+                    Value value = Value::String(std::string(resp.substr(0, length)));
+                    resp.remove_prefix(length + 2);
+                    return value;
+                }
+                case '*':
+                {
+                    long long count = std::strtoll(line.c_str(), nullptr, 10);
+                    if (count < 0)
+                        return Value::Boolean(false);
+                    Table *table = new_table();
+                    for (long long i = 0; i < count; ++i)
+                    {
+                        table->array.push_back(parse_reply(resp, false));
+                    }
+                    return Value::Of(table);
+                }
+                }
+                fail("malformed reply from command");
+            }
+
+            // The script's result as a reply: numbers are truncated to
+            // integers, true is 1, false and nil are nil, and tables are
+            // arrays up to their first nil unless they carry ok or err.
+            void append_reply(std::string &out, const Value &value, int depth)
+            {
+                switch (value.type)
+                {
+                case Value::Type::NIL:
+                    Response::append_nil(out);
+                    return;
+                case Value::Type::BOOLEAN:
+                    if (value.boolean)
+                        Response::append_integer(out, 1);
+                    else
+                        Response::append_nil(out);
+                    return;
+                case Value::Type::NUMBER:
+                {
+                    double n = std::trunc(value.number);
+                    long long integer = std::isnan(n) ? 0 : n >= 9.2e18 ? INT64_MAX
+                                                        : n <= -9.2e18  ? INT64_MIN
+                                                                        : static_cast<long long>(n);
+                    Response::append_integer(out, integer);
+                    return;
+                }
+                case Value::Type::STRING:
+                    Response::append_bulk(out, *value.string);
+                    return;
+                case Value::Type::TABLE:
+                    break;
+                }
+                const Table &table = *value.table;
+                if (depth >= MAX_REPLY_DEPTH)
+                {
+                    Response::append_nil(out);
+                    return;
+                }
+                auto err = table.strings.find("err");
+                if (err != table.strings.end() && err->second.type == Value::Type::STRING)
+                {
+                    out += '-';
+                    out += *err->second.string;
+                    out += "\r\n";
+                    return;
+                }
+                auto ok = table.strings.find("ok");
+                if (ok != table.strings.end() && ok->second.type == Value::Type::STRING)
+                {
+                    Response::append_status(out, *ok->second.string);
+                    return;
+                }
+                size_t count = 0;
+                while (count < table.array.size() && !table.array[count].is_nil())
+                {
+                    ++count;
+                }
+                Response::append_array_header(out, count);
+                for (size_t i = 0; i < count; ++i)
+                {
+                    append_reply(out, table.array[i], depth + 1);
+                }
+            }
+
+            Value redis_call(const std::vector<Value> &args, bool raise)
+            {
+                std::vector<std::string> words;
+                for (const Value &arg : args)
+                {
+                    if (arg.type == Value::Type::STRING)
+                        words.push_back(*arg.string);
+                    else if (arg.type == Value::Type::NUMBER)
+                        words.push_back(format_number(arg.number));
+                    else
+                        fail("command arguments must be strings or numbers");
+                }
+                Command command;
+                command.name = words.front();
+                command.args.assign(words.begin() + 1, words.end());
+                return from_response(call_(command), raise);
+            }
+
+            Value builtin(Builtin id, std::vector<Value> &args)
+            {
+                switch (id)
+                {
+                case Builtin::REDIS_CALL:
+                case Builtin::REDIS_PCALL:
+                    return redis_call(args, id == Builtin::REDIS_CALL);
+                case Builtin::REDIS_ERROR_REPLY:
+                    return reply_table("err", to_string(args[0], "use as error"), new_table());
+                case Builtin::REDIS_STATUS_REPLY:
+                    return reply_table("ok", to_string(args[0], "use as status"), new_table());
+                case Builtin::TONUMBER:
+                {
+                    double n;
+                    if (args[0].type == Value::Type::NUMBER)
+                        return args[0];
+                    if (args[0].type == Value::Type::STRING && parse_number(*args[0].string, n))
+                        return Value::Number(n);
+                    return Value();
+                }
+                case Builtin::TOSTRING:
+                    if (args[0].type == Value::Type::NIL)
+                        return Value::String("nil");
+                    if (args[0].type == Value::Type::BOOLEAN)
+                        return Value::String(args[0].boolean ? "true" : "false");
+                    if (args[0].type == Value::Type::TABLE)
+                        return Value::String("table");
+                    return Value::String(to_string(args[0], "convert"));
+                case Builtin::TYPE:
+                    return Value::String(type_name(args[0]));
+                case Builtin::MATH_FLOOR:
+                    return Value::Number(std::floor(to_number(args[0])));
+                case Builtin::MATH_CEIL:
+                    return Value::Number(std::ceil(to_number(args[0])));
+                case Builtin::MATH_ABS:
+                    return Value::Number(std::fabs(to_number(args[0])));
+                case Builtin::MATH_MIN:
+                case Builtin::MATH_MAX:
+                {
+                    double result = to_number(args[0]);
+                    for (size_t i = 1; i < args.size(); ++i)
+                    {
+                        double n = to_number(args[i]);
+                        result = id == Builtin::MATH_MIN ? std::min(result, n) : std::max(result, n);
+                    }
+                    return Value::Number(result);
+                }
+                case Builtin::STRING_LEN:
+                    return Value::Number(static_cast<double>(to_string(args[0], "get length of").size()));
+                case Builtin::STRING_SUB:
+                {
+                    std::string s = to_string(args[0], "take a substring of");
+                    long long size = static_cast<long long>(s.size());
+                    long long start = static_cast<long long>(to_number(args[1]));
+                    long long end = args.size() > 2 ? static_cast<long long>(to_number(args[2])) : -1;
+                    if (start < 0)
+                        start = std::max(size + start + 1, 1LL);
+                    else if (start == 0)
+                        start = 1;
+                    if (end < 0)
+                        end = size + end + 1;
+                    end = std::min(end, size);
+                    if (start > end)
+                        return Value::String("");
+                    return Value::String(s.substr(start - 1, end - start + 1));
+                }
+                case Builtin::STRING_UPPER:
+                case Builtin::STRING_LOWER:
+                {
+                    std::string s = to_string(args[0], "change the case of");
+                    for (char &c : s)
+                    {
+                        c = id == Builtin::STRING_UPPER ? std::toupper(static_cast<unsigned char>(c))
+                                                        : std::tolower(static_cast<unsigned char>(c));
+                    }
+                    return Value::String(std::move(s));
+                }
+                case Builtin::TABLE_INSERT:
+                {
+                    if (args[0].type != Value::Type::TABLE)
+                        fail("bad argument #1 to 'insert' (table expected)");
+                    std::vector<Value> &array = args[0].table->array;
+                    if (args.size() == 2)
+                    {
+                        set(args[0], Value::Number(static_cast<double>(array.size() + 1)), std::move(args[1]));
+                        return Value();
+                    }
+                    double position = to_number(args[1]);
+                    if (position < 1 || position > static_cast<double>(array.size()) + 1 || position != std::floor(position))
+                        fail("bad argument #2 to 'insert' (position out of bounds)");
+                    if (!args[2].is_nil())
+                        array.insert(array.begin() + static_cast<size_t>(position) - 1, std::move(args[2]));
+                    return Value();
+                }
+                }
+                return Value();
+            }
+        };
+    }
+
+    Script::Script(std::unique_ptr<Program> program) : program_(std::move(program))
+    {
+    }
+
+    Script::~Script() = default;
+
+    std::shared_ptr<const Script> Script::compile(std::string_view source, std::string &error)
+    {
+        auto program = std::make_unique<Program>();
+        try
+        {
+            Compiler(source, *program).compile();
+        }
+        catch (const CompileError &e)
+        {
+            error = "user_script:" + std::to_string(e.line) + ": " + e.message;
+            return nullptr;
+        }
+        return std::shared_ptr<const Script>(new Script(std::move(program)));
+    }
+
+    Response Script::run(const std::vector<std::string_view> &keys, const std::vector<std::string_view> &argv, const Call &call,
+                         std::chrono::milliseconds time_limit) const
+    {
+        return Machine(*program_, call, time_limit).run(keys, argv);
+    }
+
+    ScriptCache::ScriptCache(int64_t time_limit_ms) : time_limit_(std::max<int64_t>(time_limit_ms, 1))
+    {
+    }
+
+    std::shared_ptr<const Script> ScriptCache::load(std::string_view source, std::string &sha, std::string &error)
+    {
+        sha = sha1_hex(source);
+        if (auto script = find(sha))
+            return script;
+        auto script = Script::compile(source, error);
+        if (!script)
+            return nullptr;
+        std::unique_lock<std::shared_mutex> lock(mutex_);
+        return scripts_.emplace(sha, std::move(script)).first->second;
+    }
+
+    std::shared_ptr<const Script> ScriptCache::find(std::string_view sha) const
+    {
+        std::string key(sha);
+        for (char &c : key)
+        {
+            c = std::tolower(static_cast<unsigned char>(c));
+        }
+        std::shared_lock<std::shared_mutex> lock(mutex_);
+        auto it = scripts_.find(key);
+        return it == scripts_.end() ? nullptr : it->second;
+    }
+
+    void ScriptCache::flush()
+    {
+        std::unique_lock<std::shared_mutex> lock(mutex_);
+        scripts_.clear();
+    }
+
+    size_t ScriptCache::size() const
+    {
+        std::shared_lock<std::shared_mutex> lock(mutex_);
+        return scripts_.size();
+    }
+}
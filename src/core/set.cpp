@@ -0,0 +1,390 @@
+#include "core/set.hpp"
+#include "core/value.hpp"
+#include <algorithm>
+#include <charconv>
+#include <cstring>
+
+namespace core
+{
+    namespace
+    {
+        size_t max_intset_entries = 512;
+        size_t max_listpack_entries = 128;
+        size_t max_listpack_value = 64;
+
+        // Sets below this size ratio are merged a block at a time rather
+        // than galloped.
+        const size_t GALLOP_RATIO = 16;
+
+        size_t put_length(char *p, size_t n)
+        {
+            size_t size = 0;
+            while (n >= 0x80)
+            {
+                p[size++] = static_cast<char>(n | 0x80);
+                n >>= 7;
+            }
+            p[size++] = static_cast<char>(n);
+            return size;
+        }
+
+        size_t get_length(const char *p, size_t &n)
+        {
+            n = 0;
+            for (size_t i = 0, shift = 0;; ++i, shift += 7)
+            {
+                uint8_t byte = static_cast<uint8_t>(p[i]);
+                n |= static_cast<size_t>(byte & 0x7f) << shift;
+                if (!(byte & 0x80))
+                    return i + 1;
+            }
+        }
+
+        std::string_view format_int(int64_t value, char *buffer, size_t size)
+        {
+            char *end = std::to_chars(buffer, buffer + size, value).ptr;
+            return std::string_view(buffer, end - buffer);
+        }
+    }
+
+    void Set::configure(size_t intset_entries, size_t listpack_entries, size_t listpack_value)
+    {
+        max_intset_entries = intset_entries;
+        max_listpack_entries = listpack_entries;
+        max_listpack_value = listpack_value;
+    }
+
+    Set::Set() = default;
+
+    size_t Set::size() const
+    {
+        switch (kind())
+        {
+        case Kind::INTSET:
+            return std::get<Ints>(data_).size();
+        case Kind::LISTPACK:
+            return std::get<Listpack>(data_).count;
+        default:
+            return std::get<Table>(data_).size();
+        }
+    }
+
+    size_t Set::memory_usage() const
+    {
+        size_t total = heap_size(sizeof(Set));
+        switch (kind())
+        {
+        case Kind::INTSET:
+        {
+            size_t capacity = std::get<Ints>(data_).capacity();
+            return total + (capacity ? heap_size(capacity * sizeof(int64_t)) : 0);
+        }
+        case Kind::LISTPACK:
+        {
+            const std::string &bytes = std::get<Listpack>(data_).bytes;
+            return total + (bytes.capacity() > 15 ? heap_size(bytes.capacity() + 1) : 0);
+        }
+        default:
+            return total + table_bytes_ + std::get<Table>(data_).table_bytes();
+        }
+    }
+
+    bool Set::listpack_find(std::string_view member, size_t *offset, size_t *size) const
+    {
+        const std::string &bytes = std::get<Listpack>(data_).bytes;
+        size_t pos = 0;
+        while (pos < bytes.size())
+        {
+            size_t len;
+            size_t header = get_length(bytes.data() + pos, len);
+            if (len == member.size() && std::memcmp(bytes.data() + pos + header, member.data(), len) == 0)
+            {
+                if (offset)
+                    *offset = pos;
+                if (size)
+                    *size = header + len;
+                return true;
+            }
+            pos += header + len;
+        }
+        return false;
+    }
+
+    void Set::to_listpack()
+    {
+        Listpack listpack;
+        char buffer[24];
+        for (int64_t value : std::get<Ints>(data_))
+        {
+            std::string_view member = format_int(value, buffer, sizeof(buffer));
+            char header[10];
+            listpack.bytes.append(header, put_length(header, member.size()));
+            listpack.bytes.append(member);
+        }
+        listpack.count = std::get<Ints>(data_).size();
+        data_ = std::move(listpack);
+    }
+
+    void Set::table_insert(std::string_view member)
+    {
+        Table &table = std::get<Table>(data_);
+        if (table.insert(member, std::monostate()).second)
+            table_bytes_ += string_heap_size(member);
+    }
+
+    void Set::to_table()
+    {
+        std::vector<std::string> members(begin(), end());
+        data_.emplace<Table>().reserve(members.size());
+        table_bytes_ = 0;
+        for (const std::string &member : members)
+        {
+            table_insert(member);
+        }
+    }
+
+    void Set::reserve(size_t n)
+    {
+        if (kind() != Kind::HASHTABLE && n > std::max(max_intset_entries, max_listpack_entries))
+            to_table();
+        if (kind() == Kind::HASHTABLE)
+            std::get<Table>(data_).reserve(n);
+    }
+
+    bool Set::add(std::string_view member)
+    {
+        switch (kind())
+        {
+        case Kind::INTSET:
+        {
+            Ints &ints = std::get<Ints>(data_);
+            int64_t value;
+            if (parse_canonical_int(member, value))
+            {
+                auto it = std::lower_bound(ints.begin(), ints.end(), value);
+                if (it != ints.end() && *it == value)
+                    return false;
+                if (ints.size() < max_intset_entries)
+                {
+                    ints.insert(it, value);
+                    return true;
+                }
+            }
+            if (ints.size() < max_listpack_entries && member.size() <= max_listpack_value)
+                to_listpack();
+            else
+                to_table();
+            return add(member);
+        }
+        case Kind::LISTPACK:
+        {
+            if (listpack_find(member, nullptr, nullptr))
+                return false;
+            Listpack &listpack = std::get<Listpack>(data_);
+            if (listpack.count >= max_listpack_entries || member.size() > max_listpack_value)
+            {
+                to_table();
+                table_insert(member);
+                return true;
+            }
+            char header[10];
+            listpack.bytes.append(header, put_length(header, member.size()));
+            listpack.bytes.append(member);
+            listpack.count++;
+            return true;
+        }
+        default:
+        {
+            size_t before = std::get<Table>(data_).size();
+            table_insert(member);
+            return std::get<Table>(data_).size() != before;
+        }
+        }
+    }
+
+    bool Set::remove(std::string_view member)
+    {
+        switch (kind())
+        {
+        case Kind::INTSET:
+        {
+            Ints &ints = std::get<Ints>(data_);
+            int64_t value;
+            if (!parse_canonical_int(member, value))
+                return false;
+            auto it = std::lower_bound(ints.begin(), ints.end(), value);
+            if (it == ints.end() || *it != value)
+                return false;
+            ints.erase(it);
+            return true;
+        }
+        case Kind::LISTPACK:
+        {
+            size_t offset, size;
+            if (!listpack_find(member, &offset, &size))
+                return false;
+            Listpack &listpack = std::get<Listpack>(data_);
+            listpack.bytes.erase(offset, size);
+            listpack.count--;
+            return true;
+        }
+        default:
+        {
+            if (!std::get<Table>(data_).erase(member))
+                return false;
+            table_bytes_ -= string_heap_size(member);
+            return true;
+        }
+        }
+    }
+
+    bool Set::contains(std::string_view member) const
+    {
+        switch (kind())
+        {
+        case Kind::INTSET:
+        {
+            const Ints &ints = std::get<Ints>(data_);
+            int64_t value;
+            return parse_canonical_int(member, value) && std::binary_search(ints.begin(), ints.end(), value);
+        }
+        case Kind::LISTPACK:
+            return listpack_find(member, nullptr, nullptr);
+        default:
+            return std::get<Table>(data_).find(member) != nullptr;
+        }
+    }
+
+    Set::const_iterator Set::begin() const
+    {
+        const_iterator it;
+        it.set_ = this;
+        if (kind() == Kind::HASHTABLE)
+        {
+            auto *entry = std::get<Table>(data_).next(it.position_);
+            it.member_ = entry ? &entry->key : nullptr;
+        }
+        return it;
+    }
+
+    Set::const_iterator Set::end() const
+    {
+        const_iterator it;
+        it.set_ = this;
+        it.index_ = size();
+        return it;
+    }
+
+    std::string_view Set::const_iterator::operator*() const
+    {
+        switch (set_->kind())
+        {
+        case Kind::INTSET:
+            return format_int(std::get<Ints>(set_->data_)[index_], buffer_, sizeof(buffer_));
+        case Kind::LISTPACK:
+        {
+            const std::string &bytes = std::get<Listpack>(set_->data_).bytes;
+            size_t len;
+            size_t header = get_length(bytes.data() + offset_, len);
+            return std::string_view(bytes.data() + offset_ + header, len);
+        }
+        default:
+            return *member_;
+        }
+    }
+
+    Set::const_iterator &Set::const_iterator::operator++()
+    {
+        switch (set_->kind())
+        {
+        case Kind::INTSET:
+            break;
+        case Kind::LISTPACK:
+        {
+            size_t len;
+            offset_ += get_length(std::get<Listpack>(set_->data_).bytes.data() + offset_, len);
+            offset_ += len;
+            break;
+        }
+        default:
+        {
+            auto *entry = std::get<Table>(set_->data_).next(position_);
+            member_ = entry ? &entry->key : nullptr;
+            break;
+        }
+        }
+        ++index_;
+        return *this;
+    }
+
+    size_t Set::scan(size_t cursor, const std::function<void(std::string_view member)> &visit) const
+    {
+        if (kind() == Kind::HASHTABLE)
+            return std::get<Table>(data_).scan(cursor, [&visit](const Table::Entry &entry)
+                                               { visit(entry.key); });
+        for (auto it = begin(); it != end(); ++it)
+        {
+            visit(*it);
+        }
+        return 0;
+    }
+
+    void Set::intersect_sorted(const std::vector<int64_t> &a, const std::vector<int64_t> &b, std::vector<int64_t> &out)
+    {
+        if (a.size() > b.size())
+        {
+            intersect_sorted(b, a, out);
+            return;
+        }
+        const int64_t *first = b.data();
+        const int64_t *last = b.data() + b.size();
+        const int64_t *pos = first;
+        if (a.size() * GALLOP_RATIO < b.size())
+        {
+            for (int64_t value : a)
+            {
+                // Exponential search from the last match, then binary search
+                // within the bracket it found.
+                size_t step = 1;
+                const int64_t *low = pos;
+                while (low + step < last && low[step] < value)
+                {
+                    low += step;
+                    step <<= 1;
+                }
+                pos = std::lower_bound(low, std::min(low + step + 1, last), value);
+                if (pos == last)
+                    return;
+                if (*pos == value)
+                    out.push_back(value);
+            }
+            return;
+        }
+        // Everything before pos is smaller than the current value. Compare
+        // it against four elements at once; the compiler turns the or of
+        // equalities into vector compares.
+        size_t i = 0;
+        while (i < a.size() && pos + 4 <= last)
+        {
+            int64_t value = a[i];
+            if (pos[3] < value)
+            {
+                pos += 4;
+                continue;
+            }
+            bool match = (pos[0] == value) | (pos[1] == value) | (pos[2] == value) | (pos[3] == value);
+            if (match)
+                out.push_back(value);
+            while (*pos < value)
+                ++pos;
+            ++i;
+        }
+        for (; i < a.size() && pos < last; ++i)
+        {
+            while (pos < last && *pos < a[i])
+                ++pos;
+            if (pos < last && *pos == a[i])
+                out.push_back(a[i]);
+        }
+    }
+}
@@ -0,0 +1,244 @@
+#include "core/slab.hpp"
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <vector>
+
+namespace core
+{
+    namespace
+    {
+        // 16-byte steps up to 128, 32-byte steps up to 256, then 64.
+        const size_t CLASS_COUNT = 16;
+        const size_t SLAB_BYTES = 64 * 1024;
+        // Free blocks move between a thread and the shared pool BATCH at a
+        // time, once a thread holds more than twice that.
+        const size_t BATCH = 64;
+
+        size_t class_of(size_t size)
+        {
+            if (size <= 128)
+                return size == 0 ? 0 : (size - 1) / 16;
+            if (size <= 256)
+                return 8 + (size - 129) / 32;
+            return 12 + (size - 257) / 64;
+        }
+
+        size_t class_size(size_t index)
+        {
+            if (index < 8)
+                return (index + 1) * 16;
+            if (index < 12)
+                return 128 + (index - 7) * 32;
+            return 256 + (index - 11) * 64;
+        }
+
+        struct FreeBlock
+        {
+            FreeBlock *next;
+        };
+
+        struct Batch
+        {
+            FreeBlock *head;
+            size_t count;
+        };
+
+        // Written by its owning thread only, like the counters in stats.hpp.
+        void bump(std::atomic<uint64_t> &counter)
+        {
+            counter.store(counter.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        }
+
+        struct ThreadCache;
+
+        struct Shared
+        {
+            std::mutex mutex;
+            std::vector<Batch> batches[CLASS_COUNT];
+            std::vector<const ThreadCache *> caches;
+            // Counts of threads that exited.
+            uint64_t allocations[CLASS_COUNT] = {};
+            uint64_t frees[CLASS_COUNT] = {};
+            uint64_t large_allocations = 0;
+            std::atomic<size_t> reserved{0};
+        };
+
+        // Never destroyed, so threads exiting late can still hand blocks back.
+        Shared &shared()
+        {
+            static Shared *instance = new Shared();
+            return *instance;
+        }
+
+        thread_local bool cache_destroyed = false;
+
+        struct ThreadCache
+        {
+            FreeBlock *heads[CLASS_COUNT] = {};
+            size_t counts[CLASS_COUNT] = {};
+            // Uncarved rest of the class's current slab.
+            char *next[CLASS_COUNT] = {};
+            char *limit[CLASS_COUNT] = {};
+            std::atomic<uint64_t> allocations[CLASS_COUNT] = {};
+            std::atomic<uint64_t> frees[CLASS_COUNT] = {};
+            std::atomic<uint64_t> large_allocations{0};
+
+            ThreadCache()
+            {
+                Shared &pool = shared();
+                std::lock_guard<std::mutex> lock(pool.mutex);
+                pool.caches.push_back(this);
+            }
+
+            ~ThreadCache()
+            {
+                Shared &pool = shared();
+                std::lock_guard<std::mutex> lock(pool.mutex);
+                for (size_t c = 0; c < CLASS_COUNT; ++c)
+                {
+                    if (heads[c])
+                        pool.batches[c].push_back(Batch{heads[c], counts[c]});
+                    pool.allocations[c] += allocations[c].load(std::memory_order_relaxed);
+                    pool.frees[c] += frees[c].load(std::memory_order_relaxed);
+                }
+                pool.large_allocations += large_allocations.load(std::memory_order_relaxed);
+                pool.caches.erase(std::find(pool.caches.begin(), pool.caches.end(), this));
+                cache_destroyed = true;
+            }
+
+            void *allocate(size_t c)
+            {
+                bump(allocations[c]);
+                if (!heads[c] && !refill(c))
+                    return carve(c);
+                FreeBlock *block = heads[c];
+                heads[c] = block->next;
+                counts[c]--;
+                return block;
+            }
+
+            void release(size_t c, void *block)
+            {
+                bump(frees[c]);
+                FreeBlock *freed = static_cast<FreeBlock *>(block);
+                freed->next = heads[c];
+                heads[c] = freed;
+                if (++counts[c] <= 2 * BATCH)
+                    return;
+                FreeBlock *last = heads[c];
+                for (size_t i = 1; i < BATCH; ++i)
+                {
+                    last = last->next;
+                }
+                Batch batch{heads[c], BATCH};
+                heads[c] = last->next;
+                last->next = nullptr;
+                counts[c] -= BATCH;
+                Shared &pool = shared();
+                std::lock_guard<std::mutex> lock(pool.mutex);
+                pool.batches[c].push_back(batch);
+            }
+
+            bool refill(size_t c)
+            {
+                Shared &pool = shared();
+                std::lock_guard<std::mutex> lock(pool.mutex);
+                if (pool.batches[c].empty())
+                    return false;
+                heads[c] = pool.batches[c].back().head;
+                counts[c] = pool.batches[c].back().count;
+                pool.batches[c].pop_back();
+                return true;
+            }
+
+            void *carve(size_t c)
+            {
+                size_t size = class_size(c);
+                if (static_cast<size_t>(limit[c] - next[c]) < size)
+                {
+                    next[c] = static_cast<char *>(::operator new(SLAB_BYTES));
+                    limit[c] = next[c] + SLAB_BYTES;
+                    shared().reserved.fetch_add(SLAB_BYTES, std::memory_order_relaxed);
+                }
+                void *block = next[c];
+                next[c] += size;
+                return block;
+            }
+        };
+
+        ThreadCache &local_cache()
+        {
+            thread_local ThreadCache cache;
+            return cache;
+        }
+    }
+
+    void *Slab::allocate(size_t size)
+    {
+        if (size > MAX_SIZE)
+        {
+            if (!cache_destroyed)
+                bump(local_cache().large_allocations);
+            return ::operator new(size);
+        }
+        // Blocks are plain memory of their class size, so one allocated on
+        // its own can join a free list later like any other.
+        if (cache_destroyed)
+            return ::operator new(class_size(class_of(size)));
+        return local_cache().allocate(class_of(size));
+    }
+
+    void Slab::deallocate(void *block, size_t size)
+    {
+        if (size > MAX_SIZE)
+        {
+            ::operator delete(block);
+            return;
+        }
+        size_t c = class_of(size);
+        if (cache_destroyed)
+        {
+            Shared &pool = shared();
+            std::lock_guard<std::mutex> lock(pool.mutex);
+            FreeBlock *freed = static_cast<FreeBlock *>(block);
+            freed->next = nullptr;
+            pool.batches[c].push_back(Batch{freed, 1});
+            return;
+        }
+        local_cache().release(c, block);
+    }
+
+    size_t Slab::block_size(size_t size)
+    {
+        return size > MAX_SIZE ? size : class_size(class_of(size));
+    }
+
+    Slab::Stats Slab::stats()
+    {
+        Shared &pool = shared();
+        std::lock_guard<std::mutex> lock(pool.mutex);
+        Stats stats{0, 0, pool.large_allocations, pool.reserved.load(std::memory_order_relaxed), 0};
+        for (size_t c = 0; c < CLASS_COUNT; ++c)
+        {
+            uint64_t allocations = pool.allocations[c];
+            uint64_t frees = pool.frees[c];
+            for (const ThreadCache *cache : pool.caches)
+            {
+                allocations += cache->allocations[c].load(std::memory_order_relaxed);
+                frees += cache->frees[c].load(std::memory_order_relaxed);
+            }
+            stats.allocations += allocations;
+            stats.frees += frees;
+            // A block freed on another thread than it came from can be
+            // counted there first; never report less than nothing.
+            if (allocations > frees)
+                stats.used_bytes += (allocations - frees) * class_size(c);
+        }
+        for (const ThreadCache *cache : pool.caches)
+        {
+            stats.large_allocations += cache->large_allocations.load(std::memory_order_relaxed);
+        }
+        return stats;
+    }
+}
@@ -0,0 +1,136 @@
+#include "core/slowlog.hpp"
+#include "core/stats.hpp"
+#include <algorithm>
+#include <cstring>
+#include <ctime>
+
+namespace core
+{
+    namespace
+    {
+        // Argument bytes kept per entry; arguments that do not fit are
+        // summarized like those beyond MAX_ARGS.
+        const size_t ARG_BYTES = 1024;
+    }
+
+    struct SlowLog::Slot
+    {
+        uint64_t id;
+        int64_t time;
+        uint64_t duration_usec;
+        // Of the command, counting the name, and of the arguments kept.
+        uint32_t argc;
+        uint32_t stored;
+        // Original length of each kept argument; the first MAX_ARG_LENGTH
+        // bytes of each follow one another in bytes.
+        uint32_t lengths[MAX_ARGS];
+        char bytes[ARG_BYTES];
+        uint32_t client_length;
+        char client[MAX_CLIENT_LENGTH];
+    };
+
+    struct SlowLog::Ring
+    {
+        std::mutex mutex;
+        std::unique_ptr<Slot[]> slots;
+        size_t next = 0;
+        size_t count = 0;
+
+        explicit Ring(size_t size) : slots(new Slot[size]) {}
+    };
+
+    SlowLog::SlowLog(size_t shards, size_t max_len, int64_t threshold_usec)
+        : max_len_(max_len), enabled_(threshold_usec >= 0 && max_len > 0),
+          threshold_ticks_(threshold_usec > 0 ? static_cast<uint64_t>(threshold_usec * ticks_per_usec()) : 0)
+    {
+        for (size_t i = 0; i < shards; ++i)
+        {
+            rings_.push_back(std::make_unique<Ring>(max_len));
+        }
+    }
+
+    SlowLog::~SlowLog() = default;
+
+    void SlowLog::record(size_t shard, const Command &command, uint64_t elapsed_ticks)
+    {
+        Ring &ring = *rings_[shard];
+        std::lock_guard<std::mutex> lock(ring.mutex);
+        Slot &slot = ring.slots[ring.next];
+        ring.next = (ring.next + 1) % max_len_;
+        ring.count = std::min(ring.count + 1, max_len_);
+
+        slot.id = next_id_.fetch_add(1, std::memory_order_relaxed);
+        slot.time = std::time(nullptr);
+        slot.duration_usec = static_cast<uint64_t>(elapsed_ticks / ticks_per_usec());
+        slot.argc = static_cast<uint32_t>(command.args.size() + 1);
+        // Leaves room for the "more arguments" note when some are dropped.
+        size_t keep = slot.argc > MAX_ARGS ? MAX_ARGS - 1 : slot.argc;
+        size_t used = 0;
+        slot.stored = 0;
+        for (size_t i = 0; i < keep; ++i)
+        {
+            std::string_view arg = i == 0 ? command.name : command.args[i - 1];
+            size_t size = std::min(arg.size(), MAX_ARG_LENGTH);
+            if (used + size > ARG_BYTES)
+                break;
+            std::memcpy(slot.bytes + used, arg.data(), size);
+            slot.lengths[slot.stored++] = static_cast<uint32_t>(arg.size());
+            used += size;
+        }
+        slot.client_length = static_cast<uint32_t>(std::min(command.client.size(), MAX_CLIENT_LENGTH));
+        std::memcpy(slot.client, command.client.data(), slot.client_length);
+    }
+
+    std::vector<SlowLog::Entry> SlowLog::get(int64_t count) const
+    {
+        std::vector<Entry> entries;
+        for (const auto &ring : rings_)
+        {
+            std::lock_guard<std::mutex> lock(ring->mutex);
+            for (size_t i = 0; i < ring->count; ++i)
+            {
+                const Slot &slot = ring->slots[(ring->next + max_len_ - 1 - i) % max_len_];
+                Entry entry{slot.id, slot.time, slot.duration_usec, std::string(slot.client, slot.client_length), {}};
+                size_t offset = 0;
+                for (size_t j = 0; j < slot.stored; ++j)
+                {
+                    size_t length = slot.lengths[j];
+                    size_t size = std::min<size_t>(length, MAX_ARG_LENGTH);
+                    std::string arg(slot.bytes + offset, size);
+                    if (size < length)
+                        arg += "... (" + std::to_string(length - size) + " more bytes)";
+                    entry.argv.push_back(std::move(arg));
+                    offset += size;
+                }
+                if (slot.stored < slot.argc)
+                    entry.argv.push_back("... (" + std::to_string(slot.argc - slot.stored) + " more arguments)");
+                entries.push_back(std::move(entry));
+            }
+        }
+        std::sort(entries.begin(), entries.end(), [](const Entry &a, const Entry &b)
+                  { return a.id > b.id; });
+        if (count >= 0 && entries.size() > static_cast<size_t>(count))
+            entries.resize(count);
+        return entries;
+    }
+
+    size_t SlowLog::len() const
+    {
+        size_t total = 0;
+        for (const auto &ring : rings_)
+        {
+            std::lock_guard<std::mutex> lock(ring->mutex);
+            total += ring->count;
+        }
+        return total;
+    }
+
+    void SlowLog::reset()
+    {
+        for (const auto &ring : rings_)
+        {
+            std::lock_guard<std::mutex> lock(ring->mutex);
+            ring->count = 0;
+        }
+    }
+}
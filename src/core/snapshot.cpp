@@ -0,0 +1,42 @@
+#include "core/snapshot.hpp"
+
+namespace core
+{
+    Snapshot::Snapshot(Store &store, Emitter emit) : store_(store), emit_(std::move(emit))
+    {
+        store_.attach(this);
+    }
+
+    Snapshot::~Snapshot()
+    {
+        if (!done_)
+            store_.detach(this);
+    }
+
+    bool Snapshot::step(size_t groups)
+    {
+        while (!done_ && groups-- > 0)
+        {
+            cursor_ = store_.scan(cursor_, [this](std::string_view key, const Value &value, int64_t expire_at)
+                                  {
+                                      if (handled_.empty() || handled_.find(std::string(key)) == handled_.end())
+                                          emit_(key, value, expire_at);
+                                  });
+            if (cursor_ == 0)
+            {
+                done_ = true;
+                handled_.clear();
+                store_.detach(this);
+            }
+        }
+        return done_;
+    }
+
+    void Snapshot::before_write(std::string_view key)
+    {
+        if (!handled_.emplace(key).second)
+            return;
+        if (const Value *value = store_.lookup(key))
+            emit_(key, *value, store_.lookup_expire(key));
+    }
+}
@@ -0,0 +1,349 @@
+#include "core/stats.hpp"
+#include "core/dispatcher.hpp"
+#include "core/store.hpp"
+#include <algorithm>
+#include <cctype>
+#include <cstdio>
+#include <unistd.h>
+
+namespace core
+{
+    namespace
+    {
+        const auto CALIBRATION_TIME = std::chrono::milliseconds(10);
+
+        std::string lower(std::string_view name)
+        {
+            std::string result(name);
+            for (char &c : result)
+            {
+                c = std::tolower(static_cast<unsigned char>(c));
+            }
+            return result;
+        }
+
+        std::string format(const char *fmt, double value)
+        {
+            char buffer[64];
+            int n = std::snprintf(buffer, sizeof(buffer), fmt, value);
+            return std::string(buffer, std::min<size_t>(n, sizeof(buffer) - 1));
+        }
+
+        double usec(uint64_t ticks)
+        {
+            return ticks / ticks_per_usec();
+        }
+
+        void append_line(std::string &out, std::string_view key, const std::string &value)
+        {
+            out.append(key.data(), key.size());
+            out += ':';
+            out += value;
+            out += "\r\n";
+        }
+
+        void append_metric(std::string &out, const char *name, const char *type, const char *help)
+        {
+            out += "# HELP ";
+            out += name;
+            out += ' ';
+            out += help;
+            out += "\n# TYPE ";
+            out += name;
+            out += ' ';
+            out += type;
+            out += '\n';
+        }
+
+        void append_sample(std::string &out, const char *name, const std::string &labels, const std::string &value)
+        {
+            out += name;
+            if (!labels.empty())
+            {
+                out += '{';
+                out += labels;
+                out += '}';
+            }
+            out += ' ';
+            out += value;
+            out += '\n';
+        }
+
+        const double PERCENTILES[] = {50, 99, 99.9};
+    }
+
+    double ticks_per_usec()
+    {
+#if defined(__x86_64__) || defined(__i386__)
+        static const double rate = []
+        {
+            auto start = std::chrono::steady_clock::now();
+            uint64_t first = ticks();
+            auto now = start;
+            while (now - start < CALIBRATION_TIME)
+            {
+                now = std::chrono::steady_clock::now();
+            }
+            uint64_t elapsed = ticks() - first;
+            return elapsed / std::chrono::duration<double, std::micro>(now - start).count();
+        }();
+        return rate;
+#else
+        return 1000.0;
+#endif
+    }
+
+    void ShardStats::observe(const Store &store)
+    {
+        Store::MemoryStats stats = store.memory_stats();
+        keys.set(stats.keys);
+        expires.set(stats.expires);
+        used_memory.set(stats.used_memory);
+        maxmemory.set(stats.maxmemory);
+        expired_keys.set(stats.expired_keys);
+        evicted_keys.set(stats.evicted_keys);
+    }
+
+    ServerStats::ServerStats(size_t shards, size_t commands) : started_(std::chrono::steady_clock::now())
+    {
+        for (size_t i = 0; i < shards; ++i)
+        {
+            shards_.push_back(std::make_unique<ShardStats>(commands));
+        }
+        ticks_per_usec();
+    }
+
+    int64_t ServerStats::uptime_seconds() const
+    {
+        return std::chrono::duration_cast<std::chrono::seconds>(std::chrono::steady_clock::now() - started_).count();
+    }
+
+    uint64_t ServerStats::total(Counter ShardStats::*field) const
+    {
+        uint64_t sum = 0;
+        for (const auto &shard : shards_)
+        {
+            sum += ((*shard).*field).load();
+        }
+        return sum;
+    }
+
+    ServerStats::CommandTotals ServerStats::command_totals(size_t command) const
+    {
+        CommandTotals totals;
+        for (const auto &shard : shards_)
+        {
+            const ShardStats::CommandStats &stats = shard->commands[command];
+            if (const LatencyHistogram *histogram = stats.latency.load(std::memory_order_acquire))
+            {
+                totals.calls += histogram->count();
+                totals.ticks += histogram->sum();
+            }
+            totals.rejected += stats.rejected.load();
+            totals.failed += stats.failed.load();
+        }
+        return totals;
+    }
+
+    void ServerStats::command_latency(size_t command, LatencyHistogram &out) const
+    {
+        for (const auto &shard : shards_)
+        {
+            if (const LatencyHistogram *histogram = shard->commands[command].latency.load(std::memory_order_acquire))
+                out.merge(*histogram);
+        }
+    }
+
+    std::string ServerStats::info(const std::vector<std::string> &sections) const
+    {
+        auto wanted = [&sections](const char *section)
+        {
+            return sections.empty() || std::find(sections.begin(), sections.end(), section) != sections.end();
+        };
+        size_t commands = CommandDispatcher::command_count();
+        std::vector<CommandTotals> totals(commands);
+        uint64_t processed = 0, rejected = 0, failed = 0;
+        for (size_t i = 0; i < commands; ++i)
+        {
+            totals[i] = command_totals(i);
+            processed += totals[i].calls;
+            rejected += totals[i].rejected;
+            failed += totals[i].failed;
+        }
+
+        std::string out;
+        auto section = [&out](const char *title)
+        {
+            if (!out.empty())
+                out += "\r\n";
+            out += "# ";
+            out += title;
+            out += "\r\n";
+        };
+        if (wanted("server"))
+        {
+            section("Server");
+            append_line(out, "process_id", std::to_string(getpid()));
+            append_line(out, "shards", std::to_string(shards_.size()));
+            append_line(out, "uptime_in_seconds", std::to_string(uptime_seconds()));
+        }
+        if (wanted("clients"))
+        {
+            section("Clients");
+            append_line(out, "connected_clients", std::to_string(total(&ShardStats::connected_clients)));
+        }
+        if (wanted("memory"))
+        {
+            section("Memory");
+            append_line(out, "used_memory", std::to_string(total(&ShardStats::used_memory)));
+            append_line(out, "maxmemory", std::to_string(total(&ShardStats::maxmemory)));
+        }
+        if (wanted("stats"))
+        {
+            uint64_t cycles = 0, loop_sum = 0, loop_max = 0;
+            for (const auto &shard : shards_)
+            {
+                cycles += shard->loop.count();
+                loop_sum += shard->loop.sum();
+                loop_max = std::max(loop_max, shard->loop.max());
+            }
+            section("Stats");
+            append_line(out, "total_connections_received", std::to_string(total(&ShardStats::connections_received)));
+            append_line(out, "total_commands_processed", std::to_string(processed));
+            append_line(out, "total_net_input_bytes", std::to_string(total(&ShardStats::net_input_bytes)));
+            append_line(out, "total_net_output_bytes", std::to_string(total(&ShardStats::net_output_bytes)));
+            append_line(out, "total_reads_processed", std::to_string(total(&ShardStats::read_calls)));
+            append_line(out, "total_writes_processed", std::to_string(total(&ShardStats::write_calls)));
+            append_line(out, "rejected_calls", std::to_string(rejected));
+            append_line(out, "failed_calls", std::to_string(failed));
+            append_line(out, "expired_keys", std::to_string(total(&ShardStats::expired_keys)));
+            append_line(out, "evicted_keys", std::to_string(total(&ShardStats::evicted_keys)));
+            append_line(out, "eventloop_cycles", std::to_string(cycles));
+            append_line(out, "eventloop_duration_sum", format("%.0f", usec(loop_sum)));
+            append_line(out, "eventloop_duration_max", format("%.0f", usec(loop_max)));
+        }
+        if (wanted("commandstats"))
+        {
+            section("Commandstats");
+            for (size_t i = 0; i < commands; ++i)
+            {
+                const CommandTotals &command = totals[i];
+                if (command.calls == 0 && command.rejected == 0)
+                    continue;
+                double total_usec = usec(command.ticks);
+                append_line(out, "cmdstat_" + lower(CommandDispatcher::command_at(i).name),
+                            "calls=" + std::to_string(command.calls) + ",usec=" + format("%.0f", total_usec) +
+                                ",usec_per_call=" + format("%.2f", command.calls ? total_usec / command.calls : 0) +
+                                ",rejected_calls=" + std::to_string(command.rejected) +
+                                ",failed_calls=" + std::to_string(command.failed));
+            }
+        }
+        if (wanted("latencystats"))
+        {
+            section("Latencystats");
+            LatencyHistogram latency;
+            for (size_t i = 0; i < commands; ++i)
+            {
+                if (totals[i].calls == 0)
+                    continue;
+                latency.reset();
+                command_latency(i, latency);
+                std::string value;
+                for (double p : PERCENTILES)
+                {
+                    if (!value.empty())
+                        value += ',';
+                    value += "p" + format("%g", p) + "=" + format("%.3f", usec(latency.percentile(p)));
+                }
+                append_line(out, "latency_percentiles_usec_" + lower(CommandDispatcher::command_at(i).name), value);
+            }
+        }
+        for (const Section &extra : sections_)
+        {
+            if (wanted(lower(extra.title).c_str()))
+            {
+                section(extra.title.c_str());
+                out += extra.render();
+            }
+        }
+        if (wanted("keyspace"))
+        {
+            section("Keyspace");
+            uint64_t keys = total(&ShardStats::keys);
+            if (keys)
+                append_line(out, "db0", "keys=" + std::to_string(keys) + ",expires=" + std::to_string(total(&ShardStats::expires)));
+        }
+        return out;
+    }
+
+    void ServerStats::add_section(std::string title, std::function<std::string()> render)
+    {
+        sections_.push_back(Section{std::move(title), std::move(render)});
+    }
+
+    std::string ServerStats::prometheus() const
+    {
+        std::string out;
+        auto gauge = [&out](const char *name, const char *type, const char *help, const std::string &value)
+        {
+            append_metric(out, name, type, help);
+            append_sample(out, name, "", value);
+        };
+        gauge("rdb_uptime_seconds", "gauge", "Seconds since the server started.", std::to_string(uptime_seconds()));
+        gauge("rdb_connected_clients", "gauge", "Open client connections.", std::to_string(total(&ShardStats::connected_clients)));
+        gauge("rdb_connections_received_total", "counter", "Client connections accepted.",
+              std::to_string(total(&ShardStats::connections_received)));
+        gauge("rdb_net_input_bytes_total", "counter", "Bytes read from clients.", std::to_string(total(&ShardStats::net_input_bytes)));
+        gauge("rdb_net_output_bytes_total", "counter", "Bytes written to clients.", std::to_string(total(&ShardStats::net_output_bytes)));
+        gauge("rdb_net_read_calls_total", "counter", "Reads from client sockets.", std::to_string(total(&ShardStats::read_calls)));
+        gauge("rdb_net_write_calls_total", "counter", "Writes to client sockets.", std::to_string(total(&ShardStats::write_calls)));
+        gauge("rdb_keys", "gauge", "Keys in the keyspace.", std::to_string(total(&ShardStats::keys)));
+        gauge("rdb_expiring_keys", "gauge", "Keys with a TTL.", std::to_string(total(&ShardStats::expires)));
+        gauge("rdb_memory_used_bytes", "gauge", "Memory used by keys, values and hash tables.",
+              std::to_string(total(&ShardStats::used_memory)));
+        gauge("rdb_memory_max_bytes", "gauge", "Memory limit, 0 if unlimited.", std::to_string(total(&ShardStats::maxmemory)));
+        gauge("rdb_expired_keys_total", "counter", "Keys removed because they expired.", std::to_string(total(&ShardStats::expired_keys)));
+        gauge("rdb_evicted_keys_total", "counter", "Keys evicted under the memory limit.", std::to_string(total(&ShardStats::evicted_keys)));
+
+        uint64_t cycles = 0, loop_sum = 0;
+        for (const auto &shard : shards_)
+        {
+            cycles += shard->loop.count();
+            loop_sum += shard->loop.sum();
+        }
+        gauge("rdb_eventloop_cycles_total", "counter", "Event-loop iterations.", std::to_string(cycles));
+        gauge("rdb_eventloop_duration_seconds_total", "counter", "Time event loops spent busy.", format("%.6f", usec(loop_sum) / 1e6));
+
+        size_t commands = CommandDispatcher::command_count();
+        std::string calls, failed, rejected, latency;
+        LatencyHistogram histogram;
+        for (size_t i = 0; i < commands; ++i)
+        {
+            CommandTotals totals = command_totals(i);
+            if (totals.calls == 0 && totals.rejected == 0)
+                continue;
+            histogram.reset();
+            command_latency(i, histogram);
+            std::string label = "cmd=\"" + lower(CommandDispatcher::command_at(i).name) + "\"";
+            append_sample(calls, "rdb_commands_total", label, std::to_string(totals.calls));
+            append_sample(rejected, "rdb_commands_rejected_total", label, std::to_string(totals.rejected));
+            append_sample(failed, "rdb_commands_failed_total", label, std::to_string(totals.failed));
+            for (double p : PERCENTILES)
+            {
+                append_sample(latency, "rdb_command_latency_seconds", label + ",quantile=\"" + format("%g", p / 100) + "\"",
+                              format("%.9f", usec(histogram.percentile(p)) / 1e6));
+            }
+            append_sample(latency, "rdb_command_latency_seconds_sum", label, format("%.9f", usec(histogram.sum()) / 1e6));
+            append_sample(latency, "rdb_command_latency_seconds_count", label, std::to_string(histogram.count()));
+        }
+        append_metric(out, "rdb_commands_total", "counter", "Commands executed.");
+        out += calls;
+        append_metric(out, "rdb_commands_rejected_total", "counter", "Commands refused before running, for arity or memory.");
+        out += rejected;
+        append_metric(out, "rdb_commands_failed_total", "counter", "Commands that replied with an error.");
+        out += failed;
+        append_metric(out, "rdb_command_latency_seconds", "summary", "Command execution time.");
+        out += latency;
+        return out;
+    }
+}
@@ -1,209 +1,1459 @@
 #include "core/store.hpp"
-#include <unordered_map>
+#include "core/arena.hpp"
+#include "core/dict.hpp"
+#include "core/lazy_free.hpp"
+#include "core/snapshot.hpp"
 #include "core/value.hpp"
+#include <algorithm>
+#include <charconv>
+#include <chrono>
+#include <cmath>
+#include <ctime>
+#include <vector>
 
 namespace core
 {
+    namespace
+    {
+        // Keys sampled per round of the active expiry cycle, and the share
+        // of them that may be expired before the cycle stops early.
+        const size_t EXPIRE_SAMPLE = 20;
+        const size_t EXPIRE_STALE_PERCENT = 10;
+        const auto EXPIRE_CYCLE_INTERVAL = std::chrono::milliseconds(100);
+        const auto EXPIRE_CYCLE_BUDGET = std::chrono::microseconds(1000);
+
+        // Eviction samples a few keys at a time into a small pool of the
+        // best candidates seen so far, as Redis does.
+        const size_t EVICTION_SAMPLES = 5;
+        const size_t EVICTION_POOL_SIZE = 16;
+        const auto EVICTION_BUDGET = std::chrono::microseconds(1000);
+
+        // How far ahead of the current key a batch prefetches control bytes;
+        // slots are prefetched at half the distance, once those have arrived.
+        const size_t PREFETCH_DISTANCE = 8;
+
+        // Access metadata is 24 bits: an LRU clock in seconds, or for LFU
+        // the last decay time in minutes (16 bits) and a logarithmic
+        // access counter (8 bits).
+        const uint32_t LRU_CLOCK_MASK = (1u << 24) - 1;
+        const uint32_t LFU_INIT_VAL = 5;
+        const uint32_t LFU_LOG_FACTOR = 10;
+        const uint32_t LFU_DECAY_MINUTES = 1;
+
+        uint32_t lru_clock()
+        {
+            return static_cast<uint32_t>(std::time(nullptr)) & LRU_CLOCK_MASK;
+        }
+
+        uint32_t lfu_minutes()
+        {
+            return static_cast<uint32_t>(std::time(nullptr) / 60) & 0xffff;
+        }
+
+        uint32_t lfu_decayed(uint32_t meta)
+        {
+            uint32_t elapsed = (lfu_minutes() - (meta >> 8)) & 0xffff;
+            uint32_t periods = elapsed / LFU_DECAY_MINUTES;
+            uint32_t counter = meta & 0xff;
+            return periods > counter ? 0 : counter - periods;
+        }
+    }
+
     class StoreImpl
     {
     public:
-        std::unordered_map<std::string, Value> data;
+        struct Candidate
+        {
+            uint64_t score;
+            std::string key;
+        };
+
+        Dict<Value> data;
+        Dict<int64_t> expires;
+        std::vector<Snapshot *> snapshots;
+        Store::RemovalListener on_removed;
+        size_t expire_cursor = 0;
+        bool expire_backlog = false;
+        std::chrono::steady_clock::time_point last_expire_cycle;
+        std::vector<std::string> expired;
+
+        // Heap bytes of keys and values; the tables are counted separately.
+        size_t heap_bytes = 0;
+        size_t maxmemory = 0;
+        EvictionPolicy policy = EvictionPolicy::NOEVICTION;
+        std::vector<Candidate> pool;
+        uint64_t random_state = 0x9e3779b97f4a7c15ULL;
+        size_t expired_keys = 0;
+        size_t evicted_keys = 0;
+        std::vector<uint64_t> hashes;
+
+        LazyFree *lazy_free = nullptr;
+        size_t shard = 0;
+        LazyFreeOptions lazy;
+
+        struct Watched
+        {
+            uint64_t version;
+            uint32_t watchers;
+        };
+        Dict<Watched> watched;
+
+        // Before a key may change: snapshots in progress copy it out.
+        void copy_out(std::string_view key)
+        {
+            for (Snapshot *snapshot : snapshots)
+            {
+                snapshot->before_write(key);
+            }
+        }
+
+        // After a key did change: transactions watching it will fail.
+        void touched(std::string_view key)
+        {
+            if (!watched.empty())
+            {
+                if (auto *entry = watched.find(key))
+                    entry->value.version++;
+            }
+        }
+
+        // For writes that always change the key.
+        void before_write(std::string_view key)
+        {
+            copy_out(key);
+            touched(key);
+        }
+
+        uint64_t random()
+        {
+            random_state ^= random_state << 13;
+            random_state ^= random_state >> 7;
+            random_state ^= random_state << 17;
+            return random_state;
+        }
+
+        void init_meta(Value &value)
+        {
+            value.set_meta(policy == EvictionPolicy::ALLKEYS_LFU ? lfu_minutes() << 8 | LFU_INIT_VAL : lru_clock());
+        }
+
+        void touch(Value &value)
+        {
+            if (policy != EvictionPolicy::ALLKEYS_LFU)
+            {
+                value.set_meta(lru_clock());
+                return;
+            }
+            uint32_t counter = lfu_decayed(value.meta());
+            if (counter < 255)
+            {
+                uint32_t base = counter > LFU_INIT_VAL ? counter - LFU_INIT_VAL : 0;
+                if (random() % (base * LFU_LOG_FACTOR + 1) == 0)
+                    ++counter;
+            }
+            value.set_meta(lfu_minutes() << 8 | counter);
+        }
+
+        static size_t entry_bytes(std::string_view key, const Value &value)
+        {
+            return string_heap_size(key) + value.memory_usage() - sizeof(Value);
+        }
+
+        size_t used_memory() const
+        {
+            return data.table_bytes() + expires.table_bytes() + heap_bytes;
+        }
+
+        // Lookup for commands: a key past its expire time is removed first,
+        // and a hit counts as an access unless touch is false.
+        Dict<Value>::Entry *find(std::string_view key, bool touch_entry = true)
+        {
+            return find(key, Dict<Value>::hash(key), touch_entry);
+        }
+
+        Dict<Value>::Entry *find(std::string_view key, uint64_t hash, bool touch_entry = true)
+        {
+            auto *entry = data.find(key, hash);
+            if (!entry)
+                return nullptr;
+            if (entry->value.has_expire() && expires.find(key, hash)->value <= Store::now_ms())
+            {
+                ++expired_keys;
+                remove(std::string(key), lazy.expire);
+                return nullptr;
+            }
+            if (touch_entry)
+                touch(entry->value);
+            return entry;
+        }
+
+        Dict<Value>::Entry *insert(std::string_view key, Value &&value)
+        {
+            init_meta(value);
+            heap_bytes += entry_bytes(key, value);
+            return data.insert(key, std::move(value)).first;
+        }
+
+        // Hands a value being dropped to the lazy-free thread when asked to.
+        void dispose(Value &value, bool lazy_free_value)
+        {
+            if (lazy_free_value && lazy_free)
+                lazy_free->release(shard, std::move(value));
+        }
+
+        void replace(Dict<Value>::Entry *entry, Value &&value)
+        {
+            heap_bytes -= entry->value.memory_usage();
+            heap_bytes += value.memory_usage();
+            value.set_meta(entry->value.meta());
+            dispose(entry->value, lazy.server_del);
+            entry->value = std::move(value);
+        }
+
+        void set_expire(std::string_view key, int64_t when)
+        {
+            if (expires.insert(key, int64_t(when)).second)
+                heap_bytes += string_heap_size(key);
+            else
+                expires.find(key)->value = when;
+        }
+
+        void clear_expire(std::string_view key)
+        {
+            if (expires.erase(key))
+                heap_bytes -= string_heap_size(key);
+        }
+
+        bool erase(std::string_view key, bool lazy_free_value = false)
+        {
+            auto *entry = data.find(key);
+            if (!entry)
+                return false;
+            if (entry->value.has_expire())
+                clear_expire(key);
+            heap_bytes -= entry_bytes(key, entry->value);
+            dispose(entry->value, lazy_free_value);
+            return data.erase(key);
+        }
+
+        // Calls fn(i, hash) for every key in order, prefetching the table
+        // for the keys that follow.
+        template <typename F>
+        void for_each_key(const std::vector<std::string_view> &keys, F &&fn)
+        {
+            hashes.resize(keys.size());
+            for (size_t i = 0; i < keys.size(); ++i)
+            {
+                hashes[i] = Dict<Value>::hash(keys[i]);
+                if (i < PREFETCH_DISTANCE)
+                    data.prefetch(hashes[i]);
+            }
+            for (size_t i = 0; i < keys.size(); ++i)
+            {
+                if (i + PREFETCH_DISTANCE < keys.size())
+                    data.prefetch(hashes[i + PREFETCH_DISTANCE]);
+                if (i + PREFETCH_DISTANCE / 2 < keys.size())
+                    data.prefetch_slots(hashes[i + PREFETCH_DISTANCE / 2]);
+                fn(i, hashes[i]);
+            }
+        }
+
+        void set(std::string_view key, uint64_t hash, std::string_view value, bool keep_ttl)
+        {
+            before_write(key);
+            auto *entry = find(key, hash);
+            if (!entry)
+            {
+                insert(key, Value::string(value));
+                return;
+            }
+            bool had_expire = entry->value.has_expire();
+            replace(entry, Value::string(value));
+            if (had_expire && keep_ttl)
+            {
+                entry->value.set_has_expire(true);
+            }
+            else if (had_expire)
+            {
+                clear_expire(key);
+            }
+        }
+
+        // Drops a key on the store's own initiative (expiry or eviction).
+        void remove(const std::string &key, bool lazy_free_value)
+        {
+            before_write(key);
+            erase(key, lazy_free_value);
+            if (on_removed)
+                on_removed(key);
+        }
+
+        size_t remove(const std::vector<std::string_view> &keys, bool lazy_free_value)
+        {
+            size_t removed = 0;
+            for_each_key(keys, [this, &keys, &removed, lazy_free_value](size_t i, uint64_t hash)
+                         {
+                             copy_out(keys[i]);
+                             if (find(keys[i], hash, false) && erase(keys[i], lazy_free_value))
+                             {
+                                 touched(keys[i]);
+                                 ++removed;
+                             } });
+            return removed;
+        }
+
+        // Higher scores make better eviction victims.
+        uint64_t score(const Value &value) const
+        {
+            if (policy == EvictionPolicy::ALLKEYS_LFU)
+                return 255 - lfu_decayed(value.meta());
+            return (lru_clock() - value.meta()) & LRU_CLOCK_MASK;
+        }
+
+        void offer(uint64_t candidate_score, std::string_view key)
+        {
+            if (pool.size() == EVICTION_POOL_SIZE && candidate_score <= pool.front().score)
+                return;
+            for (const Candidate &candidate : pool)
+            {
+                if (candidate.key == key)
+                    return;
+            }
+            auto it = std::lower_bound(pool.begin(), pool.end(), candidate_score, [](const Candidate &candidate, uint64_t s)
+                                       { return candidate.score < s; });
+            pool.insert(it, Candidate{candidate_score, std::string(key)});
+            if (pool.size() > EVICTION_POOL_SIZE)
+                pool.erase(pool.begin());
+        }
+
+        // Empty lists are deleted, as in Redis.
+        std::optional<std::string> pop(std::string_view key, bool front)
+        {
+            copy_out(key);
+            auto *entry = find(key);
+            if (!entry || entry->value.type() != ValueType::LIST)
+                return std::nullopt;
+            auto &list = entry->value.as_list();
+            std::string value;
+            size_t before = list.memory_usage();
+            if (!(front ? list.pop_front(value) : list.pop_back(value)))
+                return std::nullopt;
+            touched(key);
+            heap_bytes -= before - list.memory_usage();
+            if (list.empty())
+                erase(key);
+            return value;
+        }
+
+        bool evict_one()
+        {
+            if (policy == EvictionPolicy::VOLATILE_TTL)
+            {
+                expires.sample(random(), EVICTION_SAMPLES, [this](const Dict<int64_t>::Entry &entry)
+                               { offer(UINT64_MAX - static_cast<uint64_t>(entry.value), entry.key); });
+            }
+            else
+            {
+                data.sample(random(), EVICTION_SAMPLES, [this](const Dict<Value>::Entry &entry)
+                            { offer(score(entry.value), entry.key); });
+            }
+            // Pool entries can be stale; skip keys that are gone or no longer volatile.
+            while (!pool.empty())
+            {
+                std::string key = std::move(pool.back().key);
+                pool.pop_back();
+                auto *entry = data.find(key);
+                if (!entry || (policy == EvictionPolicy::VOLATILE_TTL && !entry->value.has_expire()))
+                    continue;
+                ++evicted_keys;
+                remove(key, lazy.eviction);
+                return true;
+            }
+            return false;
+        }
     };
 
-    static StoreImpl impl;
+    Store::Store() : impl_(std::make_unique<StoreImpl>()) {}
+
+    Store::~Store() = default;
 
-    std::optional<std::string> Store::get(const std::string &key) const
+    std::optional<std::string> Store::get(std::string_view key) const
     {
-        auto it = impl.data.find(key);
-        if (it != impl.data.end() && it->second.type == ValueType::STRING)
+        auto *entry = impl_->find(key);
+        if (entry && entry->value.type() == ValueType::STRING)
         {
-            return std::get<std::string>(it->second.data);
+            return entry->value.str();
         }
         return std::nullopt;
     }
 
-    bool Store::set(const std::string &key, const std::string &value)
+    std::optional<std::string_view> Store::get(std::string_view key, Arena &arena, std::string &heap) const
+    {
+        auto *entry = impl_->find(key);
+        if (!entry || entry->value.type() != ValueType::STRING)
+        {
+            return std::nullopt;
+        }
+        if (entry->value.encoding() == Encoding::RAW)
+        {
+            heap = entry->value.str();
+            return std::string_view(heap);
+        }
+        size_t size = entry->value.str_size();
+        char *out = arena.allocate(size);
+        entry->value.copy_str(out);
+        return std::string_view(out, size);
+    }
+
+    bool Store::set(std::string_view key, std::string_view value, bool keep_ttl)
+    {
+        impl_->set(key, Dict<Value>::hash(key), value, keep_ttl);
+        return true;
+    }
+
+    bool Store::remove(std::string_view key)
     {
-        impl.data.insert_or_assign(key, Value(value));
+        impl_->copy_out(key);
+        if (!impl_->find(key) || !impl_->erase(key, impl_->lazy.user_del))
+            return false;
+        impl_->touched(key);
         return true;
     }
 
-    bool Store::remove(const std::string &key)
+    void Store::mget(const std::vector<std::string_view> &keys, const ValueVisitor &visit)
     {
-        return impl.data.erase(key) > 0;
+        impl_->for_each_key(keys, [this, &keys, &visit](size_t i, uint64_t hash)
+                            {
+                                auto *entry = impl_->find(keys[i], hash);
+                                if (entry && entry->value.type() == ValueType::STRING)
+                                    visit(entry->value.str());
+                                else
+                                    visit(std::nullopt); });
     }
 
-    bool Store::lpush(const std::string &key, const std::string &value)
+    void Store::mset(const std::vector<KeyValue> &pairs)
     {
-        auto it = impl.data.find(key);
-        if (it == impl.data.end())
+        std::vector<std::string_view> keys;
+        keys.reserve(pairs.size());
+        for (const KeyValue &pair : pairs)
         {
-            impl.data.emplace(key, Value(std::deque<std::string>{value}));
-            return true;
+            keys.push_back(pair.key);
+        }
+        impl_->for_each_key(keys, [this, &pairs](size_t i, uint64_t hash)
+                            { impl_->set(pairs[i].key, hash, pairs[i].value, false); });
+    }
+
+    bool Store::msetnx(const std::vector<KeyValue> &pairs)
+    {
+        std::vector<std::string_view> keys;
+        keys.reserve(pairs.size());
+        for (const KeyValue &pair : pairs)
+        {
+            keys.push_back(pair.key);
+        }
+        if (exists(keys) > 0)
+        {
+            return false;
+        }
+        impl_->for_each_key(keys, [this, &pairs](size_t i, uint64_t hash)
+                            { impl_->set(pairs[i].key, hash, pairs[i].value, false); });
+        return true;
+    }
+
+    size_t Store::remove(const std::vector<std::string_view> &keys)
+    {
+        return impl_->remove(keys, impl_->lazy.user_del);
+    }
+
+    size_t Store::unlink(const std::vector<std::string_view> &keys)
+    {
+        return impl_->remove(keys, true);
+    }
+
+    size_t Store::exists(const std::vector<std::string_view> &keys)
+    {
+        size_t found = 0;
+        impl_->for_each_key(keys, [this, &keys, &found](size_t i, uint64_t hash)
+                            {
+                                if (impl_->find(keys[i], hash, false))
+                                    ++found; });
+        return found;
+    }
+
+    bool Store::lpush(std::string_view key, std::string_view value)
+    {
+        impl_->copy_out(key);
+        auto *entry = impl_->find(key);
+        if (!entry)
+        {
+            entry = impl_->insert(key, Value::list());
         }
-        if (it->second.type == ValueType::LIST)
+        if (entry->value.type() == ValueType::LIST)
         {
-            auto &list = std::get<std::deque<std::string>>(it->second.data);
+            impl_->touched(key);
+            auto &list = entry->value.as_list();
+            size_t before = list.memory_usage();
             list.push_front(value);
+            impl_->heap_bytes += list.memory_usage() - before;
             return true;
         }
         return false;
     }
 
-    bool Store::rpush(const std::string &key, const std::string &value)
+    bool Store::rpush(std::string_view key, std::string_view value)
     {
-        auto it = impl.data.find(key);
-        if (it == impl.data.end())
+        impl_->copy_out(key);
+        auto *entry = impl_->find(key);
+        if (!entry)
         {
-            impl.data.emplace(key, Value(std::deque<std::string>{value}));
-            return true;
+            entry = impl_->insert(key, Value::list());
         }
-        if (it->second.type == ValueType::LIST)
+        if (entry->value.type() == ValueType::LIST)
         {
-            auto &list = std::get<std::deque<std::string>>(it->second.data);
+            impl_->touched(key);
+            auto &list = entry->value.as_list();
+            size_t before = list.memory_usage();
             list.push_back(value);
+            impl_->heap_bytes += list.memory_usage() - before;
             return true;
         }
         return false;
     }
 
-    std::optional<std::string> Store::lpop(const std::string &key)
+    std::optional<std::string> Store::lpop(std::string_view key)
     {
-        auto it = impl.data.find(key);
-        if (it != impl.data.end() && it->second.type == ValueType::LIST)
-        {
-            auto &list = std::get<std::deque<std::string>>(it->second.data);
-            if (!list.empty())
-            {
-                std::string value = list.front();
-                list.pop_front();
-                return value;
-            }
-        }
-        return std::nullopt;
+        return impl_->pop(key, true);
     }
 
-    std::optional<std::string> Store::rpop(const std::string &key)
+    std::optional<std::string> Store::rpop(std::string_view key)
     {
-        auto it = impl.data.find(key);
-        if (it != impl.data.end() && it->second.type == ValueType::LIST)
-        {
-            auto &list = std::get<std::deque<std::string>>(it->second.data);
-            if (!list.empty())
-            {
-                std::string value = list.back();
-                list.pop_back();
-                return value;
-            }
-        }
-        return std::nullopt;
+        return impl_->pop(key, false);
     }
 
-    std::optional<size_t> Store::llen(const std::string &key)
+    std::optional<size_t> Store::llen(std::string_view key)
     {
-        auto it = impl.data.find(key);
-        if (it != impl.data.end() && it->second.type == ValueType::LIST)
+        auto *entry = impl_->find(key);
+        if (entry && entry->value.type() == ValueType::LIST)
         {
-            auto &list = std::get<std::deque<std::string>>(it->second.data);
+            auto &list = entry->value.as_list();
             return list.size();
         }
         return std::nullopt;
     }
 
-    std::optional<std::deque<std::string>> Store::lrange(const std::string &key, int start, int end)
+    bool Store::lrange(std::string_view key, long long start, long long end, const std::function<void(size_t count)> &begin,
+                       const ItemVisitor &visit)
     {
-        auto it = impl.data.find(key);
-        if (it != impl.data.end() && it->second.type == ValueType::LIST)
+        auto *entry = impl_->find(key);
+        if (!entry)
         {
-            auto &list = std::get<std::deque<std::string>>(it->second.data);
-            if (list.empty() || start > end)
-                return std::deque<std::string>{};
-
-            if (start < 0)
-                start = 0;
-            if (end >= static_cast<int>(list.size()))
-                end = list.size() - 1;
-            if (start > end)
-                return std::deque<std::string>{};
-
-            std::deque<std::string> result;
-            for (int i = start; i <= end; ++i)
-            {
-                result.push_back(list[i]);
-            }
-            return result;
+            begin(0);
+            return true;
         }
-        return std::nullopt;
+        if (entry->value.type() != ValueType::LIST)
+            return false;
+        const auto &list = entry->value.as_list();
+        long long size = static_cast<long long>(list.size());
+        if (start < 0)
+            start = std::max(0LL, start + size);
+        if (end < 0)
+            end += size;
+        end = std::min(end, size - 1);
+        if (start > end)
+        {
+            begin(0);
+            return true;
+        }
+        size_t count = static_cast<size_t>(end - start + 1);
+        begin(count);
+        auto it = list.at(static_cast<size_t>(start));
+        for (size_t i = 0; i < count; ++i, ++it)
+        {
+            visit(*it);
+        }
+        return true;
     }
 
-    bool Store::sadd(const std::string &key, const std::string &value)
+    bool Store::sadd(std::string_view key, std::string_view value)
     {
-        auto it = impl.data.find(key);
-        if (it == impl.data.end())
+        impl_->copy_out(key);
+        auto *entry = impl_->find(key);
+        if (!entry)
         {
-            impl.data.emplace(key, Value(std::unordered_set<std::string>{value}));
-            return true;
+            entry = impl_->insert(key, Value::set());
         }
-        if (it->second.type == ValueType::SET)
+        if (entry->value.type() == ValueType::SET)
         {
-            auto &set = std::get<std::unordered_set<std::string>>(it->second.data);
-            set.insert(value);
+            auto &set = entry->value.as_set();
+            size_t before = set.memory_usage();
+            if (set.add(value))
+            {
+                impl_->touched(key);
+            }
+            impl_->heap_bytes += set.memory_usage() - before;
             return true;
         }
         return false;
     }
 
-    bool Store::srem(const std::string &key, const std::string &value)
+    bool Store::srem(std::string_view key, std::string_view value)
     {
-        auto it = impl.data.find(key);
-        if (it != impl.data.end() && it->second.type == ValueType::SET)
+        impl_->copy_out(key);
+        auto *entry = impl_->find(key);
+        if (entry && entry->value.type() == ValueType::SET)
         {
-            auto &set = std::get<std::unordered_set<std::string>>(it->second.data);
-            return set.erase(value) > 0;
+            auto &set = entry->value.as_set();
+            size_t before = set.memory_usage();
+            if (!set.remove(value))
+            {
+                return false;
+            }
+            impl_->touched(key);
+            impl_->heap_bytes -= before - set.memory_usage();
+            if (set.empty())
+            {
+                impl_->erase(key);
+            }
+            return true;
         }
         return false;
     }
 
-    std::optional<std::unordered_set<std::string>> Store::sismember(const std::string &key)
+    std::optional<bool> Store::sismember(std::string_view key, std::string_view member)
     {
-        auto it = impl.data.find(key);
-        if (it != impl.data.end() && it->second.type == ValueType::SET)
+        auto *entry = impl_->find(key);
+        if (!entry)
         {
-            return std::get<std::unordered_set<std::string>>(it->second.data);
+            return false;
         }
-        return std::nullopt;
+        if (entry->value.type() != ValueType::SET)
+        {
+            return std::nullopt;
+        }
+        return entry->value.as_set().contains(member);
     }
 
-    std::optional<size_t> Store::scard(const std::string &key)
+    std::optional<size_t> Store::scard(std::string_view key)
     {
-        auto it = impl.data.find(key);
-        if (it != impl.data.end() && it->second.type == ValueType::SET)
+        auto *entry = impl_->find(key);
+        if (!entry)
+        {
+            return 0;
+        }
+        if (entry->value.type() == ValueType::SET)
         {
-            auto &set = std::get<std::unordered_set<std::string>>(it->second.data);
+            auto &set = entry->value.as_set();
             return set.size();
         }
         return std::nullopt;
     }
 
-    std::optional<std::unordered_set<std::string>> Store::sinter(const std::string &key1, const std::string &key2)
+    std::optional<size_t> Store::sscan(std::string_view key, size_t cursor, const ItemVisitor &visit)
+    {
+        auto *entry = impl_->find(key);
+        if (!entry)
+            return 0;
+        if (entry->value.type() != ValueType::SET)
+            return std::nullopt;
+        return entry->value.as_set().scan(cursor, visit);
+    }
+
+    std::optional<std::vector<std::string>> Store::sinter(const std::vector<std::string_view> &keys)
     {
-        auto it1 = impl.data.find(key1);
-        auto it2 = impl.data.find(key2);
-        if (it1 != impl.data.end() && it1->second.type == ValueType::SET &&
-            it2 != impl.data.end() && it2->second.type == ValueType::SET)
+        // Expiring one key could move the entries of the others, so expire
+        // them all before taking pointers.
+        for (std::string_view key : keys)
         {
-            const auto &set1 = std::get<std::unordered_set<std::string>>(it1->second.data);
-            const auto &set2 = std::get<std::unordered_set<std::string>>(it2->second.data);
-            std::unordered_set<std::string> result;
-            for (const auto &item : set1)
+            impl_->find(key);
+        }
+        std::vector<const Set *> sets;
+        bool missing = false;
+        for (std::string_view key : keys)
+        {
+            auto *entry = impl_->data.find(key);
+            if (!entry)
+            {
+                missing = true;
+                continue;
+            }
+            if (entry->value.type() != ValueType::SET)
             {
-                if (set2.find(item) != set2.end())
-                {
-                    result.insert(item);
-                }
+                return std::nullopt;
             }
+            sets.push_back(&entry->value.as_set());
+        }
+        std::vector<std::string> result;
+        if (missing || sets.empty())
+        {
             return result;
         }
-        return std::nullopt;
+        std::sort(sets.begin(), sets.end(), [](const Set *a, const Set *b)
+                  { return a->size() < b->size(); });
+
+        // Sorted integer arrays are intersected directly, smallest first.
+        size_t sorted = 0;
+        std::vector<int64_t> ints, next;
+        if (sets[0]->ints())
+        {
+            ints = *sets[0]->ints();
+            for (sorted = 1; sorted < sets.size() && sets[sorted]->ints() && !ints.empty(); ++sorted)
+            {
+                next.clear();
+                Set::intersect_sorted(ints, *sets[sorted]->ints(), next);
+                ints.swap(next);
+            }
+        }
+
+        auto in_rest = [&sets, sorted](std::string_view member)
+        {
+            for (size_t i = std::max<size_t>(sorted, 1); i < sets.size(); ++i)
+            {
+                if (!sets[i]->contains(member))
+                    return false;
+            }
+            return true;
+        };
+        if (sets[0]->ints())
+        {
+            char buffer[24];
+            for (int64_t value : ints)
+            {
+                char *end = std::to_chars(buffer, buffer + sizeof(buffer), value).ptr;
+                std::string_view member(buffer, end - buffer);
+                if (in_rest(member))
+                    result.emplace_back(member);
+            }
+            return result;
+        }
+        for (auto it = sets[0]->begin(); it != sets[0]->end(); ++it)
+        {
+            if (in_rest(*it))
+                result.emplace_back(*it);
+        }
+        return result;
+    }
+
+    std::optional<Store::ZAddResult> Store::zadd(std::string_view key, const std::vector<ScoredMember> &members, bool nx, bool xx)
+    {
+        impl_->copy_out(key);
+        auto *entry = impl_->find(key);
+        ZAddResult result{0, 0};
+        if (!entry)
+        {
+            if (xx)
+            {
+                return result;
+            }
+            entry = impl_->insert(key, Value::zset());
+        }
+        if (entry->value.type() != ValueType::ZSET)
+        {
+            return std::nullopt;
+        }
+        auto &zset = entry->value.as_zset();
+        size_t before = zset.memory_usage();
+        for (const ScoredMember &item : members)
+        {
+            std::optional<double> old = zset.score(item.member);
+            if (old ? nx || *old == item.score : xx)
+            {
+                continue;
+            }
+            zset.add(item.member, item.score);
+            ++(old ? result.updated : result.added);
+        }
+        if (result.added || result.updated)
+        {
+            impl_->touched(key);
+        }
+        size_t after = zset.memory_usage();
+        impl_->heap_bytes += after - before;
+        if (zset.empty())
+        {
+            impl_->erase(key);
+        }
+        return result;
+    }
+
+    std::optional<double> Store::zincrby(std::string_view key, std::string_view member, double increment)
+    {
+        impl_->copy_out(key);
+        auto *entry = impl_->find(key);
+        if (entry && entry->value.type() != ValueType::ZSET)
+        {
+            return std::nullopt;
+        }
+        double score = increment;
+        if (entry)
+        {
+            score += entry->value.as_zset().score(member).value_or(0);
+        }
+        if (std::isnan(score))
+        {
+            return score;
+        }
+        if (!entry)
+        {
+            entry = impl_->insert(key, Value::zset());
+        }
+        impl_->touched(key);
+        auto &zset = entry->value.as_zset();
+        size_t before = zset.memory_usage();
+        zset.add(member, score);
+        impl_->heap_bytes += zset.memory_usage() - before;
+        return score;
+    }
+
+    std::optional<size_t> Store::zrem(std::string_view key, const std::vector<std::string_view> &members)
+    {
+        impl_->copy_out(key);
+        auto *entry = impl_->find(key);
+        if (!entry)
+        {
+            return 0;
+        }
+        if (entry->value.type() != ValueType::ZSET)
+        {
+            return std::nullopt;
+        }
+        auto &zset = entry->value.as_zset();
+        size_t before = zset.memory_usage();
+        size_t removed = 0;
+        for (std::string_view member : members)
+        {
+            removed += zset.remove(member);
+        }
+        if (removed)
+        {
+            impl_->touched(key);
+        }
+        impl_->heap_bytes -= before - zset.memory_usage();
+        if (zset.empty())
+        {
+            impl_->erase(key);
+        }
+        return removed;
+    }
+
+    bool Store::zscore(std::string_view key, std::string_view member, std::optional<double> &score)
+    {
+        score.reset();
+        auto *entry = impl_->find(key);
+        if (!entry)
+        {
+            return true;
+        }
+        if (entry->value.type() != ValueType::ZSET)
+        {
+            return false;
+        }
+        score = entry->value.as_zset().score(member);
+        return true;
+    }
+
+    bool Store::zrank(std::string_view key, std::string_view member, std::optional<size_t> &rank)
+    {
+        rank.reset();
+        auto *entry = impl_->find(key);
+        if (!entry)
+        {
+            return true;
+        }
+        if (entry->value.type() != ValueType::ZSET)
+        {
+            return false;
+        }
+        rank = entry->value.as_zset().rank(member);
+        return true;
+    }
+
+    std::optional<size_t> Store::zcard(std::string_view key)
+    {
+        auto *entry = impl_->find(key);
+        if (!entry)
+        {
+            return 0;
+        }
+        if (entry->value.type() != ValueType::ZSET)
+        {
+            return std::nullopt;
+        }
+        return entry->value.as_zset().size();
+    }
+
+    std::optional<size_t> Store::zcount(std::string_view key, const ScoreRange &range)
+    {
+        auto *entry = impl_->find(key);
+        if (!entry)
+        {
+            return 0;
+        }
+        if (entry->value.type() != ValueType::ZSET)
+        {
+            return std::nullopt;
+        }
+        const auto &zset = entry->value.as_zset();
+        size_t first = zset.count_below(range.min, range.min_exclusive);
+        size_t last = zset.count_below(range.max, !range.max_exclusive);
+        return last > first ? last - first : 0;
+    }
+
+    bool Store::zrange(std::string_view key, long long start, long long end, const std::function<void(size_t count)> &begin,
+                       const ScoredVisitor &visit)
+    {
+        auto *entry = impl_->find(key);
+        if (!entry)
+        {
+            begin(0);
+            return true;
+        }
+        if (entry->value.type() != ValueType::ZSET)
+            return false;
+        const auto &zset = entry->value.as_zset();
+        long long size = static_cast<long long>(zset.size());
+        if (start < 0)
+            start = std::max(0LL, start + size);
+        if (end < 0)
+            end += size;
+        end = std::min(end, size - 1);
+        if (start > end)
+        {
+            begin(0);
+            return true;
+        }
+        size_t count = static_cast<size_t>(end - start + 1);
+        begin(count);
+        auto it = zset.at(static_cast<size_t>(start));
+        for (size_t i = 0; i < count; ++i, ++it)
+        {
+            visit(it.member(), it.score());
+        }
+        return true;
+    }
+
+    bool Store::zrangebyscore(std::string_view key, const ScoreRange &range, long long offset, long long limit,
+                              const std::function<void(size_t count)> &begin, const ScoredVisitor &visit)
+    {
+        auto *entry = impl_->find(key);
+        if (!entry)
+        {
+            begin(0);
+            return true;
+        }
+        if (entry->value.type() != ValueType::ZSET)
+            return false;
+        const auto &zset = entry->value.as_zset();
+        size_t first = zset.count_below(range.min, range.min_exclusive);
+        size_t last = zset.count_below(range.max, !range.max_exclusive);
+        if (offset < 0 || last <= first || static_cast<size_t>(offset) >= last - first)
+        {
+            begin(0);
+            return true;
+        }
+        first += static_cast<size_t>(offset);
+        size_t count = last - first;
+        if (limit >= 0)
+            count = std::min(count, static_cast<size_t>(limit));
+        begin(count);
+        auto it = zset.at(first);
+        for (size_t i = 0; i < count; ++i, ++it)
+        {
+            visit(it.member(), it.score());
+        }
+        return true;
+    }
+
+    std::optional<size_t> Store::zscan(std::string_view key, size_t cursor, const ScoredVisitor &visit)
+    {
+        auto *entry = impl_->find(key);
+        if (!entry)
+            return 0;
+        if (entry->value.type() != ValueType::ZSET)
+            return std::nullopt;
+        return entry->value.as_zset().scan(cursor, visit);
+    }
+
+    std::optional<size_t> Store::hset(std::string_view key, const std::vector<FieldValue> &fields)
+    {
+        impl_->copy_out(key);
+        auto *entry = impl_->find(key);
+        if (!entry)
+        {
+            entry = impl_->insert(key, Value::hash());
+        }
+        if (entry->value.type() != ValueType::HASH)
+        {
+            return std::nullopt;
+        }
+        impl_->touched(key);
+        auto &hash = entry->value.as_hash();
+        size_t before = hash.memory_usage();
+        size_t added = 0;
+        for (const FieldValue &item : fields)
+        {
+            added += hash.set(item.field, item.value);
+        }
+        impl_->heap_bytes += hash.memory_usage() - before;
+        return added;
+    }
+
+    bool Store::hget(std::string_view key, std::string_view field, std::optional<std::string> &value)
+    {
+        value.reset();
+        auto *entry = impl_->find(key);
+        if (!entry)
+        {
+            return true;
+        }
+        if (entry->value.type() != ValueType::HASH)
+        {
+            return false;
+        }
+        if (auto result = entry->value.as_hash().get(field))
+        {
+            value.emplace(*result);
+        }
+        return true;
+    }
+
+    bool Store::hmget(std::string_view key, const std::vector<std::string_view> &fields, const ValueVisitor &visit)
+    {
+        auto *entry = impl_->find(key);
+        if (entry && entry->value.type() != ValueType::HASH)
+        {
+            return false;
+        }
+        for (std::string_view field : fields)
+        {
+            visit(entry ? entry->value.as_hash().get(field) : std::nullopt);
+        }
+        return true;
+    }
+
+    std::optional<size_t> Store::hdel(std::string_view key, const std::vector<std::string_view> &fields)
+    {
+        impl_->copy_out(key);
+        auto *entry = impl_->find(key);
+        if (!entry)
+        {
+            return 0;
+        }
+        if (entry->value.type() != ValueType::HASH)
+        {
+            return std::nullopt;
+        }
+        auto &hash = entry->value.as_hash();
+        size_t before = hash.memory_usage();
+        size_t removed = 0;
+        for (std::string_view field : fields)
+        {
+            removed += hash.remove(field);
+        }
+        if (removed)
+        {
+            impl_->touched(key);
+        }
+        impl_->heap_bytes -= before - hash.memory_usage();
+        if (hash.empty())
+        {
+            impl_->erase(key);
+        }
+        return removed;
+    }
+
+    Store::IncrResult Store::hincrby(std::string_view key, std::string_view field, int64_t increment, int64_t &value)
+    {
+        impl_->copy_out(key);
+        auto *entry = impl_->find(key);
+        if (entry && entry->value.type() != ValueType::HASH)
+        {
+            return IncrResult::WRONG_TYPE;
+        }
+        int64_t current = 0;
+        if (entry)
+        {
+            auto old = entry->value.as_hash().get(field);
+            if (old && !parse_canonical_int(*old, current))
+            {
+                return IncrResult::NOT_INTEGER;
+            }
+        }
+        if (__builtin_add_overflow(current, increment, &value))
+        {
+            return IncrResult::OUT_OF_RANGE;
+        }
+        if (!entry)
+        {
+            entry = impl_->insert(key, Value::hash());
+        }
+        impl_->touched(key);
+        auto &hash = entry->value.as_hash();
+        size_t before = hash.memory_usage();
+        char buffer[24];
+        char *end = std::to_chars(buffer, buffer + sizeof(buffer), value).ptr;
+        hash.set(field, std::string_view(buffer, end - buffer));
+        impl_->heap_bytes += hash.memory_usage() - before;
+        return IncrResult::OK;
+    }
+
+    std::optional<size_t> Store::hlen(std::string_view key)
+    {
+        auto *entry = impl_->find(key);
+        if (!entry)
+        {
+            return 0;
+        }
+        if (entry->value.type() != ValueType::HASH)
+        {
+            return std::nullopt;
+        }
+        return entry->value.as_hash().size();
+    }
+
+    bool Store::hgetall(std::string_view key, const std::function<void(size_t count)> &begin, const PairVisitor &visit)
+    {
+        auto *entry = impl_->find(key);
+        if (!entry)
+        {
+            begin(0);
+            return true;
+        }
+        if (entry->value.type() != ValueType::HASH)
+            return false;
+        const auto &hash = entry->value.as_hash();
+        begin(hash.size());
+        for (auto it = hash.begin(); it != hash.end(); ++it)
+        {
+            visit(it.field(), it.value());
+        }
+        return true;
+    }
+
+    std::optional<size_t> Store::hscan(std::string_view key, size_t cursor, const PairVisitor &visit)
+    {
+        auto *entry = impl_->find(key);
+        if (!entry)
+            return 0;
+        if (entry->value.type() != ValueType::HASH)
+            return std::nullopt;
+        return entry->value.as_hash().scan(cursor, visit);
+    }
+
+    bool Store::exists(std::string_view key)
+    {
+        return impl_->find(key) != nullptr;
+    }
+
+    bool Store::expire_at(std::string_view key, int64_t when)
+    {
+        impl_->copy_out(key);
+        auto *entry = impl_->find(key);
+        if (!entry)
+        {
+            return false;
+        }
+        impl_->touched(key);
+        if (when <= now_ms())
+        {
+            impl_->erase(key, impl_->lazy.expire);
+            return true;
+        }
+        entry->value.set_has_expire(true);
+        impl_->set_expire(key, when);
+        return true;
+    }
+
+    bool Store::persist(std::string_view key)
+    {
+        auto *entry = impl_->find(key);
+        if (!entry || !entry->value.has_expire())
+        {
+            return false;
+        }
+        impl_->before_write(key);
+        entry->value.set_has_expire(false);
+        impl_->clear_expire(key);
+        return true;
+    }
+
+    int64_t Store::expire_time(std::string_view key)
+    {
+        auto *entry = impl_->find(key, false);
+        if (!entry)
+        {
+            return -2;
+        }
+        return entry->value.has_expire() ? impl_->expires.find(key)->value : -1;
+    }
+
+    bool Store::active_expire_cycle()
+    {
+        StoreImpl &impl = *impl_;
+        auto started = std::chrono::steady_clock::now();
+        if (impl.expires.empty() || (!impl.expire_backlog && started - impl.last_expire_cycle < EXPIRE_CYCLE_INTERVAL))
+        {
+            return impl.expire_backlog = false;
+        }
+        impl.last_expire_cycle = started;
+        int64_t now = now_ms();
+        // Sample groups of keys along a scan of the expires table and keep
+        // going while a large share of them turns out to be expired.
+        while (true)
+        {
+            size_t sampled = 0;
+            impl.expired.clear();
+            do
+            {
+                impl.expire_cursor = impl.expires.scan(impl.expire_cursor, [&](const Dict<int64_t>::Entry &entry)
+                                                       {
+                                                           ++sampled;
+                                                           if (entry.value <= now)
+                                                               impl.expired.emplace_back(entry.key);
+                                                       });
+            } while (sampled < EXPIRE_SAMPLE && impl.expire_cursor != 0);
+            for (const std::string &key : impl.expired)
+            {
+                ++impl.expired_keys;
+                impl.remove(key, impl.lazy.expire);
+            }
+            if (impl.expired.size() * 100 <= sampled * EXPIRE_STALE_PERCENT || impl.expires.empty())
+            {
+                return impl.expire_backlog = false;
+            }
+            if (std::chrono::steady_clock::now() - started >= EXPIRE_CYCLE_BUDGET)
+            {
+                return impl.expire_backlog = true;
+            }
+        }
+    }
+
+    void Store::set_removal_listener(RemovalListener listener)
+    {
+        impl_->on_removed = std::move(listener);
+    }
+
+    void Store::set_lazy_free(LazyFree *lazy_free, size_t shard, const LazyFreeOptions &options)
+    {
+        impl_->lazy_free = lazy_free;
+        impl_->shard = shard;
+        impl_->lazy = options;
+    }
+
+    bool Store::parse_eviction_policy(std::string_view name, EvictionPolicy &policy)
+    {
+        if (name == "noeviction")
+            policy = EvictionPolicy::NOEVICTION;
+        else if (name == "allkeys-lru")
+            policy = EvictionPolicy::ALLKEYS_LRU;
+        else if (name == "allkeys-lfu")
+            policy = EvictionPolicy::ALLKEYS_LFU;
+        else if (name == "volatile-ttl")
+            policy = EvictionPolicy::VOLATILE_TTL;
+        else
+            return false;
+        return true;
+    }
+
+    void Store::set_maxmemory(size_t bytes, EvictionPolicy policy)
+    {
+        impl_->maxmemory = bytes;
+        impl_->policy = policy;
+        impl_->pool.clear();
+    }
+
+    EvictionPolicy Store::eviction_policy() const
+    {
+        return impl_->policy;
+    }
+
+    size_t Store::used_memory() const
+    {
+        return impl_->used_memory();
+    }
+
+    bool Store::make_room()
+    {
+        StoreImpl &impl = *impl_;
+        if (impl.maxmemory == 0 || impl.used_memory() <= impl.maxmemory)
+        {
+            return true;
+        }
+        if (impl.policy == EvictionPolicy::NOEVICTION)
+        {
+            return false;
+        }
+        // Normally a write only pushes a key or two out. Should the limit be
+        // far off, give up after a bounded time and let the next write carry on.
+        auto started = std::chrono::steady_clock::now();
+        size_t evicted = 0;
+        while (impl.used_memory() > impl.maxmemory)
+        {
+            if (!impl.evict_one())
+            {
+                return false;
+            }
+            if (++evicted % 16 == 0 && std::chrono::steady_clock::now() - started >= EVICTION_BUDGET)
+            {
+                break;
+            }
+        }
+        return true;
+    }
+
+    std::optional<uint32_t> Store::idle_time(std::string_view key) const
+    {
+        auto *entry = impl_->find(key, false);
+        if (!entry || impl_->policy == EvictionPolicy::ALLKEYS_LFU)
+        {
+            return std::nullopt;
+        }
+        return (lru_clock() - entry->value.meta()) & LRU_CLOCK_MASK;
+    }
+
+    std::optional<uint32_t> Store::access_frequency(std::string_view key) const
+    {
+        auto *entry = impl_->find(key, false);
+        if (!entry || impl_->policy != EvictionPolicy::ALLKEYS_LFU)
+        {
+            return std::nullopt;
+        }
+        return lfu_decayed(entry->value.meta());
+    }
+
+    int64_t Store::now_ms()
+    {
+        return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+    }
+
+    size_t Store::size() const
+    {
+        return impl_->data.size();
+    }
+
+    std::optional<size_t> Store::memory_usage(std::string_view key) const
+    {
+        auto *entry = impl_->find(key, false);
+        if (!entry)
+        {
+            return std::nullopt;
+        }
+        return impl_->data.table_bytes() / impl_->data.capacity() + string_heap_size(entry->key) +
+               entry->value.memory_usage() - sizeof(Value);
+    }
+
+    std::optional<std::string> Store::encoding(std::string_view key) const
+    {
+        auto *entry = impl_->find(key, false);
+        if (!entry)
+        {
+            return std::nullopt;
+        }
+        return Value::encoding_name(entry->value.encoding());
+    }
+
+    Store::MemoryStats Store::memory_stats() const
+    {
+        MemoryStats stats;
+        stats.keys = impl_->data.size();
+        stats.expires = impl_->expires.size();
+        stats.value_header_bytes = sizeof(Value);
+        stats.table_bytes = impl_->data.table_bytes();
+        stats.overhead_per_key = stats.keys ? stats.table_bytes / stats.keys : 0;
+        stats.used_memory = impl_->used_memory();
+        stats.maxmemory = impl_->maxmemory;
+        stats.expired_keys = impl_->expired_keys;
+        stats.evicted_keys = impl_->evicted_keys;
+        return stats;
+    }
+
+    const Value *Store::lookup(std::string_view key) const
+    {
+        auto *entry = impl_->data.find(key);
+        return entry ? &entry->value : nullptr;
+    }
+
+    int64_t Store::lookup_expire(std::string_view key) const
+    {
+        auto *entry = impl_->data.find(key);
+        return entry && entry->value.has_expire() ? impl_->expires.find(key)->value : -1;
+    }
+
+    void Store::for_each_key(const std::function<void(std::string_view key)> &visit) const
+    {
+        int64_t now = now_ms();
+        impl_->data.for_each([this, now, &visit](const Dict<Value>::Entry &entry)
+                             {
+                                 if (!entry.value.has_expire() || impl_->expires.find(entry.key)->value > now)
+                                     visit(entry.key);
+                             });
+    }
+
+    size_t Store::scan(size_t cursor, const EntryVisitor &visit) const
+    {
+        return impl_->data.scan(cursor, [this, &visit](const Dict<Value>::Entry &entry)
+                                { visit(entry.key, entry.value, entry.value.has_expire() ? impl_->expires.find(entry.key)->value : -1); });
+    }
+
+    void Store::restore(std::string_view key, Value &&value, int64_t expire_at)
+    {
+        impl_->before_write(key);
+        impl_->erase(key, impl_->lazy.server_del);
+        if (expire_at >= 0)
+        {
+            value.set_has_expire(true);
+            impl_->set_expire(key, expire_at);
+        }
+        impl_->insert(key, std::move(value));
+    }
+
+    void Store::reserve(size_t keys)
+    {
+        impl_->data.reserve(keys);
+    }
+
+    void Store::clear()
+    {
+        if (!impl_->snapshots.empty() || !impl_->watched.empty())
+        {
+            impl_->data.for_each([this](const auto &entry)
+                                 { impl_->before_write(entry.key); });
+        }
+        impl_->data.clear();
+        impl_->expires.clear();
+        impl_->heap_bytes = 0;
+        impl_->pool.clear();
+        impl_->expire_cursor = 0;
+        impl_->expire_backlog = false;
+    }
+
+    uint64_t Store::watch(std::string_view key)
+    {
+        auto inserted = impl_->watched.insert(key, StoreImpl::Watched{0, 0});
+        inserted.first->value.watchers++;
+        return inserted.first->value.version;
+    }
+
+    void Store::unwatch(std::string_view key)
+    {
+        auto *entry = impl_->watched.find(key);
+        if (entry && --entry->value.watchers == 0)
+            impl_->watched.erase(key);
+    }
+
+    uint64_t Store::version(std::string_view key) const
+    {
+        auto *entry = impl_->watched.find(key);
+        return entry ? entry->value.version : 0;
+    }
+
+    void Store::attach(Snapshot *snapshot)
+    {
+        impl_->snapshots.push_back(snapshot);
+    }
+
+    void Store::detach(Snapshot *snapshot)
+    {
+        auto &snapshots = impl_->snapshots;
+        snapshots.erase(std::remove(snapshots.begin(), snapshots.end(), snapshot), snapshots.end());
     }
 }
@@ -0,0 +1,312 @@
+#include "core/value.hpp"
+#include "core/slab.hpp"
+#include <charconv>
+#include <cstring>
+
+namespace core
+{
+    bool parse_canonical_int(std::string_view str, int64_t &out)
+    {
+        if (str.empty() || str.size() > 20)
+            return false;
+        if (str.size() > 1 && (str[0] == '0' || (str[0] == '-' && (str[1] == '0'))))
+            return false;
+        if (str == "-")
+            return false;
+        auto [ptr, ec] = std::from_chars(str.data(), str.data() + str.size(), out);
+        return ec == std::errc() && ptr == str.data() + str.size();
+    }
+
+    Value::Value(ValueType type, Encoding encoding)
+        : tag_(static_cast<uint8_t>(static_cast<uint8_t>(type) << 4 | static_cast<uint8_t>(encoding))), meta_{}
+    {
+        std::memset(data_, 0, sizeof(data_));
+    }
+
+    Value Value::string(std::string_view str)
+    {
+        int64_t number;
+        if (parse_canonical_int(str, number))
+        {
+            Value value(ValueType::STRING, Encoding::INT);
+            std::memcpy(value.data_ + WORD_OFFSET, &number, sizeof(number));
+            return value;
+        }
+        if (str.size() <= EMBSTR_MAX)
+        {
+            Value value(ValueType::STRING, Encoding::EMBSTR);
+            value.data_[0] = static_cast<char>(str.size());
+            std::memcpy(value.data_ + 1, str.data(), str.size());
+            return value;
+        }
+        Value value(ValueType::STRING, Encoding::RAW);
+        uint32_t len = static_cast<uint32_t>(str.size());
+        char *buf = static_cast<char *>(Slab::allocate(len));
+        std::memcpy(buf, str.data(), len);
+        std::memcpy(value.data_ + LEN_OFFSET, &len, sizeof(len));
+        value.set_ptr(buf);
+        return value;
+    }
+
+    Value Value::list()
+    {
+        Value value(ValueType::LIST, Encoding::QUICKLIST);
+        value.set_ptr(new List());
+        return value;
+    }
+
+    Value Value::set()
+    {
+        Value value(ValueType::SET, Encoding::HASHTABLE);
+        value.set_ptr(new Set());
+        return value;
+    }
+
+    Value Value::zset()
+    {
+        Value value(ValueType::ZSET, Encoding::BTREE);
+        value.set_ptr(new ZSet());
+        return value;
+    }
+
+    Value Value::hash()
+    {
+        Value value(ValueType::HASH, Encoding::HASHTABLE);
+        value.set_ptr(new Hash());
+        return value;
+    }
+
+    Value::Value(Value &&other) noexcept : tag_(other.tag_)
+    {
+        std::memcpy(meta_, other.meta_, sizeof(meta_));
+        std::memcpy(data_, other.data_, sizeof(data_));
+        other.tag_ = static_cast<uint8_t>(Encoding::EMBSTR);
+        other.data_[0] = 0;
+    }
+
+    Value &Value::operator=(Value &&other) noexcept
+    {
+        if (this != &other)
+        {
+            release();
+            tag_ = other.tag_;
+            std::memcpy(meta_, other.meta_, sizeof(meta_));
+            std::memcpy(data_, other.data_, sizeof(data_));
+            other.tag_ = static_cast<uint8_t>(Encoding::EMBSTR);
+            other.data_[0] = 0;
+        }
+        return *this;
+    }
+
+    Value::~Value()
+    {
+        release();
+    }
+
+    void Value::release()
+    {
+        switch (type())
+        {
+        case ValueType::STRING:
+            if (tag_encoding() == Encoding::RAW)
+                Slab::deallocate(ptr(), raw_len());
+            break;
+        case ValueType::LIST:
+            delete static_cast<List *>(ptr());
+            break;
+        case ValueType::SET:
+            delete static_cast<Set *>(ptr());
+            break;
+        case ValueType::ZSET:
+            delete static_cast<ZSet *>(ptr());
+            break;
+        case ValueType::HASH:
+            delete static_cast<Hash *>(ptr());
+            break;
+        }
+        tag_ = static_cast<uint8_t>(Encoding::EMBSTR);
+    }
+
+    void *Value::ptr() const
+    {
+        void *p;
+        std::memcpy(&p, data_ + WORD_OFFSET, sizeof(p));
+        return p;
+    }
+
+    void Value::set_ptr(void *p)
+    {
+        std::memcpy(data_ + WORD_OFFSET, &p, sizeof(p));
+    }
+
+    int64_t Value::int_value() const
+    {
+        int64_t number;
+        std::memcpy(&number, data_ + WORD_OFFSET, sizeof(number));
+        return number;
+    }
+
+    uint32_t Value::raw_len() const
+    {
+        uint32_t len;
+        std::memcpy(&len, data_ + LEN_OFFSET, sizeof(len));
+        return len;
+    }
+
+    std::string Value::str() const
+    {
+        switch (tag_encoding())
+        {
+        case Encoding::EMBSTR:
+            return std::string(data_ + 1, static_cast<uint8_t>(data_[0]));
+        case Encoding::INT:
+            return std::to_string(int_value());
+        case Encoding::RAW:
+            return std::string(static_cast<const char *>(ptr()), raw_len());
+        default:
+            return std::string();
+        }
+    }
+
+    void Value::copy_str(char *out) const
+    {
+        switch (tag_encoding())
+        {
+        case Encoding::EMBSTR:
+            std::memcpy(out, data_ + 1, static_cast<uint8_t>(data_[0]));
+            break;
+        case Encoding::INT:
+            std::to_chars(out, out + 24, int_value());
+            break;
+        case Encoding::RAW:
+            std::memcpy(out, ptr(), raw_len());
+            break;
+        default:
+            break;
+        }
+    }
+
+    size_t Value::str_size() const
+    {
+        switch (tag_encoding())
+        {
+        case Encoding::EMBSTR:
+            return static_cast<uint8_t>(data_[0]);
+        case Encoding::INT:
+        {
+            char buf[24];
+            auto result = std::to_chars(buf, buf + sizeof(buf), int_value());
+            return result.ptr - buf;
+        }
+        case Encoding::RAW:
+            return raw_len();
+        default:
+            return 0;
+        }
+    }
+
+    size_t Value::memory_usage() const
+    {
+        size_t total = sizeof(Value);
+        switch (type())
+        {
+        case ValueType::STRING:
+            if (tag_encoding() == Encoding::RAW)
+                total += raw_len() <= Slab::MAX_SIZE ? Slab::block_size(raw_len()) : heap_size(raw_len());
+            break;
+        case ValueType::LIST:
+            total += as_list().memory_usage();
+            break;
+        case ValueType::SET:
+            total += as_set().memory_usage();
+            break;
+        case ValueType::ZSET:
+            total += as_zset().memory_usage();
+            break;
+        case ValueType::HASH:
+            total += as_hash().memory_usage();
+            break;
+        }
+        return total;
+    }
+
+    size_t Value::free_effort() const
+    {
+        switch (encoding())
+        {
+        case Encoding::QUICKLIST:
+            return as_list().node_count();
+        case Encoding::HASHTABLE:
+            return type() == ValueType::SET ? as_set().size() : as_hash().size();
+        case Encoding::BTREE:
+            return as_zset().size();
+        default:
+            return 1;
+        }
+    }
+
+    Encoding Value::encoding() const
+    {
+        switch (type())
+        {
+        case ValueType::SET:
+            switch (as_set().kind())
+            {
+            case Set::Kind::INTSET:
+                return Encoding::INTSET;
+            case Set::Kind::LISTPACK:
+                return Encoding::LISTPACK;
+            default:
+                return Encoding::HASHTABLE;
+            }
+        case ValueType::ZSET:
+            return as_zset().kind() == ZSet::Kind::LISTPACK ? Encoding::LISTPACK : Encoding::BTREE;
+        case ValueType::HASH:
+            return as_hash().kind() == Hash::Kind::LISTPACK ? Encoding::LISTPACK : Encoding::HASHTABLE;
+        default:
+            return tag_encoding();
+        }
+    }
+
+    const char *Value::type_name(ValueType type)
+    {
+        switch (type)
+        {
+        case ValueType::STRING:
+            return "string";
+        case ValueType::LIST:
+            return "list";
+        case ValueType::SET:
+            return "set";
+        case ValueType::ZSET:
+            return "zset";
+        case ValueType::HASH:
+            return "hash";
+        }
+        return "none";
+    }
+
+    const char *Value::encoding_name(Encoding encoding)
+    {
+        switch (encoding)
+        {
+        case Encoding::EMBSTR:
+            return "embstr";
+        case Encoding::INT:
+            return "int";
+        case Encoding::RAW:
+            return "raw";
+        case Encoding::QUICKLIST:
+            return "quicklist";
+        case Encoding::INTSET:
+            return "intset";
+        case Encoding::LISTPACK:
+            return "listpack";
+        case Encoding::HASHTABLE:
+            return "hashtable";
+        case Encoding::BTREE:
+            return "btree";
+        }
+        return "unknown";
+    }
+}
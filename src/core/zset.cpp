@@ -0,0 +1,677 @@
+#include "core/zset.hpp"
+#include "core/value.hpp"
+#include <algorithm>
+#include <cstring>
+#include <unordered_map>
+
+namespace core
+{
+    namespace
+    {
+        size_t max_listpack_entries = 128;
+        size_t max_listpack_value = 64;
+
+        // Both node kinds come to about 1KB, a few cache lines per level.
+        const size_t LEAF_CAPACITY = 64;
+        const size_t INNER_CAPACITY = 32;
+
+        size_t put_length(char *p, size_t n)
+        {
+            size_t size = 0;
+            while (n >= 0x80)
+            {
+                p[size++] = static_cast<char>(n | 0x80);
+                n >>= 7;
+            }
+            p[size++] = static_cast<char>(n);
+            return size;
+        }
+
+        size_t get_length(const char *p, size_t &n)
+        {
+            n = 0;
+            for (size_t i = 0, shift = 0;; ++i, shift += 7)
+            {
+                uint8_t byte = static_cast<uint8_t>(p[i]);
+                n |= static_cast<size_t>(byte & 0x7f) << shift;
+                if (!(byte & 0x80))
+                    return i + 1;
+            }
+        }
+
+        // A listpack entry is the score's 8 bytes followed by the member's
+        // length and bytes.
+        struct Packed
+        {
+            double score;
+            std::string_view member;
+            size_t size;
+        };
+
+        Packed unpack(const char *p)
+        {
+            Packed packed;
+            std::memcpy(&packed.score, p, sizeof(double));
+            size_t len;
+            size_t header = get_length(p + sizeof(double), len);
+            packed.member = std::string_view(p + sizeof(double) + header, len);
+            packed.size = sizeof(double) + header + len;
+            return packed;
+        }
+
+        bool before(double score_a, std::string_view member_a, double score_b, std::string_view member_b)
+        {
+            return score_a < score_b || (score_a == score_b && member_a < member_b);
+        }
+
+        // Tree entries point at the member string owned by the hash table,
+        // whose nodes never move.
+        struct Entry
+        {
+            double score;
+            const std::string *member;
+        };
+
+        bool operator<(const Entry &a, const Entry &b)
+        {
+            return before(a.score, *a.member, b.score, *b.member);
+        }
+
+        struct Node
+        {
+            bool leaf;
+            uint32_t count = 0;
+        };
+
+        // Entries below the child and the smallest of them.
+        struct Slot
+        {
+            size_t size;
+            Entry low;
+            Node *child;
+        };
+
+        struct Inner : Node
+        {
+            Slot slots[INNER_CAPACITY];
+        };
+
+        // A hash node (next pointer, string, score, cached hash) and its
+        // bucket pointer.
+        size_t hash_item_size(std::string_view member)
+        {
+            return heap_size(sizeof(void *) + sizeof(std::string) + sizeof(double) + sizeof(size_t)) + sizeof(void *) +
+                   string_heap_size(member);
+        }
+
+        // Moves items so that left and right hold about the same number.
+        template <typename T>
+        void redistribute(T *left, uint32_t &left_count, T *right, uint32_t &right_count)
+        {
+            uint32_t total = left_count + right_count;
+            uint32_t want = total / 2;
+            if (left_count > want)
+            {
+                uint32_t move = left_count - want;
+                std::memmove(right + move, right, right_count * sizeof(T));
+                std::memcpy(right, left + want, move * sizeof(T));
+            }
+            else
+            {
+                uint32_t move = want - left_count;
+                std::memcpy(left + left_count, right, move * sizeof(T));
+                std::memmove(right, right + move, (right_count - move) * sizeof(T));
+            }
+            left_count = want;
+            right_count = total - want;
+        }
+    }
+
+    struct ZSet::Leaf : Node
+    {
+        Leaf *next = nullptr;
+        Entry entries[LEAF_CAPACITY];
+    };
+
+    struct ZSet::Tree
+    {
+        std::unordered_map<std::string, double> scores;
+        // Nodes and hash table entries.
+        size_t bytes = 0;
+        Node *root;
+
+        Tree() : root(new_leaf()) {}
+
+        ~Tree()
+        {
+            release(root);
+        }
+
+        Leaf *new_leaf()
+        {
+            Leaf *leaf = new Leaf();
+            leaf->leaf = true;
+            bytes += heap_size(sizeof(Leaf));
+            return leaf;
+        }
+
+        Inner *new_inner()
+        {
+            Inner *inner = new Inner();
+            inner->leaf = false;
+            bytes += heap_size(sizeof(Inner));
+            return inner;
+        }
+
+        void release(Node *node)
+        {
+            if (node->leaf)
+            {
+                bytes -= heap_size(sizeof(Leaf));
+                delete static_cast<Leaf *>(node);
+                return;
+            }
+            Inner *inner = static_cast<Inner *>(node);
+            for (uint32_t i = 0; i < inner->count; ++i)
+            {
+                release(inner->slots[i].child);
+            }
+            bytes -= heap_size(sizeof(Inner));
+            delete inner;
+        }
+
+        static size_t size_of(const Node *node)
+        {
+            if (node->leaf)
+                return node->count;
+            const Inner *inner = static_cast<const Inner *>(node);
+            size_t size = 0;
+            for (uint32_t i = 0; i < inner->count; ++i)
+            {
+                size += inner->slots[i].size;
+            }
+            return size;
+        }
+
+        static void refresh(Inner *inner, size_t i)
+        {
+            Slot &slot = inner->slots[i];
+            slot.size = size_of(slot.child);
+            if (slot.child->count == 0)
+                return;
+            slot.low = slot.child->leaf ? static_cast<Leaf *>(slot.child)->entries[0]
+                                        : static_cast<Inner *>(slot.child)->slots[0].low;
+        }
+
+        // The last child whose smallest entry is not after entry.
+        static size_t child_for(const Inner *inner, const Entry &entry)
+        {
+            const Slot *end = inner->slots + inner->count;
+            const Slot *it = std::upper_bound(inner->slots, end, entry, [](const Entry &e, const Slot &slot)
+                                              { return e < slot.low; });
+            return it == inner->slots ? 0 : it - inner->slots - 1;
+        }
+
+        void insert(const Entry &entry)
+        {
+            Node *split = insert(root, entry);
+            if (!split)
+                return;
+            Inner *top = new_inner();
+            top->count = 2;
+            top->slots[0].child = root;
+            top->slots[1].child = split;
+            refresh(top, 0);
+            refresh(top, 1);
+            root = top;
+        }
+
+        // Returns the new right sibling if node had to split.
+        Node *insert(Node *node, const Entry &entry)
+        {
+            if (node->leaf)
+            {
+                Leaf *leaf = static_cast<Leaf *>(node);
+                Leaf *right = nullptr;
+                Leaf *target = leaf;
+                if (leaf->count == LEAF_CAPACITY)
+                {
+                    right = new_leaf();
+                    uint32_t half = LEAF_CAPACITY / 2;
+                    right->count = LEAF_CAPACITY - half;
+                    std::memcpy(right->entries, leaf->entries + half, right->count * sizeof(Entry));
+                    leaf->count = half;
+                    right->next = leaf->next;
+                    leaf->next = right;
+                    if (!(entry < right->entries[0]))
+                        target = right;
+                }
+                Entry *end = target->entries + target->count;
+                Entry *pos = std::upper_bound(target->entries, end, entry);
+                std::memmove(pos + 1, pos, (end - pos) * sizeof(Entry));
+                *pos = entry;
+                target->count++;
+                return right;
+            }
+
+            Inner *inner = static_cast<Inner *>(node);
+            size_t i = child_for(inner, entry);
+            Node *split = insert(inner->slots[i].child, entry);
+            refresh(inner, i);
+            if (!split)
+                return nullptr;
+            Inner *right = nullptr;
+            Inner *target = inner;
+            size_t pos = i + 1;
+            if (inner->count == INNER_CAPACITY)
+            {
+                right = new_inner();
+                uint32_t half = INNER_CAPACITY / 2;
+                right->count = INNER_CAPACITY - half;
+                std::memcpy(right->slots, inner->slots + half, right->count * sizeof(Slot));
+                inner->count = half;
+                if (pos >= half)
+                {
+                    target = right;
+                    pos -= half;
+                }
+            }
+            std::memmove(target->slots + pos + 1, target->slots + pos, (target->count - pos) * sizeof(Slot));
+            target->slots[pos].child = split;
+            target->count++;
+            refresh(target, pos);
+            return right;
+        }
+
+        void erase(const Entry &entry)
+        {
+            erase(root, entry);
+            while (!root->leaf && root->count == 1)
+            {
+                Inner *old = static_cast<Inner *>(root);
+                root = old->slots[0].child;
+                old->count = 0;
+                release(old);
+            }
+        }
+
+        void erase(Node *node, const Entry &entry)
+        {
+            if (node->leaf)
+            {
+                Leaf *leaf = static_cast<Leaf *>(node);
+                Entry *end = leaf->entries + leaf->count;
+                Entry *pos = std::lower_bound(leaf->entries, end, entry);
+                std::memmove(pos, pos + 1, (end - pos - 1) * sizeof(Entry));
+                leaf->count--;
+                return;
+            }
+            Inner *inner = static_cast<Inner *>(node);
+            size_t i = child_for(inner, entry);
+            erase(inner->slots[i].child, entry);
+            refresh(inner, i);
+            uint32_t capacity = inner->slots[i].child->leaf ? LEAF_CAPACITY : INNER_CAPACITY;
+            if (inner->slots[i].child->count < capacity / 4 && inner->count > 1)
+                rebalance(inner, i + 1 < inner->count ? i : i - 1);
+        }
+
+        // Merges the children at i and i + 1 if they fit in one node, and
+        // evens them out otherwise.
+        void rebalance(Inner *inner, size_t i)
+        {
+            Node *left = inner->slots[i].child;
+            Node *right = inner->slots[i + 1].child;
+            if (left->leaf)
+            {
+                Leaf *l = static_cast<Leaf *>(left);
+                Leaf *r = static_cast<Leaf *>(right);
+                if (l->count + r->count > LEAF_CAPACITY)
+                {
+                    redistribute(l->entries, l->count, r->entries, r->count);
+                    refresh(inner, i);
+                    refresh(inner, i + 1);
+                    return;
+                }
+                std::memcpy(l->entries + l->count, r->entries, r->count * sizeof(Entry));
+                l->count += r->count;
+                l->next = r->next;
+            }
+            else
+            {
+                Inner *l = static_cast<Inner *>(left);
+                Inner *r = static_cast<Inner *>(right);
+                if (l->count + r->count > INNER_CAPACITY)
+                {
+                    redistribute(l->slots, l->count, r->slots, r->count);
+                    refresh(inner, i);
+                    refresh(inner, i + 1);
+                    return;
+                }
+                std::memcpy(l->slots + l->count, r->slots, r->count * sizeof(Slot));
+                l->count += r->count;
+            }
+            right->count = 0;
+            release(right);
+            std::memmove(inner->slots + i + 1, inner->slots + i + 2, (inner->count - i - 2) * sizeof(Slot));
+            inner->count--;
+            refresh(inner, i);
+        }
+
+        // Number of entries for which is_before holds; it must hold for a
+        // prefix of the order.
+        template <typename Pred>
+        size_t count_before(Pred is_before) const
+        {
+            size_t rank = 0;
+            const Node *node = root;
+            while (!node->leaf)
+            {
+                const Inner *inner = static_cast<const Inner *>(node);
+                const Slot *end = inner->slots + inner->count;
+                size_t k = std::partition_point(inner->slots, end, [&is_before](const Slot &slot)
+                                                { return is_before(slot.low); }) -
+                           inner->slots;
+                if (k == 0)
+                    return rank;
+                for (size_t i = 0; i + 1 < k; ++i)
+                {
+                    rank += inner->slots[i].size;
+                }
+                node = inner->slots[k - 1].child;
+            }
+            const Leaf *leaf = static_cast<const Leaf *>(node);
+            return rank + (std::partition_point(leaf->entries, leaf->entries + leaf->count, is_before) - leaf->entries);
+        }
+
+        const Leaf *find(size_t rank, uint32_t &slot) const
+        {
+            const Node *node = root;
+            while (!node->leaf)
+            {
+                const Inner *inner = static_cast<const Inner *>(node);
+                uint32_t i = 0;
+                while (i + 1 < inner->count && rank >= inner->slots[i].size)
+                {
+                    rank -= inner->slots[i].size;
+                    ++i;
+                }
+                node = inner->slots[i].child;
+            }
+            slot = static_cast<uint32_t>(rank);
+            return static_cast<const Leaf *>(node);
+        }
+    };
+
+    void ZSet::configure(size_t listpack_entries, size_t listpack_value)
+    {
+        max_listpack_entries = listpack_entries;
+        max_listpack_value = listpack_value;
+    }
+
+    ZSet::ZSet() = default;
+
+    ZSet::~ZSet() = default;
+
+    size_t ZSet::size() const
+    {
+        return tree_ ? tree_->scores.size() : listpack_count_;
+    }
+
+    size_t ZSet::memory_usage() const
+    {
+        size_t total = heap_size(sizeof(ZSet));
+        if (tree_)
+            return total + heap_size(sizeof(Tree)) + tree_->bytes;
+        return total + (listpack_.capacity() > 15 ? heap_size(listpack_.capacity() + 1) : 0);
+    }
+
+    bool ZSet::listpack_find(std::string_view member, size_t &offset, size_t &size, double &score) const
+    {
+        size_t pos = 0;
+        while (pos < listpack_.size())
+        {
+            Packed packed = unpack(listpack_.data() + pos);
+            if (packed.member == member)
+            {
+                offset = pos;
+                size = packed.size;
+                score = packed.score;
+                return true;
+            }
+            pos += packed.size;
+        }
+        return false;
+    }
+
+    void ZSet::listpack_insert(std::string_view member, double score)
+    {
+        size_t pos = 0;
+        while (pos < listpack_.size())
+        {
+            Packed packed = unpack(listpack_.data() + pos);
+            if (before(score, member, packed.score, packed.member))
+                break;
+            pos += packed.size;
+        }
+        char header[sizeof(double) + 10];
+        std::memcpy(header, &score, sizeof(double));
+        size_t header_size = sizeof(double) + put_length(header + sizeof(double), member.size());
+        listpack_.insert(pos, member);
+        listpack_.insert(pos, header, header_size);
+        listpack_count_++;
+    }
+
+    void ZSet::to_tree()
+    {
+        auto tree = std::make_unique<Tree>();
+        tree->scores.reserve(listpack_count_);
+        for (size_t pos = 0; pos < listpack_.size();)
+        {
+            Packed packed = unpack(listpack_.data() + pos);
+            auto it = tree->scores.emplace(std::string(packed.member), packed.score).first;
+            tree->bytes += hash_item_size(packed.member);
+            tree->insert(Entry{packed.score, &it->first});
+            pos += packed.size;
+        }
+        tree_ = std::move(tree);
+        std::string().swap(listpack_);
+        listpack_count_ = 0;
+    }
+
+    bool ZSet::add(std::string_view member, double score)
+    {
+        if (!tree_)
+        {
+            size_t offset, size;
+            double old;
+            if (listpack_find(member, offset, size, old))
+            {
+                if (old == score)
+                    return false;
+                listpack_.erase(offset, size);
+                listpack_count_--;
+                listpack_insert(member, score);
+                return false;
+            }
+            if (listpack_count_ < max_listpack_entries && member.size() <= max_listpack_value)
+            {
+                listpack_insert(member, score);
+                return true;
+            }
+            to_tree();
+        }
+        auto [it, inserted] = tree_->scores.try_emplace(std::string(member), score);
+        if (inserted)
+        {
+            tree_->bytes += hash_item_size(member);
+            tree_->insert(Entry{score, &it->first});
+            return true;
+        }
+        if (it->second != score)
+        {
+            tree_->erase(Entry{it->second, &it->first});
+            it->second = score;
+            tree_->insert(Entry{score, &it->first});
+        }
+        return false;
+    }
+
+    bool ZSet::remove(std::string_view member)
+    {
+        if (!tree_)
+        {
+            size_t offset, size;
+            double score;
+            if (!listpack_find(member, offset, size, score))
+                return false;
+            listpack_.erase(offset, size);
+            listpack_count_--;
+            return true;
+        }
+        auto it = tree_->scores.find(std::string(member));
+        if (it == tree_->scores.end())
+            return false;
+        tree_->erase(Entry{it->second, &it->first});
+        tree_->bytes -= hash_item_size(member);
+        tree_->scores.erase(it);
+        return true;
+    }
+
+    std::optional<double> ZSet::score(std::string_view member) const
+    {
+        if (!tree_)
+        {
+            size_t offset, size;
+            double score;
+            if (!listpack_find(member, offset, size, score))
+                return std::nullopt;
+            return score;
+        }
+        auto it = tree_->scores.find(std::string(member));
+        if (it == tree_->scores.end())
+            return std::nullopt;
+        return it->second;
+    }
+
+    std::optional<size_t> ZSet::rank(std::string_view member) const
+    {
+        if (!tree_)
+        {
+            size_t rank = 0;
+            for (size_t pos = 0; pos < listpack_.size(); ++rank)
+            {
+                Packed packed = unpack(listpack_.data() + pos);
+                if (packed.member == member)
+                    return rank;
+                pos += packed.size;
+            }
+            return std::nullopt;
+        }
+        auto it = tree_->scores.find(std::string(member));
+        if (it == tree_->scores.end())
+            return std::nullopt;
+        Entry entry{it->second, &it->first};
+        return tree_->count_before([&entry](const Entry &e)
+                                   { return e < entry; });
+    }
+
+    size_t ZSet::count_below(double score, bool inclusive) const
+    {
+        if (!tree_)
+        {
+            size_t count = 0;
+            for (size_t pos = 0; pos < listpack_.size(); ++count)
+            {
+                Packed packed = unpack(listpack_.data() + pos);
+                if (inclusive ? packed.score > score : packed.score >= score)
+                    break;
+                pos += packed.size;
+            }
+            return count;
+        }
+        if (inclusive)
+            return tree_->count_before([score](const Entry &e)
+                                       { return e.score <= score; });
+        return tree_->count_before([score](const Entry &e)
+                                   { return e.score < score; });
+    }
+
+    ZSet::const_iterator ZSet::end() const
+    {
+        const_iterator it;
+        it.zset_ = this;
+        it.index_ = size();
+        return it;
+    }
+
+    ZSet::const_iterator ZSet::at(size_t rank) const
+    {
+        if (rank >= size())
+            return end();
+        const_iterator it;
+        it.zset_ = this;
+        it.index_ = rank;
+        if (tree_)
+        {
+            it.leaf_ = tree_->find(rank, it.slot_);
+            return it;
+        }
+        for (size_t i = 0; i < rank; ++i)
+        {
+            it.offset_ += unpack(listpack_.data() + it.offset_).size;
+        }
+        return it;
+    }
+
+    std::string_view ZSet::const_iterator::member() const
+    {
+        if (leaf_)
+            return *leaf_->entries[slot_].member;
+        return unpack(zset_->listpack_.data() + offset_).member;
+    }
+
+    double ZSet::const_iterator::score() const
+    {
+        if (leaf_)
+            return leaf_->entries[slot_].score;
+        return unpack(zset_->listpack_.data() + offset_).score;
+    }
+
+    ZSet::const_iterator &ZSet::const_iterator::operator++()
+    {
+        if (leaf_)
+        {
+            if (++slot_ == leaf_->count)
+            {
+                leaf_ = leaf_->next;
+                slot_ = 0;
+            }
+        }
+        else
+        {
+            offset_ += unpack(zset_->listpack_.data() + offset_).size;
+        }
+        ++index_;
+        return *this;
+    }
+
+    size_t ZSet::scan(size_t cursor, const std::function<void(std::string_view member, double score)> &visit) const
+    {
+        if (!tree_)
+        {
+            for (auto it = begin(); it != end(); ++it)
+            {
+                visit(it.member(), it.score());
+            }
+            return 0;
+        }
+        const auto &scores = tree_->scores;
+        if (cursor >= scores.bucket_count())
+            return 0;
+        for (auto it = scores.begin(cursor); it != scores.end(cursor); ++it)
+        {
+            visit(it->first, it->second);
+        }
+        return cursor + 1 < scores.bucket_count() ? cursor + 1 : 0;
+    }
+}
@@ -0,0 +1,89 @@
+#include "net/buffer.hpp"
+#include <sys/uio.h>
+#include <algorithm>
+
+namespace net
+{
+    namespace
+    {
+        const size_t MAX_IOV = 64;
+        const size_t MAX_SPARE_CHUNKS = 2;
+    }
+
+    void OutputBuffer::append_chunked(std::string_view data)
+    {
+        size_ += data.size();
+        while (!data.empty())
+        {
+            if (!tail_ || tail_->size() == CHUNK_SIZE)
+            {
+                std::string chunk;
+                if (!spare_.empty())
+                {
+                    chunk = std::move(spare_.back());
+                    spare_.pop_back();
+                }
+                chunk.reserve(CHUNK_SIZE);
+                segments_.push_back(Segment{std::move(chunk), false});
+                tail_ = &segments_.back().data;
+            }
+            size_t take = std::min(data.size(), CHUNK_SIZE - tail_->size());
+            tail_->append(data.data(), take);
+            data.remove_prefix(take);
+        }
+    }
+
+    void OutputBuffer::append(std::string &&data)
+    {
+        if (data.size() < ZERO_COPY_MIN)
+        {
+            append(std::string_view(data));
+            return;
+        }
+        size_ += data.size();
+        segments_.push_back(Segment{std::move(data), true});
+        tail_ = nullptr;
+    }
+
+    ssize_t OutputBuffer::write_to(int fd)
+    {
+        struct iovec iov[MAX_IOV];
+        size_t count = 0;
+        size_t skip = offset_;
+        for (auto it = segments_.begin(); it != segments_.end() && count < MAX_IOV; ++it, skip = 0)
+        {
+            iov[count].iov_base = const_cast<char *>(it->data.data() + skip);
+            iov[count].iov_len = it->data.size() - skip;
+            ++count;
+        }
+        ssize_t written = ::writev(fd, iov, static_cast<int>(count));
+        if (written > 0)
+            consume(static_cast<size_t>(written));
+        return written;
+    }
+
+    void OutputBuffer::consume(size_t n)
+    {
+        size_ -= n;
+        while (n > 0)
+        {
+            Segment &front = segments_.front();
+            size_t left = front.data.size() - offset_;
+            if (n < left)
+            {
+                offset_ += n;
+                return;
+            }
+            n -= left;
+            offset_ = 0;
+            if (tail_ == &front.data)
+                tail_ = nullptr;
+            if (!front.sealed && spare_.size() < MAX_SPARE_CHUNKS)
+            {
+                front.data.clear();
+                spare_.push_back(std::move(front.data));
+            }
+            segments_.pop_front();
+        }
+    }
+}
@@ -0,0 +1,102 @@
+#include "net/metrics_server.hpp"
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <string>
+#include <system_error>
+#include <thread>
+
+namespace net
+{
+    namespace
+    {
+        const size_t MAX_REQUEST = 8 * 1024;
+
+        void write_all(int fd, const std::string &data)
+        {
+            size_t sent = 0;
+            while (sent < data.size())
+            {
+                ssize_t n = send(fd, data.data() + sent, data.size() - sent, MSG_NOSIGNAL);
+                if (n < 0 && errno == EINTR)
+                    continue;
+                if (n <= 0)
+                    return;
+                sent += n;
+            }
+        }
+    }
+
+    void MetricsServer::start()
+    {
+        server_fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (server_fd < 0)
+            throw std::system_error(errno, std::generic_category(), "socket");
+        int one = 1;
+        setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+        sockaddr_in addr{};
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = INADDR_ANY;
+        addr.sin_port = htons(port);
+
+        if (bind(server_fd, (sockaddr *)&addr, sizeof(addr)) < 0)
+            throw std::system_error(errno, std::generic_category(), "bind");
+        if (listen(server_fd, 16) < 0)
+            throw std::system_error(errno, std::generic_category(), "listen");
+        std::thread([this]
+                    { serve(); })
+            .detach();
+    }
+
+    void MetricsServer::serve()
+    {
+        while (true)
+        {
+            int fd = accept(server_fd, nullptr, nullptr);
+            if (fd < 0)
+                continue;
+            // A client that never finishes its request must not hold up the next scrape.
+            timeval timeout{1, 0};
+            setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+            setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+            respond(fd);
+            close(fd);
+        }
+    }
+
+    void MetricsServer::respond(int fd)
+    {
+        std::string request;
+        char buf[1024];
+        while (request.find("\r\n\r\n") == std::string::npos && request.size() < MAX_REQUEST)
+        {
+            ssize_t n = read(fd, buf, sizeof(buf));
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0)
+                return;
+            request.append(buf, n);
+        }
+        std::string status = "200 OK";
+        std::string body;
+        size_t line_end = request.find("\r\n");
+        std::string line = request.substr(0, line_end);
+        if (line.rfind("GET ", 0) != 0)
+        {
+            status = "405 Method Not Allowed";
+        }
+        else if (line.rfind("GET /metrics ", 0) != 0 && line.rfind("GET / ", 0) != 0)
+        {
+            status = "404 Not Found";
+        }
+        else
+        {
+            body = render();
+        }
+        std::string response = "HTTP/1.1 " + status + "\r\nContent-Type: text/plain; version=0.0.4; charset=utf-8\r\n" +
+                               "Content-Length: " + std::to_string(body.size()) + "\r\nConnection: close\r\n\r\n" + body;
+        write_all(fd, response);
+    }
+}
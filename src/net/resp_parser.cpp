@@ -0,0 +1,213 @@
+#include "net/resp_parser.hpp"
+#include <cstring>
+
+namespace net
+{
+    namespace
+    {
+        bool parse_length(const char *begin, const char *end, long long &out)
+        {
+            bool negative = false;
+            if (begin < end && *begin == '-')
+            {
+                negative = true;
+                ++begin;
+            }
+            if (begin == end || end - begin > 18)
+                return false;
+            long long value = 0;
+            for (const char *p = begin; p < end; ++p)
+            {
+                if (*p < '0' || *p > '9')
+                    return false;
+                value = value * 10 + (*p - '0');
+            }
+            out = negative ? -value : value;
+            return true;
+        }
+
+        // Finds the CRLF terminating the line at pos; returns the offset of '\r'.
+        size_t find_crlf(std::string_view buffer, size_t pos)
+        {
+            if (pos >= buffer.size())
+                return std::string_view::npos;
+            const void *cr = std::memchr(buffer.data() + pos, '\r', buffer.size() - pos);
+            if (!cr)
+                return std::string_view::npos;
+            size_t at = static_cast<const char *>(cr) - buffer.data();
+            if (at + 1 >= buffer.size())
+                return std::string_view::npos;
+            return at;
+        }
+
+        bool is_space(char c)
+        {
+            return c == ' ' || c == '\t' || c == '\r';
+        }
+    }
+
+    ParseResult RespParser::fail(const char *message)
+    {
+        error_ = std::string("Protocol error: ") + message;
+        state_ = State::START;
+        offsets_.clear();
+        return ParseResult::PROTOCOL_ERROR;
+    }
+
+    ParseResult RespParser::next(std::string_view buffer, std::vector<std::string_view> &args)
+    {
+        while (true)
+        {
+            switch (state_)
+            {
+            case State::START:
+            {
+                if (consumed_ >= buffer.size())
+                    return ParseResult::INCOMPLETE;
+                pos_ = consumed_;
+                if (buffer[pos_] == '*')
+                {
+                    ++pos_;
+                    state_ = State::MULTIBULK_LEN;
+                }
+                else
+                {
+                    state_ = State::INLINE;
+                }
+                break;
+            }
+            case State::MULTIBULK_LEN:
+            {
+                size_t cr = find_crlf(buffer, pos_);
+                if (cr == std::string_view::npos)
+                {
+                    if (buffer.size() - consumed_ > MAX_INLINE_SIZE)
+                        return fail("too big mbulk count string");
+                    return ParseResult::INCOMPLETE;
+                }
+                long long count;
+                if (buffer[cr + 1] != '\n' || !parse_length(buffer.data() + pos_, buffer.data() + cr, count) ||
+                    count > MAX_MULTIBULK)
+                    return fail("invalid multibulk length");
+                pos_ = cr + 2;
+                if (count <= 0)
+                {
+                    consumed_ = pos_;
+                    state_ = State::START;
+                    break;
+                }
+                remaining_ = count;
+                offsets_.clear();
+                state_ = State::BULK_LEN;
+                break;
+            }
+            case State::BULK_LEN:
+            {
+                if (pos_ >= buffer.size())
+                    return ParseResult::INCOMPLETE;
+                if (buffer[pos_] != '$')
+                    return fail("expected '$'");
+                size_t cr = find_crlf(buffer, pos_ + 1);
+                if (cr == std::string_view::npos)
+                {
+                    if (buffer.size() - pos_ > MAX_INLINE_SIZE)
+                        return fail("too big bulk count string");
+                    return ParseResult::INCOMPLETE;
+                }
+                long long len;
+                if (buffer[cr + 1] != '\n' || !parse_length(buffer.data() + pos_ + 1, buffer.data() + cr, len) ||
+                    len < 0 || len > MAX_BULK)
+                    return fail("invalid bulk length");
+                pos_ = cr + 2;
+                bulk_len_ = len;
+                state_ = State::BULK_DATA;
+                break;
+            }
+            case State::BULK_DATA:
+            {
+                size_t need = static_cast<size_t>(bulk_len_) + 2;
+                if (buffer.size() - pos_ < need)
+                    return ParseResult::INCOMPLETE;
+                if (buffer[pos_ + bulk_len_] != '\r' || buffer[pos_ + bulk_len_ + 1] != '\n')
+                    return fail("invalid bulk terminator");
+                offsets_.emplace_back(pos_, static_cast<size_t>(bulk_len_));
+                pos_ += need;
+                if (--remaining_ > 0)
+                {
+                    state_ = State::BULK_LEN;
+                    break;
+                }
+                args.clear();
+                for (const auto &[offset, len] : offsets_)
+                    args.emplace_back(buffer.data() + offset, len);
+                consumed_ = pos_;
+                state_ = State::START;
+                return ParseResult::COMMAND;
+            }
+            case State::INLINE:
+            {
+                ParseResult result = parse_inline(buffer, args);
+                if (result != ParseResult::COMMAND || !args.empty())
+                    return result;
+                break;
+            }
+            }
+        }
+    }
+
+    ParseResult RespParser::parse_inline(std::string_view buffer, std::vector<std::string_view> &args)
+    {
+        const void *nl = pos_ < buffer.size()
+                             ? std::memchr(buffer.data() + pos_, '\n', buffer.size() - pos_)
+                             : nullptr;
+        if (!nl)
+        {
+            pos_ = buffer.size();
+            if (buffer.size() - consumed_ > MAX_INLINE_SIZE)
+                return fail("too big inline request");
+            return ParseResult::INCOMPLETE;
+        }
+        size_t end = static_cast<const char *>(nl) - buffer.data();
+        size_t p = consumed_;
+        args.clear();
+        while (true)
+        {
+            while (p < end && is_space(buffer[p]))
+                ++p;
+            if (p >= end)
+                break;
+            if (buffer[p] == '"' || buffer[p] == '\'')
+            {
+                char quote = buffer[p++];
+                size_t close = buffer.find(quote, p);
+                if (close == std::string_view::npos || close > end ||
+                    (close + 1 < end && !is_space(buffer[close + 1])))
+                {
+                    args.clear();
+                    return fail("unbalanced quotes in request");
+                }
+                args.emplace_back(buffer.data() + p, close - p);
+                p = close + 1;
+            }
+            else
+            {
+                size_t start = p;
+                while (p < end && !is_space(buffer[p]))
+                    ++p;
+                args.emplace_back(buffer.data() + start, p - start);
+            }
+        }
+        consumed_ = end + 1;
+        pos_ = consumed_;
+        state_ = State::START;
+        return ParseResult::COMMAND;
+    }
+
+    void RespParser::discard(size_t n)
+    {
+        consumed_ -= n;
+        pos_ -= n;
+        for (auto &offset : offsets_)
+            offset.first -= n;
+    }
+}
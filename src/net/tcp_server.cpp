@@ -1,171 +1,897 @@
 #include "net/tcp_server.hpp"
+#include <algorithm>
+#include <atomic>
 #include <unistd.h>
 #include <cstring>
 #include <iostream>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <arpa/inet.h>
 #include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <fcntl.h>
 #include <map>
-#include <string>
+#include <deque>
+#include <memory>
 #include <optional>
-#include <algorithm>
+#include <string>
+#include <system_error>
+#include <thread>
 #include <cctype>
 #include "core/command.hpp"
+#include "core/dispatcher.hpp"
+#include "core/shard.hpp"
+#include "net/buffer.hpp"
+#include "net/resp_parser.hpp"
+#include "net/spsc_queue.hpp"
 
 namespace net
 {
     using core::Command;
     using core::Response;
-    std::optional<std::vector<std::string>> parse_resp_command(std::string &buffer)
+
+    // Replies of a command run on every shard, merged into one array, or
+    // of the parts of a command split across shards, merged by the
+    // dispatcher once all are in.
+    struct Gather
     {
-        if (buffer.empty() || buffer[0] != '*')
-            return std::nullopt;
-        size_t pos = 1;
-        size_t crlf = buffer.find("\r\n", pos);
-        if (crlf == std::string::npos)
-            return std::nullopt;
-        int count = std::stoi(buffer.substr(pos, crlf - pos));
-        pos = crlf + 2;
-        std::vector<std::string> args;
-        for (int i = 0; i < count; ++i)
-        {
-            if (pos >= buffer.size() || buffer[pos] != '$')
-                return std::nullopt;
-            pos++;
-            crlf = buffer.find("\r\n", pos);
-            if (crlf == std::string::npos)
-                return std::nullopt;
-            int len = std::stoi(buffer.substr(pos, crlf - pos));
-            pos = crlf + 2;
-            if (pos + len + 2 > buffer.size())
-                return std::nullopt;
-            std::string arg = buffer.substr(pos, len);
-            args.push_back(arg);
-            pos += len + 2;
-        }
-        buffer.erase(0, pos);
-        return args;
-    }
+        size_t remaining = 0;
+        size_t count = 0;
+        std::string items;
+        // The first reply that was not an array, returned instead.
+        std::optional<std::string> error;
+        const core::CommandDispatcher::CommandInfo *split = nullptr;
+        std::vector<std::string> replies;
+        std::vector<std::vector<size_t>> positions;
+    };
+
     struct ClientState
     {
-        std::string read_buffer;
-        std::string write_buffer;
+        uint64_t id = 0;
+        // "ip:port", as shown in the slow log.
+        std::string address;
+        ReadBuffer read_buffer;
+        // Size of the next read; doubles while reads fill it, up to the
+        // read budget, and halves again once they come back small.
+        size_t read_size = 0;
+        RespParser parser;
+        OutputBuffer output;
+        // Replies queued behind a command still executing on another shard,
+        // kept in request order; nullopt marks a reply not yet received.
+        std::deque<std::optional<std::string>> pending;
+        uint64_t next_seq = 0;
+        std::map<uint64_t, Gather> gathers;
+        // Between MULTI and EXEC: the commands so far, name first, copied
+        // out of the read buffer.
+        bool in_multi = false;
+        std::vector<std::vector<std::string>> queued;
+        // A command was refused while queueing; EXEC aborts.
+        bool multi_failed = false;
+        // Shards holding keys this client WATCHes.
+        std::vector<size_t> watch_shards;
+        bool close_after_write = false;
+        // Queued for flushing at the end of this loop iteration.
+        bool flush_queued = false;
+        // EPOLLOUT is armed; only while the socket would block.
+        bool want_write = false;
+    };
+
+    // A command forwarded to the shard owning its keys, or the reply to one.
+    struct ShardMessage
+    {
+        bool is_reply = false;
+        // Part of a command run on every shard.
+        bool gather = false;
+        // Index of the part of a split command.
+        size_t part = 0;
+        size_t origin = 0;
+        int fd = -1;
+        uint64_t client_id = 0;
+        uint64_t seq = 0;
+        std::string client;
+        std::string name;
+        std::vector<std::string> args;
+        std::string reply;
     };
 
+    const size_t READ_CHUNK = 16 * 1024;
+    const int MAX_EVENTS = 512;
+    const size_t QUEUE_CAPACITY = 4096;
+
     void set_nonblock(int fd)
     {
         int flags = fcntl(fd, F_GETFL, 0);
         fcntl(fd, F_SETFL, flags | O_NONBLOCK);
     }
 
-    void TCPServer::start()
+    namespace
     {
-        int server_fd = socket(AF_INET, SOCK_STREAM, 0);
-        set_nonblock(server_fd);
+        bool equals_upper(std::string_view name, std::string_view upper)
+        {
+            if (name.size() != upper.size())
+                return false;
+            for (size_t i = 0; i < name.size(); ++i)
+            {
+                if (std::toupper(static_cast<unsigned char>(name[i])) != upper[i])
+                    return false;
+            }
+            return true;
+        }
 
-        sockaddr_in addr{};
-        addr.sin_family = AF_INET;
-        addr.sin_addr.s_addr = INADDR_ANY;
-        addr.sin_port = htons(port);
+        // Queues between every ordered pair of workers plus their wakeup fds.
+        struct Mesh
+        {
+            size_t shards;
+            std::vector<std::unique_ptr<SpscQueue<ShardMessage>>> queues;
+            std::vector<int> wake_fds;
+            // Client ids are unique across workers, as shards keep WATCH
+            // state by them.
+            std::atomic<uint64_t> next_client_id{1};
 
-        bind(server_fd, (sockaddr *)&addr, sizeof(addr));
-        listen(server_fd, 16);
+            Mesh(size_t shards, std::vector<int> wake_fds) : shards(shards), wake_fds(std::move(wake_fds))
+            {
+                for (size_t i = 0; i < shards * shards; ++i)
+                {
+                    queues.push_back(std::make_unique<SpscQueue<ShardMessage>>(QUEUE_CAPACITY));
+                }
+            }
 
-        std::cout << "Server started on port " << port << std::endl;
+            SpscQueue<ShardMessage> &queue(size_t from, size_t to) { return *queues[from * shards + to]; }
+        };
 
-        int epfd = epoll_create1(0);
-        struct epoll_event ev;
-        ev.events = EPOLLIN;
-        ev.data.fd = server_fd;
-        epoll_ctl(epfd, EPOLL_CTL_ADD, server_fd, &ev);
+        int create_listener(int port)
+        {
+            int server_fd = socket(AF_INET, SOCK_STREAM, 0);
+            if (server_fd < 0)
+                throw std::system_error(errno, std::generic_category(), "socket");
+            int one = 1;
+            setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+            setsockopt(server_fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one));
+            set_nonblock(server_fd);
 
-        std::map<int, ClientState> clients;
-        const int MAX_EVENTS = 64;
-        struct epoll_event events[MAX_EVENTS];
+            sockaddr_in addr{};
+            addr.sin_family = AF_INET;
+            addr.sin_addr.s_addr = INADDR_ANY;
+            addr.sin_port = htons(port);
 
-        while (true)
+            if (bind(server_fd, (sockaddr *)&addr, sizeof(addr)) < 0)
+                throw std::system_error(errno, std::generic_category(), "bind");
+            if (listen(server_fd, 511) < 0)
+                throw std::system_error(errno, std::generic_category(), "listen");
+            return server_fd;
+        }
+
+        class Worker
         {
-            int n = epoll_wait(epfd, events, MAX_EVENTS, -1);
-            for (int i = 0; i < n; ++i)
+        private:
+            size_t id;
+            RequestHandler handler;
+            const RequestRouter &router;
+            const LoopHook &before_sleep;
+            const std::string &takeover_command;
+            const Takeover &takeover;
+            Mesh &mesh;
+            core::ShardStats *stats;
+            size_t read_budget;
+            int server_fd;
+            int wake_fd;
+            int epfd;
+            std::map<int, ClientState> clients;
+            std::vector<std::deque<ShardMessage>> outbox;
+            std::vector<std::string_view> argv;
+            Command command;
+            std::vector<int> flush_list;
+
+            void set_events(int fd, uint32_t events)
             {
-                int fd = events[i].data.fd;
-                if (fd == server_fd)
+                struct epoll_event ev;
+                ev.events = events;
+                ev.data.fd = fd;
+                epoll_ctl(epfd, EPOLL_CTL_MOD, fd, &ev);
+            }
+
+            // Closing the only descriptor also removes it from the epoll set.
+            void close_client(int fd)
+            {
+                auto it = clients.find(fd);
+                if (it != clients.end())
+                    unwatch(it->second);
+                close(fd);
+                clients.erase(fd);
+                if (stats)
+                    stats->connected_clients.set(clients.size());
+            }
+
+            void accept_clients()
+            {
+                int client_fd;
+                sockaddr_in peer{};
+                socklen_t peer_len = sizeof(peer);
+                while ((client_fd = accept4(server_fd, (sockaddr *)&peer, &peer_len, SOCK_NONBLOCK)) >= 0)
                 {
-                    int client_fd;
-                    while ((client_fd = accept(server_fd, nullptr, nullptr)) >= 0)
+                    struct epoll_event ev;
+                    ev.events = EPOLLIN;
+                    ev.data.fd = client_fd;
+                    epoll_ctl(epfd, EPOLL_CTL_ADD, client_fd, &ev);
+                    ClientState &state = clients[client_fd];
+                    state = ClientState{};
+                    state.id = mesh.next_client_id.fetch_add(1, std::memory_order_relaxed);
+                    state.read_size = READ_CHUNK;
+                    char ip[INET_ADDRSTRLEN] = "?";
+                    inet_ntop(AF_INET, &peer.sin_addr, ip, sizeof(ip));
+                    state.address = std::string(ip) + ":" + std::to_string(ntohs(peer.sin_port));
+                    peer_len = sizeof(peer);
+                    if (stats)
                     {
-                        set_nonblock(client_fd);
-                        ev.events = EPOLLIN;
-                        ev.data.fd = client_fd;
-                        epoll_ctl(epfd, EPOLL_CTL_ADD, client_fd, &ev);
-                        clients[client_fd] = ClientState{};
+                        stats->connections_received.add(1);
+                        stats->connected_clients.set(clients.size());
                     }
                 }
+            }
+
+            void queue_flush(int fd, ClientState &state)
+            {
+                if (!state.flush_queued)
+                {
+                    state.flush_queued = true;
+                    flush_list.push_back(fd);
+                }
+            }
+
+            void deliver(int fd, ClientState &state, Response &&response)
+            {
+                if (state.pending.empty())
+                {
+                    std::move(response).write_resp(state.output);
+                    queue_flush(fd, state);
+                }
                 else
                 {
-                    auto &state = clients[fd];
-                    if (events[i].events & EPOLLIN)
+                    std::string reply;
+                    std::move(response).write_resp(reply);
+                    state.pending.push_back(std::move(reply));
+                    state.next_seq++;
+                }
+            }
+
+            // MULTI, EXEC, DISCARD and UNWATCH act on the connection and are
+            // answered here; inside MULTI so is everything else, by queueing
+            // it. Returns false for commands to run as usual.
+            bool transaction(int fd, ClientState &state)
+            {
+                if (equals_upper(command.name, "MULTI"))
+                {
+                    if (state.in_multi)
                     {
-                        char buf[4096];
-                        ssize_t nread = read(fd, buf, sizeof(buf));
-                        if (nread > 0)
-                        {
-                            state.read_buffer.append(buf, nread);
-                            while (auto cmd_args = parse_resp_command(state.read_buffer))
-                            {
-                                if (cmd_args->empty())
-                                    continue;
-                                Command command;
-                                command.name = std::move(cmd_args->front());
-                                cmd_args->erase(cmd_args->begin());
-                                command.args = std::move(*cmd_args);
-                                std::transform(command.name.begin(), command.name.end(), command.name.begin(), ::toupper);
-                                Response response = handler(command);
-                                state.write_buffer += response.to_resp();
-                            }
-                            if (!state.write_buffer.empty())
-                            {
-                                ev.events = EPOLLIN | EPOLLOUT;
-                                ev.data.fd = fd;
-                                epoll_ctl(epfd, EPOLL_CTL_MOD, fd, &ev);
-                            }
-                        }
-                        else if (nread == 0)
+                        deliver(fd, state, Response::Error("MULTI calls can not be nested"));
+                        return true;
+                    }
+                    state.in_multi = true;
+                    deliver(fd, state, Response::Ok());
+                    return true;
+                }
+                if (equals_upper(command.name, "EXEC"))
+                {
+                    if (state.in_multi)
+                        exec(fd, state);
+                    else
+                        deliver(fd, state, Response::Error("EXEC without MULTI"));
+                    return true;
+                }
+                if (equals_upper(command.name, "DISCARD"))
+                {
+                    if (!state.in_multi)
+                    {
+                        deliver(fd, state, Response::Error("DISCARD without MULTI"));
+                        return true;
+                    }
+                    state.in_multi = false;
+                    state.multi_failed = false;
+                    state.queued.clear();
+                    unwatch(state);
+                    deliver(fd, state, Response::Ok());
+                    return true;
+                }
+                bool watch = equals_upper(command.name, "WATCH");
+                if (state.in_multi)
+                {
+                    if (watch)
+                    {
+                        deliver(fd, state, Response::Error("WATCH inside MULTI is not allowed"));
+                        return true;
+                    }
+                    std::string error = core::CommandDispatcher::check(command);
+                    if (!error.empty())
+                    {
+                        state.multi_failed = true;
+                        deliver(fd, state, Response::Error(error));
+                        return true;
+                    }
+                    std::vector<std::string> &words = state.queued.emplace_back();
+                    words.emplace_back(command.name);
+                    words.insert(words.end(), command.args.begin(), command.args.end());
+                    deliver(fd, state, Response::Encoded("+QUEUED\r\n"));
+                    return true;
+                }
+                if (equals_upper(command.name, "UNWATCH"))
+                {
+                    unwatch(state);
+                    deliver(fd, state, Response::Ok());
+                    return true;
+                }
+                if (watch)
+                {
+                    int target = mesh.shards > 1 ? router(command) : core::ROUTE_LOCAL;
+                    size_t shard = target >= 0 ? static_cast<size_t>(target) : id;
+                    auto &shards = state.watch_shards;
+                    if (target != core::ROUTE_CROSS_SHARD && std::find(shards.begin(), shards.end(), shard) == shards.end())
+                        shards.push_back(shard);
+                }
+                return false;
+            }
+
+            // Runs the queued commands as one EXEC on the shard owning all
+            // their keys and the watched ones; the dispatcher releases the
+            // watches there.
+            void exec(int fd, ClientState &state)
+            {
+                state.in_multi = false;
+                std::vector<std::vector<std::string>> queued = std::move(state.queued);
+                state.queued.clear();
+                if (state.multi_failed)
+                {
+                    state.multi_failed = false;
+                    unwatch(state);
+                    deliver(fd, state, Response::Encoded("-EXECABORT Transaction discarded because of previous errors.\r\n"));
+                    return;
+                }
+                int target = core::ROUTE_LOCAL;
+                bool cross_shard = false;
+                auto join = [&target, &cross_shard](int shard)
+                {
+                    if (shard == core::ROUTE_LOCAL)
+                        return;
+                    if (shard < 0 || (target != core::ROUTE_LOCAL && shard != target))
+                        cross_shard = true;
+                    else
+                        target = shard;
+                };
+                for (size_t shard : state.watch_shards)
+                {
+                    join(static_cast<int>(shard));
+                }
+                std::vector<std::string> words;
+                for (auto &queued_command : queued)
+                {
+                    if (mesh.shards > 1)
+                    {
+                        command.name = queued_command.front();
+                        command.args.assign(queued_command.begin() + 1, queued_command.end());
+                        join(router(command));
+                    }
+                    words.push_back(std::to_string(queued_command.size()));
+                    words.insert(words.end(), std::make_move_iterator(queued_command.begin()),
+                                 std::make_move_iterator(queued_command.end()));
+                }
+                if (cross_shard)
+                {
+                    unwatch(state);
+                    deliver(fd, state, Response::Encoded("-CROSSSLOT Keys in request don't hash to the same shard\r\n"));
+                    return;
+                }
+                state.watch_shards.clear();
+                command.name = "EXEC";
+                command.args.assign(words.begin(), words.end());
+                if (target == core::ROUTE_LOCAL || static_cast<size_t>(target) == id)
+                {
+                    deliver(fd, state, handler(command));
+                    return;
+                }
+                uint64_t seq = state.next_seq++;
+                state.pending.emplace_back();
+                outbox[target].push_back(forward(command, fd, state, seq, false));
+            }
+
+            // Drops the client's watches on every shard holding some; the
+            // replies are not wanted.
+            void unwatch(ClientState &state)
+            {
+                for (size_t shard : state.watch_shards)
+                {
+                    if (shard == id)
+                    {
+                        Command release;
+                        release.name = "UNWATCH";
+                        release.client_id = state.id;
+                        handler(release);
+                        continue;
+                    }
+                    ShardMessage message;
+                    message.origin = id;
+                    message.client_id = state.id;
+                    message.name = "UNWATCH";
+                    outbox[shard].push_back(std::move(message));
+                }
+                state.watch_shards.clear();
+            }
+
+            void execute(int fd, ClientState &state)
+            {
+                if (transaction(fd, state))
+                    return;
+                int target = mesh.shards > 1 ? router(command) : core::ROUTE_LOCAL;
+                if (target == core::ROUTE_CROSS_SHARD)
+                {
+                    const auto *info = core::CommandDispatcher::find_command(command.name);
+                    if (info && (info->flags & core::CommandDispatcher::CMD_SPLIT))
+                        scatter(fd, state, *info);
+                    else
+                        deliver(fd, state, Response::Encoded("-CROSSSLOT Keys in request don't hash to the same shard\r\n"));
+                    return;
+                }
+                if (target == core::ROUTE_LOCAL || static_cast<size_t>(target) == id)
+                {
+                    deliver(fd, state, handler(command));
+                    return;
+                }
+                uint64_t seq = state.next_seq++;
+                state.pending.emplace_back();
+                if (target != core::ROUTE_ALL_SHARDS)
+                {
+                    outbox[target].push_back(forward(command, fd, state, seq, false));
+                    return;
+                }
+                state.gathers[seq].remaining = mesh.shards;
+                for (size_t to = 0; to < mesh.shards; ++to)
+                {
+                    if (to != id)
+                        outbox[to].push_back(forward(command, fd, state, seq, true));
+                }
+                std::string part;
+                handler(command).write_resp(part);
+                add_part(fd, state, seq, 0, std::move(part));
+            }
+
+            // Runs each shard's part of a multi-key command whose keys span
+            // shards; the parts are not atomic as a whole.
+            void scatter(int fd, ClientState &state, const core::CommandDispatcher::CommandInfo &info)
+            {
+                std::string error = core::CommandDispatcher::check(command);
+                if (!error.empty())
+                {
+                    deliver(fd, state, Response::Error(error));
+                    return;
+                }
+                std::vector<core::CommandDispatcher::Part> parts = core::CommandDispatcher::split(command, mesh.shards);
+                uint64_t seq = state.next_seq++;
+                state.pending.emplace_back();
+                Gather &gather = state.gathers[seq];
+                gather.remaining = parts.size();
+                gather.split = &info;
+                gather.replies.resize(parts.size());
+                size_t local = parts.size();
+                for (size_t i = 0; i < parts.size(); ++i)
+                {
+                    gather.positions.push_back(std::move(parts[i].positions));
+                    if (parts[i].shard == id)
+                        local = i;
+                    else
+                        outbox[parts[i].shard].push_back(forward(parts[i].command, fd, state, seq, true, i));
+                }
+                if (local < parts.size())
+                {
+                    std::string part;
+                    handler(parts[local].command).write_resp(part);
+                    add_part(fd, state, seq, local, std::move(part));
+                }
+            }
+
+            ShardMessage forward(const Command &sent, int fd, const ClientState &state, uint64_t seq, bool gather, size_t part = 0)
+            {
+                ShardMessage message;
+                message.gather = gather;
+                message.part = part;
+                message.origin = id;
+                message.fd = fd;
+                message.client_id = state.id;
+                message.seq = seq;
+                message.client = state.address;
+                message.name = sent.name;
+                message.args.assign(sent.args.begin(), sent.args.end());
+                return message;
+            }
+
+            // Adds one shard's reply to a gathered command; the array
+            // items are appended as they are, behind a header counting all
+            // of them once the last part is in.
+            void add_part(int fd, ClientState &state, uint64_t seq, size_t index, std::string part)
+            {
+                auto it = state.gathers.find(seq);
+                Gather &gather = it->second;
+                size_t header_end = part.find("\r\n");
+                if (gather.split)
+                {
+                    gather.replies[index] = std::move(part);
+                }
+                else if (!part.empty() && part[0] == '*' && header_end != std::string::npos)
+                {
+                    gather.count += std::stoull(part.substr(1, header_end - 1));
+                    gather.items.append(part, header_end + 2, std::string::npos);
+                }
+                else if (!gather.error)
+                {
+                    gather.error = std::move(part);
+                }
+                if (--gather.remaining > 0)
+                    return;
+                std::string reply;
+                if (gather.split)
+                {
+                    reply = core::CommandDispatcher::merge(*gather.split, gather.replies, gather.positions);
+                }
+                else if (gather.error)
+                {
+                    reply = std::move(*gather.error);
+                }
+                else
+                {
+                    Response::append_array_header(reply, gather.count);
+                    reply += gather.items;
+                }
+                state.gathers.erase(it);
+                complete(fd, state, seq, std::move(reply));
+            }
+
+            // Fills the reply slot of a command that ran elsewhere and
+            // moves every reply now in order to the output.
+            void complete(int fd, ClientState &state, uint64_t seq, std::string reply)
+            {
+                uint64_t base = state.next_seq - state.pending.size();
+                state.pending[seq - base] = std::move(reply);
+                while (!state.pending.empty() && state.pending.front())
+                {
+                    state.output.append(std::move(*state.pending.front()));
+                    state.pending.pop_front();
+                }
+                queue_flush(fd, state);
+            }
+
+            // Reads until the socket is drained or the client has used its
+            // budget for this wake-up; whatever is left is reported again by
+            // the next epoll_wait. Everything read is then parsed and run in
+            // one pass, and the replies wait for the end of the iteration.
+            void handle_read(int fd, ClientState &state)
+            {
+                size_t total = 0;
+                bool eof = false;
+                while (total < read_budget)
+                {
+                    char *buf = state.read_buffer.prepare(std::min(state.read_size, read_budget - total));
+                    size_t room = std::min(state.read_buffer.writable(), read_budget - total);
+                    ssize_t nread = read(fd, buf, room);
+                    if (stats)
+                        stats->read_calls.add(1);
+                    if (nread < 0 && errno == EINTR)
+                        continue;
+                    if (nread < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                        break;
+                    if (nread <= 0)
+                    {
+                        eof = true;
+                        break;
+                    }
+                    state.read_buffer.commit(nread);
+                    total += nread;
+                    if (static_cast<size_t>(nread) < room)
+                    {
+                        if (static_cast<size_t>(nread) < state.read_size / 4)
+                            state.read_size = std::max(READ_CHUNK, state.read_size / 2);
+                        break;
+                    }
+                    state.read_size = std::min(state.read_size * 2, std::max(read_budget, READ_CHUNK));
+                }
+                if (stats)
+                    stats->net_input_bytes.add(total);
+                if (total == 0)
+                {
+                    if (eof)
+                        hang_up(fd, state);
+                    return;
+                }
+                ParseResult result;
+                while ((result = state.parser.next(state.read_buffer.view(), argv)) == ParseResult::COMMAND)
+                {
+                    command.name = argv.front();
+                    command.args.assign(argv.begin() + 1, argv.end());
+                    command.client = state.address;
+                    command.client_id = state.id;
+                    if (takeover && equals_upper(command.name, takeover_command))
+                    {
+                        // The command's arguments point into the state erased below.
+                        epoll_ctl(epfd, EPOLL_CTL_DEL, fd, nullptr);
+                        takeover(fd, command);
+                        unwatch(state);
+                        clients.erase(fd);
+                        if (stats)
+                            stats->connected_clients.set(clients.size());
+                        return;
+                    }
+                    execute(fd, state);
+                }
+                if (result == ParseResult::PROTOCOL_ERROR)
+                {
+                    deliver(fd, state, Response::Error(state.parser.error()));
+                    state.close_after_write = true;
+                }
+                else
+                {
+                    size_t consumed = state.parser.consumed();
+                    state.read_buffer.compact(consumed);
+                    state.parser.discard(consumed);
+                    state.read_buffer.shrink(2 * state.read_size);
+                }
+                if (eof)
+                    hang_up(fd, state);
+            }
+
+            // Answers what was sent before the client hung up, including
+            // replies still due from other shards, then closes.
+            void hang_up(int fd, ClientState &state)
+            {
+                if (state.output.empty() && state.pending.empty())
+                {
+                    close_client(fd);
+                    return;
+                }
+                state.close_after_write = true;
+                set_events(fd, state.want_write ? static_cast<uint32_t>(EPOLLOUT) : 0);
+                queue_flush(fd, state);
+            }
+
+            // Writes as much as the socket takes right away; EPOLLOUT is only
+            // armed while something is left over and disarmed once it drains.
+            void flush(int fd, ClientState &state)
+            {
+                state.flush_queued = false;
+                while (!state.output.empty())
+                {
+                    ssize_t nwrite = state.output.write_to(fd);
+                    if (stats)
+                        stats->write_calls.add(1);
+                    if (nwrite < 0 && errno == EINTR)
+                        continue;
+                    if (nwrite < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                        break;
+                    if (nwrite <= 0)
+                    {
+                        close_client(fd);
+                        return;
+                    }
+                    if (stats)
+                        stats->net_output_bytes.add(nwrite);
+                }
+                if (state.output.empty() && state.close_after_write && state.pending.empty())
+                {
+                    close_client(fd);
+                    return;
+                }
+                bool want_write = !state.output.empty();
+                if (want_write != state.want_write)
+                {
+                    state.want_write = want_write;
+                    set_events(fd, (want_write ? static_cast<uint32_t>(EPOLLOUT) : 0) | (state.close_after_write ? 0 : static_cast<uint32_t>(EPOLLIN)));
+                }
+            }
+
+            void flush_clients()
+            {
+                for (int fd : flush_list)
+                {
+                    auto it = clients.find(fd);
+                    if (it != clients.end() && it->second.flush_queued)
+                        flush(fd, it->second);
+                }
+                flush_list.clear();
+            }
+
+            void handle_reply(ShardMessage &message)
+            {
+                auto it = clients.find(message.fd);
+                if (it == clients.end() || it->second.id != message.client_id)
+                    return;
+                ClientState &state = it->second;
+                if (message.gather)
+                    add_part(message.fd, state, message.seq, message.part, std::move(message.reply));
+                else
+                    complete(message.fd, state, message.seq, std::move(message.reply));
+            }
+
+            void drain_inbox()
+            {
+                ShardMessage message;
+                for (size_t from = 0; from < mesh.shards; ++from)
+                {
+                    if (from == id)
+                        continue;
+                    auto &queue = mesh.queue(from, id);
+                    while (queue.try_pop(message))
+                    {
+                        if (message.is_reply)
                         {
-                            epoll_ctl(epfd, EPOLL_CTL_DEL, fd, nullptr);
-                            close(fd);
-                            clients.erase(fd);
+                            handle_reply(message);
+                            continue;
                         }
-                        else
+                        Command remote;
+                        remote.name = message.name;
+                        remote.args.assign(message.args.begin(), message.args.end());
+                        remote.client = message.client;
+                        remote.client_id = message.client_id;
+                        if (message.fd < 0)
                         {
-                            epoll_ctl(epfd, EPOLL_CTL_DEL, fd, nullptr);
-                            close(fd);
-                            clients.erase(fd);
+                            handler(remote);
+                            continue;
                         }
+                        ShardMessage reply;
+                        reply.is_reply = true;
+                        reply.gather = message.gather;
+                        reply.part = message.part;
+                        reply.fd = message.fd;
+                        reply.client_id = message.client_id;
+                        reply.seq = message.seq;
+                        handler(remote).write_resp(reply.reply);
+                        outbox[message.origin].push_back(std::move(reply));
                     }
-                    if (events[i].events & EPOLLOUT)
+                }
+            }
+
+            // Returns true while messages remain that did not fit their queue.
+            bool flush_outbox()
+            {
+                bool backlog = false;
+                for (size_t to = 0; to < mesh.shards; ++to)
+                {
+                    auto &messages = outbox[to];
+                    if (messages.empty())
+                        continue;
+                    auto &queue = mesh.queue(id, to);
+                    bool pushed = false;
+                    while (!messages.empty() && queue.try_push(messages.front()))
+                    {
+                        messages.pop_front();
+                        pushed = true;
+                    }
+                    if (pushed)
+                    {
+                        uint64_t one = 1;
+                        ssize_t ignored = write(mesh.wake_fds[to], &one, sizeof(one));
+                        (void)ignored;
+                    }
+                    backlog |= !messages.empty();
+                }
+                return backlog;
+            }
+
+        public:
+            Worker(size_t id, int port, RequestHandler handler, const RequestRouter &router, const LoopHook &before_sleep,
+                   const std::string &takeover_command, const Takeover &takeover, Mesh &mesh, core::ShardStats *stats,
+                   size_t read_budget)
+                : id(id), handler(std::move(handler)), router(router), before_sleep(before_sleep),
+                  takeover_command(takeover_command), takeover(takeover), mesh(mesh), stats(stats), read_budget(read_budget),
+                  outbox(mesh.shards)
+            {
+                server_fd = create_listener(port);
+                wake_fd = mesh.wake_fds[id];
+                epfd = epoll_create1(0);
+                struct epoll_event ev;
+                ev.events = EPOLLIN;
+                ev.data.fd = server_fd;
+                epoll_ctl(epfd, EPOLL_CTL_ADD, server_fd, &ev);
+                ev.data.fd = wake_fd;
+                epoll_ctl(epfd, EPOLL_CTL_ADD, wake_fd, &ev);
+            }
+
+            void run()
+            {
+                struct epoll_event events[MAX_EVENTS];
+                int timeout = -1;
+
+                while (true)
+                {
+                    int n = epoll_wait(epfd, events, MAX_EVENTS, timeout);
+                    uint64_t woke = stats ? core::ticks() : 0;
+                    for (int i = 0; i < n; ++i)
                     {
-                        ssize_t nwrite = write(fd, state.write_buffer.data(), state.write_buffer.size());
-                        if (nwrite > 0)
+                        int fd = events[i].data.fd;
+                        if (fd == server_fd)
+                        {
+                            accept_clients();
+                            continue;
+                        }
+                        if (fd == wake_fd)
+                        {
+                            uint64_t count;
+                            ssize_t ignored = read(wake_fd, &count, sizeof(count));
+                            (void)ignored;
+                            continue;
+                        }
+                        auto it = clients.find(fd);
+                        if (it == clients.end())
+                            continue;
+                        auto &state = it->second;
+                        // Only replies produced in earlier iterations are written
+                        // here; new ones wait until before_sleep has run.
+                        if (events[i].events & EPOLLOUT)
                         {
-                            state.write_buffer.erase(0, nwrite);
-                            if (state.write_buffer.empty())
-                            {
-                                ev.events = EPOLLIN;
-                                ev.data.fd = fd;
-                                epoll_ctl(epfd, EPOLL_CTL_MOD, fd, &ev);
-                            }
+                            flush(fd, state);
+                            if (clients.find(fd) == clients.end())
+                                continue;
                         }
-                        else
+                        if ((events[i].events & EPOLLIN) && !state.close_after_write)
                         {
-                            epoll_ctl(epfd, EPOLL_CTL_DEL, fd, nullptr);
-                            close(fd);
-                            clients.erase(fd);
+                            handle_read(fd, state);
                         }
                     }
+                    if (mesh.shards > 1)
+                    {
+                        drain_inbox();
+                    }
+                    // Runs before replies to other shards leave, so a forwarded
+                    // write is logged before its origin can answer the client.
+                    bool busy = before_sleep && before_sleep(id);
+                    flush_clients();
+                    bool backlog = mesh.shards > 1 && flush_outbox();
+                    timeout = busy ? 0 : backlog ? 1 : before_sleep ? CRON_INTERVAL_MS : -1;
+                    if (stats)
+                        stats->loop.record(core::ticks() - woke);
                 }
             }
+        };
+    }
+
+    TCPServer::TCPServer(int port, RequestHandler handler) : TCPServer(port, std::vector<RequestHandler>{handler}, nullptr)
+    {
+    }
+
+    TCPServer::TCPServer(int port, std::vector<RequestHandler> handlers, RequestRouter router)
+        : port(port), handlers(std::move(handlers)), router(std::move(router))
+    {
+        for (size_t i = 0; i < this->handlers.size(); ++i)
+        {
+            wake_fds.push_back(eventfd(0, EFD_NONBLOCK));
+        }
+    }
+
+    void TCPServer::wake(size_t shard)
+    {
+        uint64_t one = 1;
+        ssize_t ignored = write(wake_fds[shard], &one, sizeof(one));
+        (void)ignored;
+    }
+
+    void TCPServer::start()
+    {
+        size_t shards = handlers.size();
+        Mesh mesh(shards, wake_fds);
+        std::vector<std::unique_ptr<Worker>> workers;
+        for (size_t i = 0; i < shards; ++i)
+        {
+            workers.push_back(std::make_unique<Worker>(i, port, handlers[i], router, before_sleep, takeover_command, takeover, mesh,
+                                                     stats ? &stats->shard(i) : nullptr, read_budget));
+        }
+
+        std::cout << "Server started on port " << port << " with " << shards
+                  << (shards == 1 ? " thread" : " threads") << std::endl;
+
+        std::vector<std::thread> threads;
+        for (size_t i = 1; i < shards; ++i)
+        {
+            threads.emplace_back([&workers, i]
+                                 { workers[i]->run(); });
+        }
+        workers[0]->run();
+        for (auto &thread : threads)
+        {
+            thread.join();
         }
     }
 }
@@ -0,0 +1,457 @@
+#include "persist/aof.hpp"
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cctype>
+#include <charconv>
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+#include <system_error>
+#include "core/value.hpp"
+#include "net/resp_parser.hpp"
+
+namespace persist
+{
+    namespace
+    {
+        const size_t REWRITE_BATCH = 64;
+        const uint64_t AUTO_REWRITE_MIN_SIZE = 64ULL * 1024 * 1024;
+        const auto REWRITE_SLICE = std::chrono::microseconds(1000);
+
+        void write_all(int fd, const std::string &data)
+        {
+            size_t offset = 0;
+            while (offset < data.size())
+            {
+                ssize_t n = ::write(fd, data.data() + offset, data.size() - offset);
+                if (n < 0)
+                {
+                    if (errno == EINTR)
+                        continue;
+                    std::cerr << "AOF write failed: " << std::strerror(errno) << std::endl;
+                    return;
+                }
+                offset += n;
+            }
+        }
+
+        void append_header(std::string &out, size_t count)
+        {
+            out += '*';
+            out += std::to_string(count);
+            out += "\r\n";
+        }
+
+        // Emits commands that recreate key from scratch. Containers start with
+        // a DEL so that a repeated emission replaces rather than appends.
+        template <typename Items>
+        void append_container(std::string &out, const char *command, std::string_view key, const Items &items)
+        {
+            append_header(out, 2);
+            core::Command::append_bulk(out, "DEL");
+            core::Command::append_bulk(out, key);
+            auto it = items.begin();
+            size_t left = items.size();
+            while (left > 0)
+            {
+                size_t batch = std::min(left, REWRITE_BATCH);
+                append_header(out, batch + 2);
+                core::Command::append_bulk(out, command);
+                core::Command::append_bulk(out, key);
+                for (size_t i = 0; i < batch; ++i, ++it)
+                    core::Command::append_bulk(out, *it);
+                left -= batch;
+            }
+        }
+
+        void append_zset(std::string &out, std::string_view key, const core::ZSet &zset)
+        {
+            append_header(out, 2);
+            core::Command::append_bulk(out, "DEL");
+            core::Command::append_bulk(out, key);
+            auto it = zset.begin();
+            size_t left = zset.size();
+            char score[32];
+            while (left > 0)
+            {
+                size_t batch = std::min(left, REWRITE_BATCH);
+                append_header(out, 2 * batch + 2);
+                core::Command::append_bulk(out, "ZADD");
+                core::Command::append_bulk(out, key);
+                for (size_t i = 0; i < batch; ++i, ++it)
+                {
+                    char *end = std::to_chars(score, score + sizeof(score), it.score()).ptr;
+                    core::Command::append_bulk(out, std::string_view(score, end - score));
+                    core::Command::append_bulk(out, it.member());
+                }
+                left -= batch;
+            }
+        }
+
+        void append_hash(std::string &out, std::string_view key, const core::Hash &hash)
+        {
+            append_header(out, 2);
+            core::Command::append_bulk(out, "DEL");
+            core::Command::append_bulk(out, key);
+            auto it = hash.begin();
+            size_t left = hash.size();
+            while (left > 0)
+            {
+                size_t batch = std::min(left, REWRITE_BATCH);
+                append_header(out, 2 * batch + 2);
+                core::Command::append_bulk(out, "HSET");
+                core::Command::append_bulk(out, key);
+                for (size_t i = 0; i < batch; ++i, ++it)
+                {
+                    core::Command::append_bulk(out, it.field());
+                    core::Command::append_bulk(out, it.value());
+                }
+                left -= batch;
+            }
+        }
+    }
+
+    void append_value_commands(std::string &out, std::string_view key, const core::Value &value, int64_t expire_at)
+    {
+        switch (value.type())
+        {
+        case core::ValueType::STRING:
+            append_header(out, 3);
+            core::Command::append_bulk(out, "SET");
+            core::Command::append_bulk(out, key);
+            core::Command::append_bulk(out, value.str());
+            break;
+        case core::ValueType::LIST:
+            append_container(out, "RPUSH", key, value.as_list());
+            break;
+        case core::ValueType::SET:
+            append_container(out, "SADD", key, value.as_set());
+            break;
+        case core::ValueType::ZSET:
+            append_zset(out, key, value.as_zset());
+            break;
+        case core::ValueType::HASH:
+            append_hash(out, key, value.as_hash());
+            break;
+        }
+        if (expire_at >= 0)
+        {
+            append_header(out, 3);
+            core::Command::append_bulk(out, "PEXPIREAT");
+            core::Command::append_bulk(out, key);
+            core::Command::append_bulk(out, std::to_string(expire_at));
+        }
+    }
+
+    Aof::Aof(std::string path, FsyncPolicy policy, size_t shards)
+        : path_(std::move(path)), rewrite_path_(path_ + ".rewrite"), policy_(policy), shards_(shards)
+    {
+    }
+
+    Aof::~Aof()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stop_ = true;
+        }
+        wake_writer_.notify_one();
+        if (writer_.joinable())
+            writer_.join();
+        if (fd_ >= 0)
+            ::close(fd_);
+        if (rewrite_fd_ >= 0)
+        {
+            ::close(rewrite_fd_);
+            ::unlink(rewrite_path_.c_str());
+        }
+    }
+
+    bool Aof::parse_policy(std::string_view name, FsyncPolicy &policy)
+    {
+        if (name == "always")
+            policy = FsyncPolicy::ALWAYS;
+        else if (name == "everysec")
+            policy = FsyncPolicy::EVERYSEC;
+        else if (name == "no")
+            policy = FsyncPolicy::NO;
+        else
+            return false;
+        return true;
+    }
+
+    size_t Aof::load(const Router &route, const Applier &apply)
+    {
+        int fd = ::open(path_.c_str(), O_RDWR);
+        if (fd < 0)
+        {
+            if (errno == ENOENT)
+                return 0;
+            throw std::system_error(errno, std::generic_category(), "open " + path_);
+        }
+        struct stat st;
+        if (fstat(fd, &st) < 0 || st.st_size == 0)
+        {
+            ::close(fd);
+            return 0;
+        }
+        size_t size = static_cast<size_t>(st.st_size);
+        void *map = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map == MAP_FAILED)
+        {
+            ::close(fd);
+            throw std::system_error(errno, std::generic_category(), "mmap " + path_);
+        }
+        madvise(map, size, MADV_SEQUENTIAL);
+        std::string_view data(static_cast<const char *>(map), size);
+
+        // Every shard replays on its own thread. Parsing is cheap next to
+        // execution, so each thread parses the whole file and only applies
+        // the commands routed to its shard.
+        struct Replay
+        {
+            size_t count = 0;
+            size_t consumed = 0;
+            net::ParseResult result = net::ParseResult::INCOMPLETE;
+            std::string error;
+        };
+        std::vector<Replay> replays(shards_.size());
+        auto replay = [&](size_t shard)
+        {
+            net::RespParser parser;
+            std::vector<std::string_view> argv;
+            core::Command command;
+            Replay &state = replays[shard];
+            while ((state.result = parser.next(data, argv)) == net::ParseResult::COMMAND)
+            {
+                command.name = argv.front();
+                command.args.assign(argv.begin() + 1, argv.end());
+                int target = shards_.size() > 1 ? route(command) : 0;
+                if (static_cast<size_t>(target < 0 ? 0 : target) == shard)
+                    apply(shard, command);
+                ++state.count;
+            }
+            state.consumed = parser.consumed();
+            state.error = parser.error();
+        };
+        std::vector<std::thread> threads;
+        for (size_t shard = 1; shard < shards_.size(); ++shard)
+            threads.emplace_back(replay, shard);
+        replay(0);
+        for (auto &thread : threads)
+            thread.join();
+        munmap(map, size);
+
+        const Replay &result = replays[0];
+        if (result.result == net::ParseResult::PROTOCOL_ERROR)
+        {
+            ::close(fd);
+            throw std::runtime_error("Bad AOF format near offset " + std::to_string(result.consumed) + ": " + result.error);
+        }
+        if (result.consumed < size)
+        {
+            std::cerr << "AOF ends with an incomplete command, truncating " << (size - result.consumed) << " bytes" << std::endl;
+            if (ftruncate(fd, static_cast<off_t>(result.consumed)) < 0)
+                std::cerr << "AOF truncate failed: " << std::strerror(errno) << std::endl;
+        }
+        ::close(fd);
+        return result.count;
+    }
+
+    void Aof::open()
+    {
+        fd_ = ::open(path_.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+        if (fd_ < 0)
+            throw std::system_error(errno, std::generic_category(), "open " + path_);
+        struct stat st;
+        if (fstat(fd_, &st) == 0)
+        {
+            base_size_ = static_cast<uint64_t>(st.st_size);
+            file_size_.store(base_size_, std::memory_order_relaxed);
+        }
+        writer_ = std::thread([this]
+                              { writer_loop(); });
+    }
+
+    void Aof::append(size_t shard, const core::Command &command)
+    {
+        Shard &state = shards_[shard];
+        size_t start = state.buffer.size();
+        command.to_resp(state.buffer);
+        if (state.in_rewrite)
+            state.rewrite_buffer.append(state.buffer, start, std::string::npos);
+    }
+
+    bool Aof::start_rewrite()
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (rewriting_.load(std::memory_order_relaxed) || fd_ < 0)
+            return false;
+        rewrite_fd_ = ::open(rewrite_path_.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (rewrite_fd_ < 0)
+        {
+            std::cerr << "AOF rewrite: cannot create " << rewrite_path_ << ": " << std::strerror(errno) << std::endl;
+            return false;
+        }
+        shards_done_ = 0;
+        finishing_ = false;
+        rewriting_.store(true, std::memory_order_release);
+        generation_.fetch_add(1, std::memory_order_release);
+        return true;
+    }
+
+    bool Aof::before_sleep(size_t shard, core::Store &store)
+    {
+        Shard &state = shards_[shard];
+        uint64_t generation = generation_.load(std::memory_order_acquire);
+        if (state.generation != generation)
+        {
+            state.generation = generation;
+            state.in_rewrite = true;
+            state.rewrite_buffer.clear();
+            state.snapshot = std::make_unique<core::Snapshot>(store, [&state](std::string_view key, const core::Value &value, int64_t expire_at)
+                                                              { append_value_commands(state.rewrite_buffer, key, value, expire_at); });
+        }
+
+        bool walked = false;
+        if (state.snapshot)
+        {
+            auto deadline = std::chrono::steady_clock::now() + REWRITE_SLICE;
+            while (!state.snapshot->step(16) && std::chrono::steady_clock::now() < deadline)
+            {
+            }
+            if (state.snapshot->done())
+            {
+                state.snapshot.reset();
+                walked = true;
+            }
+        }
+
+        if (state.buffer.empty() && state.rewrite_buffer.empty() && !walked)
+        {
+            return state.snapshot != nullptr;
+        }
+
+        uint64_t target;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            pending_ += state.buffer;
+            appended_ += state.buffer.size();
+            target = appended_;
+            if (state.in_rewrite)
+            {
+                if (rewriting_.load(std::memory_order_relaxed))
+                {
+                    rewrite_pending_ += state.rewrite_buffer;
+                    if (walked && ++shards_done_ == shards_.size())
+                        finishing_ = true;
+                }
+                else
+                {
+                    state.in_rewrite = false;
+                }
+            }
+        }
+        state.buffer.clear();
+        state.rewrite_buffer.clear();
+        wake_writer_.notify_one();
+
+        if (policy_ == FsyncPolicy::ALWAYS)
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            synced_cv_.wait(lock, [this, target]
+                            { return synced_ >= target || stop_; });
+        }
+
+        if (!rewriting_.load(std::memory_order_relaxed))
+        {
+            state.in_rewrite = false;
+            uint64_t size = file_size_.load(std::memory_order_relaxed);
+            if (size > AUTO_REWRITE_MIN_SIZE && size > base_size_ * 2)
+                start_rewrite();
+        }
+        return state.snapshot != nullptr;
+    }
+
+    void Aof::writer_loop()
+    {
+        auto last_fsync = std::chrono::steady_clock::now();
+        std::unique_lock<std::mutex> lock(mutex_);
+        while (true)
+        {
+            wake_writer_.wait_for(lock, std::chrono::seconds(1), [this]
+                                  { return stop_ || finishing_ || !pending_.empty() || !rewrite_pending_.empty(); });
+            std::string data;
+            std::string rewrite_data;
+            data.swap(pending_);
+            rewrite_data.swap(rewrite_pending_);
+            uint64_t target = appended_;
+
+            if (finishing_)
+            {
+                // Everything committed so far is in rewrite_data as well, so
+                // the old file's tail is only needed if the switch fails.
+                finish_rewrite(data, rewrite_data);
+                synced_ = target;
+                synced_cv_.notify_all();
+                continue;
+            }
+            bool stopping = stop_;
+            lock.unlock();
+
+            if (!data.empty())
+            {
+                write_all(fd_, data);
+                file_size_.fetch_add(data.size(), std::memory_order_relaxed);
+            }
+            if (!rewrite_data.empty())
+                write_all(rewrite_fd_, rewrite_data);
+            auto now = std::chrono::steady_clock::now();
+            if (policy_ == FsyncPolicy::ALWAYS && !data.empty())
+                fdatasync(fd_);
+            else if ((policy_ == FsyncPolicy::EVERYSEC && now - last_fsync >= std::chrono::seconds(1)) || stopping)
+            {
+                fdatasync(fd_);
+                last_fsync = now;
+            }
+
+            lock.lock();
+            synced_ = target;
+            synced_cv_.notify_all();
+            if (stopping && pending_.empty())
+                return;
+        }
+    }
+
+    void Aof::finish_rewrite(const std::string &data, const std::string &rewrite_data)
+    {
+        write_all(rewrite_fd_, rewrite_data);
+        fsync(rewrite_fd_);
+        if (::rename(rewrite_path_.c_str(), path_.c_str()) < 0)
+        {
+            std::cerr << "AOF rewrite: rename failed: " << std::strerror(errno) << std::endl;
+            ::close(rewrite_fd_);
+            ::unlink(rewrite_path_.c_str());
+            write_all(fd_, data);
+            file_size_.fetch_add(data.size(), std::memory_order_relaxed);
+        }
+        else
+        {
+            ::close(fd_);
+            fd_ = rewrite_fd_;
+            struct stat st;
+            if (fstat(fd_, &st) == 0)
+            {
+                base_size_ = static_cast<uint64_t>(st.st_size);
+                file_size_.store(base_size_, std::memory_order_relaxed);
+            }
+            std::cout << "AOF rewrite complete, " << base_size_ << " bytes" << std::endl;
+        }
+        rewrite_fd_ = -1;
+        finishing_ = false;
+        rewriting_.store(false, std::memory_order_release);
+    }
+}
@@ -0,0 +1,123 @@
+#include "persist/lzf.hpp"
+#include <algorithm>
+#include <cstring>
+#include <vector>
+
+namespace persist
+{
+    namespace
+    {
+        const int HASH_BITS = 13;
+        const size_t MAX_OFFSET = 1 << 13;
+        const size_t MAX_MATCH = 264;
+        const size_t MAX_LITERALS = 32;
+    }
+
+    size_t lzf_compress(const uint8_t *in, size_t in_len, uint8_t *out, size_t out_capacity)
+    {
+        if (in_len < 4)
+            return 0;
+        thread_local std::vector<const uint8_t *> table(1 << HASH_BITS);
+        std::fill(table.begin(), table.end(), nullptr);
+
+        const uint8_t *ip = in;
+        const uint8_t *end = in + in_len;
+        const uint8_t *literals = in;
+        uint8_t *op = out;
+        uint8_t *out_end = out + out_capacity;
+
+        auto flush_literals = [&](const uint8_t *upto) -> bool
+        {
+            while (literals < upto)
+            {
+                size_t run = std::min<size_t>(MAX_LITERALS, upto - literals);
+                if (op + 1 + run > out_end)
+                    return false;
+                *op++ = static_cast<uint8_t>(run - 1);
+                std::memcpy(op, literals, run);
+                op += run;
+                literals += run;
+            }
+            return true;
+        };
+
+        while (ip + 2 < end)
+        {
+            uint32_t key = static_cast<uint32_t>(ip[0]) << 16 | static_cast<uint32_t>(ip[1]) << 8 | ip[2];
+            uint32_t slot = (key * 2654435761u) >> (32 - HASH_BITS);
+            const uint8_t *ref = table[slot];
+            table[slot] = ip;
+            if (ref && static_cast<size_t>(ip - ref - 1) < MAX_OFFSET &&
+                ref[0] == ip[0] && ref[1] == ip[1] && ref[2] == ip[2])
+            {
+                size_t offset = ip - ref - 1;
+                size_t max_len = std::min<size_t>(end - ip, MAX_MATCH);
+                size_t len = 3;
+                while (len < max_len && ref[len] == ip[len])
+                    ++len;
+                if (!flush_literals(ip) || op + 3 > out_end)
+                    return 0;
+                size_t code = len - 2;
+                if (code < 7)
+                    *op++ = static_cast<uint8_t>(code << 5 | offset >> 8);
+                else
+                {
+                    *op++ = static_cast<uint8_t>(7 << 5 | offset >> 8);
+                    *op++ = static_cast<uint8_t>(code - 7);
+                }
+                *op++ = static_cast<uint8_t>(offset & 0xff);
+                ip += len;
+                literals = ip;
+            }
+            else
+            {
+                ++ip;
+            }
+        }
+        if (!flush_literals(end))
+            return 0;
+        return op - out;
+    }
+
+    size_t lzf_decompress(const uint8_t *in, size_t in_len, uint8_t *out, size_t out_capacity)
+    {
+        const uint8_t *ip = in;
+        const uint8_t *end = in + in_len;
+        uint8_t *op = out;
+        uint8_t *out_end = out + out_capacity;
+
+        while (ip < end)
+        {
+            size_t ctrl = *ip++;
+            if (ctrl < MAX_LITERALS)
+            {
+                size_t run = ctrl + 1;
+                if (ip + run > end || op + run > out_end)
+                    return 0;
+                std::memcpy(op, ip, run);
+                ip += run;
+                op += run;
+                continue;
+            }
+            size_t len = ctrl >> 5;
+            if (len == 7)
+            {
+                if (ip >= end)
+                    return 0;
+                len += *ip++;
+            }
+            if (ip >= end)
+                return 0;
+            size_t offset = ((ctrl & 0x1f) << 8 | *ip++) + 1;
+            len += 2;
+            if (offset > static_cast<size_t>(op - out) || op + len > out_end)
+                return 0;
+            // Byte by byte: the reference may overlap the bytes being written.
+            const uint8_t *ref = op - offset;
+            for (size_t i = 0; i < len; ++i)
+                op[i] = ref[i];
+            op += len;
+        }
+        return op - out;
+    }
+}
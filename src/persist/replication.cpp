@@ -0,0 +1,717 @@
+#include "persist/replication.hpp"
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cctype>
+#include <charconv>
+#include <cstring>
+#include <iostream>
+#include <random>
+#include "net/resp_parser.hpp"
+#include "persist/aof.hpp"
+
+namespace persist
+{
+    namespace
+    {
+        const size_t SEND_CHUNK = 64 * 1024;
+        const size_t READ_CHUNK = 64 * 1024;
+        // Sync stream bytes every syncing replica has been sent are dropped
+        // once this many have piled up.
+        const size_t SYNC_TRIM = 1024 * 1024;
+        // Shards stop walking while this much of the sync stream is unsent.
+        const size_t MAX_SYNC_PENDING = 64 * 1024 * 1024;
+        const auto SYNC_SLICE = std::chrono::microseconds(1000);
+        const auto RETRY_INTERVAL = std::chrono::seconds(1);
+        const int CONNECT_TIMEOUT_MS = 2000;
+
+        std::string random_replid()
+        {
+            std::random_device device;
+            std::mt19937_64 random(device());
+            static const char hex[] = "0123456789abcdef";
+            std::string id(40, '0');
+            for (char &c : id)
+                c = hex[random() % 16];
+            return id;
+        }
+
+        std::string peer_address(int fd)
+        {
+            sockaddr_in peer{};
+            socklen_t len = sizeof(peer);
+            char ip[INET_ADDRSTRLEN] = "?";
+            if (getpeername(fd, (sockaddr *)&peer, &len) == 0)
+                inet_ntop(AF_INET, &peer.sin_addr, ip, sizeof(ip));
+            return std::string(ip) + ":" + std::to_string(ntohs(peer.sin_port));
+        }
+
+        bool equals_upper(std::string_view text, std::string_view upper)
+        {
+            if (text.size() != upper.size())
+                return false;
+            for (size_t i = 0; i < text.size(); ++i)
+            {
+                if (std::toupper(static_cast<unsigned char>(text[i])) != upper[i])
+                    return false;
+            }
+            return true;
+        }
+
+        bool send_all(int fd, const std::string &data)
+        {
+            size_t sent = 0;
+            while (sent < data.size())
+            {
+                ssize_t n = send(fd, data.data() + sent, data.size() - sent, MSG_NOSIGNAL);
+                if (n < 0 && errno == EINTR)
+                    continue;
+                if (n <= 0)
+                    return false;
+                sent += n;
+            }
+            return true;
+        }
+
+        // Returns a connected blocking socket, or -1.
+        int connect_to(const std::string &host, int port)
+        {
+            addrinfo hints{};
+            hints.ai_family = AF_INET;
+            hints.ai_socktype = SOCK_STREAM;
+            addrinfo *result = nullptr;
+            if (getaddrinfo(host.c_str(), std::to_string(port).c_str(), &hints, &result) != 0 || !result)
+                return -1;
+            int fd = socket(result->ai_family, result->ai_socktype, result->ai_protocol);
+            if (fd < 0)
+            {
+                freeaddrinfo(result);
+                return -1;
+            }
+            int flags = fcntl(fd, F_GETFL, 0);
+            fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+            int rc = connect(fd, result->ai_addr, result->ai_addrlen);
+            freeaddrinfo(result);
+            if (rc < 0 && errno == EINPROGRESS)
+            {
+                pollfd pfd{fd, POLLOUT, 0};
+                int error = 0;
+                socklen_t len = sizeof(error);
+                if (poll(&pfd, 1, CONNECT_TIMEOUT_MS) == 1 && getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &len) == 0 && error == 0)
+                    rc = 0;
+            }
+            if (rc < 0)
+            {
+                close(fd);
+                return -1;
+            }
+            fcntl(fd, F_SETFL, flags);
+            return fd;
+        }
+
+        void append_command(std::string &out, std::initializer_list<std::string_view> argv)
+        {
+            out += '*';
+            out += std::to_string(argv.size());
+            out += "\r\n";
+            for (std::string_view arg : argv)
+                core::Command::append_bulk(out, arg);
+        }
+    }
+
+    Replication::Replication(size_t shards, size_t backlog_size)
+        : replid_(random_replid()), backlog_size_(std::max<size_t>(backlog_size, 1)), shards_(shards)
+    {
+        wake_fd_ = eventfd(0, EFD_NONBLOCK);
+        sender_ = std::thread([this]
+                              { sender_loop(); });
+    }
+
+    Replication::~Replication()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stop_ = true;
+        }
+        wake();
+        if (sender_.joinable())
+            sender_.join();
+        for (auto &replica : replicas_)
+            close(replica->fd);
+        close(wake_fd_);
+    }
+
+    void Replication::append(size_t shard, const core::Command &command)
+    {
+        if (!active_.load(std::memory_order_relaxed))
+            return;
+        Shard &state = shards_[shard];
+        size_t start = state.buffer.size();
+        command.to_resp(state.buffer);
+        if (state.in_sync)
+            state.sync_buffer.append(state.buffer, start, std::string::npos);
+    }
+
+    bool Replication::before_sleep(size_t shard, core::Store &store)
+    {
+        Shard &state = shards_[shard];
+        uint64_t generation = generation_.load(std::memory_order_acquire);
+        if (state.generation != generation)
+        {
+            state.generation = generation;
+            state.in_sync = true;
+            state.sync_buffer.clear();
+            state.snapshot = std::make_unique<core::Snapshot>(store, [&state](std::string_view key, const core::Value &value, int64_t expire_at)
+                                                              { append_value_commands(state.sync_buffer, key, value, expire_at); });
+        }
+
+        bool walked = false;
+        if (state.snapshot)
+        {
+            bool backlogged;
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                backlogged = sync_data_.size() > MAX_SYNC_PENDING;
+            }
+            if (!backlogged)
+            {
+                auto deadline = std::chrono::steady_clock::now() + SYNC_SLICE;
+                while (!state.snapshot->step(16) && std::chrono::steady_clock::now() < deadline)
+                {
+                }
+            }
+            if (state.snapshot->done())
+            {
+                state.snapshot.reset();
+                walked = true;
+            }
+        }
+
+        if (state.buffer.empty() && state.sync_buffer.empty() && !walked)
+            return state.snapshot != nullptr;
+
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            write_backlog(state.buffer);
+            if (state.in_sync)
+            {
+                if (syncing_)
+                {
+                    sync_data_ += state.sync_buffer;
+                    // Every command below this offset is now either in some
+                    // shard's walk or in the sync stream, and none above it.
+                    if (walked && ++shards_done_ == shards_.size())
+                    {
+                        append_command(sync_data_, {"REPLCONF", "SYNCED", std::to_string(offset_)});
+                        sync_offset_ = offset_;
+                        sync_complete_ = true;
+                        syncing_ = false;
+                    }
+                }
+                else
+                {
+                    state.in_sync = false;
+                }
+            }
+        }
+        state.buffer.clear();
+        state.sync_buffer.clear();
+        wake();
+        return state.snapshot != nullptr;
+    }
+
+    void Replication::write_backlog(const std::string &data)
+    {
+        size_t done = 0;
+        while (done < data.size())
+        {
+            size_t pos = (offset_ + done) % backlog_size_;
+            size_t n = std::min(backlog_size_ - pos, data.size() - done);
+            std::memcpy(&backlog_[pos], data.data() + done, n);
+            done += n;
+        }
+        offset_ += data.size();
+    }
+
+    void Replication::read_backlog(uint64_t from, size_t size, std::string &out) const
+    {
+        while (size > 0)
+        {
+            size_t pos = from % backlog_size_;
+            size_t n = std::min(backlog_size_ - pos, size);
+            out.append(&backlog_[pos], n);
+            from += n;
+            size -= n;
+        }
+    }
+
+    void Replication::attach(int fd, const core::Command &psync)
+    {
+        auto replica = std::make_unique<Replica>();
+        replica->fd = fd;
+        replica->address = peer_address(fd);
+        uint64_t offset = 0;
+        bool has_offset = psync.args.size() == 2;
+        if (has_offset)
+        {
+            std::string_view arg = psync.args[1];
+            auto [ptr, ec] = std::from_chars(arg.data(), arg.data() + arg.size(), offset);
+            has_offset = ec == std::errc() && ptr == arg.data() + arg.size();
+        }
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            bool was_active = active_.load(std::memory_order_relaxed);
+            if (!was_active)
+            {
+                backlog_.resize(backlog_size_);
+                active_.store(true, std::memory_order_relaxed);
+            }
+            if (was_active && has_offset && psync.args[0] == replid_ && offset >= backlog_start() && offset <= offset_)
+            {
+                replica->out = "+CONTINUE " + replid_ + "\r\n";
+                replica->state = ReplicaState::ONLINE;
+                replica->position = offset;
+                std::cout << "Replica " << replica->address << " resumed at offset " << offset << std::endl;
+            }
+            else
+            {
+                replica->out = "+FULLRESYNC " + replid_ + "\r\n";
+                replica->state = ReplicaState::WAIT_SYNC;
+                std::cout << "Replica " << replica->address << " needs a full resync" << std::endl;
+            }
+            replicas_.push_back(std::move(replica));
+        }
+        wake();
+    }
+
+    void Replication::start_sync()
+    {
+        syncing_ = true;
+        shards_done_ = 0;
+        sync_data_.clear();
+        sync_base_ = 0;
+        sync_complete_ = false;
+        for (auto &replica : replicas_)
+        {
+            if (replica->state == ReplicaState::WAIT_SYNC)
+            {
+                replica->state = ReplicaState::SYNCING;
+                replica->position = 0;
+            }
+        }
+        generation_.fetch_add(1, std::memory_order_release);
+    }
+
+    void Replication::fill(Replica &replica)
+    {
+        if (replica.state == ReplicaState::SYNCING)
+        {
+            uint64_t end = sync_base_ + sync_data_.size();
+            if (replica.position < end)
+            {
+                size_t n = std::min<uint64_t>(SEND_CHUNK, end - replica.position);
+                replica.out.append(sync_data_, replica.position - sync_base_, n);
+                replica.position += n;
+                return;
+            }
+            if (!sync_complete_)
+                return;
+            replica.state = ReplicaState::ONLINE;
+            replica.position = sync_offset_;
+            std::cout << "Replica " << replica.address << " synchronized at offset " << sync_offset_ << std::endl;
+        }
+        if (replica.state != ReplicaState::ONLINE)
+            return;
+        if (replica.position < backlog_start())
+        {
+            std::cerr << "Replica " << replica.address << " fell behind the backlog, dropping it" << std::endl;
+            replica.closed = true;
+            return;
+        }
+        if (replica.position < offset_)
+        {
+            size_t n = std::min<uint64_t>(SEND_CHUNK, offset_ - replica.position);
+            read_backlog(replica.position, n, replica.out);
+            replica.position += n;
+        }
+    }
+
+    void Replication::wake()
+    {
+        uint64_t one = 1;
+        ssize_t ignored = write(wake_fd_, &one, sizeof(one));
+        (void)ignored;
+    }
+
+    void Replication::sender_loop()
+    {
+        std::vector<pollfd> fds;
+        std::vector<Replica *> polled;
+        char discard[4096];
+        while (true)
+        {
+            fds.assign(1, pollfd{wake_fd_, POLLIN, 0});
+            polled.clear();
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                if (stop_)
+                    return;
+                bool syncing = false;
+                bool waiting = false;
+                uint64_t sent = UINT64_MAX;
+                for (auto &replica : replicas_)
+                {
+                    if (replica->state == ReplicaState::SYNCING)
+                    {
+                        syncing = true;
+                        sent = std::min(sent, replica->position);
+                    }
+                    waiting |= replica->state == ReplicaState::WAIT_SYNC;
+                }
+                if (!syncing && sync_complete_ && !sync_data_.empty())
+                {
+                    sync_data_ = std::string();
+                    sync_base_ = 0;
+                }
+                else if (syncing && sent - sync_base_ >= SYNC_TRIM)
+                {
+                    sync_data_.erase(0, sent - sync_base_);
+                    sync_base_ = sent;
+                }
+                // A new full sync waits until the running one has been sent.
+                if (waiting && !syncing && !syncing_)
+                    start_sync();
+                for (auto &replica : replicas_)
+                {
+                    if (replica->out.empty())
+                        fill(*replica);
+                    short events = replica->out.empty() ? POLLIN : POLLIN | POLLOUT;
+                    fds.push_back(pollfd{replica->fd, events, 0});
+                    polled.push_back(replica.get());
+                }
+            }
+
+            if (poll(fds.data(), fds.size(), 1000) < 0 && errno != EINTR)
+                continue;
+            if (fds[0].revents & POLLIN)
+            {
+                uint64_t count;
+                ssize_t ignored = read(wake_fd_, &count, sizeof(count));
+                (void)ignored;
+            }
+            for (size_t i = 0; i < polled.size(); ++i)
+            {
+                Replica &replica = *polled[i];
+                short revents = fds[i + 1].revents;
+                if (revents & (POLLIN | POLLHUP | POLLERR))
+                {
+                    // Replicas send nothing after PSYNC; a read only detects
+                    // the connection closing.
+                    ssize_t n = recv(replica.fd, discard, sizeof(discard), MSG_DONTWAIT);
+                    if (n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR))
+                        replica.closed = true;
+                }
+                if (!replica.closed && (revents & POLLOUT))
+                {
+                    ssize_t n = send(replica.fd, replica.out.data(), replica.out.size(), MSG_NOSIGNAL | MSG_DONTWAIT);
+                    if (n > 0)
+                        replica.out.erase(0, n);
+                    else if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+                        replica.closed = true;
+                }
+            }
+
+            std::lock_guard<std::mutex> lock(mutex_);
+            auto closed = std::remove_if(replicas_.begin(), replicas_.end(), [](const std::unique_ptr<Replica> &replica)
+                                         {
+                                             if (!replica->closed)
+                                                 return false;
+                                             std::cout << "Replica " << replica->address << " disconnected" << std::endl;
+                                             close(replica->fd);
+                                             return true; });
+            replicas_.erase(closed, replicas_.end());
+        }
+    }
+
+    std::string Replication::info() const
+    {
+        static const char *states[] = {"wait_bgsave", "send_bulk", "online"};
+        std::lock_guard<std::mutex> lock(mutex_);
+        std::string out = "connected_slaves:" + std::to_string(replicas_.size()) + "\r\n";
+        for (size_t i = 0; i < replicas_.size(); ++i)
+        {
+            const Replica &replica = *replicas_[i];
+            out += "slave" + std::to_string(i) + ":addr=" + replica.address + ",state=" +
+                   states[static_cast<int>(replica.state)] + ",offset=" +
+                   std::to_string(replica.state == ReplicaState::ONLINE ? replica.position : 0) + "\r\n";
+        }
+        bool active = active_.load(std::memory_order_relaxed);
+        out += "master_replid:" + replid_ + "\r\n";
+        out += "master_repl_offset:" + std::to_string(offset_) + "\r\n";
+        out += "repl_backlog_active:" + std::to_string(active) + "\r\n";
+        out += "repl_backlog_size:" + std::to_string(backlog_size_) + "\r\n";
+        out += "repl_backlog_first_byte_offset:" + std::to_string(backlog_start()) + "\r\n";
+        out += "repl_backlog_histlen:" + std::to_string(offset_ - backlog_start()) + "\r\n";
+        return out;
+    }
+
+    ReplicaLink::ReplicaLink(size_t shards, Router route, Applier apply, Waker wake)
+        : route_(std::move(route)), apply_(std::move(apply)), wake_(std::move(wake))
+    {
+        for (size_t i = 0; i < shards; ++i)
+        {
+            inboxes_.push_back(std::make_unique<Inbox>());
+        }
+    }
+
+    ReplicaLink::~ReplicaLink()
+    {
+        stop();
+    }
+
+    void ReplicaLink::start(std::string host, int port)
+    {
+        halt();
+        std::lock_guard<std::mutex> lock(mutex_);
+        host_ = std::move(host);
+        port_ = port;
+        stop_ = false;
+        active_.store(true, std::memory_order_relaxed);
+        thread_ = std::thread([this]
+                              { run(); });
+    }
+
+    void ReplicaLink::stop()
+    {
+        halt();
+        // Once writable, the data may diverge from the stream, so following
+        // any primary again must start with a full resync.
+        std::lock_guard<std::mutex> lock(mutex_);
+        has_offset_ = false;
+    }
+
+    void ReplicaLink::halt()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stop_ = true;
+            if (fd_ >= 0)
+                shutdown(fd_, SHUT_RDWR);
+        }
+        stop_cv_.notify_all();
+        if (thread_.joinable())
+            thread_.join();
+        active_.store(false, std::memory_order_relaxed);
+    }
+
+    void ReplicaLink::run()
+    {
+        while (true)
+        {
+            std::string host;
+            int port;
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                if (stop_)
+                    return;
+                host = host_;
+                port = port_;
+            }
+            int fd = connect_to(host, port);
+            if (fd >= 0)
+            {
+                {
+                    std::lock_guard<std::mutex> lock(mutex_);
+                    fd_ = fd;
+                }
+                if (!stop_)
+                    follow(fd);
+                {
+                    std::lock_guard<std::mutex> lock(mutex_);
+                    fd_ = -1;
+                    link_up_ = false;
+                }
+                close(fd);
+            }
+            else
+            {
+                std::cerr << "Replication: cannot connect to " << host << ":" << port << std::endl;
+            }
+            std::unique_lock<std::mutex> lock(mutex_);
+            stop_cv_.wait_for(lock, RETRY_INTERVAL, [this]
+                              { return stop_; });
+        }
+    }
+
+    void ReplicaLink::follow(int fd)
+    {
+        std::string request;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            append_command(request, {"PSYNC", has_offset_ ? replid_ : "?", has_offset_ ? std::to_string(offset_) : "-1"});
+        }
+        if (!send_all(fd, request))
+            return;
+
+        std::string buffer;
+        char chunk[READ_CHUNK];
+        auto receive = [&]
+        {
+            ssize_t n;
+            while ((n = read(fd, chunk, sizeof(chunk))) < 0 && errno == EINTR)
+            {
+            }
+            if (n <= 0)
+                return false;
+            buffer.append(chunk, n);
+            return true;
+        };
+
+        size_t line_end;
+        while ((line_end = buffer.find("\r\n")) == std::string::npos)
+        {
+            if (!receive())
+                return;
+        }
+        std::string line = buffer.substr(0, line_end);
+        buffer.erase(0, line_end + 2);
+        bool counting;
+        if (line.rfind("+FULLRESYNC ", 0) == 0)
+        {
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                replid_ = line.substr(12);
+                has_offset_ = false;
+                syncing_ = true;
+                link_up_ = true;
+            }
+            for (size_t shard = 0; shard < inboxes_.size(); ++shard)
+            {
+                Inbox &inbox = *inboxes_[shard];
+                std::lock_guard<std::mutex> lock(inbox.mutex);
+                inbox.data.clear();
+                inbox.clear = true;
+            }
+            counting = false;
+            std::cout << "Replication: full resync from " << host_ << ":" << port_ << std::endl;
+        }
+        else if (line.rfind("+CONTINUE", 0) == 0)
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            link_up_ = true;
+            counting = true;
+            std::cout << "Replication: resumed from " << host_ << ":" << port_ << " at offset " << offset_ << std::endl;
+        }
+        else
+        {
+            std::cerr << "Replication: unexpected reply to PSYNC: " << line << std::endl;
+            return;
+        }
+
+        net::RespParser parser;
+        std::vector<std::string_view> argv;
+        core::Command command;
+        std::vector<std::string> batches(inboxes_.size());
+        while (true)
+        {
+            size_t start = 0;
+            uint64_t counted = 0;
+            net::ParseResult result;
+            while ((result = parser.next(buffer, argv)) == net::ParseResult::COMMAND)
+            {
+                size_t end = parser.consumed();
+                command.name = argv.front();
+                command.args.assign(argv.begin() + 1, argv.end());
+                if (equals_upper(command.name, "REPLCONF") && command.args.size() == 2 && equals_upper(command.args[0], "SYNCED"))
+                {
+                    uint64_t offset = 0;
+                    std::from_chars(command.args[1].data(), command.args[1].data() + command.args[1].size(), offset);
+                    std::lock_guard<std::mutex> lock(mutex_);
+                    offset_ = offset;
+                    has_offset_ = true;
+                    syncing_ = false;
+                    counting = true;
+                    counted = 0;
+                    std::cout << "Replication: synchronized at offset " << offset << std::endl;
+                }
+                else
+                {
+                    int target = inboxes_.size() > 1 ? route_(command) : 0;
+                    batches[target < 0 ? 0 : target].append(buffer, start, end - start);
+                    if (counting)
+                        counted += end - start;
+                }
+                start = end;
+            }
+            if (result == net::ParseResult::PROTOCOL_ERROR)
+            {
+                std::cerr << "Replication: bad stream from primary: " << parser.error() << std::endl;
+                return;
+            }
+            for (size_t shard = 0; shard < batches.size(); ++shard)
+            {
+                if (batches[shard].empty())
+                    continue;
+                {
+                    Inbox &inbox = *inboxes_[shard];
+                    std::lock_guard<std::mutex> lock(inbox.mutex);
+                    inbox.data += batches[shard];
+                }
+                batches[shard].clear();
+                wake_(shard);
+            }
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                offset_ += counted;
+            }
+            size_t consumed = parser.consumed();
+            buffer.erase(0, consumed);
+            parser.discard(consumed);
+            if (!receive())
+                return;
+        }
+    }
+
+    void ReplicaLink::before_sleep(size_t shard, core::Store &store)
+    {
+        Inbox &inbox = *inboxes_[shard];
+        std::string data;
+        bool clear;
+        {
+            std::lock_guard<std::mutex> lock(inbox.mutex);
+            data.swap(inbox.data);
+            clear = inbox.clear;
+            inbox.clear = false;
+        }
+        if (clear)
+            store.clear();
+        if (data.empty())
+            return;
+        net::RespParser parser;
+        std::vector<std::string_view> argv;
+        core::Command command;
+        while (parser.next(data, argv) == net::ParseResult::COMMAND)
+        {
+            command.name = argv.front();
+            command.args.assign(argv.begin() + 1, argv.end());
+            apply_(shard, command);
+        }
+    }
+
+    std::string ReplicaLink::info() const
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        std::string out = "master_host:" + host_ + "\r\n";
+        out += "master_port:" + std::to_string(port_) + "\r\n";
+        out += std::string("master_link_status:") + (link_up_ ? "up" : "down") + "\r\n";
+        out += "master_sync_in_progress:" + std::to_string(syncing_) + "\r\n";
+        out += "slave_repl_offset:" + std::to_string(offset_) + "\r\n";
+        return out;
+    }
+}
@@ -0,0 +1,756 @@
+#include "persist/snapshot_file.hpp"
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cerrno>
+#include <cmath>
+#include <cstring>
+#include <ctime>
+#include <iostream>
+#include <stdexcept>
+#include <string_view>
+#include <system_error>
+#include "core/shard.hpp"
+#include "core/value.hpp"
+#include "persist/lzf.hpp"
+
+namespace persist
+{
+    namespace
+    {
+        const char MAGIC[8] = {'R', 'D', 'B', 'S', 'N', 'A', 'P', '\0'};
+        const uint32_t VERSION = 1;
+        const size_t HEADER_SIZE = sizeof(MAGIC) + 4;
+        const size_t FOOTER_SIZE = 1 + 8 + 8;
+        // Smallest share of the records one thread decodes at load.
+        const size_t MIN_LOAD_RANGE = 1024 * 1024;
+
+        const uint8_t TYPE_STRING = 0;
+        const uint8_t TYPE_LIST = 1;
+        const uint8_t TYPE_SET = 2;
+        const uint8_t TYPE_ZSET = 3;
+        const uint8_t TYPE_HASH = 4;
+        const uint8_t TYPE_MASK = 0x0f;
+        const uint8_t EXPIRES = 0x40;
+        const uint8_t COMPRESSED = 0x80;
+        const uint8_t END_OF_FILE = 0xff;
+
+        const size_t COMPRESS_MIN = 64;
+        const size_t WRITE_CHUNK = 1 << 20;
+        const size_t MAX_QUEUED = 64 << 20;
+        const auto SAVE_SLICE = std::chrono::microseconds(1000);
+
+        void put_varint(std::string &out, uint64_t v)
+        {
+            while (v >= 0x80)
+            {
+                out += static_cast<char>(v | 0x80);
+                v >>= 7;
+            }
+            out += static_cast<char>(v);
+        }
+
+        void put_fixed(std::string &out, uint64_t v, size_t bytes)
+        {
+            for (size_t i = 0; i < bytes; ++i)
+                out += static_cast<char>(v >> (8 * i));
+        }
+
+        void put_bytes(std::string &out, std::string_view bytes)
+        {
+            put_varint(out, bytes.size());
+            out += bytes;
+        }
+
+        uint64_t get_fixed(const char *p, size_t bytes)
+        {
+            uint64_t v = 0;
+            for (size_t i = 0; i < bytes; ++i)
+                v |= static_cast<uint64_t>(static_cast<uint8_t>(p[i])) << (8 * i);
+            return v;
+        }
+
+        // Bounds-checked reader over a mapped file or a record buffer.
+        struct Reader
+        {
+            const char *pos;
+            const char *end;
+
+            bool varint(uint64_t &v)
+            {
+                v = 0;
+                for (int shift = 0; shift < 64 && pos < end; shift += 7)
+                {
+                    uint8_t byte = static_cast<uint8_t>(*pos++);
+                    v |= static_cast<uint64_t>(byte & 0x7f) << shift;
+                    if (!(byte & 0x80))
+                        return true;
+                }
+                return false;
+            }
+
+            bool bytes(uint64_t n, std::string_view &out)
+            {
+                if (n > static_cast<uint64_t>(end - pos))
+                    return false;
+                out = std::string_view(pos, n);
+                pos += n;
+                return true;
+            }
+
+            bool sized(std::string_view &out)
+            {
+                uint64_t n;
+                return varint(n) && bytes(n, out);
+            }
+        };
+
+        struct Record
+        {
+            uint8_t tag;
+            std::string_view key;
+            int64_t expire_at;
+            uint64_t raw_size;
+            std::string_view payload;
+        };
+
+        bool read_record(Reader &in, Record &record)
+        {
+            if (in.pos >= in.end)
+                return false;
+            record.tag = static_cast<uint8_t>(*in.pos++);
+            if (!in.sized(record.key))
+                return false;
+            record.expire_at = -1;
+            if (record.tag & EXPIRES)
+            {
+                std::string_view when;
+                if (!in.bytes(8, when))
+                    return false;
+                record.expire_at = static_cast<int64_t>(get_fixed(when.data(), 8));
+            }
+            record.raw_size = 0;
+            if ((record.tag & COMPRESSED) && !in.varint(record.raw_size))
+                return false;
+            return in.sized(record.payload);
+        }
+
+        template <typename Items>
+        void put_items(std::string &out, const Items &items)
+        {
+            put_varint(out, items.size());
+            for (const auto &item : items)
+                put_bytes(out, item);
+        }
+
+        // Members in score order, each followed by its score as 8 raw bytes.
+        void put_zset(std::string &out, const core::ZSet &zset)
+        {
+            put_varint(out, zset.size());
+            for (auto it = zset.begin(); it != zset.end(); ++it)
+            {
+                put_bytes(out, it.member());
+                double score = it.score();
+                uint64_t bits;
+                std::memcpy(&bits, &score, sizeof(bits));
+                put_fixed(out, bits, 8);
+            }
+        }
+
+        void put_hash(std::string &out, const core::Hash &hash)
+        {
+            put_varint(out, hash.size());
+            for (auto it = hash.begin(); it != hash.end(); ++it)
+            {
+                put_bytes(out, it.field());
+                put_bytes(out, it.value());
+            }
+        }
+
+        void put_key(std::string &out, uint8_t tag, std::string_view key, int64_t expire_at)
+        {
+            if (expire_at >= 0)
+                tag |= EXPIRES;
+            out += static_cast<char>(tag);
+            put_bytes(out, key);
+            if (expire_at >= 0)
+                put_fixed(out, static_cast<uint64_t>(expire_at), 8);
+        }
+
+        void append_record(std::string &out, std::string_view key, const core::Value &value, int64_t expire_at)
+        {
+            thread_local std::string payload;
+            payload.clear();
+            uint8_t tag = TYPE_STRING;
+            switch (value.type())
+            {
+            case core::ValueType::STRING:
+                payload = value.str();
+                break;
+            case core::ValueType::LIST:
+                tag = TYPE_LIST;
+                put_items(payload, value.as_list());
+                break;
+            case core::ValueType::SET:
+                tag = TYPE_SET;
+                put_items(payload, value.as_set());
+                break;
+            case core::ValueType::ZSET:
+                tag = TYPE_ZSET;
+                put_zset(payload, value.as_zset());
+                break;
+            case core::ValueType::HASH:
+                tag = TYPE_HASH;
+                put_hash(payload, value.as_hash());
+                break;
+            }
+            put_key(out, tag, key, expire_at);
+            put_bytes(out, payload);
+        }
+
+        bool decode_value(uint8_t type, std::string_view payload, core::Value &value)
+        {
+            if (type == TYPE_STRING)
+            {
+                value = core::Value::string(payload);
+                return true;
+            }
+            Reader in{payload.data(), payload.data() + payload.size()};
+            uint64_t count;
+            if (!in.varint(count) || count > payload.size())
+                return false;
+            std::string_view item;
+            if (type == TYPE_LIST)
+            {
+                value = core::Value::list();
+                auto &list = value.as_list();
+                for (uint64_t i = 0; i < count; ++i)
+                {
+                    if (!in.sized(item))
+                        return false;
+                    list.push_back(item);
+                }
+            }
+            else if (type == TYPE_SET)
+            {
+                value = core::Value::set();
+                auto &set = value.as_set();
+                set.reserve(count);
+                for (uint64_t i = 0; i < count; ++i)
+                {
+                    if (!in.sized(item))
+                        return false;
+                    set.add(item);
+                }
+            }
+            else if (type == TYPE_ZSET)
+            {
+                value = core::Value::zset();
+                auto &zset = value.as_zset();
+                for (uint64_t i = 0; i < count; ++i)
+                {
+                    std::string_view raw;
+                    if (!in.sized(item) || !in.bytes(8, raw))
+                        return false;
+                    uint64_t bits = get_fixed(raw.data(), 8);
+                    double score;
+                    std::memcpy(&score, &bits, sizeof(score));
+                    if (std::isnan(score))
+                        return false;
+                    zset.add(item, score);
+                }
+            }
+            else if (type == TYPE_HASH)
+            {
+                value = core::Value::hash();
+                auto &hash = value.as_hash();
+                for (uint64_t i = 0; i < count; ++i)
+                {
+                    std::string_view field;
+                    if (!in.sized(field) || !in.sized(item))
+                        return false;
+                    hash.set(field, item);
+                }
+            }
+            else
+            {
+                return false;
+            }
+            return in.pos == in.end;
+        }
+
+        // Word-at-a-time 64-bit checksum that can be fed in arbitrary pieces.
+        class Checksum
+        {
+        public:
+            void update(const char *data, size_t n)
+            {
+                total_ += n;
+                while (n > 0 && tail_len_ > 0)
+                {
+                    tail_[tail_len_++] = *data++;
+                    --n;
+                    if (tail_len_ == 8)
+                    {
+                        mix(get_fixed(tail_, 8));
+                        tail_len_ = 0;
+                    }
+                }
+                if (tail_len_ > 0)
+                    return;
+                for (; n >= 8; data += 8, n -= 8)
+                {
+                    uint64_t word;
+                    std::memcpy(&word, data, 8);
+                    mix(word);
+                }
+                std::memcpy(tail_, data, n);
+                tail_len_ = n;
+            }
+
+            uint64_t digest() const
+            {
+                Checksum copy = *this;
+                std::memset(copy.tail_ + copy.tail_len_, 0, 8 - copy.tail_len_);
+                copy.mix(get_fixed(copy.tail_, 8));
+                uint64_t h = copy.hash_ ^ total_;
+                h ^= h >> 33;
+                h *= 0xff51afd7ed558ccdULL;
+                h ^= h >> 33;
+                h *= 0xc4ceb9fe1a85ec53ULL;
+                return h ^ (h >> 33);
+            }
+
+        private:
+            uint64_t hash_ = 0x9e3779b97f4a7c15ULL;
+            uint64_t total_ = 0;
+            char tail_[8] = {};
+            size_t tail_len_ = 0;
+
+            void mix(uint64_t word)
+            {
+                hash_ ^= word * 0x87c37b91114253d5ULL;
+                hash_ = ((hash_ << 31) | (hash_ >> 33)) * 0x4cf5ad432745937fULL;
+            }
+        };
+
+        bool write_all(int fd, const std::string &data)
+        {
+            size_t offset = 0;
+            while (offset < data.size())
+            {
+                ssize_t n = ::write(fd, data.data() + offset, data.size() - offset);
+                if (n < 0)
+                {
+                    if (errno == EINTR)
+                        continue;
+                    std::cerr << "Snapshot write failed: " << std::strerror(errno) << std::endl;
+                    return false;
+                }
+                offset += n;
+            }
+            return true;
+        }
+    }
+
+    SnapshotFile::SnapshotFile(std::string path, size_t shards, bool compress)
+        : path_(std::move(path)), temp_path_(path_ + ".tmp"), compress_(compress), shards_(shards)
+    {
+    }
+
+    SnapshotFile::~SnapshotFile()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stop_ = true;
+        }
+        wake_writer_.notify_one();
+        if (writer_.joinable())
+            writer_.join();
+    }
+
+    size_t SnapshotFile::load(const std::vector<core::Store *> &stores)
+    {
+        int fd = ::open(path_.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0)
+        {
+            if (errno == ENOENT)
+                return 0;
+            throw std::system_error(errno, std::generic_category(), "open " + path_);
+        }
+        struct stat st;
+        if (fstat(fd, &st) < 0)
+        {
+            ::close(fd);
+            throw std::system_error(errno, std::generic_category(), "stat " + path_);
+        }
+        size_t size = static_cast<size_t>(st.st_size);
+        if (size < HEADER_SIZE + FOOTER_SIZE)
+        {
+            ::close(fd);
+            throw std::runtime_error("Bad snapshot file " + path_ + ": truncated");
+        }
+        void *map = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        ::close(fd);
+        if (map == MAP_FAILED)
+            throw std::system_error(errno, std::generic_category(), "mmap " + path_);
+        madvise(map, size, MADV_SEQUENTIAL);
+        const char *data = static_cast<const char *>(map);
+        const char *footer = data + size - FOOTER_SIZE;
+
+        auto fail = [&](const std::string &reason)
+        {
+            munmap(map, size);
+            throw std::runtime_error("Bad snapshot file " + path_ + ": " + reason);
+        };
+        if (std::memcmp(data, MAGIC, sizeof(MAGIC)) != 0)
+            fail("bad magic");
+        if (get_fixed(data + sizeof(MAGIC), 4) != VERSION)
+            fail("unsupported version " + std::to_string(get_fixed(data + sizeof(MAGIC), 4)));
+        if (static_cast<uint8_t>(footer[0]) != END_OF_FILE)
+            fail("missing end marker");
+        uint64_t records = get_fixed(footer + 1, 8);
+        uint64_t checksum = get_fixed(footer + 9, 8);
+
+        size_t shards = stores.size();
+        for (core::Store *store : stores)
+            store->reserve(records / shards + records / (8 * shards));
+
+        // The checksum is verified on a thread of its own while the rest
+        // loads. Records are split into ranges of about equal bytes, found
+        // by a pass that only reads record headers; every hardware thread
+        // decodes one range, the costly part, and sorts the values by the
+        // shard their keys route to. Then each shard's thread inserts its
+        // values range by range, so later records still win and no
+        // dictionary is shared between threads.
+        bool checksum_ok = true;
+        std::thread verifier([&]
+                             {
+                                 Checksum sum;
+                                 sum.update(data, size - 8);
+                                 checksum_ok = sum.digest() == checksum; });
+        auto finish = [&](const std::string &reason)
+        {
+            verifier.join();
+            fail(reason);
+        };
+
+        size_t workers = std::max<unsigned>(std::thread::hardware_concurrency(), 1);
+        size_t range_bytes = std::max<size_t>((footer - data - HEADER_SIZE) / workers, MIN_LOAD_RANGE);
+        std::vector<const char *> bounds{data + HEADER_SIZE};
+        {
+            Reader in{data + HEADER_SIZE, footer};
+            Record record;
+            while (in.pos < in.end)
+            {
+                if (static_cast<size_t>(in.pos - bounds.back()) >= range_bytes)
+                    bounds.push_back(in.pos);
+                if (!read_record(in, record))
+                    finish("corrupt record at offset " + std::to_string(in.pos - data));
+            }
+        }
+        bounds.push_back(footer);
+        size_t ranges = bounds.size() - 1;
+
+        struct Entry
+        {
+            // Points into the mapped file.
+            std::string_view key;
+            core::Value value;
+            int64_t expire_at;
+        };
+        std::vector<std::vector<std::vector<Entry>>> decoded(ranges);
+        for (auto &by_shard : decoded)
+            by_shard.resize(shards);
+        std::vector<std::string> errors(ranges);
+        int64_t now = core::Store::now_ms();
+        auto decode = [&](size_t range)
+        {
+            Reader in{bounds[range], bounds[range + 1]};
+            Record record;
+            std::string inflated;
+            core::Value value = core::Value::string("");
+            while (in.pos < in.end)
+            {
+                read_record(in, record);
+                if (record.expire_at >= 0 && record.expire_at <= now)
+                    continue;
+                std::string_view payload = record.payload;
+                if (record.tag & COMPRESSED)
+                {
+                    // A back reference is at most 3 bytes for 264 output bytes.
+                    if (record.raw_size > payload.size() * 88)
+                    {
+                        errors[range] = "corrupt compressed value for key " + std::string(record.key);
+                        return;
+                    }
+                    inflated.resize(record.raw_size);
+                    if (lzf_decompress(reinterpret_cast<const uint8_t *>(payload.data()), payload.size(),
+                                       reinterpret_cast<uint8_t *>(inflated.data()), inflated.size()) != record.raw_size)
+                    {
+                        errors[range] = "corrupt compressed value for key " + std::string(record.key);
+                        return;
+                    }
+                    payload = inflated;
+                }
+                if (!decode_value(record.tag & TYPE_MASK, payload, value))
+                {
+                    errors[range] = "corrupt value for key " + std::string(record.key);
+                    return;
+                }
+                size_t shard = shards > 1 ? core::shard_of(record.key, shards) : 0;
+                decoded[range][shard].push_back(Entry{record.key, std::move(value), record.expire_at});
+            }
+        };
+        std::vector<std::thread> threads;
+        for (size_t range = 1; range < ranges; ++range)
+            threads.emplace_back(decode, range);
+        decode(0);
+        for (auto &thread : threads)
+            thread.join();
+        threads.clear();
+        for (const std::string &error : errors)
+        {
+            if (!error.empty())
+                finish(error);
+        }
+
+        auto insert = [&](size_t shard)
+        {
+            for (size_t range = 0; range < ranges; ++range)
+            {
+                for (Entry &entry : decoded[range][shard])
+                    stores[shard]->restore(entry.key, std::move(entry.value), entry.expire_at);
+                std::vector<Entry>().swap(decoded[range][shard]);
+            }
+        };
+        for (size_t shard = 1; shard < shards; ++shard)
+            threads.emplace_back(insert, shard);
+        insert(0);
+        for (auto &thread : threads)
+            thread.join();
+        verifier.join();
+
+        if (!checksum_ok)
+            fail("checksum mismatch");
+        munmap(map, size);
+
+        size_t total = 0;
+        for (size_t shard = 0; shard < shards; ++shard)
+            total += stores[shard]->size();
+        last_save_.store(static_cast<int64_t>(st.st_mtime), std::memory_order_relaxed);
+        return total;
+    }
+
+    uint64_t SnapshotFile::dirty() const
+    {
+        uint64_t total = 0;
+        for (const Shard &shard : shards_)
+            total += shard.dirty.load(std::memory_order_relaxed);
+        return total;
+    }
+
+    bool SnapshotFile::start_save()
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (saving_.load(std::memory_order_relaxed))
+            return false;
+        if (writer_.joinable())
+            writer_.join();
+        fd_ = ::open(temp_path_.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd_ < 0)
+        {
+            std::cerr << "Snapshot: cannot create " << temp_path_ << ": " << std::strerror(errno) << std::endl;
+            return false;
+        }
+        queue_.clear();
+        queued_bytes_ = 0;
+        shards_done_ = 0;
+        dirty_at_start_ = dirty();
+        saving_.store(true, std::memory_order_release);
+        generation_.fetch_add(1, std::memory_order_release);
+        writer_ = std::thread([this]
+                              { writer_loop(); });
+        return true;
+    }
+
+    bool SnapshotFile::save(size_t shard, core::Store &store)
+    {
+        if (!start_save())
+            return false;
+        while (before_sleep(shard, store))
+        {
+        }
+        std::unique_lock<std::mutex> lock(mutex_);
+        done_cv_.wait(lock, [this]
+                      { return !saving_.load(std::memory_order_relaxed); });
+        return last_ok_;
+    }
+
+    bool SnapshotFile::before_sleep(size_t shard, core::Store &store)
+    {
+        if (shard == 0 && save_interval_.count() > 0 && !save_in_progress())
+        {
+            auto now = std::chrono::steady_clock::now();
+            if (now - last_attempt_ >= save_interval_)
+            {
+                last_attempt_ = now;
+                bool changed;
+                {
+                    std::lock_guard<std::mutex> lock(mutex_);
+                    changed = dirty() != dirty_saved_;
+                }
+                if (changed)
+                    start_save();
+            }
+        }
+
+        Shard &state = shards_[shard];
+        uint64_t generation = generation_.load(std::memory_order_acquire);
+        if (state.generation != generation)
+        {
+            state.generation = generation;
+            state.buffer.clear();
+            state.snapshot = std::make_unique<core::Snapshot>(store, [&state](std::string_view key, const core::Value &value, int64_t expire_at)
+                                                              { append_record(state.buffer, key, value, expire_at); });
+        }
+        if (!state.snapshot)
+            return false;
+
+        bool backlogged;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            backlogged = queued_bytes_ > MAX_QUEUED;
+        }
+        if (!backlogged)
+        {
+            auto deadline = std::chrono::steady_clock::now() + SAVE_SLICE;
+            while (!state.snapshot->step(16) && std::chrono::steady_clock::now() < deadline)
+            {
+            }
+        }
+        bool walked = state.snapshot->done();
+        if (walked)
+            state.snapshot.reset();
+
+        if (!state.buffer.empty() || walked)
+        {
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                queued_bytes_ += state.buffer.size();
+                queue_.push_back(std::move(state.buffer));
+                if (walked)
+                    ++shards_done_;
+            }
+            state.buffer = std::string();
+            wake_writer_.notify_one();
+        }
+        return state.snapshot != nullptr;
+    }
+
+    void SnapshotFile::writer_loop()
+    {
+        Checksum sum;
+        std::string out;
+        uint64_t records = 0;
+        bool ok = true;
+        std::string compressed;
+
+        auto flush = [&]
+        {
+            sum.update(out.data(), out.size());
+            ok = ok && write_all(fd_, out);
+            out.clear();
+        };
+
+        out.append(MAGIC, sizeof(MAGIC));
+        put_fixed(out, VERSION, 4);
+
+        std::unique_lock<std::mutex> lock(mutex_);
+        while (true)
+        {
+            wake_writer_.wait(lock, [this]
+                              { return stop_ || !queue_.empty() || shards_done_ == shards_.size(); });
+            if (stop_)
+            {
+                ok = false;
+                break;
+            }
+            std::deque<std::string> batch;
+            batch.swap(queue_);
+            bool finished = shards_done_ == shards_.size();
+            lock.unlock();
+
+            for (const std::string &buffer : batch)
+            {
+                Reader in{buffer.data(), buffer.data() + buffer.size()};
+                Record record;
+                while (read_record(in, record))
+                {
+                    ++records;
+                    std::string_view payload = record.payload;
+                    size_t size = 0;
+                    if (compress_ && payload.size() >= COMPRESS_MIN)
+                    {
+                        compressed.resize(payload.size());
+                        size = lzf_compress(reinterpret_cast<const uint8_t *>(payload.data()), payload.size(),
+                                            reinterpret_cast<uint8_t *>(compressed.data()), payload.size() - 8);
+                    }
+                    uint8_t type = record.tag & TYPE_MASK;
+                    if (size > 0)
+                    {
+                        put_key(out, type | COMPRESSED, record.key, record.expire_at);
+                        put_varint(out, payload.size());
+                        put_bytes(out, std::string_view(compressed.data(), size));
+                    }
+                    else
+                    {
+                        put_key(out, type, record.key, record.expire_at);
+                        put_bytes(out, payload);
+                    }
+                    if (out.size() >= WRITE_CHUNK)
+                        flush();
+                }
+            }
+
+            lock.lock();
+            for (const std::string &buffer : batch)
+                queued_bytes_ -= buffer.size();
+            if (finished && queue_.empty())
+                break;
+        }
+        lock.unlock();
+
+        if (ok)
+        {
+            out += static_cast<char>(END_OF_FILE);
+            put_fixed(out, records, 8);
+            sum.update(out.data(), out.size());
+            put_fixed(out, sum.digest(), 8);
+            ok = write_all(fd_, out) && fsync(fd_) == 0;
+        }
+        ::close(fd_);
+        fd_ = -1;
+        if (ok && ::rename(temp_path_.c_str(), path_.c_str()) < 0)
+        {
+            std::cerr << "Snapshot: rename failed: " << std::strerror(errno) << std::endl;
+            ok = false;
+        }
+        if (!ok)
+            ::unlink(temp_path_.c_str());
+        else
+            std::cout << "Snapshot saved, " << records << " records" << std::endl;
+
+        lock.lock();
+        last_ok_ = ok;
+        if (ok)
+        {
+            dirty_saved_ = dirty_at_start_;
+            last_save_.store(static_cast<int64_t>(std::time(nullptr)), std::memory_order_relaxed);
+        }
+        saving_.store(false, std::memory_order_release);
+        done_cv_.notify_all();
+    }
+}
@@ -0,0 +1,330 @@
+// Tests of EVAL, EVALSHA and SCRIPT through the dispatcher: the script
+// language, the redis.call() bridge, the script cache and the error
+// replies. Prints each failure and exits non-zero if there was one.
+#include <cctype>
+#include <cstdio>
+#include <string>
+#include <vector>
+#include "core/command.hpp"
+#include "core/dispatcher.hpp"
+#include "core/response.hpp"
+#include "core/script.hpp"
+#include "core/shard.hpp"
+#include "core/store.hpp"
+
+namespace
+{
+    using core::Command;
+    using core::CommandDispatcher;
+    using core::Response;
+
+    int failures = 0;
+
+    std::string bulk(const std::string &item)
+    {
+        std::string out;
+        Response::append_bulk(out, item);
+        return out;
+    }
+
+    std::string integer(long long value)
+    {
+        std::string out;
+        Response::append_integer(out, value);
+        return out;
+    }
+
+    const std::string NIL = "$-1\r\n";
+
+    std::string call(CommandDispatcher &dispatcher, const std::vector<std::string> &words)
+    {
+        Command command;
+        command.name = words.front();
+        command.args.assign(words.begin() + 1, words.end());
+        return dispatcher.dispatch(command).to_resp();
+    }
+
+    std::string describe(const std::vector<std::string> &words)
+    {
+        std::string out;
+        for (const std::string &word : words)
+        {
+            out += (out.empty() ? "" : " ") + word;
+        }
+        return out;
+    }
+
+    void expect_reply(CommandDispatcher &dispatcher, const std::vector<std::string> &words, const std::string &expected)
+    {
+        std::string reply = call(dispatcher, words);
+        if (reply != expected)
+        {
+            ++failures;
+            std::fprintf(stderr, "FAIL: %s\n  expected %s  got      %s", describe(words).c_str(), expected.c_str(), reply.c_str());
+        }
+    }
+
+    // An error reply containing fragment.
+    void expect_error(CommandDispatcher &dispatcher, const std::vector<std::string> &words, const std::string &fragment)
+    {
+        std::string reply = call(dispatcher, words);
+        if (reply.empty() || reply[0] != '-' || reply.find(fragment) == std::string::npos)
+        {
+            ++failures;
+            std::fprintf(stderr, "FAIL: %s\n  expected an error with \"%s\"\n  got      %s", describe(words).c_str(),
+                         fragment.c_str(), reply.c_str());
+        }
+    }
+
+    void expect(bool ok, const std::string &what)
+    {
+        if (!ok)
+        {
+            ++failures;
+            std::fprintf(stderr, "FAIL: %s\n", what.c_str());
+        }
+    }
+
+    // A store and dispatcher with a script cache, like one shard of the server.
+    struct Shard
+    {
+        core::Store store;
+        CommandDispatcher dispatcher{store};
+        core::ScriptCache scripts;
+
+        explicit Shard(int64_t time_limit_ms = 5000) : scripts(time_limit_ms)
+        {
+            dispatcher.set_scripts(&scripts);
+        }
+
+        std::string eval(const std::string &script, const std::vector<std::string> &keys = {},
+                         const std::vector<std::string> &argv = {})
+        {
+            return call(dispatcher, words(script, keys, argv));
+        }
+
+        static std::vector<std::string> words(const std::string &script, const std::vector<std::string> &keys = {},
+                                              const std::vector<std::string> &argv = {})
+        {
+            std::vector<std::string> out{"EVAL", script, std::to_string(keys.size())};
+            out.insert(out.end(), keys.begin(), keys.end());
+            out.insert(out.end(), argv.begin(), argv.end());
+            return out;
+        }
+    };
+
+    void test_sha1()
+    {
+        expect(core::sha1_hex("") == "da39a3ee5e6b4b0d3255bfef95601890afd80709", "sha1 of the empty string");
+        expect(core::sha1_hex("abc") == "a9993e364706816aba3e25717850c26c9cd0d89d", "sha1 of abc");
+        expect(core::sha1_hex(std::string(1000, 'a')) == "291e9a6c66994949b57ba5e650361e98fc36b1ba", "sha1 over several blocks");
+    }
+
+    void test_expressions()
+    {
+        Shard shard;
+        CommandDispatcher &d = shard.dispatcher;
+        expect_reply(d, Shard::words("return 1 + 2 * 3 ^ 2"), integer(19));
+        expect_reply(d, Shard::words("return -2 ^ 2"), integer(-4));
+        expect_reply(d, Shard::words("return 7 % 3 + -7 % 3"), integer(3));
+        expect_reply(d, Shard::words("return 10 / 4"), integer(2));
+        expect_reply(d, Shard::words("return tostring(10 / 4)"), bulk("2.5"));
+        expect_reply(d, Shard::words("return 'a' .. 1 .. 2"), bulk("a12"));
+        expect_reply(d, Shard::words("return '10' + 1"), integer(11));
+        expect_reply(d, Shard::words("return nil or false or 'd'"), bulk("d"));
+        expect_reply(d, Shard::words("return 1 and nil"), NIL);
+        expect_reply(d, Shard::words("return not nil"), integer(1));
+        expect_reply(d, Shard::words("return false"), NIL);
+        expect_reply(d, Shard::words("return 1 < 2 and 'b' >= 'a' and 1 ~= 2"), integer(1));
+        expect_reply(d, Shard::words("return #'abc' + #{1, 2}"), integer(5));
+        expect_reply(d, Shard::words("return '\\65\\t\\x42'"), bulk("A\tB"));
+        expect_reply(d, Shard::words("-- comment\n--[[ block\n]] return [[a\nb]]"), bulk("a\nb"));
+        expect_reply(d, Shard::words("return [==[x]]y]==]"), bulk("x]]y"));
+        expect_reply(d, Shard::words("return 0x10 + 1e1"), integer(26));
+        expect_reply(d, Shard::words(""), NIL);
+    }
+
+    void test_statements()
+    {
+        Shard shard;
+        CommandDispatcher &d = shard.dispatcher;
+        expect_reply(d, Shard::words("local s = 0 for i = 1, 10 do s = s + i end return s"), integer(55));
+        expect_reply(d, Shard::words("local s = 0 for i = 10, 1, -3 do s = s + i end return s"), integer(22));
+        expect_reply(d, Shard::words("local s = 0 for i = 1, 0 do s = 1 end return s"), integer(0));
+        expect_reply(d, Shard::words("local i = 0 while true do i = i + 1 if i == 5 then break end end return i"), integer(5));
+        expect_reply(d, Shard::words("local n = 0 repeat local done = n >= 2 n = n + 1 until done return n"), integer(3));
+        expect_reply(d, Shard::words("local x = 2 if x == 1 then return 'one' elseif x == 2 then return 'two' else return 'other' end"),
+                     bulk("two"));
+        expect_reply(d, Shard::words("local a, b, c = 1, 2 return {a, b, c == nil}"), "*3\r\n:1\r\n:2\r\n:1\r\n");
+        expect_reply(d, Shard::words("local x = 1 do local x = 2 end return x"), integer(1));
+        expect_reply(d, Shard::words("local t = {a = 1, ['b'] = 2; 3} t.c = 4 return t.a + t.b + t.c + #t"), integer(8));
+        expect_reply(d, Shard::words("local t = {} for i = 1, 3 do t[i] = i * i end t[2] = nil return t"), "*1\r\n:1\r\n");
+        expect_reply(d, Shard::words("local t = {1, 3} table.insert(t, 2, 2) table.insert(t, 4) return t"),
+                     "*4\r\n:1\r\n:2\r\n:3\r\n:4\r\n");
+        expect_reply(d, Shard::words("local t = {} t[3] = 'c' t[1] = 'a' t[2] = 'b' return t"), "*3\r\n$1\r\na\r\n$1\r\nb\r\n$1\r\nc\r\n");
+        expect_reply(d, Shard::words("return {1, 'two', {3}, nil, 5}"), "*3\r\n:1\r\n$3\r\ntwo\r\n*1\r\n:3\r\n");
+        expect_reply(d, Shard::words("local t = {1, nil, 3} return t[3]"), integer(3));
+        expect_reply(d, Shard::words("return string.sub('hello', 2, -2) .. string.upper('x') .. string.lower('Y') .. string.len('abc')"),
+                     bulk("ellXy3"));
+        expect_reply(d, Shard::words("return math.max(1, 7, 3) + math.min(4, 2) + math.floor(2.7) + math.ceil(0.2) + math.abs(-1)"),
+                     integer(13));
+        expect_reply(d, Shard::words("return tonumber('0x10') + tonumber(5)"), integer(21));
+        expect_reply(d, Shard::words("return tonumber('x')"), NIL);
+        expect_reply(d, Shard::words("return type(KEYS) .. type(nil) .. type(1) .. type('') .. type(true)"),
+                     bulk("tablenilnumberstringboolean"));
+        expect_reply(d, Shard::words("return {KEYS[1], KEYS[2], ARGV[1], #ARGV}", {"k1", "k2"}, {"a1"}),
+                     "*4\r\n$2\r\nk1\r\n$2\r\nk2\r\n$2\r\na1\r\n:1\r\n");
+        // A table holding itself stops at the reply depth limit.
+        std::string nested = shard.eval("local t = {} t[1] = t return t");
+        expect(nested.compare(0, 4, "*1\r\n") == 0 && nested.find(NIL) != std::string::npos, "self-referencing table");
+    }
+
+    void test_redis_call()
+    {
+        Shard shard;
+        CommandDispatcher &d = shard.dispatcher;
+        expect_reply(d, Shard::words("return redis.call('SET', KEYS[1], ARGV[1])", {"k"}, {"v"}), "+OK\r\n");
+        expect_reply(d, {"GET", "k"}, bulk("v"));
+        expect_reply(d, Shard::words("return redis.call('GET', KEYS[1])", {"k"}), bulk("v"));
+        expect_reply(d, Shard::words("return redis.call('GET', 'missing') == false"), integer(1));
+        expect_reply(d, Shard::words("return redis.call('RPUSH', 'l', 'a', 'b', 3)"), "+OK\r\n");
+        expect_reply(d, Shard::words("return redis.call('LRANGE', 'l', 0, -1)"), "*3\r\n$1\r\na\r\n$1\r\nb\r\n$1\r\n3\r\n");
+        expect_reply(d, Shard::words("return redis.call('SET', 'n', 41) and tonumber(redis.call('GET', 'n')) + 1"), integer(42));
+        expect_reply(d, Shard::words("local r = redis.call('SET', 'k', 'w') return r.ok"), bulk("OK"));
+        expect_reply(d, Shard::words("return redis.call('PING')"), "+PONG\r\n");
+
+        // A rate limiter: at most two calls per key, one round trip each.
+        const std::string limiter = "local n = tonumber(redis.call('GET', KEYS[1]) or '0') "
+                                    "if n >= tonumber(ARGV[1]) then return 0 end "
+                                    "redis.call('SET', KEYS[1], n + 1) return n + 1";
+        expect_reply(d, Shard::words(limiter, {"rate"}, {"2"}), integer(1));
+        expect_reply(d, Shard::words(limiter, {"rate"}, {"2"}), integer(2));
+        expect_reply(d, Shard::words(limiter, {"rate"}, {"2"}), integer(0));
+
+        expect_reply(d, Shard::words("return redis.call('NOPE')"), "-ERR Unknown command: NOPE\r\n");
+        expect_reply(d, Shard::words("local r = redis.pcall('NOPE') return r.err"), bulk("ERR Unknown command: NOPE"));
+        expect_reply(d, Shard::words("return redis.pcall('NOPE')"), "-ERR Unknown command: NOPE\r\n");
+        expect_reply(d, Shard::words("return redis.error_reply('MY fault')"), "-MY fault\r\n");
+        expect_reply(d, Shard::words("return redis.status_reply('FINE')"), "+FINE\r\n");
+        expect_error(d, Shard::words("return redis.call('EVAL', 'return 1', 0)"), "not allowed from scripts");
+        expect_error(d, Shard::words("return redis.call('SCRIPT', 'FLUSH')"), "not allowed from scripts");
+        expect_error(d, Shard::words("return redis.call('GET', {})"), "command arguments must be strings or numbers");
+    }
+
+    // Writes reach the write listeners one by one, and EVAL itself never.
+    void test_effects()
+    {
+        Shard shard;
+        std::vector<std::string> written;
+        shard.dispatcher.add_write_listener([&written](const Command &command)
+                                            { written.emplace_back(command.name); });
+        shard.eval("redis.call('SET', 'a', '1') redis.call('GET', 'a') redis.call('DEL', 'a')");
+        expect(written == std::vector<std::string>{"SET", "DEL"}, "script writes are propagated as commands");
+    }
+
+    void test_cache()
+    {
+        Shard shard;
+        CommandDispatcher &d = shard.dispatcher;
+        const std::string source = "return ARGV[1]";
+        std::string sha = core::sha1_hex(source);
+        expect_reply(d, {"SCRIPT", "LOAD", source}, bulk(sha));
+        expect_reply(d, {"EVALSHA", sha, "0", "hi"}, bulk("hi"));
+        std::string upper = sha;
+        for (char &c : upper)
+        {
+            c = static_cast<char>(std::toupper(static_cast<unsigned char>(c)));
+        }
+        expect_reply(d, {"EVALSHA", upper, "0", "hi"}, bulk("hi"));
+        shard.eval("return 2");
+        expect_reply(d, {"SCRIPT", "EXISTS", sha, core::sha1_hex("return 2"), "ffff"}, "*3\r\n:1\r\n:1\r\n:0\r\n");
+        expect(shard.scripts.size() == 2, "EVAL caches its script");
+        expect_reply(d, {"SCRIPT", "FLUSH"}, "+OK\r\n");
+        expect_reply(d, {"EVALSHA", sha, "0", "hi"}, "-NOSCRIPT No matching script. Please use EVAL.\r\n");
+        expect_error(d, {"SCRIPT", "LOAD", "return +"}, "Error compiling script");
+        expect(shard.scripts.size() == 0, "scripts that do not compile are not cached");
+        expect_error(d, {"SCRIPT", "KILL"}, "SCRIPT supports only");
+    }
+
+    void test_errors()
+    {
+        Shard shard;
+        CommandDispatcher &d = shard.dispatcher;
+        expect_error(d, {"EVAL", "return 1", "x"}, "value is not an integer or out of range");
+        expect_error(d, {"EVAL", "return 1", "-1"}, "Number of keys can't be negative");
+        expect_error(d, {"EVAL", "return 1", "2", "k"}, "Number of keys can't be greater than number of args");
+        expect_error(d, {"EVAL", "return 1"}, "wrong number of arguments");
+
+        expect_reply(d, Shard::words("return x"), "-ERR Error compiling script: user_script:1: undefined variable 'x' near '<eof>'\r\n");
+        expect_error(d, Shard::words("return 1 +"), "unexpected symbol");
+        expect_error(d, Shard::words("if true then"), "'end' expected");
+        expect_error(d, Shard::words("return 'abc"), "unfinished string");
+        expect_error(d, Shard::words("local function f() end"), "functions are not supported");
+        expect_error(d, Shard::words("for k, v in pairs(KEYS) do end"), "only numeric for loops are supported");
+        expect_error(d, Shard::words("local t = {} t:insert(1)"), "method calls are not supported");
+        expect_error(d, Shard::words("local a, b = 1, 2 a, b = b, a"), "multiple assignment is not supported");
+        expect_error(d, Shard::words("return string.format('%d', 1)"), "unknown function 'string.format'");
+        expect_error(d, Shard::words("return math.max()"), "wrong number of arguments to 'math.max'");
+        expect_error(d, Shard::words("break"), "no loop to break");
+        expect_error(d, Shard::words("return " + std::string(300, '(') + "1" + std::string(300, ')')), "too many syntax levels");
+
+        expect_reply(d, Shard::words("local a = 1\nlocal b = nil\nreturn b.c"), "-ERR user_script:3: attempt to index a nil value\r\n");
+        expect_error(d, Shard::words("return {} < 1"), "attempt to compare table with number");
+        expect_error(d, Shard::words("return 1 + {}"), "attempt to perform arithmetic on a table value");
+        expect_error(d, Shard::words("return 'a' .. {}"), "attempt to concatenate a table value");
+        expect_error(d, Shard::words("return #5"), "attempt to get length of a number value");
+        expect_error(d, Shard::words("local t = {} t[nil] = 1"), "table index is nil");
+        expect_error(d, Shard::words("for i = 1, 'x' do end"), "'for' limit must be a number");
+
+        Shard slow(50);
+        expect_error(slow.dispatcher, Shard::words("while true do end"), "exceeded the time limit of 50 ms");
+        expect_reply(slow.dispatcher, Shard::words("return 1"), integer(1));
+
+        core::Store store;
+        CommandDispatcher bare(store);
+        expect_error(bare, Shard::words("return 1"), "scripting is not available");
+    }
+
+    // With several shards a script may only reach keys of its own.
+    void test_shards()
+    {
+        Shard shard;
+        shard.dispatcher.set_shard(0, 4);
+        std::string local_key, remote_key;
+        for (int i = 0; local_key.empty() || remote_key.empty(); ++i)
+        {
+            std::string key = "key" + std::to_string(i);
+            (core::shard_of(key, 4) == 0 ? local_key : remote_key) = key;
+        }
+        expect_reply(shard.dispatcher, Shard::words("return redis.call('SET', KEYS[1], 'v')", {local_key}), "+OK\r\n");
+        expect_error(shard.dispatcher, Shard::words("return redis.call('GET', KEYS[1])", {remote_key}), "another shard");
+
+        Command eval;
+        eval.name = "EVAL";
+        std::vector<std::string> words = Shard::words("return 1", {local_key, remote_key}, {"arg"});
+        eval.args.assign(words.begin() + 1, words.end());
+        expect(shard.dispatcher.route(eval, 4) == core::ROUTE_CROSS_SHARD, "EVAL routes by its declared keys");
+        words = Shard::words("return 1", {}, {remote_key});
+        eval.args.assign(words.begin() + 1, words.end());
+        expect(shard.dispatcher.route(eval, 4) == core::ROUTE_LOCAL, "EVAL arguments after the keys are not routed");
+    }
+}
+
+int main()
+{
+    test_sha1();
+    test_expressions();
+    test_statements();
+    test_redis_call();
+    test_effects();
+    test_cache();
+    test_errors();
+    test_shards();
+    if (failures)
+    {
+        std::fprintf(stderr, "%d failed\n", failures);
+        return 1;
+    }
+    std::printf("All script tests passed\n");
+    return 0;
+}